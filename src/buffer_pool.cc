@@ -0,0 +1,174 @@
+#include <algorithm>
+#include <new>
+
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "buffer_pool.h"
+#include "tunnel_protocol.h"
+#include "verbose.h"
+
+static std::atomic<bool> huge_pages { false };
+
+void SlabMemory::useHugePages( bool on )
+{
+    huge_pages = on;
+}
+
+void* SlabMemory::allocate( size_t bytes )
+{
+    if( !huge_pages ) return ::operator new( bytes );
+
+    void* slab = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    slab = mmap( nullptr, bytes, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+    if( slab == MAP_FAILED )
+    {
+        LOG_DEBUG << "No reserved huge pages (" << strerror(errno)
+                  << "), asking for transparent huge pages" << std::endl;
+    }
+#endif
+    if( slab == MAP_FAILED )
+    {
+        slab = mmap( nullptr, bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        if( slab == MAP_FAILED ) throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+        madvise( slab, bytes, MADV_HUGEPAGE );
+#endif
+    }
+    return slab;
+}
+
+void SlabMemory::release( void* slab, size_t bytes )
+{
+    if( !huge_pages ) ::operator delete( slab );
+    else              munmap( slab, bytes );
+}
+
+const size_t BufferPool::class_sizes[BufferPool::num_classes] =
+{
+    256,
+    2048,
+    16384 + TunnelProtocol::HEADER_SIZE,
+    TunnelProtocol::MAX_PAYLOAD_SIZE + TunnelProtocol::HEADER_SIZE
+};
+
+BufferPool::~BufferPool( )
+{
+    for( void* slab : _slabs )
+    {
+        SlabMemory::release( slab, slab_size );
+    }
+}
+
+char* BufferPool::get( size_t size, size_t& capacity )
+{
+    size_t c = 0;
+    while( c < num_classes && class_sizes[c] < size ) c++;
+
+    if( c == num_classes )
+    {
+        _misses++;
+        capacity = size;
+        return new char[size];
+    }
+
+    capacity = class_sizes[c];
+
+    if( _free[c].empty() )
+    {
+        _misses++;
+
+        // Cut a new slab into buffers of this class
+        char* slab = static_cast<char*>( SlabMemory::allocate( slab_size ) );
+        _slabs.push_back( slab );
+        for( size_t off = 0; off + capacity <= slab_size; off += capacity )
+        {
+            _free[c].push_back( slab + off );
+        }
+        LOG_DEBUG << "Buffer pool class " << capacity << " grew to "
+                  << _free[c].size() << " free buffers" << std::endl;
+    }
+    else
+    {
+        _hits++;
+    }
+
+    char* buffer = _free[c].back();
+    _free[c].pop_back();
+    return buffer;
+}
+
+void BufferPool::put( char* buffer, size_t capacity )
+{
+    for( size_t c = 0; c < num_classes; c++ )
+    {
+        if( class_sizes[c] == capacity )
+        {
+            _free[c].push_back( buffer );
+            return;
+        }
+    }
+    delete [] buffer;
+}
+
+BlockPool::~BlockPool( )
+{
+    for( char* slab : _slabs )
+    {
+        ::operator delete( slab );
+    }
+}
+
+void* BlockPool::allocate( size_t size )
+{
+    if( _block_size == 0 )
+    {
+        // Room for the free list pointer, aligned for any object
+        const size_t align = alignof(max_align_t);
+        _block_size = ( std::max( size, sizeof(FreeBlock) ) + align - 1 ) / align * align;
+    }
+
+    if( size > _block_size )
+    {
+        _misses++;
+        return ::operator new( size );
+    }
+
+    if( _free == nullptr )
+    {
+        _misses++;
+        char* slab = static_cast<char*>( ::operator new( _block_size * blocks_per_slab ) );
+        _slabs.push_back( slab );
+        for( size_t i = 0; i < blocks_per_slab; i++ )
+        {
+            FreeBlock* block = reinterpret_cast<FreeBlock*>( slab + i * _block_size );
+            block->next = _free;
+            _free       = block;
+        }
+    }
+    else
+    {
+        _hits++;
+    }
+
+    FreeBlock* block = _free;
+    _free = block->next;
+    return block;
+}
+
+void BlockPool::deallocate( void* block, size_t size )
+{
+    if( size > _block_size )
+    {
+        ::operator delete( block );
+        return;
+    }
+
+    FreeBlock* b = static_cast<FreeBlock*>( block );
+    b->next = _free;
+    _free   = b;
+}
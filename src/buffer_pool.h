@@ -0,0 +1,134 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Memory for the pools below is allocated in slabs that are never returned
+ * before the pool is destroyed, so a busy event loop does not call malloc
+ * once the pools have grown to their working size.
+ */
+namespace SlabMemory
+{
+    /* Back the slabs of BufferPool with huge pages (MAP_HUGETLB, or
+     * transparent huge pages as a fallback) on Linux. Call it before any
+     * pool allocates.
+     */
+    void useHugePages( bool on );
+
+    void* allocate( size_t bytes );
+    void  release( void* slab, size_t bytes );
+};
+
+/* Buffers in a few size classes. The largest class holds a complete tunnel
+ * message. Not thread-safe; every event loop owns its pools.
+ */
+class BufferPool
+{
+public:
+    static const size_t num_classes = 4;
+    static const size_t class_sizes[num_classes];
+
+    // Every class grows by one slab of this size at a time
+    static const size_t slab_size = 2 * 1024 * 1024;
+
+private:
+    std::vector<char*> _free[num_classes];
+    std::vector<void*> _slabs;
+
+    // Statistics, may be read by other threads
+    std::atomic<uint64_t> _hits   { 0 };  // served from a free list
+    std::atomic<uint64_t> _misses { 0 };  // needed a new slab or malloc
+
+public:
+    BufferPool( ) = default;
+    BufferPool( const BufferPool& ) = delete;
+    BufferPool& operator=( const BufferPool& ) = delete;
+    ~BufferPool( );
+
+    /* Get a buffer of at least size bytes. Its real size is stored in
+     * capacity, which must be passed to put() again.
+     */
+    char* get( size_t size, size_t& capacity );
+
+    // Return a buffer from get()
+    void put( char* buffer, size_t capacity );
+
+    // Thread-safe statistics
+    inline uint64_t hits() const   { return _hits; }
+    inline uint64_t misses() const { return _misses; }
+};
+
+/* Fixed-size blocks, e.g. for the nodes of a std::map through
+ * PoolAllocator. The block size is taken from the first allocation. Larger
+ * requests go to the heap. Not thread-safe.
+ */
+class BlockPool
+{
+    static const size_t blocks_per_slab = 64;
+
+    struct FreeBlock
+    {
+        FreeBlock* next;
+    };
+
+    size_t             _block_size { 0 };
+    FreeBlock*         _free       { nullptr };
+    std::vector<char*> _slabs;
+
+    // Statistics, may be read by other threads
+    std::atomic<uint64_t> _hits   { 0 };
+    std::atomic<uint64_t> _misses { 0 };
+
+public:
+    BlockPool( ) = default;
+    BlockPool( const BlockPool& ) = delete;
+    BlockPool& operator=( const BlockPool& ) = delete;
+    ~BlockPool( );
+
+    void* allocate( size_t size );
+    void  deallocate( void* block, size_t size );
+
+    // Thread-safe statistics
+    inline uint64_t hits() const   { return _hits; }
+    inline uint64_t misses() const { return _misses; }
+};
+
+/* Standard allocator that takes single objects from a BlockPool. All
+ * containers that share a pool must live in the same thread.
+ */
+template<typename T>
+class PoolAllocator
+{
+    template<typename U> friend class PoolAllocator;
+
+    BlockPool* _pool;
+
+public:
+    using value_type = T;
+
+    explicit PoolAllocator( BlockPool& pool ) : _pool( &pool ) { }
+
+    template<typename U>
+    PoolAllocator( const PoolAllocator<U>& other ) : _pool( other._pool ) { }
+
+    T* allocate( size_t n )
+    {
+        if( n == 1 ) return static_cast<T*>( _pool->allocate( sizeof(T) ) );
+        return static_cast<T*>( ::operator new( n * sizeof(T) ) );
+    }
+
+    void deallocate( T* p, size_t n )
+    {
+        if( n == 1 ) _pool->deallocate( p, sizeof(T) );
+        else         ::operator delete( p );
+    }
+
+    template<typename U>
+    bool operator==( const PoolAllocator<U>& other ) const { return _pool == other._pool; }
+
+    template<typename U>
+    bool operator!=( const PoolAllocator<U>& other ) const { return _pool != other._pool; }
+};
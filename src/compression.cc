@@ -0,0 +1,208 @@
+#include <math.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "compression.h"
+#include "tunnel_protocol.h"
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+
+/* Setting up a deflate or inflate stream allocates its windows. Every
+ * thread keeps one of each and resets it per message.
+ */
+struct DeflateStream
+{
+    z_stream z;
+    bool     ok;
+
+    DeflateStream( )
+    {
+        memset( &z, 0, sizeof(z) );
+        ok = ( deflateInit2( &z, Z_BEST_SPEED, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY ) == Z_OK );
+    }
+    ~DeflateStream( ) { if( ok ) deflateEnd( &z ); }
+};
+
+struct InflateStream
+{
+    z_stream z;
+    bool     ok;
+
+    InflateStream( )
+    {
+        memset( &z, 0, sizeof(z) );
+        ok = ( inflateInit2( &z, -15 ) == Z_OK );
+    }
+    ~InflateStream( ) { if( ok ) inflateEnd( &z ); }
+};
+
+static thread_local DeflateStream deflater;
+static thread_local InflateStream inflater;
+#endif // HAVE_ZLIB
+
+Compression::Codec Compression::codec( )
+{
+#if defined(HAVE_LZ4)
+    return Codec::LZ4;
+#elif defined(HAVE_ZLIB)
+    return Codec::Deflate;
+#else
+    return Codec::None;
+#endif
+}
+
+uint32_t Compression::capabilities( )
+{
+    uint32_t caps = 0;
+#ifdef HAVE_LZ4
+    caps |= TunnelProtocol::CAP_LZ4;
+#endif
+#ifdef HAVE_ZLIB
+    caps |= TunnelProtocol::CAP_DEFLATE;
+#endif
+    return caps;
+}
+
+Compression::Codec Compression::codecFor( uint32_t peer_capabilities )
+{
+    const uint32_t shared = capabilities() & peer_capabilities;
+    if( shared & TunnelProtocol::CAP_LZ4 )     return Codec::LZ4;
+    if( shared & TunnelProtocol::CAP_DEFLATE ) return Codec::Deflate;
+    return Codec::None;
+}
+
+const char* Compression::codecName( Codec codec )
+{
+    switch( codec )
+    {
+    case Codec::LZ4:     return "LZ4";
+    case Codec::Deflate: return "deflate";
+    default:             return "none";
+    }
+}
+
+size_t Compression::compress( const char* in, size_t len, char* out, size_t capacity, Codec codec )
+{
+    // Not worth it unless it saves at least 1/16
+    const size_t limit = std::min( capacity, len - len / 16 );
+    if( len > UINT16_MAX || limit <= HEADER_SIZE ) return 0;
+
+    size_t size = 0;
+
+    switch( codec )
+    {
+#ifdef HAVE_LZ4
+    case Codec::LZ4:
+    {
+        const int retval = LZ4_compress_default( in, out + HEADER_SIZE, len, limit - HEADER_SIZE );
+        if( retval <= 0 ) return 0;
+        size = retval;
+        break;
+    }
+#endif
+#ifdef HAVE_ZLIB
+    case Codec::Deflate:
+        if( !deflater.ok || deflateReset( &deflater.z ) != Z_OK ) return 0;
+        deflater.z.next_in   = (Bytef*)in;
+        deflater.z.avail_in  = len;
+        deflater.z.next_out  = (Bytef*)( out + HEADER_SIZE );
+        deflater.z.avail_out = limit - HEADER_SIZE;
+        if( deflate( &deflater.z, Z_FINISH ) != Z_STREAM_END ) return 0;
+        size = deflater.z.total_out;
+        break;
+#endif
+    default:
+        (void)in;
+        return 0;
+    }
+
+    const uint16_t original = htons( len );
+    out[0] = static_cast<char>( codec );
+    memcpy( out + 1, &original, sizeof(original) );
+    return HEADER_SIZE + size;
+}
+
+int Compression::decompress( const char* in, size_t len, char* out, size_t capacity )
+{
+    if( len < HEADER_SIZE ) return -1;
+
+    uint16_t original;
+    memcpy( &original, in + 1, sizeof(original) );
+    original = ntohs( original );
+    if( original > capacity ) return -1;
+
+    const char*  data = in + HEADER_SIZE;
+    const size_t size = len - HEADER_SIZE;
+
+    switch( static_cast<Codec>( in[0] ) )
+    {
+#ifdef HAVE_LZ4
+    case Codec::LZ4:
+        return ( LZ4_decompress_safe( data, out, size, original ) == original ) ? original : -1;
+#endif
+#ifdef HAVE_ZLIB
+    case Codec::Deflate:
+        if( !inflater.ok || inflateReset( &inflater.z ) != Z_OK ) return -1;
+        inflater.z.next_in   = (Bytef*)data;
+        inflater.z.avail_in  = size;
+        inflater.z.next_out  = (Bytef*)out;
+        inflater.z.avail_out = original;
+        if( inflate( &inflater.z, Z_FINISH ) != Z_STREAM_END ) return -1;
+        return ( inflater.z.total_out == original ) ? original : -1;
+#endif
+    default:
+        (void)data;
+        (void)size;
+        (void)out;
+        return -1;
+    }
+}
+
+double Compression::entropy( const char* data, size_t len )
+{
+    if( len == 0 ) return 0;
+
+    uint32_t counts[256] = { 0 };
+    for( size_t i = 0; i < len; i++ ) counts[ (uint8_t)data[i] ]++;
+
+    double bits = 0;
+    for( uint32_t count : counts )
+    {
+        if( count == 0 ) continue;
+        const double p = (double)count / len;
+        bits -= p * log2( p );
+    }
+    return bits;
+}
+
+size_t CompressionEstimator::compress( const char* in, size_t len, char* out, size_t capacity,
+                                       Compression::Codec codec )
+{
+    if( len < min_size ) return 0;
+
+    // Random-looking data, e.g. video or encrypted payloads, counts as a failure
+    size_t size = 0;
+    if( Compression::entropy( in, std::min( len, sample_size ) ) <= max_entropy )
+    {
+        size = Compression::compress( in, len, out, capacity, codec );
+    }
+
+    const uint32_t ratio = ( size > 0 ) ? ( 256 * size ) / len : 256;
+    _ratio = ( 3 * _ratio + ratio ) / 4;
+
+    if( _ratio > good_ratio )
+    {
+        _skip    = _backoff;
+        _backoff = std::min( 2 * _backoff, max_backoff );
+    }
+    else
+    {
+        _backoff = min_backoff;
+    }
+    return size;
+}
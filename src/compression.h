@@ -0,0 +1,104 @@
+#pragma once
+
+#include <algorithm>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Compression of single tunnel message payloads. A message whose payload
+ * is compressed has TunnelProtocol::COMPRESSED set in its type field, and
+ * the payload starts with a 3-byte header (network endian):
+ *
+ * +---------+----------------------+-----------------+
+ * | codec 1 | original length 2    | compressed data |
+ * +---------+----------------------+-----------------+
+ *
+ * The codecs are LZ4 and raw deflate at the fastest level, as far as the
+ * programs were built with them. Peers announce the codecs they can decode
+ * as capabilities in their HELLO, and a sender only uses one of those.
+ */
+namespace Compression
+{
+    enum class Codec : uint8_t
+    {
+        None    = 0,
+        LZ4     = 1,
+        Deflate = 2
+    };
+
+    static constexpr size_t HEADER_SIZE = 3;
+
+    // The preferred codec of this build, None if it was built without one
+    Codec codec();
+
+    // TunnelProtocol::CAP_* bits of the codecs that this build decodes
+    uint32_t capabilities();
+
+    // The best codec that this build and a peer with these capabilities share
+    Codec codecFor( uint32_t peer_capabilities );
+
+    // Name of the codec, for logging
+    const char* codecName( Codec codec );
+
+    /* Compress len bytes into out with codec, header included. Returns the
+     * size of the result, or 0 if it would not save at least 1/16 of len
+     * or does not fit into capacity, or the codec is not available.
+     */
+    size_t compress( const char* in, size_t len, char* out, size_t capacity, Codec codec );
+
+    /* Decompress a payload made by compress() into out. Returns the
+     * original size, or -1 if the payload is damaged, too large for
+     * capacity, or uses a codec that this build does not have.
+     */
+    int decompress( const char* in, size_t len, char* out, size_t capacity );
+
+    // Order-0 entropy of the bytes in bits per byte, 0 to 8
+    double entropy( const char* data, size_t len );
+}
+
+/* Decides for one stream of messages, e.g. the TCP_DATA of a conn_id,
+ * whether compressing pays off. It keeps a moving average of the size
+ * ratio of the messages it tried. Once that is worse than good_ratio, the
+ * stream is sent as it is for a while, and then one message is tried
+ * again. The pause doubles as long as the stream does not get better.
+ * Messages whose first bytes look random are not even tried.
+ */
+class CompressionEstimator
+{
+public:
+    // Smaller messages are sent as they are and do not count
+    static constexpr size_t   min_size     = 128;
+
+    // Bytes looked at by the entropy test, and its limit in bits per byte
+    static constexpr size_t   sample_size  = 512;
+    static constexpr double   max_entropy  = 7.2;
+
+    // Compressed size per original size in 1/256 that is still worth it
+    static constexpr uint32_t good_ratio   = 224;
+
+    // Payload bytes between two tries while the stream does not compress
+    static constexpr uint64_t min_backoff  = 64 * 1024;
+    static constexpr uint64_t max_backoff  = 16 * 1024 * 1024;
+
+private:
+    uint32_t _ratio   { 128 };          // moving average, in 1/256
+    uint64_t _skip    { 0 };            // bytes to send as they are before the next try
+    uint64_t _backoff { min_backoff };
+
+public:
+    // True if the next message should be tried
+    inline bool active() const { return _skip == 0; }
+
+    /* Try to compress a message while active(), into out with room for
+     * capacity bytes. Returns the size of the compressed payload, or 0 if
+     * the message should be sent as it is.
+     */
+    size_t compress( const char* in, size_t len, char* out, size_t capacity,
+                     Compression::Codec codec );
+
+    // Count bytes that were sent without trying while !active()
+    inline void sent( size_t len ) { _skip -= std::min<uint64_t>( len, _skip ); }
+
+    // Current moving average of the compressed size per original size
+    inline double ratio() const { return _ratio / 256.0; }
+};
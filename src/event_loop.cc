@@ -0,0 +1,280 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+
+#include "event_loop.h"
+#include "verbose.h"
+
+EventLoop::Backend EventLoop::defaultBackend( )
+{
+#ifdef __linux__
+    return Backend::Epoll;
+#else
+    return Backend::Poll;
+#endif
+}
+
+bool EventLoop::backendFromString( const std::string& name, Backend& backend )
+{
+    if( name == "epoll" )
+        backend = Backend::Epoll;
+    else if( name == "poll" )
+        backend = Backend::Poll;
+    else
+        return false;
+    return true;
+}
+
+EventLoop::EventLoop( Backend backend )
+{
+#ifdef __linux__
+    if( backend == Backend::Epoll )
+    {
+        std::unique_ptr<EpollPoller> epoller( new EpollPoller );
+        if( epoller->valid() )
+        {
+            _poller = std::move( epoller );
+        }
+        else
+        {
+            LOG_WARN << "epoll is not available, falling back to poll" << std::endl;
+        }
+    }
+#endif
+
+    if( !_poller )
+    {
+        _poller.reset( new PollPoller );
+    }
+
+    LOG_DEBUG << "Event loop uses the " << _poller->name() << " backend" << std::endl;
+
+    int fds[2];
+    if( ::pipe( fds ) < 0 )
+    {
+        LOG_ERROR << "Failed to create the wakeup pipe of the event loop: " << strerror(errno) << std::endl;
+        return;
+    }
+    for( int fd : fds )
+    {
+        fcntl( fd, F_SETFL, fcntl( fd, F_GETFL, 0 ) | O_NONBLOCK );
+        fcntl( fd, F_SETFD, FD_CLOEXEC );
+    }
+    _wakeup_read  = fds[0];
+    _wakeup_write = fds[1];
+    add( _wakeup_read, IoEvent::Readable, [this](uint32_t) { runPosted(); } );
+}
+
+EventLoop::~EventLoop( )
+{
+    if( _wakeup_read >= 0 )
+    {
+        remove( _wakeup_read );
+        ::close( _wakeup_read );
+        ::close( _wakeup_write );
+    }
+}
+
+void EventLoop::stop( )
+{
+    _stopped = true;
+
+    // Wake up a loop that is blocked in another thread
+    post( Task() );
+}
+
+void EventLoop::post( Task task )
+{
+    {
+        std::lock_guard<std::mutex> guard( _posted_lock );
+        if( task ) _posted.push_back( std::move(task) );
+    }
+
+    const char c = 0;
+    if( ::write( _wakeup_write, &c, 1 ) < 0 && errno != EAGAIN )
+    {
+        LOG_WARN << "Failed to wake up the event loop: " << strerror(errno) << std::endl;
+    }
+}
+
+void EventLoop::runPosted( )
+{
+    char drain[64];
+    while( ::read( _wakeup_read, drain, sizeof(drain) ) > 0 )
+        ;
+
+    std::vector<Task> tasks;
+    {
+        std::lock_guard<std::mutex> guard( _posted_lock );
+        tasks.swap( _posted );
+    }
+
+    for( Task& t : tasks ) t();
+}
+
+bool EventLoop::add( int fd, uint32_t events, Callback cb )
+{
+    if( _handlers.find( fd ) != _handlers.end() )
+    {
+        LOG_WARN << "fd " << fd << " is already in the event loop, replacing its callback" << std::endl;
+        _handlers[fd]->callback = std::move( cb );
+        return modify( fd, events );
+    }
+
+    if( !_poller->add( fd, events ) ) return false;
+
+    std::shared_ptr<Handler> h( new Handler{ events, std::move(cb) } );
+    _handlers[fd] = h;
+    return true;
+}
+
+bool EventLoop::modify( int fd, uint32_t events )
+{
+    auto it = _handlers.find( fd );
+    if( it == _handlers.end() ) return false;
+    if( it->second->events == events ) return true;
+
+    if( !_poller->modify( fd, events ) ) return false;
+    it->second->events = events;
+    return true;
+}
+
+void EventLoop::remove( int fd )
+{
+    auto it = _handlers.find( fd );
+    if( it == _handlers.end() ) return;
+
+    _poller->remove( fd );
+    _handlers.erase( it );
+
+    if( _dispatching ) _removed.insert( fd );
+}
+
+bool EventLoop::watches( int fd ) const
+{
+    return _handlers.find( fd ) != _handlers.end();
+}
+
+uint32_t EventLoop::interest( int fd ) const
+{
+    auto it = _handlers.find( fd );
+    return ( it != _handlers.end() ) ? it->second->events : 0;
+}
+
+void EventLoop::defer( Task task )
+{
+    _deferred.push_back( std::move(task) );
+}
+
+void EventLoop::runDeferred( )
+{
+    // Deferred tasks may defer new tasks, which run in the same round
+    while( !_deferred.empty() )
+    {
+        std::vector<Task> tasks;
+        tasks.swap( _deferred );
+        for( Task& task : tasks ) task();
+    }
+}
+
+EventLoop::TimerId EventLoop::addTimer( Clock::time_point when, Task task )
+{
+    const TimerId id = _next_timer++;
+    _timers.emplace( std::make_pair( when, id ), std::move(task) );
+    _timer_due[id] = when;
+    return id;
+}
+
+void EventLoop::cancelTimer( TimerId id )
+{
+    auto it = _timer_due.find( id );
+    if( it == _timer_due.end() ) return;
+
+    _timers.erase( std::make_pair( it->second, id ) );
+    _timer_due.erase( it );
+}
+
+int EventLoop::timerTimeout( ) const
+{
+    if( _timers.empty() ) return -1;
+
+    const auto wait = std::chrono::duration_cast<std::chrono::microseconds>(
+                          _timers.begin()->first.first - Clock::now() ).count();
+    return ( wait <= 0 ) ? 0 : (int)( ( wait + 999 ) / 1000 );
+}
+
+void EventLoop::runTimers( )
+{
+    // Timers that the tasks add wait for the next iteration
+    const Clock::time_point now   = Clock::now();
+    const TimerId           limit = _next_timer;
+
+    auto it = _timers.begin();
+    while( it != _timers.end() && it->first.first <= now )
+    {
+        if( it->first.second >= limit )
+        {
+            ++it;
+            continue;
+        }
+
+        Task task = std::move( it->second );
+        _timer_due.erase( it->first.second );
+        _timers.erase( it );
+        task();
+
+        // The task may have added or cancelled timers
+        it = _timers.begin();
+    }
+}
+
+bool EventLoop::runOnce( int timeout_ms )
+{
+    // Work deferred outside of an iteration must not wait for an event
+    runDeferred();
+
+    const int timer_ms = timerTimeout();
+    if( timer_ms >= 0 && ( timeout_ms < 0 || timer_ms < timeout_ms ) ) timeout_ms = timer_ms;
+
+    _ready.clear();
+
+    int n = _poller->wait( _ready, timeout_ms );
+    if( n < 0 )
+    {
+        if( errno == EINTR ) return true;
+        LOG_ERROR << "Waiting for events with " << _poller->name() << " failed: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    LOG_DEBUG << _poller->name() << " returned " << n << " ready fds out of " << _handlers.size() << std::endl;
+
+    _dispatching = true;
+    _removed.clear();
+
+    for( const ReadyEvent& ev : _ready )
+    {
+        if( !_removed.empty() && _removed.count( ev.fd ) ) continue;
+
+        auto it = _handlers.find( ev.fd );
+        if( it == _handlers.end() ) continue;
+
+        // Keep the handler alive even if the callback removes its own fd
+        std::shared_ptr<Handler> h = it->second;
+        h->callback( ev.events );
+    }
+
+    _dispatching = false;
+
+    runTimers();
+    runDeferred();
+    return true;
+}
+
+void EventLoop::run( )
+{
+    while( !_stopped )
+    {
+        if( !runOnce( -1 ) ) break;
+    }
+}
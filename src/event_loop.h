@@ -0,0 +1,171 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <stdint.h>
+
+#include "event_poller.h"
+
+/* Event loop shared by TunnelServer and TunnelClient.
+ *
+ * Every watched fd has its own callback, which is called with the IoEvent
+ * flags that the backend reported. The interest set lives in the kernel
+ * (epoll), so the cost of a wakeup depends on the number of ready fds and
+ * not on the number of open connections.
+ *
+ * Callbacks may add, modify and remove any fd, including their own.
+ *
+ * Timers run tasks at a given time, after the callbacks of the iteration
+ * in which they become due. runOnce() waits no longer than until the
+ * next one.
+ */
+class EventLoop
+{
+public:
+    using Callback = std::function<void(uint32_t events)>;
+    using Task     = std::function<void()>;
+    using Clock    = std::chrono::steady_clock;
+    using TimerId  = uint64_t;  // 0 is never used
+
+    enum class Backend
+    {
+        Epoll,    // Linux only
+        Poll      // portable fallback
+    };
+
+    // The best backend for this platform
+    static Backend defaultBackend( );
+
+    /* Translate a command line value (epoll or poll) into a Backend.
+     * Returns false for unknown names.
+     */
+    static bool backendFromString( const std::string& name, Backend& backend );
+
+    EventLoop( Backend backend = defaultBackend() );
+
+    EventLoop( const EventLoop& ) = delete;
+
+    ~EventLoop( );
+
+    /* Watch fd for the IoEvent flags in events. Add IoEvent::EdgeTriggered
+     * to get a single notification per readiness change instead of one per
+     * wakeup. Returns false if the backend refused the fd.
+     */
+    bool add( int fd, uint32_t events, Callback cb );
+
+    // Change the flags of a watched fd
+    bool modify( int fd, uint32_t events );
+
+    // Stop watching fd. Safe to call for fds that are not watched.
+    void remove( int fd );
+
+    // Check if fd is currently watched
+    bool watches( int fd ) const;
+
+    // The flags that fd is currently watched for, or 0
+    uint32_t interest( int fd ) const;
+
+    /* Wait for events at most timeout_ms milliseconds (-1 means forever),
+     * or until the next timer is due, call the callbacks of all ready fds
+     * and run the due timers.
+     * Returns false if waiting failed for a reason other than EINTR.
+     */
+    bool runOnce( int timeout_ms = -1 );
+
+    // Call runOnce until stop() is called or an error occurs
+    void run( );
+
+    /* Make run() return after the current iteration, or immediately if it
+     * has not started yet. May be called from any thread.
+     */
+    void stop( );
+
+    // Check if stop() has been called
+    bool stopped() const { return _stopped; }
+
+    /* Run task in the loop's thread during its next iteration.
+     * This is the only way for other threads to touch objects that are
+     * owned by the loop. May be called from any thread.
+     */
+    void post( Task task );
+
+    /* Run task in the loop's thread after the callbacks of the current
+     * iteration, or before the next wait when called outside of one. Lets
+     * callbacks batch work, e.g. writes, per wakeup. Not thread-safe, other
+     * threads must use post().
+     */
+    void defer( Task task );
+
+    /* Run task once in the loop's thread when the time when has come.
+     * Tasks may add new timers, which run in a later iteration at the
+     * earliest. Returns the id for cancelTimer(). Not thread-safe, other
+     * threads must use post().
+     */
+    TimerId addTimer( Clock::time_point when, Task task );
+
+    // Run task after delay, see addTimer()
+    inline TimerId addTimer( Clock::duration delay, Task task )
+    {
+        return addTimer( Clock::now() + delay, std::move(task) );
+    }
+
+    /* Forget a timer that has not run yet. Safe to call with 0, and with
+     * the id of a timer that has run or was cancelled.
+     */
+    void cancelTimer( TimerId id );
+
+    // Number of watched fds
+    size_t size() const { return _handlers.size(); }
+
+    // Name of the backend, for logging
+    const char* backendName() const { return _poller->name(); }
+
+private:
+    void runPosted( );
+    void runDeferred( );
+    void runTimers( );
+
+    // Milliseconds until the next timer is due, rounded up, -1 if there is none
+    int timerTimeout( ) const;
+
+    struct Handler
+    {
+        uint32_t events;
+        Callback callback;
+    };
+
+    std::unique_ptr<EventPoller>                          _poller;
+    std::unordered_map<int, std::shared_ptr<Handler>>     _handlers;
+    std::vector<ReadyEvent>                               _ready;
+
+    /* fds removed while callbacks are being dispatched. Their remaining
+     * events from the current wakeup are stale and must be skipped, even if
+     * the fd number is reused by a new socket in the same iteration.
+     */
+    std::unordered_set<int>                               _removed;
+    bool                                                  _dispatching { false };
+    std::atomic<bool>                                     _stopped { false };
+
+    // Self-pipe that wakes the loop up for posted tasks and stop()
+    int                                                   _wakeup_read  { -1 };
+    int                                                   _wakeup_write { -1 };
+    std::mutex                                            _posted_lock;
+    std::vector<Task>                                     _posted;
+
+    // Tasks from defer(), only touched by the loop's thread
+    std::vector<Task>                                     _deferred;
+
+    // Timers by due time, ids count up so that equal times keep their order
+    std::map<std::pair<Clock::time_point, TimerId>, Task> _timers;
+    std::unordered_map<TimerId, Clock::time_point>        _timer_due;
+    TimerId                                               _next_timer { 1 };
+};
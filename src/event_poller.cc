@@ -0,0 +1,157 @@
+#include <algorithm>
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "event_poller.h"
+#include "verbose.h"
+
+#ifdef __linux__
+
+static uint32_t toEpoll( uint32_t events )
+{
+    uint32_t ev = 0;
+    if( events & IoEvent::Readable )      ev |= EPOLLIN | EPOLLRDHUP;
+    if( events & IoEvent::Writable )      ev |= EPOLLOUT;
+    if( events & IoEvent::EdgeTriggered ) ev |= EPOLLET;
+    return ev;
+}
+
+static uint32_t fromEpoll( uint32_t ev )
+{
+    uint32_t events = 0;
+    if( ev & (EPOLLIN | EPOLLRDHUP) ) events |= IoEvent::Readable;
+    if( ev & EPOLLOUT )               events |= IoEvent::Writable;
+    if( ev & EPOLLERR )               events |= IoEvent::Error;
+    if( ev & EPOLLHUP )               events |= IoEvent::HangUp;
+    return events;
+}
+
+EpollPoller::EpollPoller( )
+    : _events( 256 )
+{
+    _epfd = epoll_create1( EPOLL_CLOEXEC );
+    if( _epfd < 0 )
+    {
+        LOG_ERROR << "Failed to create epoll instance: " << strerror(errno) << std::endl;
+    }
+}
+
+EpollPoller::~EpollPoller( )
+{
+    if( _epfd >= 0 ) ::close( _epfd );
+}
+
+bool EpollPoller::add( int fd, uint32_t events )
+{
+    epoll_event ev;
+    memset( &ev, 0, sizeof(ev) );
+    ev.events  = toEpoll( events );
+    ev.data.fd = fd;
+    if( epoll_ctl( _epfd, EPOLL_CTL_ADD, fd, &ev ) < 0 )
+    {
+        LOG_WARN << "epoll_ctl ADD failed for fd " << fd << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool EpollPoller::modify( int fd, uint32_t events )
+{
+    epoll_event ev;
+    memset( &ev, 0, sizeof(ev) );
+    ev.events  = toEpoll( events );
+    ev.data.fd = fd;
+    if( epoll_ctl( _epfd, EPOLL_CTL_MOD, fd, &ev ) < 0 )
+    {
+        LOG_WARN << "epoll_ctl MOD failed for fd " << fd << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void EpollPoller::remove( int fd )
+{
+    if( epoll_ctl( _epfd, EPOLL_CTL_DEL, fd, nullptr ) < 0 )
+    {
+        LOG_DEBUG << "epoll_ctl DEL failed for fd " << fd << ": " << strerror(errno) << std::endl;
+    }
+}
+
+int EpollPoller::wait( std::vector<ReadyEvent>& ready, int timeout_ms )
+{
+    int n = epoll_wait( _epfd, _events.data(), _events.size(), timeout_ms );
+    if( n < 0 ) return n;
+
+    for( int i=0; i<n; i++ )
+    {
+        ready.push_back( ReadyEvent{ _events[i].data.fd, fromEpoll( _events[i].events ) } );
+    }
+
+    // A full result array means that more fds may have been ready. Grow for next time.
+    if( n == (int)_events.size() )
+    {
+        _events.resize( _events.size() * 2 );
+    }
+    return n;
+}
+
+#endif // __linux__
+
+bool PollPoller::add( int fd, uint32_t events )
+{
+    auto it = std::find_if( _fds.begin(), _fds.end(), [fd](const pollfd& p) { return p.fd == fd; } );
+    if( it != _fds.end() )
+    {
+        LOG_WARN << "fd " << fd << " is already watched by poll" << std::endl;
+        return false;
+    }
+
+    pollfd p;
+    p.fd      = fd;
+    p.events  = 0;
+    p.revents = 0;
+    if( events & IoEvent::Readable ) p.events |= POLLIN;
+    if( events & IoEvent::Writable ) p.events |= POLLOUT;
+    _fds.push_back( p );
+    return true;
+}
+
+bool PollPoller::modify( int fd, uint32_t events )
+{
+    auto it = std::find_if( _fds.begin(), _fds.end(), [fd](const pollfd& p) { return p.fd == fd; } );
+    if( it == _fds.end() ) return false;
+
+    it->events = 0;
+    if( events & IoEvent::Readable ) it->events |= POLLIN;
+    if( events & IoEvent::Writable ) it->events |= POLLOUT;
+    return true;
+}
+
+void PollPoller::remove( int fd )
+{
+    auto it = std::find_if( _fds.begin(), _fds.end(), [fd](const pollfd& p) { return p.fd == fd; } );
+    if( it != _fds.end() ) _fds.erase( it );
+}
+
+int PollPoller::wait( std::vector<ReadyEvent>& ready, int timeout_ms )
+{
+    int n = ::poll( _fds.data(), _fds.size(), timeout_ms );
+    if( n <= 0 ) return n;
+
+    int found = 0;
+    for( const pollfd& p : _fds )
+    {
+        if( p.revents == 0 ) continue;
+
+        uint32_t events = 0;
+        if( p.revents & POLLIN )  events |= IoEvent::Readable;
+        if( p.revents & POLLOUT ) events |= IoEvent::Writable;
+        if( p.revents & (POLLERR | POLLNVAL) ) events |= IoEvent::Error;
+        if( p.revents & POLLHUP ) events |= IoEvent::HangUp;
+        ready.push_back( ReadyEvent{ p.fd, events } );
+        found++;
+    }
+    return found;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <vector>
+
+#include <stdint.h>
+#include <poll.h>
+
+/* Readiness flags used by EventLoop and its pollers. They are
+ * deliberately independent of EPOLLIN/POLLIN so that the same values work
+ * with every backend.
+ */
+namespace IoEvent
+{
+    static constexpr uint32_t Readable      = 1u << 0;
+    static constexpr uint32_t Writable      = 1u << 1;
+    static constexpr uint32_t Error         = 1u << 2;  // only reported, never requested
+    static constexpr uint32_t HangUp        = 1u << 3;  // only reported, never requested
+    static constexpr uint32_t EdgeTriggered = 1u << 4;  // only requested, never reported
+};
+
+struct ReadyEvent
+{
+    int      fd;
+    uint32_t events;
+};
+
+/* The kernel interface behind an EventLoop. A poller keeps the interest set
+ * persistently, so the loop does not have to rebuild it on every wakeup.
+ */
+class EventPoller
+{
+public:
+    virtual ~EventPoller() = default;
+
+    // Start watching fd for the given IoEvent flags
+    virtual bool add( int fd, uint32_t events ) = 0;
+
+    // Change the flags of an fd that is already watched
+    virtual bool modify( int fd, uint32_t events ) = 0;
+
+    // Stop watching fd. Must be called before fd is closed.
+    virtual void remove( int fd ) = 0;
+
+    /* Wait at most timeout_ms milliseconds (-1 means forever) and append
+     * the ready fds to ready. Returns the number of ready fds, or -1 with
+     * errno set.
+     */
+    virtual int wait( std::vector<ReadyEvent>& ready, int timeout_ms ) = 0;
+
+    // Name of the backend, for logging
+    virtual const char* name() const = 0;
+};
+
+#ifdef __linux__
+#include <sys/epoll.h>
+
+// Linux backend. Scales with the number of ready fds, not watched fds.
+class EpollPoller : public EventPoller
+{
+    int _epfd { -1 };
+    std::vector<epoll_event> _events;
+
+public:
+    EpollPoller( );
+    ~EpollPoller( );
+
+    bool valid() const { return _epfd >= 0; }
+
+    bool add( int fd, uint32_t events ) override;
+    bool modify( int fd, uint32_t events ) override;
+    void remove( int fd ) override;
+    int  wait( std::vector<ReadyEvent>& ready, int timeout_ms ) override;
+    const char* name() const override { return "epoll"; }
+};
+#endif
+
+/* Portable backend based on poll(). Used where epoll is not available
+ * (macOS). EdgeTriggered is ignored, all fds are level-triggered.
+ */
+class PollPoller : public EventPoller
+{
+    std::vector<pollfd> _fds;
+
+public:
+    bool add( int fd, uint32_t events ) override;
+    bool modify( int fd, uint32_t events ) override;
+    void remove( int fd ) override;
+    int  wait( std::vector<ReadyEvent>& ready, int timeout_ms ) override;
+    const char* name() const override { return "poll"; }
+};
@@ -0,0 +1,28 @@
+#include <algorithm>
+
+#include "retransmit_buffer.h"
+
+void RetransmitBuffer::append( const char* data, size_t len )
+{
+    _buffer.insert( _buffer.end(), data, data + len );
+}
+
+void RetransmitBuffer::acknowledge( uint64_t offset )
+{
+    offset = std::min( offset, end() );
+    if( offset <= _base ) return;
+
+    _head += offset - _base;
+    _base  = offset;
+    if( _head == _buffer.size() )
+    {
+        _buffer.clear();
+        _head = 0;
+    }
+    else if( _head > _buffer.size() / 2 )
+    {
+        // Drop the acknowledged bytes once they are the larger part of the buffer
+        _buffer.erase( _buffer.begin(), _buffer.begin() + _head );
+        _head = 0;
+    }
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The TCP_DATA payload bytes of one connection that the peer has not
+ * acknowledged yet, so that they can be sent again on a new tunnel
+ * connection (see TunnelResume). Offsets count the connection's bytes
+ * since it was opened. Flow control bounds the buffer by STREAM_WINDOW.
+ */
+class RetransmitBuffer
+{
+    // Bytes before _head have been acknowledged
+    std::vector<char> _buffer;
+    size_t            _head { 0 };
+
+    // Offset of the byte at _head
+    uint64_t          _base { 0 };
+
+public:
+    // Offset of the oldest byte that is kept
+    inline uint64_t base() const { return _base; }
+
+    // Offset behind the newest byte
+    inline uint64_t end() const { return _base + _buffer.size() - _head; }
+
+    // Keep a copy of the next len bytes of the connection
+    void append( const char* data, size_t len );
+
+    // Drop the bytes before offset, which the peer has acknowledged
+    void acknowledge( uint64_t offset );
+
+    /* The bytes from offset on, base() <= offset <= end(). They are
+     * contiguous and stay valid until the next append() or acknowledge().
+     */
+    inline const char* at( uint64_t offset ) const { return _buffer.data() + _head + ( offset - _base ); }
+};
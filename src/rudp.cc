@@ -0,0 +1,1103 @@
+#include <algorithm>
+#include <random>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "rudp.h"
+#include "tunnel_protocol.h"
+#include "verbose.h"
+
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+using std::chrono::duration_cast;
+
+namespace
+{
+    const uint8_t version = 1;
+
+    // Datagram types
+    const uint8_t type_syn     = 1;
+    const uint8_t type_syn_ack = 2;
+    const uint8_t type_data    = 3;
+    const uint8_t type_close   = 4;
+
+    // Frame types in DATA datagrams
+    const uint8_t frame_stream   = 1;
+    const uint8_t frame_ack      = 2;
+    const uint8_t frame_datagram = 3;
+    const uint8_t frame_ping     = 4;
+
+    const size_t header_size          = 12;
+    const size_t stream_frame_header  = 1 + 4 + 8 + 2;
+    const size_t datagram_frame_header = 1 + 2;
+    const size_t max_ack_ranges       = 32;
+
+    /* Bytes that may wait per association: read from the dispatcher but not
+     * acknowledged, and received but not taken by the dispatcher.
+     */
+    const size_t send_limit     = 4 * 1024 * 1024;
+    const size_t recv_limit     = 8 * 1024 * 1024;
+    const size_t datagram_limit = 1024;
+    const size_t retired_limit  = 4096;
+
+    const milliseconds syn_interval   { 200 };
+    const milliseconds keepalive      { 1000 };
+    const milliseconds idle_timeout   { 30000 };
+    const milliseconds initial_pto    { 300 };
+    const milliseconds max_ack_delay  { 5 };
+    const int          max_backoff    = 6;
+
+    // Dispatcher messages are read in chunks of this size
+    const size_t local_chunk_size = 64 * 1024;
+    thread_local char local_chunk[local_chunk_size];
+
+    inline void put16( char* p, uint16_t v ) { v = htons(v); memcpy( p, &v, 2 ); }
+    inline void put32( char* p, uint32_t v ) { v = htonl(v); memcpy( p, &v, 4 ); }
+    inline void put64( char* p, uint64_t v )
+    {
+        put32( p,     static_cast<uint32_t>( v >> 32 ) );
+        put32( p + 4, static_cast<uint32_t>( v ) );
+    }
+
+    inline uint16_t get16( const char* p ) { uint16_t v; memcpy( &v, p, 2 ); return ntohs(v); }
+    inline uint32_t get32( const char* p ) { uint32_t v; memcpy( &v, p, 4 ); return ntohl(v); }
+    inline uint64_t get64( const char* p )
+    {
+        return ( static_cast<uint64_t>( get32( p ) ) << 32 ) | get32( p + 4 );
+    }
+
+    void putHeader( char* p, uint8_t type, uint32_t id, uint32_t packet )
+    {
+        p[0] = version;
+        p[1] = type;
+        p[2] = p[3] = 0;
+        put32( p + 4, id );
+        put32( p + 8, packet );
+    }
+
+    // Length of the tunnel message at the start of data, or 0 if it is incomplete
+    size_t messageSize( const char* data, size_t size )
+    {
+        if( size < sizeof(TunnelMessageHeader) ) return 0;
+        const size_t total = sizeof(TunnelMessageHeader) + get16( data + 4 );
+        return ( total <= size ) ? total : 0;
+    }
+
+    inline TunnelMessageType messageType( const char* message )
+    {
+        return static_cast<TunnelMessageType>( get16( message + 6 ) & ~TunnelProtocol::COMPRESSED );
+    }
+}
+
+void RudpEndpoint::RangeSet::add( uint64_t first, uint64_t end )
+{
+    if( first >= end ) return;
+
+    // Merge with a range that starts before and reaches first
+    auto it = _ranges.upper_bound( first );
+    if( it != _ranges.begin() )
+    {
+        auto prev = std::prev( it );
+        if( prev->second >= first )
+        {
+            if( prev->second >= end ) return;
+            first = prev->first;
+            it    = prev;
+        }
+    }
+
+    // Swallow the ranges that start inside [first,end]
+    while( it != _ranges.end() && it->first <= end )
+    {
+        end = std::max( end, it->second );
+        it  = _ranges.erase( it );
+    }
+    _ranges[first] = end;
+}
+
+bool RudpEndpoint::RangeSet::covers( uint64_t first, uint64_t end ) const
+{
+    auto it = _ranges.upper_bound( first );
+    if( it == _ranges.begin() ) return false;
+    --it;
+    return it->second >= end;
+}
+
+void RudpEndpoint::RangeSet::remove( uint64_t first, uint64_t end )
+{
+    if( first >= end ) return;
+
+    auto it = _ranges.upper_bound( first );
+    if( it != _ranges.begin() ) --it;
+
+    while( it != _ranges.end() && it->first < end )
+    {
+        const uint64_t f = it->first;
+        const uint64_t e = it->second;
+        if( e <= first )
+        {
+            ++it;
+            continue;
+        }
+        it = _ranges.erase( it );
+        if( f < first ) _ranges[f] = first;
+        if( e > end )   _ranges[end] = e;
+    }
+}
+
+void RudpEndpoint::RangeSet::trimBelow( uint64_t first )
+{
+    while( !_ranges.empty() && _ranges.begin()->first < first )
+    {
+        auto           it  = _ranges.begin();
+        const uint64_t end = it->second;
+        _ranges.erase( it );
+        if( end > first ) _ranges[first] = end;
+    }
+}
+
+void RudpEndpoint::RangeSet::keepNewest( size_t count )
+{
+    while( _ranges.size() > count ) _ranges.erase( _ranges.begin() );
+}
+
+RudpEndpoint::RudpEndpoint( EventLoop::Backend backend )
+    : _loop( backend )
+{
+}
+
+RudpEndpoint::~RudpEndpoint( )
+{
+    _loop.stop();
+    if( _thread.joinable() ) _thread.join();
+}
+
+bool RudpEndpoint::listen( uint16_t port, AcceptCallback accept )
+{
+    if( !_socket.createServer( port ) ) return false;
+
+    _server = true;
+    _accept = std::move( accept );
+    _socket.setNoBlock();
+
+    // A burst of a whole congestion window must not overflow the socket
+    int size = send_limit;
+    setsockopt( _socket.socket(), SOL_SOCKET, SO_SNDBUF, &size, sizeof(size) );
+    setsockopt( _socket.socket(), SOL_SOCKET, SO_RCVBUF, &size, sizeof(size) );
+
+    _loop.add( _socket.socket(), IoEvent::Readable, [this](uint32_t) { onSocket(); } );
+    _thread = std::thread( [this]() { run(); } );
+    return true;
+}
+
+std::unique_ptr<TCPSocket> RudpEndpoint::connect( const std::string& host, uint16_t port, int timeout_ms )
+{
+    if( !_socket.create() ) return nullptr;
+
+    _server_addr = SockAddr( host.c_str(), port );
+
+    int size = send_limit;
+    setsockopt( _socket.socket(), SOL_SOCKET, SO_SNDBUF, &size, sizeof(size) );
+    setsockopt( _socket.socket(), SOL_SOCKET, SO_RCVBUF, &size, sizeof(size) );
+
+    std::random_device random;
+    uint32_t id = 0;
+    while( id == 0 ) id = random();
+
+    char syn[header_size];
+    putHeader( syn, type_syn, id, 0 );
+
+    const Clock::time_point deadline = Clock::now() + milliseconds( timeout_ms );
+    bool answered = false;
+
+    while( !answered && Clock::now() < deadline )
+    {
+        if( _socket.send( syn, sizeof(syn), _server_addr ) < 0 )
+        {
+            LOG_WARN << "Cannot send to " << _server_addr << ": " << strerror(errno) << std::endl;
+        }
+
+        const Clock::time_point retry = std::min( deadline, Clock::now() + syn_interval );
+        while( !answered )
+        {
+            const int wait = duration_cast<milliseconds>( retry - Clock::now() ).count();
+            if( wait <= 0 ) break;
+
+            pollfd pfd = { _socket.socket(), POLLIN, 0 };
+            if( ::poll( &pfd, 1, wait ) <= 0 ) continue;
+
+            char     answer[max_datagram];
+            SockAddr from;
+            int retval = _socket.recv( answer, sizeof(answer), from );
+            answered = ( retval >= (int)header_size && from == _server_addr &&
+                         answer[0] == version && answer[1] == type_syn_ack &&
+                         get32( answer + 4 ) == id );
+        }
+    }
+
+    if( !answered )
+    {
+        LOG_WARN << "No answer from " << _server_addr << " to the reliable-UDP SYN" << std::endl;
+        return nullptr;
+    }
+
+    _socket.setNoBlock();
+    std::unique_ptr<TCPSocket> remote = newAssociation( id, _server_addr );
+    if( !remote ) return nullptr;
+
+    _loop.add( _socket.socket(), IoEvent::Readable, [this](uint32_t) { onSocket(); } );
+    _thread = std::thread( [this]() { run(); } );
+    return remote;
+}
+
+std::unique_ptr<TCPSocket> RudpEndpoint::newAssociation( uint32_t id, const SockAddr& peer )
+{
+    int fds[2];
+    if( ::socketpair( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds ) < 0 )
+    {
+        LOG_ERROR << "Cannot create a socketpair for association " << id << ": " << strerror(errno) << std::endl;
+        return nullptr;
+    }
+
+    int size = 1024 * 1024;
+    for( int fd : fds )
+    {
+        setsockopt( fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size) );
+        setsockopt( fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size) );
+    }
+
+    std::unique_ptr<Association> a( new Association );
+    a->id        = id;
+    a->peer      = peer;
+    a->started   = !_server;  // TunnelClient needs no HELLO first
+    a->last_recv = a->last_send = Clock::now();
+    a->local.adopt( fds[0] );
+    a->local.setNoBlock();
+
+    std::unique_ptr<TCPSocket> remote( new TCPSocket );
+    remote->adopt( fds[1] );
+
+    _loop.add( fds[0], IoEvent::Readable, [this,id](uint32_t events)
+    {
+        auto it = _associations.find( id );
+        if( it != _associations.end() ) onLocal( *it->second, events );
+    } );
+
+    LOG_INFO << "Reliable-UDP association " << id << " with " << peer << std::endl;
+    scheduleTimers( a->last_send + keepalive );
+    _associations[id] = std::move( a );
+    return remote;
+}
+
+void RudpEndpoint::run( )
+{
+    _loop.run();
+}
+
+void RudpEndpoint::onSocket( )
+{
+    while( _socket.recvBatch( _in ) > 0 )
+    {
+        for( size_t i=0; i<_in.count(); i++ )
+        {
+            onDatagram( _in.data(i), _in.size(i), _in.addr(i) );
+        }
+        if( !_in.full() ) break;
+    }
+
+    // Pass on what arrived, answer with ACKs and fill the windows that opened
+    std::vector<uint32_t> ids;
+    for( auto& entry : _associations ) ids.push_back( entry.first );
+    for( uint32_t id : ids )
+    {
+        auto it = _associations.find( id );
+        if( it == _associations.end() ) continue;
+
+        Association& a = *it->second;
+        writeLocal( a );
+        if( _associations.count( id ) == 0 ) continue;
+        sendPackets( a );
+        watchLocal( a );
+        scheduleTimers( nextTimer( a ) );
+    }
+    flushOut();
+}
+
+void RudpEndpoint::onDatagram( const char* data, size_t size, const SockAddr& from )
+{
+    if( size < header_size || data[0] != version ) return;
+
+    const uint8_t  type   = data[1];
+    const uint32_t id     = get32( data + 4 );
+    const uint32_t packet = get32( data + 8 );
+
+    if( !_server && from != _server_addr ) return;
+
+    if( type == type_syn )
+    {
+        if( _server ) onSyn( id, from );
+        return;
+    }
+
+    auto it = _associations.find( id );
+    if( it == _associations.end() )
+    {
+        // E.g. after a restart of TunnelServer, make TunnelClient reconnect
+        if( _server && type == type_data ) sendControl( id, type_close, from );
+        return;
+    }
+
+    Association& a = *it->second;
+    if( from != a.peer ) return;
+
+    if( type == type_close )
+    {
+        close( id, false, "closed by the peer" );
+    }
+    else if( type == type_data )
+    {
+        a.last_recv = Clock::now();
+        onData( a, packet, data + header_size, size - header_size );
+    }
+}
+
+void RudpEndpoint::onSyn( uint32_t id, const SockAddr& from )
+{
+    auto it = _associations.find( id );
+    if( it == _associations.end() )
+    {
+        std::unique_ptr<TCPSocket> remote = newAssociation( id, from );
+        if( !remote ) return;
+        _accept( std::move( remote ) );
+    }
+    else if( it->second->peer != from )
+    {
+        LOG_WARN << "Ignoring SYN for association " << id << " from " << from
+                 << ", it belongs to " << it->second->peer << std::endl;
+        return;
+    }
+
+    // Also when the first SYN_ACK was lost
+    sendControl( id, type_syn_ack, from );
+}
+
+void RudpEndpoint::onData( Association& a, uint32_t packet, const char* frames, size_t size )
+{
+    const bool duplicate = a.received.covers( packet, packet + 1ull );
+    const bool full      = a.recv_buffered + ( a.to_local.size() - a.to_local_head ) > recv_limit;
+
+    // Without a record of the packet, the peer sends its data again later
+    const bool accept    = !duplicate && !full;
+    bool       eliciting = false;
+
+    size_t pos = 0;
+    while( pos < size )
+    {
+        const uint8_t frame = frames[pos++];
+        if( frame == frame_stream )
+        {
+            if( size - pos < stream_frame_header - 1 ) return;
+            const uint32_t stream = get32( frames + pos );
+            const uint64_t offset = get64( frames + pos + 4 );
+            const uint16_t length = get16( frames + pos + 12 );
+            pos += stream_frame_header - 1;
+            if( size - pos < length ) return;
+
+            if( accept ) deliver( a, stream, offset, frames + pos, length );
+            pos += length;
+            eliciting = true;
+        }
+        else if( frame == frame_ack )
+        {
+            if( size - pos < 1 ) return;
+            const size_t count = (uint8_t)frames[pos++];
+            if( size - pos < count * 8 ) return;
+
+            onAck( a, frames + pos, count );
+            pos += count * 8;
+        }
+        else if( frame == frame_datagram )
+        {
+            if( size - pos < 2 ) return;
+            const uint16_t length = get16( frames + pos );
+            pos += 2;
+            if( size - pos < length ) return;
+
+            const char* message = frames + pos;
+            if( accept && a.started && messageSize( message, length ) == length )
+            {
+                a.to_local.insert( a.to_local.end(), message, message + length );
+            }
+            pos += length;
+            eliciting = true;
+        }
+        else if( frame == frame_ping )
+        {
+            eliciting = true;
+        }
+        else
+        {
+            LOG_WARN << "Unknown frame type " << (int)frame << " in association " << a.id << std::endl;
+            return;
+        }
+    }
+
+    if( accept )
+    {
+        a.received.add( packet, packet + 1ull );
+        a.received.keepNewest( max_ack_ranges );
+        if( eliciting ) a.ack_pending = true;
+    }
+    else if( duplicate && eliciting )
+    {
+        // Our ACK may have been lost
+        a.ack_pending = true;
+    }
+}
+
+void RudpEndpoint::deliver( Association& a, uint32_t stream, uint64_t offset, const char* data, size_t size )
+{
+    if( a.retired.count( stream ) ) return;
+
+    RecvStream& r = a.recv[stream];
+    if( offset + size <= r.contiguous ) return;
+
+    if( offset > r.contiguous || ( !a.started && stream != 0 ) )
+    {
+        auto it = r.early.find( offset );
+        if( it == r.early.end() || it->second.size() < size )
+        {
+            if( it != r.early.end() ) a.recv_buffered -= it->second.size();
+            r.early[offset].assign( data, size );
+            a.recv_buffered += size;
+        }
+        if( offset > r.contiguous ) return;
+    }
+    else
+    {
+        const size_t skip = r.contiguous - offset;
+        r.partial.append( data + skip, size - skip );
+        r.contiguous += size - skip;
+    }
+
+    if( a.started || stream == 0 ) pull( a, stream );
+}
+
+void RudpEndpoint::pull( Association& a, uint32_t stream )
+{
+    auto sit = a.recv.find( stream );
+    if( sit == a.recv.end() ) return;
+    RecvStream& r = sit->second;
+
+    // Chunks that the gap held back
+    auto it = r.early.begin();
+    while( it != r.early.end() && it->first <= r.contiguous )
+    {
+        const uint64_t end = it->first + it->second.size();
+        if( end > r.contiguous )
+        {
+            r.partial.append( it->second, r.contiguous - it->first, std::string::npos );
+            r.contiguous = end;
+        }
+        a.recv_buffered -= it->second.size();
+        it = r.early.erase( it );
+    }
+
+    bool   closed      = false;
+    bool   was_started = a.started;
+    size_t pos         = 0;
+    size_t length;
+    while( !closed && ( length = messageSize( r.partial.data() + pos, r.partial.size() - pos ) ) > 0 )
+    {
+        const char* message = r.partial.data() + pos;
+        a.to_local.insert( a.to_local.end(), message, message + length );
+        closed = ( messageType( message ) == TunnelMessageType::TCP_CLOSE && stream != 0 );
+        pos += length;
+        a.started = true;
+    }
+    r.partial.erase( 0, pos );
+
+    if( closed )
+    {
+        // Late retransmissions of the conn_id are dropped from now on
+        for( auto& chunk : r.early ) a.recv_buffered -= chunk.second.size();
+        a.recv.erase( sit );
+        a.retired.insert( stream );
+        a.retired_order.push_back( stream );
+        if( a.retired_order.size() > retired_limit )
+        {
+            // A stream that stayed idle since has nothing more to say
+            const uint32_t oldest = a.retired_order.front();
+            auto send = a.send.find( oldest );
+            if( send != a.send.end() && send->second.idle() ) a.send.erase( send );
+            a.retired.erase( oldest );
+            a.retired_order.pop_front();
+        }
+
+        /* The dispatcher may still acknowledge the data of the conn_id, so
+         * the stream keeps its offset until that is acknowledged.
+         */
+        auto send = a.send.find( stream );
+        if( send != a.send.end() ) send->second.closing = true;
+    }
+
+    if( !was_started && a.started )
+    {
+        // The HELLO is through, release the streams that arrived before it
+        std::vector<uint32_t> waiting;
+        for( auto& entry : a.recv )
+        {
+            if( entry.first != 0 ) waiting.push_back( entry.first );
+        }
+        for( uint32_t s : waiting ) pull( a, s );
+    }
+}
+
+void RudpEndpoint::onLocal( Association& a, uint32_t events )
+{
+    const uint32_t id = a.id;
+
+    if( events & IoEvent::Writable ) writeLocal( a );
+    if( _associations.count( id ) == 0 ) return;
+
+    if( events & ( IoEvent::Readable | IoEvent::HangUp | IoEvent::Error ) ) readLocal( a );
+    if( _associations.count( id ) == 0 ) return;
+
+    sendPackets( a );
+    watchLocal( a );
+    scheduleTimers( nextTimer( a ) );
+    flushOut();
+}
+
+void RudpEndpoint::readLocal( Association& a )
+{
+    while( a.send_buffered < send_limit )
+    {
+        ssize_t retval = ::read( a.local.socket(), local_chunk, local_chunk_size );
+        if( retval < 0 && errno == EINTR ) continue;
+        if( retval < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) return;
+        if( retval <= 0 )
+        {
+            a.local_eof = true;
+            close( a.id, true, "the tunnel was closed locally" );
+            return;
+        }
+
+        a.from_local.insert( a.from_local.end(), local_chunk, local_chunk + retval );
+
+        size_t pos = 0;
+        size_t length;
+        while( ( length = messageSize( a.from_local.data() + pos, a.from_local.size() - pos ) ) > 0 )
+        {
+            queueMessage( a, a.from_local.data() + pos, length );
+            pos += length;
+        }
+        a.from_local.erase( a.from_local.begin(), a.from_local.begin() + pos );
+    }
+}
+
+void RudpEndpoint::writeLocal( Association& a )
+{
+    while( a.to_local_head < a.to_local.size() )
+    {
+        ssize_t retval = ::send( a.local.socket(), a.to_local.data() + a.to_local_head,
+                                 a.to_local.size() - a.to_local_head, MSG_NOSIGNAL | MSG_DONTWAIT );
+        if( retval < 0 && errno == EINTR ) continue;
+        if( retval < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) return;
+        if( retval < 0 )
+        {
+            close( a.id, true, "the tunnel was closed locally" );
+            return;
+        }
+        a.to_local_head += retval;
+    }
+    a.to_local.clear();
+    a.to_local_head = 0;
+}
+
+void RudpEndpoint::queueMessage( Association& a, const char* message, size_t size )
+{
+    const TunnelMessageType type    = messageType( message );
+    const uint32_t          conn_id = get32( message );
+
+    if( type == TunnelMessageType::UDP_SEGMENTS )
+    {
+        /* Each packet of the run travels on its own. A run without a valid
+         * segment size is dropped, because its conn_id names a UDP flow and
+         * must not reach the stream of the TCP connection with that id.
+         */
+        uint16_t segment;
+        if( !TunnelProtocol::parseUdpSegments( message + sizeof(TunnelMessageHeader),
+                                               size - sizeof(TunnelMessageHeader), segment ) )
+        {
+            LOG_WARN << "Dropping a malformed UDP_SEGMENTS message in association " << a.id << std::endl;
+            return;
+        }
+
+        const char* data = message + sizeof(TunnelMessageHeader) + sizeof(TunnelUdpSegments);
+        const char* end  = message + size;
+        while( data < end )
+        {
+            const size_t length = std::min<size_t>( segment, end - data );
+            TunnelMessageHeader header;
+            TunnelProtocol::createHeader( header, conn_id, length, TunnelMessageType::UDP_PACKET );
+
+            std::string packet( reinterpret_cast<const char*>( &header ), sizeof(header) );
+            packet.append( data, length );
+            queueMessage( a, packet.data(), packet.size() );
+            data += length;
+        }
+        return;
+    }
+
+    if( type == TunnelMessageType::UDP_PACKET &&
+        header_size + datagram_frame_header + size <= max_datagram )
+    {
+        if( a.datagrams.size() >= datagram_limit )
+        {
+            a.datagrams_dropped++;
+            return;
+        }
+        a.datagrams.emplace_back( message, size );
+        return;
+    }
+
+    /* The conn_id of a UDP packet names its UDP flow, and flow ids overlap
+     * with those of TCP connections. Packets too large for a datagram go on
+     * stream 0, which is never retired.
+     */
+    const uint32_t stream = ( type == TunnelMessageType::UDP_PACKET ) ? 0 : conn_id;
+    appendStream( a, stream, message, size, type == TunnelMessageType::TCP_CLOSE && conn_id != 0 );
+}
+
+void RudpEndpoint::appendStream( Association& a, uint32_t stream, const char* message, size_t size, bool closing )
+{
+    SendStream& s = a.send[stream];
+
+    // Drop the acknowledged prefix before the buffer grows
+    if( s.head > 0 && s.head >= s.buffer.size() / 2 )
+    {
+        s.buffer.erase( s.buffer.begin(), s.buffer.begin() + s.head );
+        s.head = 0;
+    }
+    s.buffer.insert( s.buffer.end(), message, message + size );
+    s.closing = s.closing || closing;
+    a.send_buffered += size;
+
+    if( !s.active )
+    {
+        s.active = true;
+        a.active.push_back( stream );
+    }
+}
+
+void RudpEndpoint::onAck( Association& a, const char* ranges, size_t count )
+{
+    const Clock::time_point now = Clock::now();
+
+    for( size_t i=0; i<count; i++ )
+    {
+        const uint32_t first = get32( ranges + i * 8 );
+        const uint32_t last  = get32( ranges + i * 8 + 4 );
+        if( last < first ) continue;
+
+        // The newest range comes first, its end gives an RTT sample
+        if( i == 0 && (int64_t)last > a.largest_acked )
+        {
+            auto newest = a.sent.find( last );
+            if( newest != a.sent.end() )
+            {
+                a.latest = duration_cast<microseconds>( now - newest->second.time );
+                updateRtt( a, a.latest );
+            }
+            a.largest_acked = last;
+        }
+
+        auto it = a.sent.lower_bound( first );
+        while( it != a.sent.end() && it->first <= last )
+        {
+            SentPacket& p = it->second;
+            for( const SentChunk& c : p.chunks )
+            {
+                auto sit = a.send.find( c.stream );
+                if( sit == a.send.end() ) continue;
+
+                SendStream& s = sit->second;
+                s.acked.add( c.offset, c.offset + c.length );
+
+                // Slide the base over the acknowledged bytes
+                auto front = s.acked.ranges().begin();
+                if( front != s.acked.ranges().end() && front->first <= s.base && front->second > s.base )
+                {
+                    const uint64_t released = front->second - s.base;
+                    s.head          += released;
+                    s.base           = front->second;
+                    a.send_buffered -= released;
+                }
+                s.acked.trimBelow( s.base );
+                s.lost.trimBelow( s.base );
+
+                if( s.idle() )
+                {
+                    s.buffer.clear();
+                    s.head = 0;
+                    if( s.closing ) a.send.erase( sit );
+                }
+            }
+
+            a.in_flight -= std::min<size_t>( a.in_flight, p.bytes );
+            if( (int64_t)it->first > a.recovery_end )
+            {
+                if( a.cwnd < a.ssthresh ) a.cwnd += p.bytes;
+                else                      a.cwnd += max_datagram * p.bytes / a.cwnd;
+                a.cwnd = std::min( a.cwnd, send_limit );
+            }
+            it = a.sent.erase( it );
+        }
+    }
+
+    a.backoff = 0;
+    detectLosses( a, now );
+}
+
+void RudpEndpoint::detectLosses( Association& a, Clock::time_point now )
+{
+    a.loss_time = Clock::time_point();
+
+    const microseconds rtt   = std::max( a.srtt, a.latest );
+    const microseconds delay = std::max( microseconds( 1000 ), rtt * 9 / 8 );
+
+    auto it = a.sent.begin();
+    while( it != a.sent.end() && (int64_t)it->first < a.largest_acked )
+    {
+        if( a.largest_acked - it->first >= 3 || it->second.time + delay <= now )
+        {
+            onLost( a, it->second, it->first );
+            it = a.sent.erase( it );
+        }
+        else
+        {
+            const Clock::time_point when = it->second.time + delay;
+            if( a.loss_time == Clock::time_point() || when < a.loss_time ) a.loss_time = when;
+            ++it;
+        }
+    }
+}
+
+void RudpEndpoint::onLost( Association& a, SentPacket& packet, uint32_t number )
+{
+    for( const SentChunk& c : packet.chunks )
+    {
+        auto sit = a.send.find( c.stream );
+        if( sit == a.send.end() ) continue;
+
+        SendStream& s = sit->second;
+        if( c.offset + c.length <= s.base ) continue;
+
+        s.lost.add( std::max( c.offset, s.base ), c.offset + c.length );
+        if( !s.active )
+        {
+            s.active = true;
+            a.active.push_back( c.stream );
+        }
+    }
+
+    a.in_flight -= std::min<size_t>( a.in_flight, packet.bytes );
+    a.packets_lost++;
+
+    // One window reduction per round trip
+    if( (int64_t)number > a.recovery_end )
+    {
+        a.recovery_end = (int64_t)a.next_packet - 1;
+        a.ssthresh     = std::max( a.cwnd / 2, 2 * max_datagram );
+        a.cwnd         = a.ssthresh;
+    }
+}
+
+void RudpEndpoint::updateRtt( Association& a, microseconds sample )
+{
+    if( a.srtt.count() == 0 )
+    {
+        a.srtt   = sample;
+        a.rttvar = sample / 2;
+        return;
+    }
+    const microseconds diff = ( a.srtt > sample ) ? a.srtt - sample : sample - a.srtt;
+    a.rttvar = ( a.rttvar * 3 + diff ) / 4;
+    a.srtt   = ( a.srtt * 7 + sample ) / 8;
+}
+
+microseconds RudpEndpoint::probeTimeout( const Association& a ) const
+{
+    if( a.srtt.count() == 0 ) return initial_pto;
+    return a.srtt + std::max( a.rttvar * 4, microseconds( 1000 ) ) + max_ack_delay;
+}
+
+void RudpEndpoint::sendPackets( Association& a )
+{
+    const Clock::time_point now = Clock::now();
+    char packet[max_datagram];
+
+    while( true )
+    {
+        const bool window = a.in_flight + max_datagram <= a.cwnd;
+        const bool data   = window && ( !a.datagrams.empty() || !a.active.empty() );
+        if( !a.ack_pending && !a.ping_pending && !data ) return;
+
+        size_t     pos       = header_size;
+        bool       eliciting = false;
+        SentPacket sent;
+
+        if( a.ack_pending && !a.received.empty() )
+        {
+            const auto& ranges = a.received.ranges();
+            const size_t count = std::min( ranges.size(), max_ack_ranges );
+            packet[pos++] = frame_ack;
+            packet[pos++] = (char)count;
+            size_t written = 0;
+            for( auto it = ranges.rbegin(); written < count; ++it, ++written )
+            {
+                put32( packet + pos,     static_cast<uint32_t>( it->first ) );
+                put32( packet + pos + 4, static_cast<uint32_t>( it->second - 1 ) );
+                pos += 8;
+            }
+        }
+        a.ack_pending = false;
+
+        if( window )
+        {
+            while( !a.datagrams.empty() &&
+                   pos + datagram_frame_header + a.datagrams.front().size() <= max_datagram )
+            {
+                const std::string& message = a.datagrams.front();
+                packet[pos] = frame_datagram;
+                put16( packet + pos + 1, message.size() );
+                memcpy( packet + pos + datagram_frame_header, message.data(), message.size() );
+                pos += datagram_frame_header + message.size();
+                a.datagrams.pop_front();
+                eliciting = true;
+            }
+
+            // Streams take turns, lost bytes before new ones
+            while( !a.active.empty() && pos + stream_frame_header < max_datagram )
+            {
+                const uint32_t id  = a.active.front();
+                auto           sit = a.send.find( id );
+                if( sit == a.send.end() )
+                {
+                    a.active.pop_front();
+                    continue;
+                }
+                SendStream& s = sit->second;
+
+                const size_t room = max_datagram - pos - stream_frame_header;
+                uint64_t offset;
+                size_t   length;
+                bool     resend = false;
+
+                while( !s.lost.empty() )
+                {
+                    auto range = *s.lost.ranges().begin();
+                    if( s.acked.covers( range.first, range.second ) )
+                    {
+                        s.lost.remove( range.first, range.second );
+                        continue;
+                    }
+                    resend = true;
+                    break;
+                }
+
+                if( resend )
+                {
+                    auto range = *s.lost.ranges().begin();
+                    offset = range.first;
+                    length = std::min<uint64_t>( range.second - range.first, room );
+                    s.lost.remove( offset, offset + length );
+                    a.bytes_resent += length;
+                }
+                else if( s.next < s.end() )
+                {
+                    offset = s.next;
+                    length = std::min<uint64_t>( s.end() - s.next, room );
+                    s.next += length;
+                }
+                else
+                {
+                    a.active.pop_front();
+                    s.active = false;
+                    continue;
+                }
+
+                packet[pos] = frame_stream;
+                put32( packet + pos + 1, id );
+                put64( packet + pos + 5, offset );
+                put16( packet + pos + 13, length );
+                memcpy( packet + pos + stream_frame_header, s.buffer.data() + s.head + ( offset - s.base ), length );
+                pos += stream_frame_header + length;
+                sent.chunks.push_back( SentChunk{ id, offset, (uint16_t)length } );
+                eliciting = true;
+
+                a.active.pop_front();
+                if( s.lost.empty() && s.next >= s.end() ) s.active = false;
+                else                                      a.active.push_back( id );
+            }
+        }
+
+        if( a.ping_pending && !eliciting )
+        {
+            packet[pos++] = frame_ping;
+            eliciting = true;
+        }
+        a.ping_pending = false;
+
+        if( pos == header_size ) return;
+
+        const uint32_t number = a.next_packet++;
+        putHeader( packet, type_data, a.id, number );
+
+        if( eliciting )
+        {
+            sent.time  = now;
+            sent.bytes = pos;
+            a.sent.emplace( number, std::move( sent ) );
+            a.in_flight     += pos;
+            a.last_eliciting = now;
+        }
+        a.packets_sent++;
+        a.last_send = now;
+
+        if( !_out.add( packet, pos, a.peer ) )
+        {
+            flushOut();
+            _out.add( packet, pos, a.peer );
+        }
+        if( _out.full() ) flushOut();
+
+        // An ACK or a probe alone does not fill more packets
+        if( !eliciting || !window ) return;
+    }
+}
+
+void RudpEndpoint::sendControl( uint32_t id, uint8_t type, const SockAddr& to )
+{
+    char packet[header_size];
+    putHeader( packet, type, id, 0 );
+    if( !_out.add( packet, sizeof(packet), to ) )
+    {
+        flushOut();
+        _out.add( packet, sizeof(packet), to );
+    }
+}
+
+void RudpEndpoint::flushOut( )
+{
+    if( !_out.empty() ) _socket.sendBatch( _out );
+}
+
+void RudpEndpoint::onTimers( )
+{
+    _timer = 0;
+
+    const Clock::time_point now = Clock::now();
+    Clock::time_point next = Clock::time_point::max();
+
+    std::vector<uint32_t> ids;
+    for( auto& entry : _associations ) ids.push_back( entry.first );
+
+    for( uint32_t id : ids )
+    {
+        Association& a = *_associations[id];
+
+        if( now - a.last_recv >= idle_timeout )
+        {
+            close( id, true, "the peer did not answer" );
+            continue;
+        }
+
+        if( a.loss_time != Clock::time_point() && now >= a.loss_time ) detectLosses( a, now );
+
+        if( !a.sent.empty() )
+        {
+            const Clock::time_point probe = a.last_eliciting + probeTimeout( a ) * ( 1 << a.backoff );
+            if( now >= probe )
+            {
+                // Nothing was acknowledged for too long, send everything again
+                auto it = a.sent.begin();
+                while( it != a.sent.end() )
+                {
+                    onLost( a, it->second, it->first );
+                    it = a.sent.erase( it );
+                }
+                a.in_flight = 0;
+                if( a.backoff > 0 ) a.cwnd = 2 * max_datagram;
+                a.backoff = std::min( a.backoff + 1, max_backoff );
+                a.ping_pending = true;
+            }
+        }
+
+        if( now - a.last_recv >= keepalive && now - a.last_send >= keepalive ) a.ping_pending = true;
+
+        sendPackets( a );
+        watchLocal( a );
+        next = std::min( next, nextTimer( a ) );
+    }
+    flushOut();
+
+    if( !_associations.empty() ) scheduleTimers( next );
+}
+
+RudpEndpoint::Clock::time_point RudpEndpoint::nextTimer( const Association& a ) const
+{
+    Clock::time_point next = std::max( a.last_send, a.last_recv ) + keepalive;
+    if( a.loss_time != Clock::time_point() ) next = std::min( next, a.loss_time );
+    if( !a.sent.empty() )
+    {
+        next = std::min( next, a.last_eliciting + probeTimeout( a ) * ( 1 << a.backoff ) );
+    }
+    return next;
+}
+
+void RudpEndpoint::scheduleTimers( Clock::time_point when )
+{
+    if( _timer && _timer_due <= when ) return;
+
+    _loop.cancelTimer( _timer );
+    _timer     = _loop.addTimer( when, [this]() { onTimers(); } );
+    _timer_due = when;
+}
+
+void RudpEndpoint::watchLocal( Association& a )
+{
+    uint32_t events = 0;
+    if( !a.local_eof && a.send_buffered < send_limit ) events |= IoEvent::Readable;
+    if( a.to_local_head < a.to_local.size() )          events |= IoEvent::Writable;
+
+    if( events != _loop.interest( a.local.socket() ) ) _loop.modify( a.local.socket(), events );
+}
+
+void RudpEndpoint::close( uint32_t id, bool tell_peer, const char* reason )
+{
+    auto it = _associations.find( id );
+    if( it == _associations.end() ) return;
+
+    Association& a = *it->second;
+    if( tell_peer ) sendControl( id, type_close, a.peer );
+    flushOut();
+
+    LOG_INFO << "Reliable-UDP association " << id << " with " << a.peer << " ends, " << reason
+             << ": " << a.packets_sent << " packets sent, " << a.packets_lost << " lost, "
+             << a.bytes_resent << " bytes resent, " << a.datagrams_dropped << " datagrams dropped, srtt "
+             << a.srtt.count() << "us" << std::endl;
+
+    _loop.remove( a.local.socket() );
+    _associations.erase( it );
+
+    // A client endpoint serves one association
+    if( !_server ) _loop.stop();
+}
@@ -0,0 +1,285 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <stdint.h>
+
+#include "udp.h"
+#include "tcp.h"
+#include "sockaddr.h"
+#include "event_loop.h"
+
+/* Reliable-UDP transport for tunnel connections.
+ *
+ * Inside one TCP tunnel, a single lost segment stalls the messages of all
+ * conn_ids until it is retransmitted, and the retransmissions of the inner
+ * TCP connections pile up on top of the tunnel's own. This transport carries
+ * the tunnel messages over UDP instead, with one reliable byte stream per
+ * conn_id, so a loss only delays the stream it belongs to. UDP_PACKET
+ * messages travel unreliably, like the UDP they came from; those too large
+ * for a datagram go reliably on stream 0 with the control messages.
+ *
+ * The dispatchers keep talking to a TCPSocket: the transport hands them one
+ * end of a local stream socketpair and runs the other end in its own thread.
+ * It reads tunnel messages from there, sends them as datagrams, and writes
+ * the messages that arrive back into it, complete messages at a time.
+ *
+ * Wire format, all fields in network byte order. Every datagram starts with
+ *
+ * +-----------+--------+------------+------------------+-----------------+
+ * | version 1 | type 1 | reserved 2 | association 4    | packet number 4 |
+ * +-----------+--------+------------+------------------+-----------------+
+ *
+ * SYN opens an association with the id chosen by TunnelClient, SYN_ACK
+ * confirms it, CLOSE ends it. A DATA datagram carries a sequence of frames:
+ *
+ *   STREAM   type 1, stream 4, offset 8, length 2, bytes
+ *   ACK      type 2, count 1, count times ( first 4, last 4 ), newest first
+ *   DATAGRAM type 3, length 2, one complete tunnel message
+ *   PING     type 4
+ *
+ * Packet numbers of DATA datagrams count up from 0 in each direction and
+ * are never reused; a retransmission carries the lost bytes in a new
+ * packet. ACK frames list the received packet numbers as ranges (SACK).
+ * A packet is lost when three later ones have been acknowledged or it is
+ * older than 9/8 of the RTT; if no acknowledgement arrives within the
+ * probe timeout, everything in flight is resent. The congestion window
+ * follows NewReno.
+ */
+class RudpEndpoint
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Called in the endpoint's thread for every association a client opened
+    using AcceptCallback = std::function<void(std::unique_ptr<TCPSocket> local)>;
+
+    // Size of the datagrams, small enough for common paths without fragmentation
+    static const size_t max_datagram = 1400;
+
+    /* Byte or packet number ranges [first,end), e.g. the acknowledged parts
+     * of a stream.
+     */
+    class RangeSet
+    {
+        std::map<uint64_t, uint64_t> _ranges;  // first -> end
+
+    public:
+        void add( uint64_t first, uint64_t end );
+
+        // True if [first,end) lies inside one range
+        bool covers( uint64_t first, uint64_t end ) const;
+
+        // Remove [first,end) from the ranges
+        void remove( uint64_t first, uint64_t end );
+
+        // Drop everything below first
+        void trimBelow( uint64_t first );
+
+        // Keep only the count ranges with the largest numbers
+        void keepNewest( size_t count );
+
+        inline bool empty() const { return _ranges.empty(); }
+        inline const std::map<uint64_t, uint64_t>& ranges() const { return _ranges; }
+        inline void clear() { _ranges.clear(); }
+    };
+
+private:
+    // Sending half of the stream of one conn_id
+    struct SendStream
+    {
+        std::vector<char> buffer;        // bytes from offset base on, starting at head
+        size_t            head { 0 };
+        uint64_t          base { 0 };    // everything below is acknowledged
+        uint64_t          next { 0 };    // first byte that was never sent
+        RangeSet          acked;         // acknowledged ranges above base
+        RangeSet          lost;          // ranges to send again
+        bool              active { false };  // listed in Association::active
+        bool              closing { false }; // TCP_CLOSE sent or received, dropped once acknowledged
+
+        inline uint64_t end() const { return base + buffer.size() - head; }
+        inline bool     idle() const { return end() == base; }
+    };
+
+    // Receiving half of the stream of one conn_id
+    struct RecvStream
+    {
+        uint64_t                        contiguous { 0 };  // all bytes below have arrived
+        std::map<uint64_t, std::string> early;             // chunks behind a gap
+        std::string                     partial;           // start of an incomplete message
+    };
+
+    struct SentChunk
+    {
+        uint32_t stream;
+        uint64_t offset;
+        uint16_t length;
+    };
+
+    struct SentPacket
+    {
+        Clock::time_point      time;
+        uint16_t               bytes;
+        std::vector<SentChunk> chunks;
+    };
+
+    // One tunnel connection
+    struct Association
+    {
+        uint32_t   id;
+        SockAddr   peer;
+        TCPSocket  local;            // our end of the socketpair
+        bool       local_eof { false };
+
+        // Tunnel messages read from local that are not complete yet
+        std::vector<char> from_local;
+
+        // Complete messages for local that it has not taken yet
+        std::vector<char> to_local;
+        size_t            to_local_head { 0 };
+
+        std::unordered_map<uint32_t, SendStream> send;
+        std::unordered_map<uint32_t, RecvStream> recv;
+        std::deque<uint32_t>                     active;     // streams with something to send
+        std::deque<std::string>                  datagrams;  // unreliable messages to send
+        size_t                                   send_buffered { 0 };
+        size_t                                   recv_buffered { 0 };
+
+        // Nothing but stream 0 is delivered before its first message, the HELLO
+        bool started { false };
+
+        // Streams of conn_ids that were closed; late duplicates are ignored
+        std::unordered_set<uint32_t> retired;
+        std::deque<uint32_t>         retired_order;
+
+        // Sender state
+        uint32_t                         next_packet { 0 };
+        std::map<uint32_t, SentPacket>   sent;
+        size_t                           in_flight { 0 };
+        int64_t                          largest_acked { -1 };
+        Clock::time_point                last_eliciting;   // last packet that needs an ACK
+        Clock::time_point                loss_time;        // earliest time-threshold loss, or zero
+
+        // Receiver state
+        RangeSet received;
+        bool     ack_pending  { false };
+        bool     ping_pending { false };  // keepalive or probe
+
+        // RTT estimate and probe timeout backoff
+        std::chrono::microseconds srtt    { 0 };
+        std::chrono::microseconds rttvar  { 0 };
+        std::chrono::microseconds latest  { 0 };
+        int                       backoff { 0 };
+
+        // NewReno congestion control, in bytes
+        size_t  cwnd          { 10 * max_datagram };
+        size_t  ssthresh      { SIZE_MAX };
+        int64_t recovery_end  { -1 };  // no window reduction for losses up to this packet
+
+        Clock::time_point last_recv;
+        Clock::time_point last_send;
+
+        // Statistics
+        uint64_t packets_sent   { 0 };
+        uint64_t packets_lost   { 0 };
+        uint64_t bytes_resent   { 0 };
+        uint64_t datagrams_dropped { 0 };
+    };
+
+    EventLoop   _loop;
+    UDPSocket   _socket;
+    bool        _server { false };
+    SockAddr    _server_addr;  // client only
+
+    std::unordered_map<uint32_t, std::unique_ptr<Association>> _associations;
+
+    AcceptCallback _accept;
+
+    // Runs onTimers(), 0 if none is scheduled
+    EventLoop::TimerId _timer { 0 };
+    Clock::time_point  _timer_due;
+
+    UDPBatch _in;
+    UDPBatch _out;
+
+    std::thread _thread;
+
+public:
+    explicit RudpEndpoint( EventLoop::Backend backend = EventLoop::defaultBackend() );
+    RudpEndpoint( const RudpEndpoint& ) = delete;
+    RudpEndpoint& operator=( const RudpEndpoint& ) = delete;
+
+    // Stop the endpoint's thread. Open associations are dropped.
+    ~RudpEndpoint( );
+
+    /* TunnelServer: accept associations on UDP port and call accept for
+     * each of them, in the endpoint's thread. Starts the thread.
+     * Returns false if the port cannot be bound.
+     */
+    bool listen( uint16_t port, AcceptCallback accept );
+
+    /* TunnelClient: open an association to host:port. Waits up to
+     * timeout_ms for TunnelServer's answer, then starts the thread.
+     * Returns the end of the association for the dispatcher, or nullptr.
+     * The endpoint serves one association; its thread ends with it.
+     */
+    std::unique_ptr<TCPSocket> connect( const std::string& host, uint16_t port, int timeout_ms = 1000 );
+
+private:
+    void run( );
+
+    /* Create association id with peer and its socketpair. Returns the end
+     * for the dispatcher, or nullptr if the socketpair cannot be created.
+     */
+    std::unique_ptr<TCPSocket> newAssociation( uint32_t id, const SockAddr& peer );
+
+    void onSocket( );
+    void onDatagram( const char* data, size_t size, const SockAddr& from );
+    void onSyn( uint32_t id, const SockAddr& from );
+    void onData( Association& a, uint32_t packet, const char* frames, size_t size );
+
+    void onLocal( Association& a, uint32_t events );
+    void readLocal( Association& a );
+    void writeLocal( Association& a );
+    void queueMessage( Association& a, const char* message, size_t size );
+    void deliver( Association& a, uint32_t stream, uint64_t offset, const char* data, size_t size );
+
+    // Move the contiguous bytes of a stream to local, complete messages at a time
+    void pull( Association& a, uint32_t stream );
+
+    // Append a message to the send stream of its conn_id
+    void appendStream( Association& a, uint32_t stream, const char* message, size_t size, bool closing );
+
+    void onAck( Association& a, const char* ranges, size_t count );
+    void detectLosses( Association& a, Clock::time_point now );
+    void onLost( Association& a, SentPacket& packet, uint32_t number );
+    void updateRtt( Association& a, std::chrono::microseconds sample );
+    std::chrono::microseconds probeTimeout( const Association& a ) const;
+
+    // Send what the congestion window allows, plus an ACK if one is due
+    void sendPackets( Association& a );
+    void sendControl( uint32_t id, uint8_t type, const SockAddr& to );
+    void flushOut( );
+
+    // Timer task, handles the timers of all associations
+    void onTimers( );
+
+    // Time at which the next timer of a is due
+    Clock::time_point nextTimer( const Association& a ) const;
+
+    // Make onTimers() run at when, or earlier
+    void scheduleTimers( Clock::time_point when );
+
+    void watchLocal( Association& a );
+    void close( uint32_t id, bool tell_peer, const char* reason );
+};
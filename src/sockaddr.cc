@@ -88,6 +88,12 @@ bool SockAddr::getPeer( int socket ) const
     return false;
 }
 
+bool SockAddr::operator==( const SockAddr& other ) const
+{
+    return addr.sin_addr.s_addr == other.addr.sin_addr.s_addr &&
+           addr.sin_port        == other.addr.sin_port;
+}
+
 std::ostream& SockAddr::print( std::ostream& ostr ) const
 {
     ostr << getAddress() << ":" << getPort();
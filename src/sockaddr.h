@@ -42,6 +42,13 @@ public:
      * of its peer, which fits into a sockaddr_in struct. Let's fetch it. */
     bool getPeer( int socket ) const;
 
+    // Same IPv4 address and port
+    bool operator==( const SockAddr& other ) const;
+    inline bool operator!=( const SockAddr& other ) const { return !( *this == other ); }
+
+    // IPv4 address and port in one number, e.g. as a hash key
+    inline uint64_t key( ) const { return ( uint64_t( addr.sin_addr.s_addr ) << 16 ) | addr.sin_port; }
+
     // Print dotted decimal address and port to the given ostream.
     std::ostream& print( std::ostream& ostr ) const;
 };
@@ -1,6 +1,12 @@
+#include <algorithm>
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/tcp.h>  // For TCP_NODELAY
+#include <netinet/in.h>
+#ifdef __linux__
+#include <linux/errqueue.h>  // For zero-copy completions
+#endif
 
 #include <fcntl.h>
 #include <unistd.h> // for close
@@ -9,8 +15,28 @@
 
 #include "sockaddr.h"
 #include "tcp.h"
+#include "tls.h"
 #include "verbose.h"
 
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+/* Without kTLS, sendv() encrypts from a copy of its buffers, in chunks of
+ * four maximal TLS records.
+ */
+static const size_t tls_chunk_size = 4 * 16384;
+static thread_local char tls_chunk[tls_chunk_size];
+
+// Reason of the first error in OpenSSL's queue, for logging
+static const char* tlsError( )
+{
+    const char* reason = ERR_reason_error_string( ERR_peek_error() );
+    return reason ? reason : "unknown reason";
+}
+#endif
+
 TCPSocket::TCPSocket( uint16_t port )
 {
     bool success = createServer( port );
@@ -170,6 +196,17 @@ bool TCPSocket::createServer( uint16_t port )
 
 void TCPSocket::destroy( )
 {
+#ifdef HAVE_OPENSSL
+    if( _ssl )
+    {
+        // Tell the peer that the end is intended, but do not wait for its answer
+        if( _valid && _tls_up ) SSL_shutdown( _ssl );
+        SSL_free( _ssl );
+        _ssl     = nullptr;
+        _ktls_tx = _ktls_rx = _tls_up = false;
+        _tls_held = 0;
+    }
+#endif
     if( _valid )
     {
         LOG_DEBUG << "Closing TCP socket " << _sock << std::endl;
@@ -197,8 +234,82 @@ void TCPSocket::setNoBlock( )
     fcntl( _sock, F_SETFL, flags );
 }
 
+bool TCPSocket::createNoBlock( )
+{
+    _sock = ::socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+    if( _sock < 0 )
+    {
+        LOG_ERROR << "Failed to create TCP socket" << std::endl;
+        return false;
+    }
+
+    // CRITICAL FOR LOW LATENCY: Disable Nagle's algorithm
+    setTcpNoDelay();
+
+    // Increase socket buffers for better burst handling (1MB)
+    setSocketBuffers(1024 * 1024);
+
+    setNoBlock();
+
+    _valid = true;
+    return true;
+}
+
+bool TCPSocket::adopt( int fd )
+{
+    destroy();
+    if( fd < 0 ) return false;
+
+    _sock  = fd;
+    _port  = 0;
+    _valid = true;
+    return true;
+}
+
+bool TCPSocket::startConnect( const SockAddr& server )
+{
+    int retval = ::connect( _sock, server.get(), server.size() );
+    if( retval < 0 && errno != EINPROGRESS )
+    {
+        LOG_ERROR << "Failed to connect TCP client socket to port " << server.getPort()
+                  << " - " << strerror(errno)
+                  << std::endl;
+        return false;
+    }
+
+    LOG_DEBUG << "Connecting TCP socket " << _sock << " to port " << server.getPort() << std::endl;
+    return true;
+}
+
+int TCPSocket::finishConnect( )
+{
+    int       err    = 0;
+    socklen_t errlen = sizeof(err);
+
+    if( ::getsockopt( _sock, SOL_SOCKET, SO_ERROR, &err, &errlen ) < 0 )
+    {
+        err = errno;
+    }
+    if( err != 0 ) return err;
+
+    SockAddr  addr;
+    socklen_t addrlen = addr.size();
+
+    if( getsockname( _sock, addr.get(), &addrlen ) < 0 )
+    {
+        LOG_WARN << "Failed to retrieve TCP socket's local port after connect (ignore)" << std::endl;
+    }
+    else
+    {
+        _port = addr.getPort();
+    }
+    return 0;
+}
+
 int TCPSocket::recv( char* buffer, size_t buflen )
 {
+    if( _ssl ) return recvTLS( buffer, buflen );
+
     LOG_DEBUG << "wait for data on TCP socket " << _sock 
               << ", port " << _port 
               << " (up to " << buflen << " bytes)" << std::endl;
@@ -221,6 +332,12 @@ int TCPSocket::send( const void* buffer, size_t buflen )
     LOG_DEBUG << "sending " << buflen 
               << " bytes on TCP socket " << _sock << std::endl;
 
+    if( _ssl && !_ktls_tx )
+    {
+        iovec iov { const_cast<void*>( buffer ), buflen };
+        return sendTLS( &iov, 1 );
+    }
+
     size_t totalSent = 0;
     const char* buf = static_cast<const char*>(buffer);
     
@@ -237,9 +354,11 @@ int TCPSocket::send( const void* buffer, size_t buflen )
             }
             else if (errno == EWOULDBLOCK || errno == EAGAIN)
             {
-                // Socket buffer full, but we're in blocking mode so this shouldn't happen
-                LOG_WARN << " unexpected EWOULDBLOCK on blocking socket" << std::endl;
-                return -1;
+                // Socket buffer full on a non-blocking socket. Not an error,
+                // the caller must keep the rest until the socket is writable.
+                LOG_DEBUG << "TCP socket " << _sock << " would block after "
+                          << totalSent << " of " << buflen << " bytes" << std::endl;
+                return (totalSent > 0) ? (int)totalSent : -1;
             }
             else
             {
@@ -264,6 +383,324 @@ int TCPSocket::send( const void* buffer, size_t buflen )
     return totalSent;
 }
 
+int TCPSocket::sendv( const iovec* iov, size_t iovcnt, bool more, bool zerocopy )
+{
+    // With kTLS, the kernel turns the plain bytes into records
+    if( _ssl && !_ktls_tx ) return sendTLS( iov, iovcnt );
+
+    msghdr msg;
+    memset( &msg, 0, sizeof(msg) );
+    msg.msg_iov    = const_cast<iovec*>( iov );
+    msg.msg_iovlen = iovcnt;
+
+    int flags = 0;
+#ifdef MSG_NOSIGNAL
+    // A tunnel that was reset by the peer must not kill the process
+    flags |= MSG_NOSIGNAL;
+#endif
+#ifdef MSG_MORE
+    if( more ) flags |= MSG_MORE;
+#endif
+#ifdef MSG_ZEROCOPY
+    if( zerocopy ) flags |= MSG_ZEROCOPY;
+#endif
+
+    int retval;
+    do
+    {
+        retval = ::sendmsg( _sock, &msg, flags );
+    }
+    while( retval < 0 && errno == EINTR );
+
+    if( retval < 0 && errno != EAGAIN && errno != EWOULDBLOCK )
+    {
+        LOG_ERROR << " failed to send " << iovcnt << " buffers on TCP socket " << _sock
+                  << " with error msg " << strerror(errno) << std::endl;
+    }
+    return retval;
+}
+
+bool TCPSocket::setZeroCopy( )
+{
+#ifdef SO_ZEROCOPY
+    int on = 1;
+    if( setsockopt( _sock, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on) ) == 0 )
+    {
+        return true;
+    }
+    LOG_WARN << "SO_ZEROCOPY is not supported on TCP socket " << _sock << ": " << strerror(errno) << std::endl;
+#endif
+    return false;
+}
+
+bool TCPSocket::alive( )
+{
+    if( !_valid ) return false;
+
+    // With kTLS RX, data records read fine but a control record fails with EIO
+    char byte;
+    const int retval = ::recv( _sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT );
+    if( retval > 0 ) return true;
+    if( retval == 0 ) return false;
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == EIO;
+}
+
+bool TCPSocket::setRealTime( )
+{
+    // Room for a few RTTs of UDP traffic at video rates, not for a bulk transfer
+    setSocketBuffers( 128 * 1024 );
+
+#ifdef TCP_NOTSENT_LOWAT
+    int lowat = 16 * 1024;
+    if( setsockopt( _sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat) ) == 0 )
+    {
+        return true;
+    }
+    LOG_WARN << "TCP_NOTSENT_LOWAT is not supported on TCP socket " << _sock << ": " << strerror(errno) << std::endl;
+#endif
+    return false;
+}
+
+bool TCPSocket::recvZeroCopyCompletion( uint32_t& lo, uint32_t& hi, bool& copied )
+{
+#if defined(__linux__) && defined(SO_EE_ORIGIN_ZEROCOPY)
+    while( true )
+    {
+        char   control[128];
+        msghdr msg;
+        memset( &msg, 0, sizeof(msg) );
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+
+        if( ::recvmsg( _sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT ) < 0 )
+        {
+            return false;
+        }
+
+        for( cmsghdr* cm = CMSG_FIRSTHDR( &msg ); cm != nullptr; cm = CMSG_NXTHDR( &msg, cm ) )
+        {
+            if( !( cm->cmsg_level == SOL_IP   && cm->cmsg_type == IP_RECVERR ) &&
+                !( cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR ) )
+            {
+                continue;
+            }
+
+            sock_extended_err err;
+            memcpy( &err, CMSG_DATA(cm), sizeof(err) );
+            if( err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno != 0 )
+            {
+                continue;
+            }
+
+            lo     = err.ee_info;
+            hi     = err.ee_data;
+            copied = ( err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED ) != 0;
+            return true;
+        }
+        // Something else was queued, look at the next message
+    }
+#else
+    return false;
+#endif
+}
+
+#ifdef HAVE_OPENSSL
+bool TCPSocket::startTLS( TLSContext& ctx, bool server, const std::string& host )
+{
+    _ssl = SSL_new( ctx.get() );
+    if( _ssl == nullptr || SSL_set_fd( _ssl, _sock ) != 1 )
+    {
+        LOG_ERROR << "Cannot start TLS on TCP socket " << _sock << std::endl;
+        SSL_free( _ssl );
+        _ssl = nullptr;
+        return false;
+    }
+
+    if( server )
+    {
+        SSL_set_accept_state( _ssl );
+        return true;
+    }
+
+    // The certificate must name host, as an IP address or a DNS name
+    if( !host.empty() &&
+        X509_VERIFY_PARAM_set1_ip_asc( SSL_get0_param( _ssl ), host.c_str() ) != 1 )
+    {
+        SSL_set1_host( _ssl, host.c_str() );
+        SSL_set_tlsext_host_name( _ssl, host.c_str() );
+    }
+
+    if( SSL_connect( _ssl ) != 1 )
+    {
+        const long verify = SSL_get_verify_result( _ssl );
+        LOG_ERROR << "TLS handshake with " << host << " failed on TCP socket " << _sock << ": "
+                  << ( verify != X509_V_OK ? X509_verify_cert_error_string( verify )
+                                           : tlsError() )
+                  << std::endl;
+        ERR_clear_error();
+        SSL_free( _ssl );
+        _ssl = nullptr;
+        return false;
+    }
+
+    checkKernelTLS();
+    return true;
+}
+
+void TCPSocket::checkKernelTLS( )
+{
+    _tls_up = true;
+#ifndef OPENSSL_NO_KTLS
+    _ktls_tx = BIO_get_ktls_send( SSL_get_wbio( _ssl ) );
+    _ktls_rx = BIO_get_ktls_recv( SSL_get_rbio( _ssl ) );
+#endif
+    LOG_INFO << SSL_get_version( _ssl ) << " with " << SSL_get_cipher_name( _ssl )
+             << " on TCP socket " << _sock << ", kernel TLS for sending "
+             << ( _ktls_tx ? "on" : "off" ) << ", for receiving "
+             << ( _ktls_rx ? "on" : "off" ) << std::endl;
+}
+
+int TCPSocket::recvTLS( char* buffer, size_t buflen )
+{
+    /* Take every complete record, so that none is left behind in OpenSSL
+     * while the socket itself has nothing more to read.
+     */
+    size_t received = 0;
+    while( received < buflen )
+    {
+        const int retval = SSL_read( _ssl, buffer + received, buflen - received );
+        if( retval > 0 )
+        {
+            received += retval;
+            continue;
+        }
+
+        const int err = SSL_get_error( _ssl, retval );
+        if( !_tls_up && SSL_is_init_finished( _ssl ) ) checkKernelTLS();
+
+        if( received > 0 ) break;
+
+        switch( err )
+        {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            if( errno == 0 ) errno = ECONNRESET;
+            break;
+        default:
+            LOG_WARN << "TLS error on TCP socket " << _sock << ": "
+                     << tlsError() << std::endl;
+            errno = ECONNRESET;
+            break;
+        }
+        ERR_clear_error();
+        return -1;
+    }
+
+    LOG_DEBUG << "read " << received << " decrypted bytes from TCP socket " << _sock << std::endl;
+    return received;
+}
+
+int TCPSocket::sendTLS( const iovec* iov, size_t iovcnt )
+{
+    /* OpenSSL wants a retried write to start with the same bytes. The
+     * caller learns how many from pendingWrite() and keeps them at the
+     * front of its queue.
+     */
+    _tls_held = 0;
+
+    size_t sent = 0;
+    size_t i    = 0;
+    size_t off  = 0;
+    while( i < iovcnt )
+    {
+        size_t len = 0;
+        for( size_t j = i, o = off; j < iovcnt && len < tls_chunk_size; j++, o = 0 )
+        {
+            const size_t n = std::min( iov[j].iov_len - o, tls_chunk_size - len );
+            memcpy( tls_chunk + len, static_cast<const char*>( iov[j].iov_base ) + o, n );
+            len += n;
+        }
+        if( len == 0 ) break;
+
+        size_t chunk_sent = 0;
+        while( chunk_sent < len )
+        {
+            const int retval = SSL_write( _ssl, tls_chunk + chunk_sent, len - chunk_sent );
+            if( retval > 0 )
+            {
+                chunk_sent += retval;
+                continue;
+            }
+
+            const int err = SSL_get_error( _ssl, retval );
+            if( err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ )
+            {
+                _tls_held = len - chunk_sent;
+                if( sent + chunk_sent > 0 ) return sent + chunk_sent;
+                errno = EAGAIN;
+                return -1;
+            }
+
+            LOG_ERROR << " failed to send " << len << " bytes with TLS on TCP socket " << _sock
+                      << ": " << ( err == SSL_ERROR_SYSCALL ? strerror(errno)
+                                                            : tlsError() )
+                      << std::endl;
+            ERR_clear_error();
+            if( err != SSL_ERROR_SYSCALL || errno == 0 ) errno = ECONNRESET;
+            return -1;
+        }
+        sent += len;
+
+        // Skip the buffers that went into this chunk
+        while( i < iovcnt && len >= iov[i].iov_len - off )
+        {
+            len -= iov[i].iov_len - off;
+            off  = 0;
+            i++;
+        }
+        off += len;
+    }
+    return sent;
+}
+
+size_t TCPSocket::pending() const
+{
+    return _ssl ? SSL_pending( _ssl ) : 0;
+}
+#else
+bool TCPSocket::startTLS( TLSContext&, bool, const std::string& )
+{
+    LOG_ERROR << "TLS is not available, the programs were built without OpenSSL" << std::endl;
+    return false;
+}
+
+void TCPSocket::checkKernelTLS( )
+{
+}
+
+int TCPSocket::recvTLS( char*, size_t )
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+int TCPSocket::sendTLS( const iovec*, size_t )
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+size_t TCPSocket::pending() const
+{
+    return 0;
+}
+#endif
+
 SockAddr TCPSocket::getPeer( )
 {
     SockAddr peer;
@@ -3,15 +3,26 @@
 #include <iostream>
 #include <string>
 #include <stdint.h>
+#include <sys/uio.h>
 
 #include "sockaddr.h"
 
+class TLSContext;
+typedef struct ssl_st SSL;
+
 class TCPSocket
 {
     int      _sock  { -1 };
     uint16_t _port  { 0 };
     bool     _valid { false };
 
+    // Set by startTLS()
+    SSL*     _ssl     { nullptr };
+    bool     _ktls_tx { false };  // the kernel encrypts what is written
+    bool     _ktls_rx { false };  // the kernel decrypts what is read
+    bool     _tls_up  { false };  // the handshake is complete
+    size_t   _tls_held { 0 };     // see pendingWrite()
+
     /* Create a TCP socket and connect it to the given port.
      * Store own port in _port.
      */
@@ -26,6 +37,12 @@ class TCPSocket
     void setTcpNoDelay();
     void setSocketBuffers(int size);
 
+    // Learn after the TLS handshake whether the kernel took over the records
+    void checkKernelTLS();
+
+    int recvTLS( char* buffer, size_t buflen );
+    int sendTLS( const iovec* iov, size_t iovcnt );
+
 public:
     // Create an unconnected client socket
     TCPSocket( ) = default;
@@ -68,6 +85,29 @@ public:
     // Set this socket to non-blocking. Important for TCP forwarding.
     void setNoBlock( );
 
+    /* Create a non-blocking client socket without connecting it.
+     * Returns false if the socket could not be created.
+     */
+    bool createNoBlock( );
+
+    /* Take over fd, a connected stream socket that was not created by
+     * TCPSocket, e.g. one end of a socketpair. It is closed with the object.
+     * Returns false if fd is not valid.
+     */
+    bool adopt( int fd );
+
+    /* Start connecting a socket from createNoBlock() to server.
+     * Returns false if the connection attempt failed immediately, errno
+     * tells why. Otherwise the socket becomes writable when the attempt
+     * is over; call finishConnect() then.
+     */
+    bool startConnect( const SockAddr& server );
+
+    /* Complete a connection attempt started by startConnect().
+     * Returns 0 on success or the errno value of the failed connect.
+     */
+    int finishConnect( );
+
     /* Read from the socket into given buffer, up to buflen bytes.
      * The socket must be valid.
      * The function works differently when the socket is blocking vs when it is
@@ -79,11 +119,81 @@ public:
     /* Write to the socket from the given buffer, up to buflen bytes.
      * The socket must be valid.
      * The function works differently when the socket is blocking vs when it is
-     * non-blocking.
+     * non-blocking. A blocking socket writes all bytes or fails. A non-blocking
+     * socket returns as soon as its send buffer is full, so the return value
+     * may be smaller than buflen; if no byte fits, it returns -1 with errno
+     * set to EAGAIN.
      * Returns the usual socket error codes.
      */
     int send( const void* buffer, size_t buflen );
 
+    /* Write the iovcnt buffers of iov with a single sendmsg call. Set more
+     * if the caller will write again right away; TCP may then hold back a
+     * partial segment (MSG_MORE, where available). Meant for non-blocking
+     * sockets: returns the number of bytes written, which may be less than
+     * the total, or -1 with errno set (EAGAIN if nothing fitted). With
+     * zerocopy set, the data is sent with MSG_ZEROCOPY, see setZeroCopy().
+     */
+    int sendv( const iovec* iov, size_t iovcnt, bool more, bool zerocopy = false );
+
+    /* Allow sendv() with zerocopy set (SO_ZEROCOPY, Linux 4.14 and later).
+     * The kernel then sends from the caller's buffers, which must stay
+     * unchanged until a completion for the send has been received.
+     * Returns false if that is not supported.
+     */
+    bool setZeroCopy( );
+
+    /* Keep the kernel's queue short for latency-sensitive traffic: a small
+     * send buffer, and TCP_NOTSENT_LOWAT so that the socket only becomes
+     * writable when little unsent data is left. A message then waits behind
+     * a few KB at most instead of a full buffer.
+     * Returns false if TCP_NOTSENT_LOWAT is not supported.
+     */
+    bool setRealTime( );
+
+    /* Read one zero-copy completion from the socket's error queue. Every
+     * successful sendv() with zerocopy set has a number, counting from 0,
+     * and [lo,hi] is the range of sends the kernel has released. copied is
+     * set if the kernel had to copy the data after all.
+     * Returns false if no completion is waiting.
+     */
+    bool recvZeroCopyCompletion( uint32_t& lo, uint32_t& hi, bool& copied );
+
+    /* Speak TLS 1.3 on this connected socket. A client performs the
+     * handshake right away and must still be blocking; host is the name or
+     * address in TunnelServer's certificate. A server's handshake runs in
+     * its first recv() calls, so it may be non-blocking; recv() returns -1
+     * with EAGAIN until application data arrives.
+     * Returns false if TLS could not be started.
+     */
+    bool startTLS( TLSContext& ctx, bool server, const std::string& host = "" );
+
+    inline bool isTLS() const { return _ssl != nullptr; }
+
+    /* True if bytes written to socket() directly reach the peer as they
+     * should, i.e. without TLS or with the kernel encrypting (kTLS TX).
+     * Only then may the socket be the target of splice().
+     */
+    inline bool rawWrites() const { return _ssl == nullptr || _ktls_tx; }
+
+    /* Decrypted bytes that TLS holds back because the last recv() had no
+     * room for them. The socket does not become readable for these.
+     */
+    size_t pending() const;
+
+    /* Bytes after those that the last sendv() reported as written, which
+     * TLS has taken into a record that it could not send yet. The next
+     * sendv() must start with these bytes again, unchanged. Always 0
+     * without TLS or with kTLS.
+     */
+    inline size_t pendingWrite() const { return _tls_held; }
+
+    /* False if the peer has closed the connection or it failed. Nothing
+     * that has arrived is consumed, so this suits a connection that is
+     * not read yet, like a standby tunnel connection.
+     */
+    bool alive( );
+
     /* Get the IP and port information for a connected peer, or an empty
      * SockAddr structure if there is no valid connection. For printing log info.
      */
@@ -1,7 +1,20 @@
+#include <algorithm>
+
 #include "tcp_connection_manager.h"
 
+void TCPConnectionManager::Connection::resetWindow()
+{
+    data_sent           = 0;
+    peer_consumed       = 0;
+    consumed_base       = out_queue.sent() + out_queue.queued();
+    consumed_advertised = 0;
+    retransmit          = RetransmitBuffer();
+}
+
 TCPConnectionManager::TCPConnectionManager()
-    : _next_conn_id(1)
+    : _connections( ConnectionMap::allocator_type( _connection_pool ) )
+    , _socket_to_conn_id( SocketMap::allocator_type( _socket_pool ) )
+    , _next_conn_id(1)
 {}
 
 uint32_t TCPConnectionManager::allocateConnId()
@@ -32,6 +45,16 @@ void TCPConnectionManager::removeConnection(uint32_t conn_id)
     }
 }
     
+void TCPConnectionManager::closeSocket(uint32_t conn_id)
+{
+    auto it = _connections.find(conn_id);
+    if (it != _connections.end() && it->second.socket)
+    {
+        _socket_to_conn_id.erase(it->second.socket->socket());
+        it->second.socket.reset();
+    }
+}
+
 TCPConnectionManager::Connection* TCPConnectionManager::getConnection(uint32_t conn_id)
 {
     auto it = _connections.find(conn_id);
@@ -77,6 +100,14 @@ size_t TCPConnectionManager::connectionCount() const
     return _connections.size();
 }
     
+void TCPConnectionManager::resetWindows()
+{
+    for (auto& pair : _connections)
+    {
+        pair.second.resetWindow();
+    }
+}
+
 void TCPConnectionManager::markInvalid(uint32_t conn_id)
 {
     auto it = _connections.find(conn_id);
@@ -86,3 +117,37 @@ void TCPConnectionManager::markInvalid(uint32_t conn_id)
     }
 }
 
+
+void TCPConnectionManager::setWeight(uint32_t conn_id, uint16_t weight)
+{
+    auto it = _connections.find(conn_id);
+    if (it != _connections.end())
+    {
+        it->second.weight = std::max<uint16_t>(weight, 1);
+    }
+}
+
+void TCPConnectionManager::markReady(Connection* conn)
+{
+    if (!conn->ready)
+    {
+        conn->ready = true;
+        _ready.push_back(conn->conn_id);
+    }
+}
+
+TCPConnectionManager::Connection* TCPConnectionManager::nextReady()
+{
+    if (_ready.empty()) return nullptr;
+
+    const uint32_t conn_id = _ready.front();
+    _ready.pop_front();
+
+    Connection* conn = getConnection(conn_id);
+    if (!conn || !conn->ready) return nullptr;
+
+    const int64_t quantum = conn->weight * drr_quantum;
+    conn->ready   = false;
+    conn->deficit = std::min(conn->deficit, quantum) + quantum;
+    return conn;
+}
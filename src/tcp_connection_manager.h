@@ -1,9 +1,16 @@
 #pragma once
 
+#include <algorithm>
+#include <deque>
 #include <map>
 #include <memory>
 #include <vector>
 #include "tcp.h"
+#include "buffer_pool.h"
+#include "tcp_send_queue.h"
+#include "retransmit_buffer.h"
+#include "compression.h"
+#include "tunnel_protocol.h"
 #include "sockaddr.h"
 
 // Manages multiple TCP connections through the tunnel
@@ -11,22 +18,145 @@
 class TCPConnectionManager
 {
 public:
+    /* When a connection queues more than this because its socket is slow,
+     * the dispatcher stops reading the tunnel until the queue has drained
+     * to half of it. The same limit applies to the tunnel's own queue, which
+     * stops reading from the connections.
+     */
+    static const size_t max_queued_bytes = 1024 * 1024;
+
+    /* Bytes a connection of weight 1 may read per round of the deficit
+     * round-robin over the readable connections, see nextReady().
+     */
+    static const size_t drr_quantum = 16384;
+
     struct Connection
     {
         uint32_t conn_id;
         std::unique_ptr<TCPSocket> socket;
         bool valid;
-        
+
+        // Bytes the non-blocking socket did not accept yet
+        TCPSendQueue out_queue;
+
+        // The peer has sent TCP_CLOSE, close as soon as out_queue is empty
+        bool closing;
+
+        // The non-blocking connect has not completed yet. Data is only
+        // queued until then.
+        bool connecting;
+
+        /* Flow control, see TunnelWindowUpdate. All counts are TCP_DATA
+         * payload bytes since the current tunnel connection was established.
+         * With lossless resumption, they count on across tunnel connections.
+         */
+        uint64_t data_sent;           // sent to the tunnel
+        uint64_t peer_consumed;       // written to its socket by the peer
+        uint64_t consumed_base;       // bytes in out_queue when the tunnel was established
+        uint64_t consumed_advertised; // last count sent in a WINDOW_UPDATE
+
+        // TCP_DATA payload bytes sent since the connection was opened, across
+        // tunnel connections. Decides its priority in the tunnel's writer.
+        uint64_t data_total;
+
+        /* Deficit round-robin. A connection may read weight * drr_quantum
+         * bytes per round. What it could not use because it ran out of
+         * window or the tunnel was congested carries over to its next turn,
+         * up to one quantum. A connection whose socket is empty starts its
+         * next turn from zero. Bulk data is read in whole frames, which can
+         * make the deficit negative; the connection skips its turns until
+         * the quanta have paid that back.
+         */
+        uint16_t weight;
+        int64_t  deficit;
+        bool     ready;    // in the round-robin list
+
+        // Whether its TCP_DATA is worth compressing, with --compress
+        CompressionEstimator compression;
+
+        /* Lossless resumption, see TunnelResume. The sent bytes that the
+         * peer has not consumed yet, from peer_consumed to data_sent.
+         */
+        RetransmitBuffer retransmit;
+
+        // Not read until the peer's RESUME has arrived
+        bool resuming;
+
+        // The socket is closed and TCP_CLOSE was sent, or is due on the next
+        // tunnel connection. Kept until the peer has consumed all data.
+        bool finished;
+
         Connection(uint32_t id, std::unique_ptr<TCPSocket> sock)
             : conn_id(id)
             , socket( std::move(sock) )
             , valid(true)
+            , closing(false)
+            , connecting(false)
+            , data_sent(0)
+            , peer_consumed(0)
+            , consumed_base(0)
+            , consumed_advertised(0)
+            , data_total(0)
+            , weight(1)
+            , deficit(0)
+            , ready(false)
+            , resuming(false)
+            , finished(false)
         {}
+
+        // Bytes that may be read from the socket and sent to the tunnel now
+        inline size_t sendWindow() const
+        {
+            const uint64_t outstanding = data_sent - peer_consumed;
+            return (outstanding < TunnelProtocol::STREAM_WINDOW)
+                 ? TunnelProtocol::STREAM_WINDOW - outstanding : 0;
+        }
+
+        // Bytes from the tunnel that this side has written to the socket
+        inline uint64_t consumed() const
+        {
+            return std::max(out_queue.sent(), consumed_base) - consumed_base;
+        }
+
+        // Bytes from the tunnel that this side has written or queued
+        inline uint64_t received() const { return out_queue.sent() + out_queue.queued() - consumed_base; }
+
+        // Start counting from zero for a new tunnel connection
+        void resetWindow();
+
+        // Number of bytes waiting in out_queue
+        inline size_t queued() const { return out_queue.queued(); }
+
+        // See TCPSendQueue::write
+        inline bool write(const char* data, size_t len)
+        {
+            if (connecting)
+            {
+                out_queue.append(data, len);
+                return true;
+            }
+            return out_queue.write(*socket, data, len);
+        }
+
+        // See TCPSendQueue::flush
+        inline bool flush() { return out_queue.flush(*socket); }
     };
     
 private:
-    std::map<uint32_t, Connection> _connections;  // conn_id -> Connection
-    std::map<int, uint32_t> _socket_to_conn_id;   // socket fd -> conn_id
+    // The map nodes come from these pools instead of the heap
+    BlockPool _connection_pool;
+    BlockPool _socket_pool;
+
+    using ConnectionMap = std::map<uint32_t, Connection, std::less<uint32_t>,
+                                   PoolAllocator<std::pair<const uint32_t, Connection>>>;
+    using SocketMap     = std::map<int, uint32_t, std::less<int>,
+                                   PoolAllocator<std::pair<const int, uint32_t>>>;
+
+    ConnectionMap _connections;        // conn_id -> Connection
+    SocketMap     _socket_to_conn_id;  // socket fd -> conn_id
+
+    // Readable connections in round-robin order. Removed ones are skipped.
+    std::deque<uint32_t> _ready;
     uint32_t _next_conn_id;
     
 public:
@@ -40,6 +170,9 @@ public:
     
     // Remove a connection
     void removeConnection(uint32_t conn_id);
+
+    // Close the socket of a connection but keep its record
+    void closeSocket(uint32_t conn_id);
     
     // Get connection by conn_id
     Connection* getConnection(uint32_t conn_id);
@@ -61,4 +194,29 @@ public:
     
     // Mark connection as invalid (but don't remove yet)
     void markInvalid(uint32_t conn_id);
+
+    // Set the share of a connection in the deficit round-robin, at least 1
+    void setWeight(uint32_t conn_id, uint16_t weight);
+
+    // Append the connection to the round-robin list unless it is there already
+    void markReady(Connection* conn);
+
+    /* Take the next connection from the round-robin list and add its
+     * quantum to its deficit, of which at most one quantum is left from
+     * earlier turns. Returns nullptr for a connection that was removed
+     * meanwhile. The caller reads about conn->deficit bytes, if that is
+     * positive, and calls markReady() again if the socket has more.
+     */
+    Connection* nextReady();
+
+    // Entries in the round-robin list, including removed connections
+    inline size_t readyCount() const { return _ready.size(); }
+
+    /* Restart flow control of all connections for a new tunnel connection.
+     * Both sides do this when the tunnel is (re)established.
+     */
+    void resetWindows();
+
+    // Thread-safe statistics of the connection record pool
+    inline const BlockPool& pool() const { return _connection_pool; }
 };
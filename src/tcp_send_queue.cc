@@ -0,0 +1,68 @@
+#include <errno.h>
+
+#include "tcp_send_queue.h"
+
+bool TCPSendQueue::write( TCPSocket& socket, const void* data, size_t len )
+{
+    const char* bytes = static_cast<const char*>(data);
+    size_t      sent  = 0;
+
+    // Keep the byte order: nothing bypasses data that is already queued
+    if( queued() == 0 && len > 0 )
+    {
+        int retval = socket.send( bytes, len );
+        if( retval < 0 )
+        {
+            if( errno != EAGAIN && errno != EWOULDBLOCK ) return false;
+        }
+        else
+        {
+            sent   = retval;
+            _sent += retval;
+        }
+    }
+
+    if( sent < len )
+    {
+        append( bytes + sent, len - sent );
+    }
+    return true;
+}
+
+void TCPSendQueue::append( const void* data, size_t len )
+{
+    const char* bytes = static_cast<const char*>(data);
+    _buffer.insert( _buffer.end(), bytes, bytes + len );
+}
+
+bool TCPSendQueue::flush( TCPSocket& socket )
+{
+    if( queued() == 0 ) return true;
+
+    int retval = socket.send( _buffer.data() + _offset, queued() );
+    if( retval < 0 )
+    {
+        return ( errno == EAGAIN || errno == EWOULDBLOCK );
+    }
+
+    _offset += retval;
+    _sent   += retval;
+    if( _offset == _buffer.size() )
+    {
+        clear();
+    }
+    else if( _offset > _buffer.size() / 2 )
+    {
+        // Drop the sent bytes once they are the larger part of the buffer
+        _buffer.erase( _buffer.begin(), _buffer.begin() + _offset );
+        _offset = 0;
+    }
+    return true;
+}
+
+void TCPSendQueue::clear( )
+{
+    _buffer.clear();
+    _offset = 0;
+}
+
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tcp.h"
+
+/* Outbound bytes of a non-blocking TCP socket. Data that the socket does
+ * not accept immediately is kept here, in order, and sent by flush() when
+ * the socket becomes writable. Used for the tunnel and for every forwarded
+ * TCP connection, so that a slow peer never blocks the event loop.
+ */
+class TCPSendQueue
+{
+    // Bytes before _offset have been sent already
+    std::vector<char> _buffer;
+    size_t            _offset { 0 };
+
+    // Bytes that the socket has accepted over the queue's lifetime
+    uint64_t          _sent { 0 };
+
+public:
+    // Number of bytes waiting to be sent
+    inline size_t queued() const { return _buffer.size() - _offset; }
+
+    // Number of bytes the socket has accepted so far, queued or not
+    inline uint64_t sent() const { return _sent; }
+
+    /* Send data on the socket, or append it to the queue if older data
+     * is still waiting or the socket does not take all of it.
+     * Returns false if the socket failed.
+     */
+    bool write( TCPSocket& socket, const void* data, size_t len );
+
+    // Append data without trying to send it, e.g. before the socket is connected
+    void append( const void* data, size_t len );
+
+    /* Send as much of the queue as the socket takes. Call it when the
+     * socket is writable. Returns false if the socket failed.
+     */
+    bool flush( TCPSocket& socket );
+
+    // Drop all queued bytes
+    void clear( );
+};
+
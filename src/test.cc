@@ -4,6 +4,7 @@
 // #include <cstring> // For memset
 
 // #include <sys/socket.h>
+#include <poll.h>
 // #include <netinet/in.h>
 // #include <arpa/inet.h>
 // #include <unistd.h> // for close
@@ -15,8 +16,1061 @@
 // #include <sys/types.h>
 // #include <netdb.h>
 
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <poll.h>
+
 #include "sockaddr.h"
 #include "udp.h"
+#include "tcp.h"
+#include "compression.h"
+#include "tcp_connection_manager.h"
+#include "tcp_send_queue.h"
+#include "tunnel_writer.h"
+#include "tunnel_message_reconstructor.h"
+#include "tunnel_send_message.h"
+#include "rudp.h"
+#include "retransmit_buffer.h"
+#include "udp_flow_table.h"
+#include "tls.h"
+
+#ifdef HAVE_OPENSSL
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+#endif
+
+static int failures = 0;
+
+static void check( const std::string& what, bool ok )
+{
+    std::cout << what << ": " << ( ok ? "ok" : "FAILED" ) << std::endl;
+    if( !ok ) failures++;
+}
+
+// A connected pair of TCP sockets on the loopback interface
+static bool connectedPair( std::unique_ptr<TCPSocket>& client, std::unique_ptr<TCPSocket>& server )
+{
+    TCPSocket listener( 0 );
+    SockAddr  addr;
+    socklen_t addrlen = addr.size();
+    if( !listener.valid() || getsockname( listener.socket(), addr.get(), &addrlen ) < 0 ) return false;
+
+    client.reset( new TCPSocket( "127.0.0.1", addr.getPort() ) );
+    server.reset( new TCPSocket( listener, true ) );
+    return client->valid() && server->valid();
+}
+
+// Read what arrives on a non-blocking socket and append it to received
+static void receive( TCPSocket& socket, std::vector<char>& received )
+{
+    char    buffer[65536];
+    ssize_t retval;
+    while( ( retval = ::recv( socket.socket(), buffer, sizeof(buffer), MSG_DONTWAIT ) ) > 0 )
+    {
+        received.insert( received.end(), buffer, buffer + retval );
+    }
+}
+
+static void testSendQueue( )
+{
+    std::unique_ptr<TCPSocket> client, server;
+    if( !connectedPair( client, server ) )
+    {
+        check( "send queue sockets", false );
+        return;
+    }
+    client->setNoBlock();
+    server->setNoBlock();
+
+    // A small send buffer, so that the queue has to keep most of the data
+    int size = 16384;
+    setsockopt( server->socket(), SOL_SOCKET, SO_SNDBUF, &size, sizeof(size) );
+
+    std::vector<char> data( 4 * 1024 * 1024 );
+    for( size_t i = 0; i < data.size(); i++ ) data[i] = (char)( i * 7 );
+
+    TCPSendQueue queue;
+    bool ok = queue.write( *server, data.data(), data.size() / 2 );
+    ok = ok && queue.write( *server, data.data() + data.size() / 2, data.size() / 2 );
+    check( "send queue keeps what the socket does not take", ok && queue.queued() > 0 );
+
+    std::vector<char> received;
+    for( int i = 0; i < 100000 && ok && received.size() < data.size(); i++ )
+    {
+        pollfd writable = { server->socket(), POLLOUT, 0 };
+        poll( &writable, 1, 10 );
+        ok = queue.flush( *server );
+        receive( *client, received );
+    }
+    check( "send queue flushes in order", ok && received == data && queue.queued() == 0 );
+}
+
+// A message as it arrived, see parseMessages()
+struct Parsed
+{
+    uint32_t          conn_id;
+    TunnelMessageType type;
+    std::string       payload;
+};
+
+// Split the bytes of a tunnel connection with version 1 headers into messages
+static std::vector<Parsed> parseMessages( const std::vector<char>& bytes )
+{
+    std::vector<Parsed> messages;
+    size_t pos = 0;
+    while( pos + TunnelProtocol::HEADER_SIZE <= bytes.size() )
+    {
+        TunnelMessageHeader header;
+        memcpy( &header, bytes.data() + pos, TunnelProtocol::HEADER_SIZE );
+
+        Parsed   message;
+        uint16_t length;
+        TunnelProtocol::parseHeader( header, message.conn_id, length, message.type );
+        if( pos + TunnelProtocol::HEADER_SIZE + length > bytes.size() ) break;
+
+        message.payload.assign( bytes.data() + pos + TunnelProtocol::HEADER_SIZE, length );
+        messages.push_back( message );
+        pos += TunnelProtocol::HEADER_SIZE + length;
+    }
+    return messages;
+}
+
+// Queue a message with the writer's framing
+static void appendMessage( TunnelWriter& writer, uint32_t conn_id, const std::string& payload,
+                           TunnelMessageType type = TunnelMessageType::TCP_DATA,
+                           TunnelWriter::Priority priority = TunnelWriter::Priority::Bulk )
+{
+    writer.append( conn_id, type, payload.data(), payload.size(), priority );
+}
+
+// Flush writer and read from peer until the writer's queue is empty
+static bool drain( TunnelWriter& writer, TCPSocket& socket, TCPSocket& peer, std::vector<char>& received )
+{
+    bool ok = true;
+    for( int i = 0; i < 10000 && ok && writer.queued() > 0; i++ )
+    {
+        pollfd writable = { socket.socket(), POLLOUT, 0 };
+        poll( &writable, 1, 10 );
+        ok = writer.flush( socket );
+        receive( peer, received );
+    }
+    // The last bytes may still be on their way
+    for( int i = 0; i < 10; i++ )
+    {
+        pollfd readable = { peer.socket(), POLLIN, 0 };
+        if( poll( &readable, 1, 10 ) > 0 ) receive( peer, received );
+    }
+    return ok && writer.queued() == 0;
+}
+
+static void testTunnelWriter( )
+{
+    std::unique_ptr<TCPSocket> client, server;
+    if( !connectedPair( client, server ) )
+    {
+        check( "writer sockets", false );
+        return;
+    }
+    client->setNoBlock();
+    server->setNoBlock();
+
+    TunnelWriter writer;
+    appendMessage( writer, 1, "one" );
+    appendMessage( writer, 2, "two" );
+    appendMessage( writer, 1, "three" );
+    check( "writer coalesces messages", writer.flush( *server ) && writer.writes() == 1 && writer.messages() == 3 );
+
+    std::vector<char> received;
+    for( int i = 0; i < 100 && received.size() < 3 * TunnelProtocol::HEADER_SIZE + 11; i++ )
+    {
+        pollfd readable = { client->socket(), POLLIN, 0 };
+        poll( &readable, 1, 10 );
+        receive( *client, received );
+    }
+    std::vector<Parsed> messages = parseMessages( received );
+    check( "writer keeps the order", messages.size() == 3 && messages[0].payload == "one" && messages[1].conn_id == 2
+                                     && messages[2].payload == "three" && messages[2].conn_id == 1 );
+
+    // Messages that the socket takes in parts arrive whole
+    int size = 16384;
+    setsockopt( server->socket(), SOL_SOCKET, SO_SNDBUF, &size, sizeof(size) );
+
+    const size_t count = 200;
+    for( size_t i = 0; i < count; i++ )
+    {
+        appendMessage( writer, i, std::string( 1000 + 37 * i, (char)i ) );
+    }
+    received.clear();
+    bool ok = true;
+    for( int i = 0; i < 10000 && ok && ( writer.queued() > 0 || parseMessages( received ).size() < count ); i++ )
+    {
+        pollfd writable = { server->socket(), POLLOUT, 0 };
+        poll( &writable, 1, 10 );
+        ok = writer.flush( *server );
+        receive( *client, received );
+    }
+    messages = parseMessages( received );
+    bool whole = ok && messages.size() == count;
+    for( size_t i = 0; whole && i < count; i++ )
+    {
+        whole = messages[i].conn_id == i && messages[i].payload == std::string( 1000 + 37 * i, (char)i );
+    }
+    check( "writer sends partially written messages whole", whole && writer.queued() == 0 );
+}
+
+// Payload of the i-th message of testReconstructor(), up to the largest size
+static std::string payloadOf( size_t i )
+{
+    const size_t size = ( i % 10 == 9 ) ? TunnelProtocol::MAX_PAYLOAD_SIZE : ( i * 6553 ) % TunnelProtocol::MAX_PAYLOAD_SIZE;
+    std::string payload( size, ' ' );
+    for( size_t j = 0; j < size; j++ ) payload[j] = (char)( i + j );
+    return payload;
+}
+
+static void testReconstructor( )
+{
+    std::unique_ptr<TCPSocket> client, server;
+    if( !connectedPair( client, server ) )
+    {
+        check( "reconstructor sockets", false );
+        return;
+    }
+    client->setNoBlock();
+    server->setNoBlock();
+
+    const size_t count = 100;
+    TunnelWriter writer;
+    for( size_t i = 0; i < count; i++ ) appendMessage( writer, i, payloadOf( i ) );
+
+    // Messages are split across reads, and the tail moves to the front of the buffer
+    TunnelMessageReconstructor reconstructor;
+    size_t next  = 0;
+    size_t reads = 0;
+    bool   ok    = true;
+    for( int i = 0; i < 10000 && ok && next < count; i++ )
+    {
+        ok = writer.flush( *server );
+
+        pollfd readable = { client->socket(), POLLIN, 0 };
+        if( poll( &readable, 1, 10 ) <= 0 ) continue;
+        if( reconstructor.readFrom( *client ) <= 0 ) continue;
+        reads++;
+
+        TunnelMessage message;
+        while( ok && reconstructor.nextMessage( message ) )
+        {
+            const std::string expected = payloadOf( next );
+            ok = message.conn_id == next && message.type == TunnelMessageType::TCP_DATA
+              && std::string( message.payload.data(), message.payload.size() ) == expected;
+            next++;
+        }
+    }
+    check( "reconstructor decodes " + std::to_string( next ) + " messages in " + std::to_string( reads ) + " reads",
+           ok && next == count && reconstructor.buffered() == 0 );
+}
+
+/* Bytes after an invalid header are not decoded, even if they look like a
+ * valid message, until clear() starts over.
+ */
+static void testCorruptMessage( )
+{
+    std::unique_ptr<TCPSocket> client, server;
+    if( !connectedPair( client, server ) )
+    {
+        check( "corrupt message sockets", false );
+        return;
+    }
+    client->setNoBlock();
+
+    TunnelMessageHeader valid, invalid;
+    TunnelProtocol::createHeader( valid, 1, 0, TunnelMessageType::TCP_CLOSE );
+    TunnelProtocol::createHeader( invalid, 2, 0, TunnelMessageType::TCP_CLOSE );
+    invalid.type = htons( 0x3fff );
+
+    std::string bytes;
+    bytes.append( (const char*)&valid, sizeof(valid) );
+    bytes.append( (const char*)&invalid, sizeof(invalid) );
+    bytes.append( (const char*)&valid, sizeof(valid) );
+    ::send( server->socket(), bytes.data(), bytes.size(), 0 );
+
+    TunnelMessageReconstructor reconstructor;
+    TunnelMessage              message;
+    size_t                     decoded = 0;
+    for( int i = 0; i < 100 && reconstructor.buffered() < bytes.size(); i++ )
+    {
+        pollfd readable = { client->socket(), POLLIN, 0 };
+        if( poll( &readable, 1, 10 ) > 0 ) reconstructor.readFrom( *client );
+    }
+    while( reconstructor.nextMessage( message ) ) decoded++;
+    check( "corrupt message fails the reconstructor", decoded == 1 && reconstructor.failed() );
+
+    // More valid bytes do not help
+    ::send( server->socket(), (const char*)&valid, sizeof(valid), 0 );
+    pollfd readable = { client->socket(), POLLIN, 0 };
+    if( poll( &readable, 1, 100 ) > 0 ) reconstructor.readFrom( *client );
+    check( "corrupt message stays failed", !reconstructor.nextMessage( message ) && reconstructor.failed() );
+
+    // A new tunnel connection starts over
+    reconstructor.clear();
+    ::send( server->socket(), (const char*)&valid, sizeof(valid), 0 );
+    if( poll( &readable, 1, 100 ) > 0 ) reconstructor.readFrom( *client );
+    check( "corrupt message cleared", !reconstructor.failed() && reconstructor.nextMessage( message )
+                                   && message.conn_id == 1 && message.type == TunnelMessageType::TCP_CLOSE );
+}
+
+// The ranges as "[first,end) ..."
+static std::string rangesOf( const RudpEndpoint::RangeSet& set )
+{
+    std::string text;
+    for( auto& range : set.ranges() )
+    {
+        if( !text.empty() ) text += " ";
+        text += "[" + std::to_string( range.first ) + "," + std::to_string( range.second ) + ")";
+    }
+    return text;
+}
+
+static void checkRanges( const std::string& what, const RudpEndpoint::RangeSet& set, const std::string& expected )
+{
+    const std::string text = rangesOf( set );
+    check( what + " " + text, text == expected );
+}
+
+static void testRangeSet( )
+{
+    RudpEndpoint::RangeSet set;
+    set.add( 10, 20 );
+    set.add( 30, 40 );
+    set.add( 5, 5 );
+    checkRanges( "ranges add", set, "[10,20) [30,40)" );
+
+    set.add( 20, 25 );
+    checkRanges( "ranges add adjacent", set, "[10,25) [30,40)" );
+
+    set.add( 12, 18 );
+    checkRanges( "ranges add inside", set, "[10,25) [30,40)" );
+
+    set.add( 0, 50 );
+    checkRanges( "ranges add spanning", set, "[0,50)" );
+    check( "ranges covers", set.covers( 0, 50 ) && set.covers( 10, 11 ) && !set.covers( 40, 51 ) );
+
+    set.remove( 10, 20 );
+    checkRanges( "ranges remove middle", set, "[0,10) [20,50)" );
+    check( "ranges covers after remove", !set.covers( 5, 25 ) && set.covers( 20, 50 ) );
+
+    set.remove( 0, 5 );
+    set.remove( 45, 60 );
+    checkRanges( "ranges remove edges", set, "[5,10) [20,45)" );
+
+    set.remove( 8, 22 );
+    checkRanges( "ranges remove across", set, "[5,8) [22,45)" );
+
+    set.add( 50, 60 );
+    set.add( 70, 80 );
+    set.keepNewest( 2 );
+    checkRanges( "ranges keepNewest", set, "[50,60) [70,80)" );
+
+    set.keepNewest( 5 );
+    checkRanges( "ranges keepNewest more than kept", set, "[50,60) [70,80)" );
+
+    set.trimBelow( 55 );
+    checkRanges( "ranges trimBelow", set, "[55,60) [70,80)" );
+
+    set.remove( 0, 100 );
+    check( "ranges remove all", set.empty() );
+}
+
+/* Write the queue of writer to socket, and read messages from peer until
+ * count have arrived or a second has passed.
+ */
+static std::vector<Parsed> exchange( TunnelWriter& writer, TCPSocket& socket,
+                                     TunnelMessageReconstructor& reconstructor, TCPSocket& peer, size_t count )
+{
+    std::vector<Parsed> messages;
+    for( int i = 0; i < 100 && messages.size() < count; i++ )
+    {
+        if( !writer.flush( socket ) ) break;
+
+        pollfd readable = { peer.socket(), POLLIN, 0 };
+        if( poll( &readable, 1, 10 ) <= 0 || reconstructor.readFrom( peer ) <= 0 ) continue;
+
+        TunnelMessage message;
+        while( reconstructor.nextMessage( message ) )
+        {
+            messages.push_back( Parsed{ message.conn_id, message.type,
+                                        std::string( message.payload.data(), message.payload.size() ) } );
+        }
+    }
+    return messages;
+}
+
+static bool contains( const std::vector<Parsed>& messages, uint32_t conn_id, TunnelMessageType type, const std::string& payload )
+{
+    for( auto& message : messages )
+    {
+        if( message.conn_id == conn_id && message.type == type && message.payload == payload ) return true;
+    }
+    return false;
+}
+
+static void testRudp( )
+{
+    std::mutex                 mutex;
+    std::unique_ptr<TCPSocket> accepted;
+    RudpEndpoint               server_end;
+    uint16_t                   port = 0;
+    for( uint16_t p = 42000; p < 42100 && port == 0; p++ )
+    {
+        if( server_end.listen( p, [&]( std::unique_ptr<TCPSocket> local )
+                               { std::lock_guard<std::mutex> lock( mutex ); accepted = std::move( local ); } ) )
+        {
+            port = p;
+        }
+    }
+
+    RudpEndpoint client_end;
+    std::unique_ptr<TCPSocket> client = client_end.connect( "127.0.0.1", port );
+    for( int i = 0; i < 100 && client; i++ )
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        if( accepted ) break;
+        std::this_thread::sleep_for( std::chrono::milliseconds( 10 ) );
+    }
+    std::unique_ptr<TCPSocket> server;
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        server = std::move( accepted );
+    }
+    if( port == 0 || !client || !server )
+    {
+        check( "reliable-UDP association", false );
+        return;
+    }
+    client->setNoBlock();
+    server->setNoBlock();
+
+    TunnelHello hello;
+    TunnelProtocol::createHello( hello, 0, 1, 1, 0 );
+
+    // Streams of two conn_ids
+    TunnelWriter               writer;
+    TunnelMessageReconstructor reconstructor;
+    const std::string          bulk( 60000, 'b' );
+    appendMessage( writer, 0, std::string( (const char*)&hello, sizeof(hello) ), TunnelMessageType::HELLO );
+    appendMessage( writer, 1, "hello" );
+    appendMessage( writer, 2, bulk );
+    appendMessage( writer, 1, "", TunnelMessageType::TCP_CLOSE );
+    std::vector<Parsed> messages = exchange( writer, *client, reconstructor, *server, 4 );
+    check( "reliable-UDP delivers the streams", messages.size() == 4 && messages[0].type == TunnelMessageType::HELLO
+                                                && contains( messages, 1, TunnelMessageType::TCP_DATA, "hello" )
+                                                && contains( messages, 2, TunnelMessageType::TCP_DATA, bulk )
+                                                && contains( messages, 1, TunnelMessageType::TCP_CLOSE, "" ) );
+
+    // A UDP packet travels as a datagram once the HELLO is through
+    appendMessage( writer, 7, "ping", TunnelMessageType::UDP_PACKET );
+    messages = exchange( writer, *client, reconstructor, *server, 1 );
+    check( "reliable-UDP delivers the UDP packet", contains( messages, 7, TunnelMessageType::UDP_PACKET, "ping" ) );
+
+    // Too large for a datagram, from the flow whose id TCP connection 1 had
+    const std::string large( 3000, 'u' );
+    appendMessage( writer, 1, large, TunnelMessageType::UDP_PACKET );
+    messages = exchange( writer, *client, reconstructor, *server, 1 );
+    check( "reliable-UDP delivers a large UDP packet of a closed conn_id",
+           contains( messages, 1, TunnelMessageType::UDP_PACKET, large ) );
+
+    // A run without a segment size does not end up on the stream of TCP connection 2
+    TunnelUdpSegments segments;
+    TunnelProtocol::createUdpSegments( segments, 0 );
+    const std::string run = std::string( (const char*)&segments, sizeof(segments) ) + std::string( 3000, 's' );
+    appendMessage( writer, 2, run, TunnelMessageType::UDP_SEGMENTS );
+    appendMessage( writer, 2, "after" );
+    messages = exchange( writer, *client, reconstructor, *server, 2 );
+    check( "reliable-UDP drops a malformed UDP_SEGMENTS", messages.size() == 1
+                                                        && contains( messages, 2, TunnelMessageType::TCP_DATA, "after" ) );
+}
+
+static void testPriorities( )
+{
+    std::unique_ptr<TCPSocket> client, server;
+    if( !connectedPair( client, server ) )
+    {
+        check( "priority sockets", false );
+        return;
+    }
+    client->setNoBlock();
+    server->setNoBlock();
+    int size = 16384;
+    setsockopt( server->socket(), SOL_SOCKET, SO_SNDBUF, &size, sizeof(size) );
+
+    // Bulk data that the socket cannot take at once
+    TunnelWriter      writer;
+    std::vector<char> received;
+    const size_t      count = 400;
+    for( size_t i = 0; i < count; i++ ) appendMessage( writer, 1, std::string( 10000, (char)i ) );
+    bool ok = writer.flush( *server );
+    receive( *client, received );
+    const bool backlog = writer.queued() > 0;
+
+    appendMessage( writer, 2, "keys", TunnelMessageType::TCP_DATA, TunnelWriter::Priority::Interactive );
+    appendMessage( writer, 3, "udp", TunnelMessageType::UDP_PACKET, TunnelWriter::Priority::Control );
+    ok = ok && drain( writer, *server, *client, received );
+
+    std::vector<Parsed> messages = parseMessages( received );
+    size_t control = 0, interactive = 0, bulk = 0, last_bulk = 0;
+    bool   ordered = true;
+    for( size_t i = 0; i < messages.size(); i++ )
+    {
+        if( messages[i].conn_id == 3 ) control = i;
+        if( messages[i].conn_id == 2 ) interactive = i;
+        if( messages[i].conn_id == 1 )
+        {
+            ordered   = ordered && messages[i].payload == std::string( 10000, (char)bulk );
+            last_bulk = i;
+            bulk++;
+        }
+    }
+    check( "priority writer sends every message whole", ok && backlog && messages.size() == count + 2
+                                                        && bulk == count && ordered );
+    check( "priority control before interactive before queued bulk", control < interactive && interactive < last_bulk );
+}
+
+static void testDeficitRoundRobin( )
+{
+    TCPConnectionManager manager;
+    std::unique_ptr<TCPSocket> sockets[6];
+    for( int i = 0; i < 3; i++ )
+    {
+        if( !connectedPair( sockets[2 * i], sockets[2 * i + 1] ) )
+        {
+            check( "round-robin sockets", false );
+            return;
+        }
+        manager.addConnection( i + 1, sockets[2 * i] );
+    }
+    manager.setWeight( 1, 1 );
+    manager.setWeight( 2, 3 );
+    manager.setWeight( 3, 0 );
+    check( "round-robin weight is at least 1", manager.getConnection( 3 )->weight == 1 );
+
+    // Both connections always have more to read and use all of their deficit
+    size_t served[3] = { 0, 0, 0 };
+    manager.markReady( manager.getConnection( 1 ) );
+    manager.markReady( manager.getConnection( 2 ) );
+    manager.markReady( manager.getConnection( 2 ) );
+    check( "round-robin lists a connection once", manager.readyCount() == 2 );
+    for( int i = 0; i < 100; i++ )
+    {
+        TCPConnectionManager::Connection* conn = manager.nextReady();
+        served[conn->conn_id] += (size_t)conn->deficit;
+        conn->deficit          = 0;
+        manager.markReady( conn );
+    }
+    check( "round-robin shares follow the weights", served[2] == 3 * served[1]
+                                                 && served[1] == 50 * TCPConnectionManager::drr_quantum );
+
+    // What a connection could not use carries over to its next turn
+    TCPConnectionManager::Connection* conn = manager.nextReady();
+    const int64_t unused = conn->deficit / 2;
+    conn->deficit = unused;
+    manager.markReady( conn );
+    manager.nextReady();
+    check( "round-robin keeps an unused deficit", manager.nextReady() == conn
+                                               && conn->deficit == unused + conn->weight * TCPConnectionManager::drr_quantum );
+
+    // A connection that kept running out of window does not save up more than a quantum
+    TCPConnectionManager::Connection* first = manager.getConnection( 1 );
+    first->deficit = 5 * TCPConnectionManager::drr_quantum;
+    manager.markReady( first );
+    check( "round-robin carries over one quantum at most",
+           manager.nextReady() == first && first->deficit == 2 * TCPConnectionManager::drr_quantum );
+
+    // A connection removed while it waits is skipped
+    manager.markReady( manager.getConnection( 2 ) );
+    manager.removeConnection( 2 );
+    check( "round-robin skips removed connections", manager.nextReady() == nullptr && manager.readyCount() == 0 );
+}
+
+// Try messages that do not compress until the estimator stops trying; returns the number of tries
+static int triesUntilBackoff( CompressionEstimator& estimator, const char* noise, size_t len )
+{
+    char out[8192];
+    int  tries = 0;
+    while( estimator.active() && tries < 100 )
+    {
+        estimator.compress( noise, len, out, sizeof(out), Compression::codec() );
+        tries++;
+    }
+    return tries;
+}
+
+// True if the estimator tries again after exactly skip bytes were sent as they are
+static bool skips( CompressionEstimator& estimator, uint64_t skip )
+{
+    estimator.sent( skip - 1 );
+    if( estimator.active() ) return false;
+    estimator.sent( 1 );
+    return estimator.active();
+}
+
+static void testCompressionEstimator( )
+{
+    // Random bytes fail the entropy test
+    char     noise[4096];
+    uint32_t seed = 1;
+    for( size_t i = 0; i < sizeof(noise); i++ )
+    {
+        seed     = seed * 1103515245 + 12345;
+        noise[i] = (char)( seed >> 24 );
+    }
+
+    CompressionEstimator estimator;
+    char out[8192];
+    check( "estimator small message ignored",
+           estimator.compress( noise, CompressionEstimator::min_size - 1, out, sizeof(out), Compression::codec() ) == 0
+           && estimator.ratio() == 0.5 );
+
+    const int tries = triesUntilBackoff( estimator, noise, sizeof(noise) );
+    check( "estimator backs off after " + std::to_string( tries ) + " tries", tries > 1 && tries < 10 );
+    check( "estimator skips min_backoff", skips( estimator, CompressionEstimator::min_backoff ) );
+
+    // Every further failure doubles the skipped bytes up to max_backoff
+    uint64_t backoff = 2 * CompressionEstimator::min_backoff;
+    bool     doubles = true;
+    while( backoff <= 2 * CompressionEstimator::max_backoff )
+    {
+        doubles = doubles && triesUntilBackoff( estimator, noise, sizeof(noise) ) == 1
+                          && skips( estimator, std::min( backoff, CompressionEstimator::max_backoff ) );
+        backoff *= 2;
+    }
+    check( "estimator backoff doubles up to max_backoff", doubles );
+
+    if( Compression::codec() == Compression::Codec::None ) return;
+
+    // A message that compresses well resets the backoff
+    const char zeros[4096] = { 0 };
+    const size_t size = estimator.compress( zeros, sizeof(zeros), out, sizeof(out), Compression::codec() );
+    check( "estimator compresses zeros", size > 0 && size < sizeof(zeros) / 4 && estimator.active() );
+
+    triesUntilBackoff( estimator, noise, sizeof(noise) );
+    check( "estimator backoff reset", skips( estimator, CompressionEstimator::min_backoff ) );
+}
+
+// Encode a header, then decode it, also from every incomplete prefix
+static void testHeader( uint16_t version, uint32_t conn_id, size_t length, TunnelMessageType type,
+                        bool compressed, size_t expected_size )
+{
+    const std::string what = "header v" + std::to_string( version ) + " conn_id " + std::to_string( conn_id )
+                           + " length " + std::to_string( length );
+
+    char buffer[TunnelProtocol::MAX_HEADER_SIZE];
+    const size_t size = TunnelProtocol::encodeHeader( buffer, version, conn_id, length, type, compressed );
+    check( what + " size " + std::to_string( size ), size == expected_size );
+
+    uint32_t          got_conn_id;
+    size_t            got_length;
+    TunnelMessageType got_type;
+    bool              got_compressed;
+    bool              incomplete = true;
+    for( size_t i = 0; i < size; i++ )
+    {
+        if( TunnelProtocol::decodeHeader( buffer, i, version, got_conn_id, got_length, got_type, got_compressed ) != 0 )
+        {
+            incomplete = false;
+        }
+    }
+    check( what + " incomplete", incomplete );
+
+    const int retval = TunnelProtocol::decodeHeader( buffer, size, version, got_conn_id, got_length, got_type, got_compressed );
+    check( what + " decoded", retval == (int)size && got_conn_id == conn_id && got_length == length
+                              && got_type == type && got_compressed == compressed );
+}
+
+static void testProtocol( )
+{
+    testHeader( 1, 0x12345678, 1000, TunnelMessageType::TCP_DATA, false, TunnelProtocol::HEADER_SIZE );
+    testHeader( 1, 7, 65535, TunnelMessageType::UDP_PACKET, true, TunnelProtocol::HEADER_SIZE );
+
+    // The varints take one byte up to 127, and 256 KB need three
+    testHeader( 2, 0, 0, TunnelMessageType::HELLO, false, 2 );
+    testHeader( 2, 0, 127, TunnelMessageType::UDP_PACKET, false, 2 );
+    testHeader( 2, 0, 128, TunnelMessageType::UDP_PACKET, true, 3 );
+    testHeader( 2, 127, 128, TunnelMessageType::TCP_DATA, false, 4 );
+    testHeader( 2, 128, 0, TunnelMessageType::TCP_CLOSE, false, 4 );
+    testHeader( 2, UINT32_MAX, TunnelProtocol::MAX_FRAME_SIZE, TunnelMessageType::TCP_DATA, true, 9 );
+
+    char buffer[TunnelProtocol::MAX_HEADER_SIZE];
+    uint32_t          conn_id;
+    size_t            length;
+    TunnelMessageType type;
+    bool              compressed;
+
+    size_t size = TunnelProtocol::encodeHeader( buffer, 2, 1, TunnelProtocol::MAX_FRAME_SIZE + 1, TunnelMessageType::TCP_DATA );
+    check( "header v2 length above MAX_FRAME_SIZE rejected",
+           TunnelProtocol::decodeHeader( buffer, size, 2, conn_id, length, type, compressed ) == -1 );
+
+    buffer[0] = 0;
+    check( "header v2 type 0 rejected", TunnelProtocol::decodeHeader( buffer, 2, 2, conn_id, length, type, compressed ) == -1 );
+
+    // A length varint of more than 4 bytes
+    TunnelProtocol::encodeHeader( buffer, 2, 0, 0, TunnelMessageType::TCP_DATA );
+    for( size_t i = 1; i < 6; i++ ) buffer[i] = (char)0x80;
+    check( "header v2 overlong varint rejected",
+           TunnelProtocol::decodeHeader( buffer, 6, 2, conn_id, length, type, compressed ) == -1 );
+}
+
+/* Switch to framing version 2 behind a backlog, the way the dispatchers
+ * answer a HELLO: the old messages and the HELLO keep version 1, and a
+ * frame larger than version 1 allows follows them.
+ */
+static void testFraming( )
+{
+    std::unique_ptr<TCPSocket> client, server;
+    if( !connectedPair( client, server ) )
+    {
+        check( "framing sockets", false );
+        return;
+    }
+    client->setNoBlock();
+    server->setNoBlock();
+    int size = 16384;
+    setsockopt( server->socket(), SOL_SOCKET, SO_SNDBUF, &size, sizeof(size) );
+
+    TunnelWriter writer;
+    const size_t count = 100;
+    for( size_t i = 0; i < count; i++ ) appendMessage( writer, 1, std::string( 30000, (char)i ) );
+    bool ok = writer.flush( *server );
+    const bool backlog = writer.queued() > 0;
+
+    TunnelHello hello;
+    TunnelProtocol::createHello( hello, 0, 1, 2, 0 );
+    writer.barrier();
+    appendMessage( writer, 0, std::string( (const char*)&hello, sizeof(hello) ), TunnelMessageType::HELLO,
+                   TunnelWriter::Priority::Control );
+    writer.setFraming( 2 );
+    const std::string frame( 200000, 'f' );
+    appendMessage( writer, 0x1234, frame );
+    appendMessage( writer, 2, "udp", TunnelMessageType::UDP_PACKET, TunnelWriter::Priority::Control );
+
+    // The peer switches after the HELLO
+    TunnelMessageReconstructor reconstructor;
+    std::vector<Parsed>        messages;
+    for( int i = 0; i < 10000 && ok && messages.size() < count + 3; i++ )
+    {
+        ok = writer.flush( *server );
+
+        pollfd readable = { client->socket(), POLLIN, 0 };
+        if( poll( &readable, 1, 10 ) <= 0 || reconstructor.readFrom( *client ) <= 0 ) continue;
+
+        TunnelMessage message;
+        while( reconstructor.nextMessage( message ) )
+        {
+            messages.push_back( Parsed{ message.conn_id, message.type,
+                                        std::string( message.payload.data(), message.payload.size() ) } );
+            if( message.type == TunnelMessageType::HELLO ) reconstructor.setFraming( 2 );
+        }
+    }
+
+    bool ordered = ok && backlog && messages.size() == count + 3;
+    for( size_t i = 0; ordered && i < count; i++ )
+    {
+        ordered = messages[i].conn_id == 1 && messages[i].payload == std::string( 30000, (char)i );
+    }
+    check( "framing barrier keeps the backlog before the HELLO", ordered && messages[count].type == TunnelMessageType::HELLO );
+    check( "framing version 2 carries a frame over 64 KB", ordered
+                                                         && messages[count + 1].conn_id == 2
+                                                         && messages[count + 2].conn_id == 0x1234
+                                                         && messages[count + 2].payload == frame
+                                                         && reconstructor.buffered() == 0 );
+}
+
+/* TCP_DATA of a Bulk connection over 64 KB goes in one frame, whether it
+ * is read with recv() or moved with splice(), as the dispatchers do.
+ */
+static void testLargeTcpData( )
+{
+    std::unique_ptr<TCPSocket> source, conn, client, server;
+    if( !connectedPair( source, conn ) || !connectedPair( client, server ) )
+    {
+        check( "large data sockets", false );
+        return;
+    }
+    conn->setNoBlock();
+    client->setNoBlock();
+    server->setNoBlock();
+
+    TunnelWriter               writer;
+    TunnelMessageReconstructor reconstructor;
+    writer.setFraming( 2 );
+    reconstructor.setFraming( 2 );
+
+    const size_t len = 100000;
+    std::string  data( len, 0 );
+    for( size_t i = 0; i < len; i++ ) data[i] = (char)( i * 7 );
+
+    // Wait until the connection has all of it
+    auto arrived = [&]() {
+        std::vector<char> peek( len );
+        for( int i = 0; i < 100; i++ )
+        {
+            pollfd readable = { conn->socket(), POLLIN, 0 };
+            poll( &readable, 1, 10 );
+            if( ::recv( conn->socket(), peek.data(), len, MSG_PEEK | MSG_DONTWAIT ) == (ssize_t)len ) return true;
+        }
+        return false;
+    };
+
+    std::vector<char> buffer( writer.maxPayload() );
+    ssize_t bytes = ( source->send( data.data(), len ) == (int)len && arrived() )
+                  ? conn->recv( buffer.data(), writer.maxPayload() ) : -1;
+    bool ok = bytes == (ssize_t)len && sendTunnelMessage( writer, 1, TunnelMessageType::TCP_DATA, buffer.data(), bytes,
+                                                          TunnelWriter::Priority::Bulk );
+    std::vector<Parsed> messages = exchange( writer, *server, reconstructor, *client, 1 );
+    check( "TCP_DATA over 64 KB is read and sent in one frame",
+           ok && messages.size() == 1 && messages[0].conn_id == 1 && messages[0].payload == data );
+
+#ifdef __linux__
+    // A pipe stands in for the socket, which may splice less than it holds
+    int source_pipe[2];
+    if( writer.enableSplice() && writer.spliceRoom() >= len && pipe( source_pipe ) == 0 )
+    {
+        fcntl( source_pipe[1], F_SETPIPE_SZ, 1024 * 1024 );
+        ok = ::write( source_pipe[1], data.data(), len ) == (ssize_t)len
+          && writer.spliceFrom( source_pipe[0], 2, TunnelMessageType::TCP_DATA, writer.maxPayload() ) == (int)len;
+        messages = exchange( writer, *server, reconstructor, *client, 1 );
+        check( "TCP_DATA over 64 KB is spliced in one frame",
+               ok && messages.size() == 1 && messages[0].conn_id == 2 && messages[0].payload == data );
+        ::close( source_pipe[0] );
+        ::close( source_pipe[1] );
+    }
+#endif
+}
+
+// True if buffer holds byte i of the connection, which is (char)i, from offset to its end
+static bool replays( const RetransmitBuffer& buffer, uint64_t offset )
+{
+    const char* data = buffer.at( offset );
+    for( uint64_t i = offset; i < buffer.end(); i++ )
+    {
+        if( data[i - offset] != (char)i ) return false;
+    }
+    return true;
+}
+
+static void testRetransmitBuffer( )
+{
+    char bytes[1000];
+    for( size_t i = 0; i < sizeof(bytes); i++ ) bytes[i] = (char)i;
+
+    RetransmitBuffer buffer;
+    buffer.append( bytes, 100 );
+    check( "retransmit append", buffer.base() == 0 && buffer.end() == 100 && replays( buffer, 0 ) );
+
+    buffer.acknowledge( 30 );
+    check( "retransmit trim", buffer.base() == 30 && buffer.end() == 100 && replays( buffer, 30 ) );
+
+    buffer.acknowledge( 10 );
+    check( "retransmit old acknowledgement ignored", buffer.base() == 30 && replays( buffer, 30 ) );
+
+    // Drops the acknowledged bytes from the vector
+    buffer.acknowledge( 80 );
+    check( "retransmit trim most", buffer.base() == 80 && buffer.end() == 100 && replays( buffer, 80 ) );
+
+    buffer.append( bytes + 100, 900 );
+    check( "retransmit replay after append", buffer.end() == 1000 && replays( buffer, 80 ) && replays( buffer, 500 ) );
+
+    buffer.acknowledge( 2000 );
+    check( "retransmit acknowledgement beyond end", buffer.base() == 1000 && buffer.end() == 1000 );
+
+    buffer.append( bytes, 10 );
+    check( "retransmit append when empty", buffer.base() == 1000 && buffer.end() == 1010 && buffer.at( 1000 )[9] == 9 );
+}
+
+static void testUdpFlowTable( )
+{
+    using Table = UdpFlowTable<std::string>;
+    const Table::Clock::time_point start = Table::Clock::now();
+    const std::chrono::seconds     second( 1 );
+
+    Table table( 3 );
+    check( "flow table oldest when empty", table.oldest() == table.end() );
+    table.insert( 1, "a", start );
+    table.insert( 2, "b", start + second );
+    table.insert( 3, "c", start + 2 * second );
+    check( "flow table full", table.full() && table.size() == 3 );
+    check( "flow table find", table.find( 2 ) != table.end() && table.find( 2 )->second.flow == "b"
+                            && table.find( 4 ) == table.end() );
+
+    // A packet of flow 1 makes flow 2 the least recently active one
+    table.touch( table.find( 1 ), start + 3 * second );
+    check( "flow table oldest", table.oldest()->first == 2 );
+
+    table.erase( table.oldest() );
+    check( "flow table erase", !table.full() && table.find( 2 ) == table.end() && table.oldest()->first == 3 );
+
+    // Flows touched at the same time keep the order of the packets
+    Table lru( 3 );
+    lru.insert( 1, "a", start );
+    lru.insert( 2, "b", start );
+    lru.insert( 3, "c", start );
+    lru.touch( lru.find( 1 ), start );
+    check( "flow table least recently touched first", lru.oldest()->first == 2 );
+
+    // Taking the oldest until the table is empty goes by activity
+    lru.touch( lru.find( 2 ), start + second );
+    std::string order;
+    while( !lru.empty() )
+    {
+        order += lru.oldest()->second.flow;
+        lru.erase( lru.oldest() );
+    }
+    check( "flow table activity order", order == "cab" && lru.oldest() == lru.end() );
+}
+
+#ifdef HAVE_OPENSSL
+/* Write a self-signed certificate for 127.0.0.1 and its key to temporary
+ * PEM files. Returns false if that fails.
+ */
+static bool createCertificate( std::string& cert_file, std::string& key_file )
+{
+    EVP_PKEY*     key = nullptr;
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id( EVP_PKEY_EC, nullptr );
+    bool ok = ctx && EVP_PKEY_keygen_init( ctx ) == 1
+           && EVP_PKEY_CTX_set_ec_paramgen_curve_nid( ctx, NID_X9_62_prime256v1 ) == 1
+           && EVP_PKEY_keygen( ctx, &key ) == 1;
+    EVP_PKEY_CTX_free( ctx );
+
+    X509* cert = X509_new();
+    if( ok )
+    {
+        X509_set_version( cert, 2 );
+        ASN1_INTEGER_set( X509_get_serialNumber( cert ), 1 );
+        X509_gmtime_adj( X509_getm_notBefore( cert ), -3600 );
+        X509_gmtime_adj( X509_getm_notAfter( cert ), 3600 );
+        X509_set_pubkey( cert, key );
+        X509_NAME* name = X509_get_subject_name( cert );
+        X509_NAME_add_entry_by_txt( name, "CN", MBSTRING_ASC, (const unsigned char*)"127.0.0.1", -1, -1, 0 );
+        X509_set_issuer_name( cert, name );
+
+        X509V3_CTX v3;
+        X509V3_set_ctx_nodb( &v3 );
+        X509V3_set_ctx( &v3, cert, cert, nullptr, nullptr, 0 );
+        for( auto ext : { std::make_pair( NID_basic_constraints, "critical,CA:TRUE" ),
+                          std::make_pair( NID_subject_alt_name, "IP:127.0.0.1" ) } )
+        {
+            X509_EXTENSION* extension = X509V3_EXT_conf_nid( nullptr, &v3, ext.first, ext.second );
+            ok = ok && extension && X509_add_ext( cert, extension, -1 ) == 1;
+            X509_EXTENSION_free( extension );
+        }
+        ok = ok && X509_sign( cert, key, EVP_sha256() ) > 0;
+    }
+
+    char cert_name[] = "/tmp/tunnel-test-cert-XXXXXX";
+    char key_name[]  = "/tmp/tunnel-test-key-XXXXXX";
+    FILE* cert_out = ok ? fdopen( mkstemp( cert_name ), "w" ) : nullptr;
+    FILE* key_out  = ok ? fdopen( mkstemp( key_name ), "w" ) : nullptr;
+    ok = ok && cert_out && key_out
+       && PEM_write_X509( cert_out, cert ) == 1
+       && PEM_write_PrivateKey( key_out, key, nullptr, nullptr, 0, nullptr, nullptr ) == 1;
+    if( cert_out ) fclose( cert_out );
+    if( key_out ) fclose( key_out );
+    X509_free( cert );
+    EVP_PKEY_free( key );
+
+    cert_file = cert_name;
+    key_file  = key_name;
+    return ok;
+}
+
+/* With TLS in user space, a write that fills the socket leaves bytes in a
+ * record that OpenSSL must send first. Control messages that are queued
+ * meanwhile must not overtake them.
+ */
+static void testTLSPriorities( )
+{
+    std::string cert_file, key_file;
+    const bool certificate = createCertificate( cert_file, key_file );
+    std::unique_ptr<TLSContext> server_ctx = certificate ? TLSContext::createServer( cert_file, key_file ) : nullptr;
+    std::unique_ptr<TLSContext> client_ctx = certificate ? TLSContext::createClient( cert_file ) : nullptr;
+    unlink( cert_file.c_str() );
+    unlink( key_file.c_str() );
+
+    std::unique_ptr<TCPSocket> client, server;
+    if( !server_ctx || !client_ctx || !connectedPair( client, server ) )
+    {
+        check( "TLS priority setup", false );
+        return;
+    }
+
+    // The client's handshake blocks, the server's runs while it reads
+    bool handshake = false;
+    server->setNoBlock();
+    server->startTLS( *server_ctx, true );
+    std::thread connect( [&]() { handshake = client->startTLS( *client_ctx, false, "127.0.0.1" ); } );
+    char byte;
+    for( int i = 0; i < 100; i++ )
+    {
+        pollfd readable = { server->socket(), POLLIN, 0 };
+        if( poll( &readable, 1, 10 ) > 0 ) server->recv( &byte, 1 );
+    }
+    connect.join();
+    client->setNoBlock();
+    int size = 16384;
+    setsockopt( server->socket(), SOL_SOCKET, SO_SNDBUF, &size, sizeof(size) );
+
+    // Control messages join a backlog of bulk data again and again
+    TunnelWriter               writer;
+    TunnelMessageReconstructor reconstructor;
+    const size_t               count = 200;
+    size_t bulk    = 0;
+    size_t control = 0;
+    bool   ok      = handshake;
+    for( size_t i = 0; i < count; i++ ) appendMessage( writer, 1, std::string( 20000 + i, (char)i ) );
+    for( int i = 0; i < 10000 && ok && ( bulk < count || control < count ); i++ )
+    {
+        if( i < (int)count )
+        {
+            appendMessage( writer, 2, std::string( 100, (char)i ), TunnelMessageType::UDP_PACKET,
+                           TunnelWriter::Priority::Control );
+        }
+        ok = writer.flush( *server );
+
+        pollfd readable = { client->socket(), POLLIN, 0 };
+        if( poll( &readable, 1, 1 ) <= 0 || reconstructor.readFrom( *client ) <= 0 ) continue;
+
+        TunnelMessage message;
+        while( ok && reconstructor.nextMessage( message ) )
+        {
+            const std::string payload( message.payload.data(), message.payload.size() );
+            if( message.conn_id == 1 )
+            {
+                ok = payload == std::string( 20000 + bulk, (char)bulk );
+                bulk++;
+            }
+            else
+            {
+                ok = message.conn_id == 2 && payload == std::string( 100, (char)control );
+                control++;
+            }
+        }
+        ok = ok && !reconstructor.failed();
+    }
+    check( "TLS priority writer keeps the stream intact", ok && bulk == count && control == count );
+}
+#endif
 
 int main( )
 {
@@ -28,5 +1082,25 @@ int main( )
 
     SockAddr heise( "www.heise.de", 80 );
     heise.print( std::cout ) << std::endl;
+
+    testSendQueue();
+    testTunnelWriter();
+    testReconstructor();
+    testCorruptMessage();
+    testPriorities();
+#ifdef HAVE_OPENSSL
+    testTLSPriorities();
+#endif
+    testDeficitRoundRobin();
+    testCompressionEstimator();
+    testProtocol();
+    testFraming();
+    testLargeTcpData();
+    testRetransmitBuffer();
+    testUdpFlowTable();
+    testRangeSet();
+    testRudp();
+
+    return ( failures > 0 ) ? 1 : 0;
 }
 
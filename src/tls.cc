@@ -0,0 +1,124 @@
+#include "tls.h"
+#include "verbose.h"
+
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+// Log and clear OpenSSL's error queue
+static void logSSLErrors( const char* what )
+{
+    unsigned long err;
+    bool          any = false;
+    while( ( err = ERR_get_error() ) != 0 )
+    {
+        char text[256];
+        ERR_error_string_n( err, text, sizeof(text) );
+        LOG_ERROR << what << ": " << text << std::endl;
+        any = true;
+    }
+    if( !any ) LOG_ERROR << what << std::endl;
+}
+
+static SSL_CTX* newContext( const SSL_METHOD* method )
+{
+    SSL_CTX* ctx = SSL_CTX_new( method );
+    if( ctx == nullptr )
+    {
+        logSSLErrors( "Cannot create a TLS context" );
+        return nullptr;
+    }
+
+    // Both programs come from this tree, there is no older peer to talk to
+    SSL_CTX_set_min_proto_version( ctx, TLS1_3_VERSION );
+
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options( ctx, SSL_OP_ENABLE_KTLS );
+#endif
+
+    /* TCPSocket::sendv() retries with whatever is queued then, which may
+     * have grown since a write that could not complete.
+     */
+    SSL_CTX_set_mode( ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER );
+    return ctx;
+}
+
+TLSContext::~TLSContext( )
+{
+    SSL_CTX_free( _ctx );
+}
+
+std::unique_ptr<TLSContext> TLSContext::createServer( const std::string& cert_file,
+                                                      const std::string& key_file )
+{
+    SSL_CTX* ctx = newContext( TLS_server_method() );
+    if( ctx == nullptr ) return nullptr;
+
+    std::unique_ptr<TLSContext> context( new TLSContext( ctx ) );
+
+    if( SSL_CTX_use_certificate_chain_file( ctx, cert_file.c_str() ) != 1 )
+    {
+        logSSLErrors( ( "Cannot load the TLS certificate " + cert_file ).c_str() );
+        return nullptr;
+    }
+    if( SSL_CTX_use_PrivateKey_file( ctx, key_file.c_str(), SSL_FILETYPE_PEM ) != 1 ||
+        SSL_CTX_check_private_key( ctx ) != 1 )
+    {
+        logSSLErrors( ( "Cannot use the TLS private key " + key_file ).c_str() );
+        return nullptr;
+    }
+
+    /* A tunnel lives long and reconnects with a full handshake, session
+     * tickets would only be extra bytes in front of the first message.
+     */
+    SSL_CTX_set_num_tickets( ctx, 0 );
+    return context;
+}
+
+std::unique_ptr<TLSContext> TLSContext::createClient( const std::string& ca_file )
+{
+    SSL_CTX* ctx = newContext( TLS_client_method() );
+    if( ctx == nullptr ) return nullptr;
+
+    std::unique_ptr<TLSContext> context( new TLSContext( ctx ) );
+
+    const int loaded = ca_file.empty() ? SSL_CTX_set_default_verify_paths( ctx )
+                                       : SSL_CTX_load_verify_locations( ctx, ca_file.c_str(), nullptr );
+    if( loaded != 1 )
+    {
+        logSSLErrors( ( "Cannot load the CA certificates " + ca_file ).c_str() );
+        return nullptr;
+    }
+    SSL_CTX_set_verify( ctx, SSL_VERIFY_PEER, nullptr );
+    return context;
+}
+
+bool TLSContext::available( )
+{
+    return true;
+}
+
+#else // HAVE_OPENSSL
+
+TLSContext::~TLSContext( )
+{
+}
+
+std::unique_ptr<TLSContext> TLSContext::createServer( const std::string&, const std::string& )
+{
+    LOG_ERROR << "TLS is not available, the programs were built without OpenSSL" << std::endl;
+    return nullptr;
+}
+
+std::unique_ptr<TLSContext> TLSContext::createClient( const std::string& )
+{
+    LOG_ERROR << "TLS is not available, the programs were built without OpenSSL" << std::endl;
+    return nullptr;
+}
+
+bool TLSContext::available( )
+{
+    return false;
+}
+
+#endif // HAVE_OPENSSL
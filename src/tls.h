@@ -0,0 +1,40 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+typedef struct ssl_ctx_st SSL_CTX;
+
+/* TLS 1.3 settings for the tunnel connections, see TCPSocket::startTLS().
+ * After the handshake, OpenSSL hands the record layer to the kernel (kTLS)
+ * if both support it, so encrypted tunnel data can still be written with
+ * sendmsg and splice. Otherwise the records are encrypted in user space.
+ */
+class TLSContext
+{
+    SSL_CTX* _ctx;
+
+    explicit TLSContext( SSL_CTX* ctx ) : _ctx( ctx ) { }
+
+public:
+    TLSContext( const TLSContext& ) = delete;
+    TLSContext& operator=( const TLSContext& ) = delete;
+    ~TLSContext( );
+
+    /* TunnelServer side: certificate chain and private key in PEM files.
+     * Returns nullptr after logging the reason if they cannot be used.
+     */
+    static std::unique_ptr<TLSContext> createServer( const std::string& cert_file,
+                                                     const std::string& key_file );
+
+    /* TunnelClient side: verify TunnelServer's certificate with the CA
+     * certificates in ca_file, or with the system's if ca_file is empty.
+     * Returns nullptr after logging the reason on failure.
+     */
+    static std::unique_ptr<TLSContext> createClient( const std::string& ca_file );
+
+    // False if the programs were built without OpenSSL
+    static bool available( );
+
+    inline SSL_CTX* get() const { return _ctx; }
+};
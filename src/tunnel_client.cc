@@ -6,6 +6,7 @@
 
 #include <thread>
 #include <chrono>
+#include <atomic>
 
 #include <argp.h>
 
@@ -14,62 +15,48 @@
 
 #include "tunnel_client_argp.h"
 #include "tunnel_client_dispatch.h"
+#include "event_loop.h"
 #include "sockaddr.h"
 #include "udp.h"
 #include "tcp.h"
+#include "tls.h"
+#include "tunnel_client_dialer.h"
+#include "buffer_pool.h"
 #include "verbose.h"
 
-// Attempt to connect to TunnelServer with retry
-// Returns valid TCPSocket or invalid socket if max retries exceeded
-std::unique_ptr<TCPSocket> connectWithRetry(const std::string& host, uint16_t port, 
-                                            int max_attempts = 100 )
-{
-    for (int attempt = 0; attempt < max_attempts; attempt++)
-    {
-        LOG_INFO << "Connection attempt " << attempt+1 << " of " << max_attempts 
-                 << " to " << host << ":" << port << std::endl;
-        
-        std::unique_ptr<TCPSocket> tunnel(new TCPSocket(host, port));
-        
-        if (tunnel->valid())
-        {
-            LOG_INFO << "Successfully connected to " << host << ":" << port 
-                     << " on socket " << tunnel->socket() << std::endl;
-            return tunnel;
-        }
-        
-	if( attempt == 0 )
-	{
-       	    std::cerr << "Connection attempt 1 failed" << std::endl;
-	}
-	else
-	{
-	    std::cerr << " " << attempt+1;
-	}
-       	LOG_WARN << "Connection attempt " << attempt+1 << " failed" << std::endl;
-        tunnel.reset(); // explicit delete although it auto-deletes in next loop
-        
-        if (attempt < max_attempts)
-        {
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        }
-    }
+// Set when the user presses Q or a shard gives up. Read by all shard threads.
+static std::atomic<bool> quit_requested { false };
 
-    std::cerr << std::endl;
-    LOG_ERROR << "Failed to connect after " << max_attempts << " attempts" << std::endl;
-    return nullptr;
-}
+// Set when a shard could not connect to TunnelServer at all
+static std::atomic<bool> connect_failed { false };
 
 int main( int argc, char* argv[] )
 {
     arguments args;
 
     callArgParse( argc, argv, args );
+    SlabMemory::useHugePages( args.huge_pages );
 
     std::cout << "= ======================" << std::endl;
     std::cout << "= ==== TunnelClient ====" << std::endl;
     std::cout << "= ======================" << std::endl;
-    std::cout << "= Press Q<ret> to quit" << std::endl;
+    std::cout << "= Press Q<ret> to quit, S<ret> for statistics" << std::endl;
+
+    std::unique_ptr<TLSContext> tls;
+    if( args.tls )
+    {
+        tls = TLSContext::createClient( args.tls_ca );
+        if( !tls )
+        {
+            LOG_ERROR << "Cannot set up TLS for the tunnel (quitting)" << std::endl;
+            return -1;
+        }
+        std::cout << "= Tunnel connections are encrypted with TLS 1.3" << std::endl;
+    }
+    if( args.rudp )
+    {
+        std::cout << "= Tunnel connections run over reliable UDP" << std::endl;
+    }
 
     UDPSocket udp_forwarder;
     if( udp_forwarder.create() == false )
@@ -80,65 +67,198 @@ int main( int argc, char* argv[] )
     std::cout << "= Anonymous forwarding socket " << udp_forwarder.socket() << " created" << std::endl;
     udp_forwarder.setNoBlock(); // collection should proceed if the UDP socket is temporarily blocked
 
-    std::shared_ptr<TCPSocket> webSock;
-
     SockAddr dest_udp( args.forward_udp_host.c_str(), args.forward_udp_port );
     SockAddr dest_tcp( args.forward_tcp_host.c_str(), args.forward_tcp_port );
 
-    // Main reconnection loop
-    bool continue_running = true;
-    int reconnect_count = 0;
-    
-    while (continue_running)
+    // Optional UDP side channel for UDP packets, to the tunnel's port number
+    UDPSocket udp_channel;
+    SockAddr  dest_channel( args.tunnel_host.c_str(), args.tunnel_port );
+    if( args.datagrams )
     {
-        // Connect to TunnelServer with retry
-        std::unique_ptr<TCPSocket> tunnel( connectWithRetry(args.tunnel_host, args.tunnel_port) );
-        
-        if (!tunnel || !tunnel->valid())
+        if( udp_channel.create() == false )
         {
-            LOG_ERROR << "Could not establish tunnel connection. Exiting." << std::endl;
+            LOG_ERROR << "Failed to create UDP socket for the side channel (quitting)" << std::endl;
             return -1;
         }
-        LOG_INFO << "Established a tunnel to " << tunnel->getPeer() << " on socket " << tunnel->socket() << std::endl;
-        
-        reconnect_count++;
-        if (reconnect_count > 1)
-        {
-            std::cout << "= Reconnection #" << (reconnect_count - 1) 
-                      << " established" << std::endl;
-        }
-        else
-        {
-            std::cout << "= Initial connection established" << std::endl;
-        }
-        
-        std::cout << "= Connected to " << args.tunnel_host << ":" << args.tunnel_port
-                  << " on socket " << tunnel->socket() << std::endl;
-        
-        // Run dispatch loop
-        // Returns true if user requested quit, false if connection lost
-        bool user_quit = dispatch_loop( tunnel, udp_forwarder, webSock, 
-                                        dest_udp, dest_tcp );
-        
-
-        if (user_quit)
+        udp_channel.setNoBlock();
+        std::cout << "= UDP side channel to " << dest_channel << " on socket " << udp_channel.socket() << std::endl;
+    }
+
+    /* One dispatcher per tunnel connection. They live across reconnections,
+     * they own the preserved TCP connections. Shard 0 handles UDP; with
+     * --realtime it is an extra one that TunnelServer gives no TCP connections.
+     */
+    const int shard_count = args.tunnels + ( args.realtime ? 1 : 0 );
+    std::vector<std::unique_ptr<TunnelClientDispatch>> shards;
+    for( int i=0; i<shard_count; i++ )
+    {
+        shards.emplace_back( new TunnelClientDispatch( i, shard_count,
+                                                       ( i == 0 ) ? &udp_forwarder : nullptr,
+                                                       ( i == 0 && args.datagrams ) ? &udp_channel : nullptr,
+                                                       dest_udp, dest_tcp, dest_channel, args.max_connects,
+                                                       args.zerocopy, size_t( args.interactive_kb ) * 1024,
+                                                       args.compress, !args.no_resume,
+                                                       args.heartbeat_ms, args.heartbeat_misses, args.udp_timeout,
+                                                       args.backend ) );
+    }
+
+    /* One dialer per shard. Attempts alternate between TunnelServer and the
+     * --alternate one, if given.
+     */
+    std::vector<TunnelClientDialer::Target> targets { { args.tunnel_host, args.tunnel_port } };
+    if( args.alternate_port != 0 )
+    {
+        targets.push_back( { args.alternate_host, args.alternate_port } );
+        std::cout << "= Standby tunnel connections go to " << args.alternate_host << ":"
+                  << args.alternate_port << " when it can be reached" << std::endl;
+    }
+    else if( args.standby )
+    {
+        std::cout << "= A standby tunnel connection is kept for every tunnel connection" << std::endl;
+    }
+    std::vector<std::unique_ptr<TunnelClientDialer>> dialers;
+    for( int i=0; i<shard_count; i++ )
+    {
+        dialers.emplace_back( new TunnelClientDialer( i, targets, tls.get(), args.rudp, args.backend ) );
+    }
+
+    // The main thread only watches stdin
+    EventLoop main_loop( args.backend );
+
+    auto quitAll = [&shards,&dialers,&main_loop]()
+    {
+        quit_requested = true;
+        for( auto& shard : shards ) shard->quit();
+        for( auto& dialer : dialers ) dialer->cancel();
+        main_loop.stop();
+    };
+
+    if( !main_loop.add( 0, IoEvent::Readable, [&main_loop,&quitAll,&shards](uint32_t)
         {
-            std::cout << "= User requested quit. Exiting." << std::endl;
-            continue_running = false;
-        }
-        else
+            int c = getchar( );
+            if( c == 'q' || c == 'Q' )
+            {
+                std::cout << "= Q pressed by user. Quitting." << std::endl;
+                quitAll();
+            }
+            else if( c == 's' || c == 'S' )
+            {
+                for( auto& shard : shards ) shard->printStats( std::cout );
+            }
+            else if( c == EOF )
+            {
+                // stdin is closed or redirected, stop watching it instead of spinning
+                main_loop.remove( 0 );
+            }
+        } ) )
+    {
+        LOG_WARN << "Cannot watch stdin, Q<ret> will not work" << std::endl;
+    }
+
+    std::atomic<int> total_reconnects { 0 };
+
+    // Main reconnection loop of every shard
+    std::vector<std::thread> threads;
+    for( int shard = 0; shard < shard_count; shard++ )
+    {
+        TunnelClientDispatch& dispatcher = *shards[shard];
+        TunnelClientDialer&   dialer     = *dialers[shard];
+
+        threads.emplace_back( [&args,&dispatcher,&dialer,&main_loop,&quitAll,&total_reconnects,shard]()
         {
-            std::cout << "= Tunnel connection lost. Attempting reconnection..." << std::endl;
-            LOG_INFO << "Tunnel disconnected. Will attempt to reconnect." << std::endl;
-        }
+            using Clock = std::chrono::steady_clock;
+            int reconnect_count = 0;
+            Clock::time_point lost;
+
+            dialer.dial( 0 );
+            while (!quit_requested)
+            {
+                // Take the standby, or wait for the connection that is being dialled
+                bool standby = false;
+                TunnelClientDialer::Connection connection = dialer.take( standby );
+                std::unique_ptr<TCPSocket>& tunnel = connection.tunnel;
+
+                if (!tunnel || !tunnel->valid())
+                {
+                    if (!quit_requested)
+                    {
+                        LOG_ERROR << "Could not establish tunnel connection. Exiting." << std::endl;
+                        connect_failed = true;
+                    }
+                    break;
+                }
+                LOG_INFO << "Established a tunnel to " << tunnel->getPeer() << " on socket " << tunnel->socket() << std::endl;
+
+                /* Dial the next tunnel connection right away, to the other
+                 * TunnelServer if there is one, so that it is ready when
+                 * this one fails.
+                 */
+                const size_t next = ( connection.target + 1 ) % dialer.targets();
+                if (args.standby) dialer.dial( next );
+
+                if (args.realtime && shard == 0 && !args.rudp)
+                {
+                    // UDP packets must not wait behind a full send buffer
+                    tunnel->setRealTime();
+                }
+
+                const TunnelClientDialer::Target& target = dialer.target( connection.target );
+                reconnect_count++;
+                if (reconnect_count > 1)
+                {
+                    const auto failover = std::chrono::duration_cast<std::chrono::microseconds>( Clock::now() - lost );
+                    dispatcher.noteFailover( failover, standby );
+                    std::cout << "= Reconnection #" << (reconnect_count - 1)
+                              << " of shard " << shard << " established after " << failover.count() / 1000.0
+                              << " ms" << ( standby ? " (standby)" : "" ) << std::endl;
+                    total_reconnects++;
+                }
+                else
+                {
+                    std::cout << "= Initial connection of shard " << shard << " established" << std::endl;
+                }
+
+                std::cout << "= Connected to " << target.host << ":" << target.port
+                          << " on socket " << tunnel->socket() << std::endl;
+
+                // Run dispatch loop
+                // Returns true if user requested quit, false if connection lost
+                bool user_quit = dispatcher.run( tunnel );
+
+                if (user_quit)
+                {
+                    break;
+                }
+                lost = Clock::now();
+
+                // Without a standby, try the same TunnelServer first
+                dialer.dial( args.standby ? next : connection.target );
+
+                std::cout << "= Tunnel connection of shard " << shard << " lost. Attempting reconnection..." << std::endl;
+                LOG_INFO << "Tunnel disconnected. Will attempt to reconnect." << std::endl;
+            }
+
+            // If one shard gives up, the whole TunnelClient quits
+            main_loop.post( quitAll );
+        } );
     }
-    
+
+    main_loop.run( );
+
+    for( auto& t : threads ) t.join();
+
+    if (connect_failed)
+    {
+        return -1;
+    }
+
+    std::cout << "= User requested quit. Exiting." << std::endl;
     std::cout << "= TunnelClient shutting down" << std::endl;
-    if (reconnect_count > 1)
+    if (total_reconnects > 0)
     {
-        std::cout << "= Total reconnections: " << (reconnect_count - 1) << std::endl;
+        std::cout << "= Total reconnections: " << total_reconnects << std::endl;
     }
-    
+
     return 0;
 }
 
@@ -5,6 +5,7 @@
 #include <argp.h>
 #include "generic_argp.h"
 #include "tunnel_client_argp.h"
+#include "compression.h"
 #include "verbose.h"
 
 const char *argp_program_version = "TunnelClient 0.1";
@@ -17,6 +18,24 @@ static char args_doc[] = "<tunnel-url>";
 static struct argp_option options[] = {
     { "fwd-udp",      'u', "string",    0, "(mandatory) The UDP URL of the local machine."},
     { "fwd-tcp",      't', "string",    0, "(mandatory) The TCP URL of the local machine."},
+    { "tunnels",      'n', "int",       0, "Number of parallel tunnel connections to TunnelServer, each served by its own thread (default 1). Must match TunnelServer."},
+    { "max-connects", 'c', "int",       0, "Maximum number of concurrent connects to the TCP destination per tunnel connection (default 64). Further TCP_OPENs wait."},
+    { "backend",      'b', "string",    0, "Event loop backend: epoll (default on Linux) or poll."},
+    { "huge-pages",   'H', 0,           0, "Allocate the tunnel message buffers from huge pages."},
+    { "zerocopy",     'z', 0,           0, "Send large batches of tunnel messages with MSG_ZEROCOPY (Linux)."},
+    { "compress",     'Z', 0,           0, "Compress TCP data and UDP packets for the tunnel where that saves bandwidth."},
+    { "no-resume",    'N', 0,           0, "Do not keep a copy of the TCP data in flight to send it again after a tunnel reconnect. Data in flight is lost then, but bulk data may be spliced."},
+    { "standby",      's', 0,           0, "Keep a second tunnel connection to TunnelServer ready for each one in use, and switch to it at once when the one in use fails."},
+    { "alternate",    'a', "url",       0, "Connect the standby tunnel connections to this second TunnelServer, hostname:port or 'dotted decimal address':port, when it can be reached (implies --standby)."},
+    { "datagrams",    'd', 0,           0, "Open a UDP side channel to TunnelServer's tunnel port and carry UDP packets on it instead of the tunnel. TunnelServer needs --datagrams as well."},
+    { "interactive",  'I', "KB",        0, "TCP data of a connection goes ahead of bulk transfers in the tunnel's send queue until the connection has sent this many KB (default 64, 0 for never)."},
+    { "realtime",     'R', 0,           0, "Open an extra tunnel connection that only carries UDP packets, with a short send queue, so they do not wait behind TCP data. TunnelServer needs --realtime as well."},
+    { "transport",    'x', "string",    0, "tcp (default), or rudp to carry the tunnel over reliable UDP. TunnelServer needs --transport rudp as well."},
+    { "tls",          'T', 0,           0, "Encrypt the tunnel with TLS 1.3 and verify TunnelServer's certificate with the system's CA certificates."},
+    { "tls-ca",       'A', "file",      0, "Verify TunnelServer's certificate with the CA certificates in this PEM file instead (implies --tls)."},
+    { "heartbeat",    'p', "ms",        0, "Send a PING to TunnelServer this often and measure the round-trip time (default 200, 0 for never)."},
+    { "heartbeat-misses", 'm', "int",   0, "Reconnect when nothing arrived from TunnelServer for this many heartbeats (default 3)."},
+    { "udp-timeout",  'U', "s",         0, "Close the forwarding socket of a UDP flow when no packet passed for this many seconds (default 60)."},
     { "verbose",      'v', 0,           0, "Enable verbose output (informational and debug messages)."},
     { 0 }
 };
@@ -51,6 +70,100 @@ static error_t parse_opt( int key, char *arg, struct argp_state *state )
             args->forward_tcp_port = port;
         }
         break;
+    case 'n':
+        args->tunnels = atoi( arg );
+        if( args->tunnels < 1 )
+        {
+            argp_error( state, "Option --tunnels (-n) must be at least 1.");
+        }
+        break;
+    case 'c':
+        args->max_connects = atoi( arg );
+        if( args->max_connects < 1 )
+        {
+            argp_error( state, "Option --max-connects (-c) must be at least 1.");
+        }
+        break;
+    case 'b':
+        if( !EventLoop::backendFromString( arg, args->backend ) )
+        {
+            argp_error( state, "Unknown event loop backend %s.", arg );
+        }
+        break;
+    case 'H':
+        args->huge_pages = true;
+        break;
+    case 'z':
+        args->zerocopy = true;
+        break;
+    case 'Z':
+        if( Compression::codec() == Compression::Codec::None )
+        {
+            argp_error( state, "Compression is not available, TunnelClient was built without LZ4 and zlib." );
+        }
+        args->compress = true;
+        break;
+    case 'd':
+        args->datagrams = true;
+        break;
+    case 'N':
+        args->no_resume = true;
+        break;
+    case 'R':
+        args->realtime = true;
+        break;
+    case 's':
+        args->standby = true;
+        break;
+    case 'a':
+        {
+            args->standby        = true;
+            args->alternate_host = arg;
+            const int port = extractPort( args->alternate_host );
+            if( port < 0 )
+            {
+                argp_error( state, "URL of option --alternate (-a) does not contain a port." );
+            }
+            args->alternate_port = port;
+        }
+        break;
+    case 'I':
+        args->interactive_kb = atoi( arg );
+        break;
+    case 'p':
+        args->heartbeat_ms = atoi( arg );
+        break;
+    case 'U':
+        args->udp_timeout = atoi( arg );
+        if( args->udp_timeout < 1 )
+        {
+            argp_error( state, "Option --udp-timeout (-U) must be at least 1.");
+        }
+        break;
+    case 'm':
+        args->heartbeat_misses = atoi( arg );
+        if( args->heartbeat_misses < 1 )
+        {
+            argp_error( state, "Option --heartbeat-misses (-m) must be at least 1.");
+        }
+        break;
+    case 'x':
+        if( std::string( arg ) == "rudp" )
+        {
+            args->rudp = true;
+        }
+        else if( std::string( arg ) != "tcp" )
+        {
+            argp_error( state, "Unknown transport %s.", arg );
+        }
+        break;
+    case 'T':
+        args->tls = true;
+        break;
+    case 'A':
+        args->tls    = true;
+        args->tls_ca = arg;
+        break;
     case 'v':
         args->verbose = true;
         g_verbose = true;
@@ -91,6 +204,14 @@ static error_t parse_opt( int key, char *arg, struct argp_state *state )
         {
             argp_error( state, "Mandatory option --fwd-tcp (-t) is missing.");
         }
+        if (args->datagrams && args->tls)
+        {
+            argp_error( state, "The UDP side channel (--datagrams) is not encrypted and cannot be combined with TLS.");
+        }
+        if (args->rudp && ( args->datagrams || args->tls ))
+        {
+            argp_error( state, "The rudp transport cannot be combined with --datagrams or TLS.");
+        }
         return 0;
     default:
         return 0;
@@ -2,6 +2,8 @@
 
 #include <argp.h>
 
+#include "event_loop.h"
+
 struct arguments
 {
     std::string forward_udp_host {""};
@@ -11,7 +13,28 @@ struct arguments
 
     std::string tunnel_host      {""};
     uint16_t    tunnel_port      {0};
+    std::string alternate_host   {""};  // second TunnelServer for the standby, see --alternate
+    uint16_t    alternate_port   {0};
+    uint16_t    tunnels          {1};
+    uint16_t    max_connects     {64};
+    uint32_t    interactive_kb   {64};
+    uint32_t    heartbeat_ms     {200};
+    uint32_t    heartbeat_misses {3};
+    uint32_t    udp_timeout      {60};
     
+    EventLoop::Backend backend { EventLoop::defaultBackend() };
+
+    bool        tls              {false};
+    std::string tls_ca           {""};
+
+    bool huge_pages {false};
+    bool zerocopy {false};
+    bool compress {false};
+    bool no_resume {false};
+    bool standby {false};
+    bool datagrams {false};
+    bool rudp {false};
+    bool realtime {false};
     bool verbose {false};
 };
 
@@ -0,0 +1,157 @@
+#include <algorithm>
+#include <iostream>
+#include <random>
+
+#include "tunnel_client_dialer.h"
+#include "verbose.h"
+
+TunnelClientDialer::TunnelClientDialer( int shard,
+                                        const std::vector<Target>& targets,
+                                        TLSContext* tls,
+                                        bool rudp,
+                                        EventLoop::Backend backend,
+                                        int max_attempts )
+    : _shard( shard )
+    , _targets( targets )
+    , _tls( tls )
+    , _rudp( rudp )
+    , _backend( backend )
+    , _max_attempts( max_attempts )
+{
+}
+
+TunnelClientDialer::~TunnelClientDialer( )
+{
+    cancel();
+    if( _thread.joinable() ) _thread.join();
+}
+
+void TunnelClientDialer::dial( size_t first )
+{
+    std::lock_guard<std::mutex> lock( _mutex );
+    startLocked( first );
+}
+
+void TunnelClientDialer::startLocked( size_t first )
+{
+    if( _dialing || _ready.tunnel || _cancelled ) return;
+
+    // The previous thread has finished, it cleared _dialing as its last step
+    if( _thread.joinable() ) _thread.join();
+
+    _dialing = true;
+    _thread  = std::thread( [this,first]() { dialLoop( first ); } );
+}
+
+TunnelClientDialer::Connection TunnelClientDialer::take( bool& ready )
+{
+    std::unique_lock<std::mutex> lock( _mutex );
+    ready = !_dialing && _ready.tunnel;
+
+    while( true )
+    {
+        _changed.wait( lock, [this]() { return !_dialing || _cancelled; } );
+        if( _cancelled || !_ready.tunnel ) return Connection();
+
+        Connection connection = std::move( _ready );
+        _ready = Connection();
+        if( connection.tunnel->alive() ) return connection;
+
+        // TunnelServer went away while the connection waited, try the other address first
+        LOG_INFO << "Standby tunnel connection of shard " << _shard << " to "
+                 << _targets[connection.target].host << ":" << _targets[connection.target].port
+                 << " was closed, dialing again" << std::endl;
+        ready = false;
+        startLocked( ( connection.target + 1 ) % _targets.size() );
+    }
+}
+
+void TunnelClientDialer::cancel( )
+{
+    std::lock_guard<std::mutex> lock( _mutex );
+    _cancelled = true;
+    _changed.notify_all();
+}
+
+void TunnelClientDialer::dialLoop( size_t first )
+{
+    for( int attempt = 0; attempt < _max_attempts; attempt++ )
+    {
+        const size_t index = ( first + attempt ) % _targets.size();
+        Connection connection = connectTo( index );
+
+        std::unique_lock<std::mutex> lock( _mutex );
+        if( connection.tunnel )
+        {
+            _ready   = std::move( connection );
+            _dialing = false;
+            _changed.notify_all();
+            return;
+        }
+        if( _cancelled ) break;
+
+        if( attempt == 0 )
+        {
+            std::cerr << "Connection attempt 1 of shard " << _shard << " failed" << std::endl;
+        }
+        else
+        {
+            std::cerr << " " << attempt+1;
+        }
+        LOG_WARN << "Connection attempt " << attempt+1 << " failed" << std::endl;
+
+        // cancel() cuts the delay short
+        if( _changed.wait_for( lock, retryDelay( attempt ), [this]() { return _cancelled; } ) ) break;
+    }
+
+    std::lock_guard<std::mutex> lock( _mutex );
+    if( !_cancelled )
+    {
+        std::cerr << std::endl;
+        LOG_ERROR << "Failed to connect after " << _max_attempts << " attempts" << std::endl;
+    }
+    _dialing = false;
+    _changed.notify_all();
+}
+
+TunnelClientDialer::Connection TunnelClientDialer::connectTo( size_t index )
+{
+    const Target& target = _targets[index];
+    LOG_INFO << "Connection attempt of shard " << _shard << " to " << target.host << ":" << target.port << std::endl;
+
+    Connection connection;
+    connection.target = index;
+    if( _rudp )
+    {
+        connection.rudp.reset( new RudpEndpoint( _backend ) );
+        connection.tunnel = connection.rudp->connect( target.host, target.port );
+    }
+    else
+    {
+        connection.tunnel.reset( new TCPSocket( target.host, target.port ) );
+    }
+
+    if( connection.tunnel && connection.tunnel->valid() && _tls &&
+        !connection.tunnel->startTLS( *_tls, false, target.host ) )
+    {
+        connection.tunnel->destroy();
+    }
+
+    if( !connection.tunnel || !connection.tunnel->valid() )
+    {
+        return Connection();
+    }
+
+    LOG_INFO << "Successfully connected to " << target.host << ":" << target.port
+             << " on socket " << connection.tunnel->socket() << std::endl;
+    return connection;
+}
+
+std::chrono::milliseconds TunnelClientDialer::retryDelay( int attempt )
+{
+    // 50 ms doubling up to 2 s, of which a random part of up to one half is left out
+    static thread_local std::mt19937 random( std::random_device{}() );
+    const int delay = std::min( 2000, 50 << std::min( attempt, 6 ) );
+    std::uniform_int_distribution<int> jitter( delay / 2, delay );
+    return std::chrono::milliseconds( jitter( random ) );
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tcp.h"
+#include "tls.h"
+#include "rudp.h"
+#include "event_loop.h"
+
+/* Connects the tunnel connections of one shard of TunnelClient, in a
+ * thread of its own. The shard thread starts a connection with dial() and
+ * gets it with take(). With a standby, it dials the next tunnel connection
+ * as soon as it has the current one, so that a failed tunnel connection is
+ * replaced without waiting for a TCP (and TLS) handshake.
+ *
+ * Attempts alternate between the TunnelServer addresses, starting with the
+ * given one. Failed attempts are repeated after an exponentially growing
+ * delay with random jitter, so that the shards of many TunnelClients do
+ * not dial a restarted TunnelServer in lockstep.
+ */
+class TunnelClientDialer
+{
+public:
+    // A TunnelServer address, host name or dotted decimal
+    struct Target
+    {
+        std::string host;
+        uint16_t    port;
+    };
+
+    // A connected tunnel connection
+    struct Connection
+    {
+        // Only for the reliable-UDP transport, must outlive tunnel
+        std::unique_ptr<RudpEndpoint> rudp;
+        std::unique_ptr<TCPSocket>    tunnel;
+        size_t                        target { 0 };  // index of its address
+    };
+
+private:
+    const int                 _shard;
+    const std::vector<Target> _targets;
+    TLSContext*               _tls;
+    const bool                _rudp;
+    const EventLoop::Backend  _backend;
+    const int                 _max_attempts;
+
+    std::mutex              _mutex;
+    std::condition_variable _changed;
+    std::thread             _thread;
+    bool                    _dialing   { false };
+    bool                    _cancelled { false };
+    Connection              _ready;  // tunnel is null until a connection succeeded
+
+public:
+    TunnelClientDialer( int shard,
+                        const std::vector<Target>& targets,
+                        TLSContext* tls,
+                        bool rudp,
+                        EventLoop::Backend backend,
+                        int max_attempts = 100 );
+
+    // Cancels dialing and waits for the thread
+    ~TunnelClientDialer( );
+
+    inline size_t targets() const { return _targets.size(); }
+
+    inline const Target& target( size_t index ) const { return _targets[index]; }
+
+    /* Start connecting in the background, first to the address with index
+     * first. Does nothing while a connection is being dialled or waits to
+     * be taken.
+     */
+    void dial( size_t first );
+
+    /* Wait for the connection that dial() started and hand it over. ready
+     * is set if it was established already when take() was called. A
+     * waiting connection that TunnelServer has closed meanwhile is dropped
+     * and dialled again. Returns a Connection without tunnel if all
+     * attempts failed or cancel() was called.
+     */
+    Connection take( bool& ready );
+
+    // Thread-safe. Stop dialing and make take() return, for quitting.
+    void cancel( );
+
+private:
+    // Thread function, tries the addresses in turn from first
+    void dialLoop( size_t first );
+
+    // One connection attempt, including the TLS handshake
+    Connection connectTo( size_t index );
+
+    // Delay before the attempt after attempt number attempt (counting from 0)
+    static std::chrono::milliseconds retryDelay( int attempt );
+
+    // dial() with _mutex held
+    void startLocked( size_t first );
+};
@@ -1,11 +1,10 @@
 #include <iostream>
-#include <sstream>
 #include <string>
 #include <vector>
 #include <memory>
 #include <algorithm>
+#include <random>
 
-#include <sys/select.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
@@ -13,387 +12,1608 @@
 #include "tunnel_client_dispatch.h"
 #include "tunnel_protocol.h"
 #include "tunnel_send_message.h"
-#include "tunnel_message_reconstructor.h"
-#include "tcp_connection_manager.h"
 #include "sockaddr.h"
 #include "udp.h"
 #include "verbose.h"
 
-static const size_t max_buffer_size = 100000;
-static const size_t max_tcp_data_size = 16384;  // 16KB per TCP read
-
-char udp_packet_buffer[max_buffer_size];
-char tcp_data_buffer[max_tcp_data_size];
-char tcp_tunnel_buffer[max_buffer_size];
-
-TunnelMessageReconstructor reconstructor;
-
-// Static TCP connection manager - preserved across reconnections
-static TCPConnectionManager tcp_connections;
-
-// Dispatch loop for TunnelClient
-// Returns true if user requested quit (Q pressed)
-// Returns false if connection was lost (should reconnect)
-bool dispatch_loop( const std::unique_ptr<TCPSocket>& tunnel,
-                    UDPSocket& udp_forwarder,
-                    std::shared_ptr<TCPSocket> webSock,
-                    const SockAddr& dest_udp,
-                    const SockAddr& dest_tcp )
-{
-    fd_set read_fds;
-    int    fd_max = 0;
-    bool   cont_loop = true;
-    bool   user_quit = false;  // Track if user requested quit
-
-    std::vector<int> read_sockets;
-    read_sockets.push_back( 0 ); // stdin
-    read_sockets.push_back( tunnel->socket() );
-    read_sockets.push_back( udp_forwarder.socket() );
-    
+static const size_t max_tcp_data_size = 16384;  // 16KB per read of interactive data
+
+// Registrations of the UDP side channel are repeated this often until
+// TunnelServer echoes one, and as keepalives afterwards
+static const std::chrono::milliseconds channel_retry( 1000 );
+static const std::chrono::milliseconds channel_keepalive( 5000 );
+
+// The channel is given up if no echo arrived for this long
+static const std::chrono::milliseconds channel_timeout( 15000 );
+
+// TunnelServer answers our HELLO right away, unless it is too old for that
+static const std::chrono::milliseconds hello_timeout( 2000 );
+
+// Buffers, one set per shard thread
+static thread_local char tcp_data_buffer[TunnelProtocol::MAX_FRAME_SIZE];
+static thread_local char compress_buffer[TunnelProtocol::MAX_PAYLOAD_SIZE];
+
+TunnelClientDispatch::TunnelClientDispatch( int shard,
+                                            int shards,
+                                            UDPSocket* udp_forwarder,
+                                            UDPSocket* udp_channel,
+                                            const SockAddr& dest_udp,
+                                            const SockAddr& dest_tcp,
+                                            const SockAddr& dest_channel,
+                                            size_t max_connects,
+                                            bool zerocopy,
+                                            size_t interactive_bytes,
+                                            bool compress,
+                                            bool resume,
+                                            int heartbeat_ms,
+                                            int heartbeat_misses,
+                                            int udp_timeout_s,
+                                            EventLoop::Backend backend )
+    : _shard( shard )
+    , _shards( shards )
+    , _udp_forwarder( udp_forwarder )
+    , _dest_udp( dest_udp )
+    , _dest_tcp( dest_tcp )
+    , _max_connects( max_connects )
+    , _loop( backend )
+    , _zerocopy( zerocopy )
+    , _interactive_bytes( interactive_bytes )
+    , _compress( compress )
+    , _resume_enabled( resume )
+    , _udp_channel( udp_channel )
+    , _dest_channel( dest_channel )
+    , _udp_timeout( std::max( udp_timeout_s, 1 ) )
+    , _heartbeat_interval( heartbeat_ms )
+    , _heartbeat_misses( std::max( heartbeat_misses, 1 ) )
+{
+    // Bulk TCP data bypasses user space where splice() exists
+    _tunnel_writer.enableSplice();
+
+    if( _udp_forwarder )
+    {
+        _udp_in.reset( new UDPBatch );
+        _udp_out.reset( new UDPBatch );
+    }
+    if( _udp_channel )
+    {
+        _channel_out.reset( new UDPBatch );
+    }
+}
+
+void TunnelClientDispatch::printStats( std::ostream& ostr ) const
+{
+    const uint64_t messages = _tunnel_writer.messages();
+    const uint64_t writes   = _tunnel_writer.writes();
+
+    ostr << "= Shard " << _shard << ": " << messages << " tunnel messages in "
+         << writes << " writes";
+    if( writes > 0 ) ostr << " (" << (double)messages / writes << " per write)";
+    ostr << std::endl;
+
+    ostr << "= Shard " << _shard << ": message buffers " << _tunnel_writer.pool().hits() << " hits, "
+         << _tunnel_writer.pool().misses() << " misses; connection records "
+         << _tcp_connections.pool().hits() << " hits, " << _tcp_connections.pool().misses()
+         << " misses" << std::endl;
+
+    ostr << "= Shard " << _shard << ": tunnel bytes " << _tunnel_writer.bytesZeroCopy() << " zero-copy, "
+         << _tunnel_writer.bytesCopied() << " copied, " << _tunnel_writer.bytesSpliced()
+         << " spliced" << std::endl;
+
+    if( _compress )
+    {
+        ostr << "= Shard " << _shard << ": " << Compression::codecName( _codec )
+             << " compressed " << _compressed_in << " payload bytes to " << _compressed_out << std::endl;
+    }
+
+    if( _heartbeat_interval.count() > 0 )
+    {
+        ostr << "= Shard " << _shard << ": heartbeat RTT ";
+        if( _rtt_latest_us < 0 ) ostr << "unknown";
+        else ostr << _rtt_latest_us / 1000.0 << " ms (smoothed " << _rtt_smoothed_us / 1000.0 << " ms)";
+        ostr << ", " << _pings_sent << " PINGs, " << _pongs_received << " PONGs, "
+             << _dead_tunnels << " dead tunnels given up" << std::endl;
+    }
+
+    if( _failovers > 0 )
+    {
+        ostr << "= Shard " << _shard << ": " << _failovers << " failovers, " << _failovers_standby
+             << " to a standby, last " << _failover_last_us / 1000.0 << " ms, mean "
+             << _failover_total_us / 1000.0 / _failovers << " ms, max " << _failover_max_us / 1000.0
+             << " ms" << std::endl;
+    }
+
+    if( _resume_enabled )
+    {
+        ostr << "= Shard " << _shard << ": " << _connections_resumed << " connections resumed, "
+             << _bytes_resent << " bytes sent again" << std::endl;
+    }
+
+    if( _udp_forwarder )
+    {
+        ostr << "= Shard " << _shard << ": " << _udp_recv_packets << " UDP packets in "
+             << _udp_recv_calls << " receive calls, " << _udp_send_packets << " UDP packets in "
+             << _udp_send_calls << " send calls; " << _udp_flow_count << " UDP flows, "
+             << _udp_flows_expired << " expired, " << _udp_flows_evicted << " evicted" << std::endl;
+    }
+
+    if( _udp_channel )
+    {
+        ostr << "= Shard " << _shard << ": UDP side channel " << ( _channel_up ? "up" : "down" ) << ", "
+             << _channel_recv_packets << " datagrams received, "
+             << _channel_send_packets << " sent" << std::endl;
+    }
+}
+
+void TunnelClientDispatch::noteFailover( std::chrono::microseconds time, bool standby )
+{
+    const uint64_t us = time.count();
+    _failover_last_us   = us;
+    _failover_total_us += us;
+    if( us > _failover_max_us ) _failover_max_us = us;
+    if( standby ) _failovers_standby++;
+    _failovers++;
+}
+
+void TunnelClientDispatch::quit( )
+{
+    _user_quit = true;
+    _loop.post( [this]() { _cont_loop = false; } );
+}
+
+bool TunnelClientDispatch::run( const std::unique_ptr<TCPSocket>& tunnel )
+{
+    _tunnel    = &tunnel;
+    _cont_loop = !_user_quit;
+    _reconstructor.clear();
+    _reconstructor.setFraming( 1 );
+    _codec = Compression::Codec::None;
+
+    // Nothing of the previous tunnel's queue can be delivered any more
+    tunnel->setNoBlock();
+    _tunnel_writer.clear();
+    _tunnel_writer.allowSplice( tunnel->rawWrites() );
+    if( _zerocopy ) _tunnel_writer.enableZeroCopy( *tunnel );
+    _tunnel_blocked = false;
+    if( _tunnel_congested ) setTunnelCongested( false );
+
+    /* Until TunnelServer's answer tells whether it resumes them, the
+     * preserved connections are not read. Without resumption, TunnelServer
+     * starts counting from zero on the new tunnel as well.
+     */
+    _resume         = false;
+    _hello_pending  = true;
+    _hello_timer    = _loop.addTimer( hello_timeout, [this]() { onHelloTimeout(); } );
+    if( !_resume_enabled ) _tcp_connections.resetWindows();
+    for( uint32_t conn_id : _tcp_connections.getAllConnIds() )
+    {
+        auto* conn = _tcp_connections.getConnection(conn_id);
+        conn->resuming = _resume_enabled;
+        watchConnection( conn );
+    }
+
+    _loop.add( tunnel->socket(), IoEvent::Readable,
+               [this](uint32_t events) { onTunnel(events); } );
+    updateTunnelInterest();
+
+    /* Tell TunnelServer which shard this tunnel connection belongs to, and
+     * what we speak. A TunnelServer that knows HELLO version 2 answers.
+     */
+    const uint32_t caps = Compression::capabilities() | TunnelProtocol::CAP_HEARTBEAT | TunnelProtocol::CAP_UDP_FLOWS |
+                          ( _resume_enabled ? TunnelProtocol::CAP_RESUME : 0 );
+    TunnelHello hello;
+    TunnelProtocol::createHello( hello, _shard, _shards, TunnelProtocol::VERSION, caps );
+    if( !sendToTunnel( 0, TunnelMessageType::HELLO,
+                       (const char*)&hello, sizeof(hello) ) )
+    {
+        LOG_ERROR << "Failed to send HELLO on the tunnel of shard " << _shard << std::endl;
+        _cont_loop = false;
+    }
+
+    /* Register the UDP side channel with a new cookie, which TunnelServer
+     * learns through the tunnel. The first registration datagram is sent
+     * by onChannelTimer() right away.
+     */
+    if( _udp_channel )
+    {
+        std::random_device random;
+        _channel_cookie = ( static_cast<uint64_t>( random() ) << 32 ) | random();
+        _channel_up     = false;
+        _channel_next_hello = Clock::now();
+        _channel_timer      = _loop.addTimer( _channel_next_hello, [this]() { onChannelTimer(); } );
+
+        TunnelUdpChannel channel;
+        TunnelProtocol::createUdpChannel( channel, _channel_cookie );
+        sendToTunnel( 0, TunnelMessageType::UDP_CHANNEL, (const char*)&channel, sizeof(channel) );
+
+        _loop.add( _udp_channel->socket(), IoEvent::Readable, [this](uint32_t) { onUdpChannel(); } );
+    }
+
+    /* The forwarders are only watched while a tunnel exists, because
+     * responses from the destination cannot go anywhere in between.
+     */
+    if( _udp_forwarder )
+    {
+        UDPSocket* forwarder = _udp_forwarder;
+        _loop.add( forwarder->socket(), IoEvent::Readable, [this,forwarder](uint32_t) { onUdpForwarder( 0, forwarder ); } );
+        for( auto& flow : _udp_flows )
+        {
+            const uint32_t flow_id = flow.first;
+            UDPSocket*     socket  = flow.second.flow.get();
+            _loop.add( socket->socket(), IoEvent::Readable, [this,flow_id,socket](uint32_t) { onUdpForwarder( flow_id, socket ); } );
+        }
+    }
+
     // Log existing TCP connections on entry (after reconnection)
-    if (tcp_connections.connectionCount() > 0)
+    if (_tcp_connections.connectionCount() > 0)
     {
-        LOG_INFO << "Dispatch loop started with " << tcp_connections.connectionCount() 
+        LOG_INFO << "Dispatch loop started with " << _tcp_connections.connectionCount()
                  << " existing TCP connections preserved" << std::endl;
-        for (uint32_t conn_id : tcp_connections.getAllConnIds())
+        for (uint32_t conn_id : _tcp_connections.getAllConnIds())
         {
             LOG_DEBUG << "  Preserved conn_id=" << conn_id << std::endl;
         }
     }
 
-    while( cont_loop )
+    LOG_INFO << "Shard " << _shard << " dispatching events with " << _loop.backendName() << std::endl;
+
+    while( _cont_loop )
+    {
+        if( !_loop.runOnce() ) break;
+    }
+
+    // The timers of this tunnel connection, the UDP flows outlive it
+    _loop.cancelTimer( _hello_timer );
+    _loop.cancelTimer( _channel_timer );
+    _loop.cancelTimer( _heartbeat_timer );
+    _hello_timer = _channel_timer = _heartbeat_timer = 0;
+
+    _loop.remove( tunnel->socket() );
+    if( _udp_channel )
     {
-        FD_ZERO( &read_fds );
+        flushUdpChannel();
+        _loop.remove( _udp_channel->socket() );
+        _channel_up = false;
+    }
+    if( _udp_forwarder )
+    {
+        flushUdpForwarder();
+        _loop.remove( _udp_forwarder->socket() );
+        for( auto& flow : _udp_flows ) _loop.remove( flow.second.flow->socket() );
+    }
 
-        std::ostringstream ostr;
-        ostr << "    call select with read fds ";
-        for( auto it : read_sockets )
-        {
-            ostr << it << " ";
-            FD_SET( it, &read_fds );
-            fd_max = std::max( fd_max, it );
-        }
-        
-        // Add all TCP connection sockets (preserved across reconnections)
-        auto tcp_sockets = tcp_connections.getAllSockets();
-        for (int sock : tcp_sockets)
+    // Cleanup before exiting dispatch loop
+    if (_user_quit)
+    {
+        LOG_INFO << "User quit - closing all TCP connections" << std::endl;
+
+        // Close all TCP connections gracefully on user quit
+        for (uint32_t conn_id : _tcp_connections.getAllConnIds())
         {
-            ostr << sock << " ";
-            FD_SET( sock, &read_fds );
-            fd_max = std::max( fd_max, sock );
+            LOG_DEBUG << "Closing TCP connection conn_id=" << conn_id << std::endl;
+            removeConnection(conn_id);
         }
-        
-        LOG_DEBUG << ostr.str() << std::endl;
+    }
+    else
+    {
+        LOG_INFO << "Tunnel disconnected - preserving "
+                 << _tcp_connections.connectionCount()
+                 << " TCP connections for reconnection" << std::endl;
+        // TCP connections are NOT removed - they remain in _tcp_connections
+        // They will continue to be monitored after reconnection
+    }
+
+    // Clear any remaining data in reconstructor
+    LOG_DEBUG << "Flushing reconstructor buffer. Remaining bytes: "
+              << _reconstructor.buffered() << std::endl;
+
+    _tunnel = nullptr;
+
+    // Return true if user quit, false if connection lost
+    return _user_quit;
+}
+
+void TunnelClientDispatch::onTunnel( uint32_t events )
+{
+    // Zero-copy completions arrive on the error queue
+    if( ( events & IoEvent::Error ) && _zerocopy )
+    {
+        _tunnel_writer.reapCompletions( *tunnel() );
+    }
+    if( events & IoEvent::Writable )
+    {
+        flushTunnel();
+        if( !_cont_loop ) return;
+    }
+    if( !( events & ( IoEvent::Readable | IoEvent::Error | IoEvent::HangUp ) ) ) return;
+
+    // Read straight into the reconstructor's buffer
+    int retval = _reconstructor.readFrom( *tunnel() );
+    if( retval < 0 )
+    {
+        if( errno == EAGAIN || errno == EWOULDBLOCK ) return;
+
+        LOG_ERROR << "Error in TCP tunnel, socket " << tunnel()->socket() << ". "
+                  << strerror(errno) << std::endl;
+        LOG_INFO << "Tunnel connection lost. TCP connections will be preserved for reconnection." << std::endl;
+        _cont_loop = false;
+        return;
+    }
+    else if( retval == 0 )
+    {
+        LOG_INFO << "Tunnel socket closed by server." << std::endl;
+        LOG_INFO << "TCP connections will be preserved for reconnection." << std::endl;
+        _cont_loop = false;
+        return;
+    }
+    _last_received = Clock::now();
+
+    // Process all complete messages
+    TunnelMessage msg;
+    while (_reconstructor.nextMessage( msg ))
+    {
+        handleTunnelMessage( msg );
+    }
+
+    // Nothing after a corrupt message can be trusted, the new tunnel resumes the connections
+    if( _reconstructor.failed() )
+    {
+        LOG_ERROR << "Corrupt message from TunnelServer on shard " << _shard
+                  << ", reconnecting. TCP connections will be preserved." << std::endl;
+        _cont_loop = false;
+        return;
+    }
+
+    // TLS may hold decrypted bytes back that did not fit into the buffer
+    if( _cont_loop && tunnel()->pending() > 0 )
+    {
+        _loop.defer( [this]() { if( _cont_loop ) onTunnel( IoEvent::Readable ); } );
+    }
+}
+
+void TunnelClientDispatch::handleTunnelMessage( TunnelMessage& msg )
+{
+    LOG_DEBUG << "Processing message: type="
+              << TunnelProtocol::messageTypeToString(msg.type)
+              << " conn_id=" << msg.conn_id
+              << " payload_size=" << msg.payload.size() << std::endl;
 
-        int retval = ::select( fd_max+1, &read_fds, nullptr, nullptr, nullptr );
+    // A TunnelServer that does not answer our HELLO starts with something else
+    if (_hello_pending && msg.type != TunnelMessageType::HELLO)
+    {
+        LOG_INFO << "TunnelServer does not answer the HELLO of shard " << _shard << std::endl;
+        _hello_pending = false;
+        if (_resume_enabled) startWithoutResume();
+    }
 
-        if (retval < 0)
+    switch (msg.type)
+    {
+        case TunnelMessageType::UDP_PACKET:
         {
-            if (errno == EINTR)
+            // Forward UDP packet to destination
+            if (!_udp_forwarder)
             {
-                // Interrupted by signal, retry
-                continue;
+                LOG_WARN << "Received UDP packet on shard " << _shard
+                         << ", but only shard 0 handles UDP" << std::endl;
+            }
+            else
+            {
+                // Zero-length UDP packet is valid
+                sendToUdpForwarder(msg.conn_id, msg.payload.data(), msg.payload.size());
+                LOG_DEBUG << "Queued UDP packet of size "
+                          << msg.payload.size() << " for destination" << std::endl;
             }
-            LOG_ERROR << "Select failed: " << strerror(errno) << std::endl;
             break;
         }
 
-        if( FD_ISSET( 0, &read_fds ) )
+        case TunnelMessageType::UDP_SEGMENTS:
         {
-            int c = getchar( );
-            if( c == 'q' || c == 'Q' )
+            // Run of equally sized UDP packets, sent with one GSO send
+            uint16_t segment_size;
+            if (!_udp_forwarder)
+            {
+                LOG_WARN << "Received UDP packets on shard " << _shard
+                         << ", but only shard 0 handles UDP" << std::endl;
+            }
+            else if (!TunnelProtocol::parseUdpSegments(msg.payload.data(), msg.payload.size(), segment_size))
             {
-                std::cout << "= Q pressed by user. Quitting." << std::endl;
-                user_quit = true;
-                cont_loop = false;
+                LOG_WARN << "Ignoring malformed UDP_SEGMENTS message" << std::endl;
             }
+            else
+            {
+                sendToUdpForwarder(msg.conn_id, msg.payload.data() + sizeof(TunnelUdpSegments),
+                                   msg.payload.size() - sizeof(TunnelUdpSegments),
+                                   segment_size);
+                LOG_DEBUG << "Queued " << msg.payload.size() - sizeof(TunnelUdpSegments)
+                          << " bytes of UDP packets of size " << segment_size
+                          << " for destination" << std::endl;
+            }
+            break;
         }
 
-        if( FD_ISSET( tunnel->socket(), &read_fds ) )
+        case TunnelMessageType::TCP_OPEN:
         {
-            int retval = tunnel->recv( tcp_tunnel_buffer, max_buffer_size );
-            if( retval < 0 )
+            LOG_INFO << "TCP_OPEN received for conn_id=" << msg.conn_id << std::endl;
+
+            // Check if connection already exists (after reconnection)
+            if (_tcp_connections.hasConnection(msg.conn_id))
             {
-                LOG_ERROR << "Error in TCP tunnel, socket " << tunnel->socket() << ". "
-                          << strerror(errno) << std::endl;
-                LOG_INFO << "Tunnel connection lost. TCP connections will be preserved for reconnection." << std::endl;
-                cont_loop = false;
+                LOG_WARN << "TCP_OPEN for existing conn_id=" << msg.conn_id
+                         << " - connection already preserved from before reconnection" << std::endl;
+                // Connection already exists, don't create new one
+                break;
             }
-            else if( retval == 0 )
+
+            openConnection(msg.conn_id,
+                           TunnelProtocol::parseTcpOpen(msg.payload.data(), msg.payload.size()));
+            break;
+        }
+
+        case TunnelMessageType::TCP_DATA:
+        {
+            auto* conn = _tcp_connections.getConnection(msg.conn_id);
+            if (conn && conn->socket && conn->valid)
             {
-                LOG_INFO << "Tunnel socket closed by server." << std::endl;
-                LOG_INFO << "TCP connections will be preserved for reconnection." << std::endl;
-                cont_loop = false;
+                writeToConnection(conn, msg.payload.data(), msg.payload.size());
             }
-            else
+            else if (!conn || !conn->finished)
             {
-                // Feed received bytes to reconstructor
-                reconstructor.collect_from_tunnel( tcp_tunnel_buffer, retval );
-                
-                // Process all complete messages
-                while (reconstructor.hasMessages())
-                {
-                    TunnelMessage& msg = reconstructor.frontMessage();
-                    
-                    LOG_DEBUG << "Processing message: type=" 
-                              << TunnelProtocol::messageTypeToString(msg.type)
-                              << " conn_id=" << msg.conn_id
-                              << " payload_size=" << msg.payload.size() << std::endl;
-                    
-                    switch (msg.type)
-                    {
-                        case TunnelMessageType::UDP_PACKET:
-                        {
-                            // Forward UDP packet to destination
-                            if (msg.payload.size() > 0)
-                            {
-                                int sent = udp_forwarder.send(msg.payload.data(), 
-                                                             msg.payload.size(), 
-                                                             dest_udp);
-                                if (sent >= 0)
-                                {
-                                    LOG_DEBUG << "Forwarded UDP packet of size " 
-                                              << msg.payload.size() << " to destination" << std::endl;
-                                }
-                                else if (errno == EWOULDBLOCK || errno == EAGAIN)
-                                {
-                                    LOG_WARN << "UDP socket would block - packet dropped" << std::endl;
-                                }
-                                else
-                                {
-                                    LOG_ERROR << "Error forwarding UDP packet: " 
-                                              << strerror(errno) << std::endl;
-                                }
-                            }
-                            else
-                            {
-                                // Zero-length UDP packet is valid
-                                LOG_DEBUG << "Forwarding zero-length UDP packet" << std::endl;
-                                int sent = udp_forwarder.send(msg.payload.data(), 0, dest_udp);
-                                if (sent < 0)
-                                {
-                                    LOG_ERROR << "Error forwarding zero-length UDP packet: " 
-                                              << strerror(errno) << std::endl;
-                                }
-                            }
-                            break;
-                        }
-                        
-                        case TunnelMessageType::TCP_OPEN:
-                        {
-                            LOG_INFO << "TCP_OPEN received for conn_id=" << msg.conn_id << std::endl;
-                            
-                            // Check if connection already exists (after reconnection)
-                            if (tcp_connections.hasConnection(msg.conn_id))
-                            {
-                                LOG_WARN << "TCP_OPEN for existing conn_id=" << msg.conn_id 
-                                         << " - connection already preserved from before reconnection" << std::endl;
-                                // Connection already exists, don't create new one
-                                break;
-                            }
-                            
-                            // Create outgoing TCP connection to destination
-                            std::unique_ptr<TCPSocket> tcp_conn( new TCPSocket(dest_tcp.getAddress().c_str(), 
-                                                                               dest_tcp.getPort()) );
-                            
-                            if (tcp_conn->valid())
-                            {
-                                // Set non-blocking to avoid delaying UDP
-                                tcp_conn->setNoBlock();
-                                
-                                LOG_INFO << "Connected to " << dest_tcp.getAddress() 
-                                         << ":" << dest_tcp.getPort() 
-                                         << " for conn_id=" << msg.conn_id << std::endl;
-                                
-                                tcp_connections.addConnection(msg.conn_id, tcp_conn);
-                            }
-                            else
-                            {
-                                LOG_ERROR << "Failed to connect to " << dest_tcp.getAddress() 
-                                          << ":" << dest_tcp.getPort() 
-                                          << " for conn_id=" << msg.conn_id << std::endl;
-                                
-                                // Send TCP_CLOSE back to server
-                                sendTunnelMessage(tunnel, msg.conn_id, 
-                                                  TunnelMessageType::TCP_CLOSE, nullptr, 0);
-                            }
-                            break;
-                        }
-                        
-                        case TunnelMessageType::TCP_DATA:
-                        {
-                            auto* conn = tcp_connections.getConnection(msg.conn_id);
-                            if (conn && conn->socket && conn->valid)
-                            {
-                                int sent = conn->socket->send(msg.payload.data(), msg.payload.size());
-                                if (sent < 0)
-                                {
-                                    LOG_WARN << "Failed to send TCP data to conn_id=" 
-                                             << msg.conn_id << std::endl;
-                                    tcp_connections.removeConnection(msg.conn_id);
-                                    sendTunnelMessage(tunnel, msg.conn_id, 
-                                                     TunnelMessageType::TCP_CLOSE, nullptr, 0);
-                                }
-                                else
-                                {
-                                    LOG_DEBUG << "Forwarded " << sent 
-                                              << " bytes to destination TCP conn_id=" << msg.conn_id << std::endl;
-                                }
-                            }
-                            else
-                            {
-                                LOG_WARN << "Received TCP_DATA for unknown conn_id=" << msg.conn_id << std::endl;
-                                sendTunnelMessage(tunnel, msg.conn_id, 
-                                                 TunnelMessageType::TCP_CLOSE, nullptr, 0);
-                            }
-                            break;
-                        }
-                        
-                        case TunnelMessageType::TCP_CLOSE:
-                        {
-                            LOG_INFO << "TCP_CLOSE received for conn_id=" << msg.conn_id << std::endl;
-                            tcp_connections.removeConnection(msg.conn_id);
-                            break;
-                        }
-                        
-                        default:
-                            LOG_ERROR << "Unknown message type: " 
-                                      << static_cast<int>(msg.type) << std::endl;
-                            break;
-                    }
-                    
-                    // Remove processed message
-                    reconstructor.popMessage();
-                }
+                LOG_WARN << "Received TCP_DATA for unknown conn_id=" << msg.conn_id << std::endl;
+                sendToTunnel(msg.conn_id,
+                             TunnelMessageType::TCP_CLOSE, nullptr, 0);
             }
+            break;
         }
 
-        if( FD_ISSET( udp_forwarder.socket(), &read_fds ) )
+        case TunnelMessageType::TCP_CLOSE:
         {
-            // Receive UDP response from the destination
-            SockAddr response_sender;
-            int retval = udp_forwarder.recv( udp_packet_buffer, max_buffer_size, response_sender );
-            
-            if (retval > 0)
+            LOG_INFO << "TCP_CLOSE received for conn_id=" << msg.conn_id << std::endl;
+            auto* conn = _tcp_connections.getConnection(msg.conn_id);
+            if (conn && conn->socket && conn->queued() > 0)
             {
-                LOG_DEBUG << "Received UDP response (" << retval 
-                          << " bytes) from destination " 
-                          << response_sender.getAddress() << ":" << response_sender.getPort() 
-                          << std::endl;
-                
-                // Send response back through tunnel to TunnelServer
-                bool success = sendTunnelMessage(tunnel,
-                                                0,  // conn_id = 0 for UDP
-                                                TunnelMessageType::UDP_PACKET,
-                                                udp_packet_buffer,
-                                                retval);
-                
-                if (success)
-                {
-                    LOG_DEBUG << "Sent UDP response back through tunnel" << std::endl;
-                }
-                else
-                {
-                    LOG_ERROR << "Failed to send UDP response through tunnel" << std::endl;
-                    LOG_INFO << "Tunnel connection lost while sending. Will reconnect." << std::endl;
-                    cont_loop = false;
-                }
+                // Deliver what TunnelServer sent before closing
+                LOG_DEBUG << "Closing conn_id=" << msg.conn_id << " after flushing "
+                          << conn->queued() << " queued bytes" << std::endl;
+                conn->closing = true;
+                updateConnection(conn);
             }
-            else if (retval < 0)
+            else
             {
-                if (errno != EWOULDBLOCK && errno != EAGAIN)
-                {
-                    LOG_ERROR << "Error receiving UDP response: " << strerror(errno) << std::endl;
-                }
+                if (conn && conn->socket) acknowledgeClose(conn);
+                removeConnection(msg.conn_id);
             }
+            break;
         }
 
-        // Check all TCP connections to destination for data
-        // These connections are preserved across tunnel reconnections
-        for (uint32_t conn_id : tcp_connections.getAllConnIds())
+        case TunnelMessageType::WINDOW_UPDATE:
         {
-            auto* conn = tcp_connections.getConnection(conn_id);
-            if (!conn || !conn->socket || !conn->valid)
-                continue;
-                
-            if (FD_ISSET(conn->socket->socket(), &read_fds))
-            {
-                int bytes = conn->socket->recv(tcp_data_buffer, max_tcp_data_size);
-                
-                if (bytes == 0)
-                {
-                    // Connection closed by destination
-                    LOG_INFO << "Destination TCP connection closed, conn_id=" << conn_id << std::endl;
-                    
-                    // Try to send TCP_CLOSE through tunnel
-                    // If tunnel is down, this will fail but connection will be cleaned up
-                    sendTunnelMessage(tunnel, conn_id, TunnelMessageType::TCP_CLOSE, nullptr, 0);
-                    tcp_connections.removeConnection(conn_id);
-                }
-                else if (bytes < 0)
-                {
-                    if (errno == EAGAIN || errno == EWOULDBLOCK)
-                    {
-                        // Non-blocking socket, no data available
-                        continue;
-                    }
-                    
-                    LOG_WARN << "Error reading from destination TCP conn_id=" << conn_id 
-                             << ": " << strerror(errno) << std::endl;
-                    
-                    sendTunnelMessage(tunnel, conn_id, TunnelMessageType::TCP_CLOSE, nullptr, 0);
-                    tcp_connections.removeConnection(conn_id);
-                }
-                else
-                {
-                    // Data received from destination
-                    LOG_DEBUG << "Received " << bytes << " bytes from destination TCP conn_id=" << conn_id << std::endl;
-                    
-                    bool success = sendTunnelMessage(tunnel, 
-                                                     conn_id,
-                                                     TunnelMessageType::TCP_DATA,
-                                                     tcp_data_buffer,
-                                                     bytes);
-                    
-                    if (!success)
-                    {
-                        LOG_ERROR << "Failed to send TCP_DATA for conn_id=" << conn_id << std::endl;
-                        LOG_INFO << "Tunnel connection lost while sending TCP data. Will reconnect." << std::endl;
-                        // Don't remove connection - it will be preserved for reconnection
-                        cont_loop = false;
-                        break;  // Exit loop to trigger reconnection
-                    }
-                }
-            }
+            handleWindowUpdate(msg);
+            break;
+        }
+
+        case TunnelMessageType::RESUME:
+        {
+            handleResume(msg);
+            break;
+        }
+
+        case TunnelMessageType::HELLO:
+        {
+            handleHello(msg);
+            break;
+        }
+
+        case TunnelMessageType::PING:
+        {
+            sendToTunnel(0, TunnelMessageType::PONG, msg.payload.data(), msg.payload.size());
+            break;
+        }
+
+        case TunnelMessageType::PONG:
+        {
+            handlePong(msg);
+            break;
         }
+
+        default:
+            LOG_ERROR << "Unknown message type: "
+                      << static_cast<int>(msg.type) << std::endl;
+            break;
     }
-    
-    // Cleanup before exiting dispatch loop
-    if (user_quit)
+}
+
+void TunnelClientDispatch::onUdpForwarder( uint32_t flow_id, UDPSocket* socket )
+{
+    // Receive all waiting UDP responses from the destination
+    int count = socket->recvBatch( *_udp_in );
+
+    if (count < 0)
     {
-        LOG_INFO << "User quit - closing all TCP connections" << std::endl;
-        
-        // Close all TCP connections gracefully on user quit
-        for (uint32_t conn_id : tcp_connections.getAllConnIds())
+        if (errno != EWOULDBLOCK && errno != EAGAIN)
         {
-            LOG_DEBUG << "Closing TCP connection conn_id=" << conn_id << std::endl;
-            tcp_connections.removeConnection(conn_id);
+            LOG_ERROR << "Error receiving UDP response: " << strerror(errno) << std::endl;
         }
+        return;
     }
-    else
+
+    _udp_recv_calls++;
+    _udp_recv_packets += count;
+
+    auto flow = _udp_flows.find(flow_id);
+    if (flow != _udp_flows.end()) _udp_flows.touch(flow, Clock::now());
+
+    for (int i = 0; i < count; i++)
     {
-        LOG_INFO << "Tunnel disconnected - preserving " 
-                 << tcp_connections.connectionCount() 
-                 << " TCP connections for reconnection" << std::endl;
-        // TCP connections are NOT removed - they remain in tcp_connections
-        // They will continue to be monitored after reconnection
+        const int retval = _udp_in->size(i);
+        if (retval == 0) continue;
+
+        LOG_DEBUG << "Received UDP response (" << retval
+                  << " bytes) from destination "
+                  << _udp_in->addr(i).getAddress() << ":" << _udp_in->addr(i).getPort()
+                  << std::endl;
+
+        // The side channel does not wait behind the tunnel's data
+        if (_channel_up && TunnelProtocol::HEADER_SIZE + retval <= TunnelProtocol::MAX_DATAGRAM_SIZE)
+        {
+            sendToUdpChannel(flow_id, TunnelMessageType::UDP_PACKET, _udp_in->data(i), retval);
+            continue;
+        }
+
+        if (_tunnel_congested)
+        {
+            LOG_DEBUG << "Tunnel of shard " << _shard << " is congested. Drop UDP response." << std::endl;
+            return;
+        }
+
+        // Send response back through tunnel to TunnelServer
+        bool success = sendToTunnel(flow_id,
+                                    TunnelMessageType::UDP_PACKET,
+                                    _udp_in->data(i),
+                                    retval,
+                                    TunnelWriter::Priority::Control,
+                                    &_udp_compression);
+
+        if (success)
+        {
+            LOG_DEBUG << "Sent UDP response back through tunnel" << std::endl;
+        }
+        else
+        {
+            LOG_ERROR << "Failed to send UDP response through tunnel" << std::endl;
+            LOG_INFO << "Tunnel connection lost while sending. Will reconnect." << std::endl;
+            _cont_loop = false;
+            return;
+        }
     }
-    
-    // Clear any remaining data in reconstructor
-    LOG_DEBUG << "Flushing reconstructor buffer. Remaining messages: " 
-              << reconstructor.messageCount() << std::endl;
-    
-    // Return true if user quit, false if connection lost
-    return user_quit;
 }
 
+UDPSocket* TunnelClientDispatch::udpFlowSocket( uint32_t flow_id )
+{
+    if( flow_id == 0 ) return _udp_forwarder;
+
+    const Clock::time_point now = Clock::now();
+    auto it = _udp_flows.find( flow_id );
+    if( it != _udp_flows.end() )
+    {
+        _udp_flows.touch( it, now );
+        return it->second.flow.get();
+    }
+
+    if( _udp_flows.full() )
+    {
+        auto oldest = _udp_flows.oldest();
+        LOG_INFO << "Too many UDP flows, closing flow " << oldest->first << std::endl;
+        closeUdpFlow( oldest );
+        _udp_flows_evicted++;
+    }
+
+    std::unique_ptr<UDPSocket> socket( new UDPSocket );
+    if( !socket->create() )
+    {
+        LOG_WARN << "Cannot create a forwarding socket for UDP flow " << flow_id << ", dropping its packets" << std::endl;
+        return nullptr;
+    }
+    socket->setNoBlock();
+
+    UDPSocket* raw = socket.get();
+    _loop.add( raw->socket(), IoEvent::Readable, [this,flow_id,raw](uint32_t) { onUdpForwarder( flow_id, raw ); } );
+    _udp_flows.insert( flow_id, std::move( socket ), now );
+    _udp_flow_count     = _udp_flows.size();
+    if( !_udp_sweep_timer ) _udp_sweep_timer = _loop.addTimer( _udp_timeout, [this]() { onUdpSweepTimer(); } );
+
+    LOG_INFO << "New UDP flow " << flow_id << " forwarded from socket " << raw->socket() << std::endl;
+    return raw;
+}
+
+void TunnelClientDispatch::closeUdpFlow( UdpFlows::iterator it )
+{
+    if( _udp_out_socket == it->second.flow.get() ) flushUdpForwarder();
+    _loop.remove( it->second.flow->socket() );
+    _udp_flows.erase( it );
+    _udp_flow_count = _udp_flows.size();
+}
+
+void TunnelClientDispatch::onUdpSweepTimer( )
+{
+    _udp_sweep_timer = 0;
+
+    // The first flow that is still active ends the sweep, all later ones are younger
+    const Clock::time_point now = Clock::now();
+    while( !_udp_flows.empty() )
+    {
+        auto it = _udp_flows.oldest();
+        if( now - it->second.last_active < _udp_timeout ) break;
+
+        LOG_INFO << "UDP flow " << it->first << " expired" << std::endl;
+        closeUdpFlow( it );
+        _udp_flows_expired++;
+    }
+
+    // A flow is closed at most a quarter of the timeout late
+    if( !_udp_flows.empty() )
+    {
+        _udp_sweep_timer = _loop.addTimer( std::chrono::duration_cast<Clock::duration>( _udp_timeout ) / 4,
+                                           [this]() { onUdpSweepTimer(); } );
+    }
+}
+
+void TunnelClientDispatch::sendToUdpForwarder( uint32_t flow_id, const char* data, size_t len, uint16_t segment )
+{
+    UDPSocket* socket = udpFlowSocket( flow_id );
+    if( !socket ) return;
+
+    // A batch goes out through one socket
+    if( _udp_out->full() || ( !_udp_out->empty() && socket != _udp_out_socket ) )
+    {
+        flushUdpForwarder();
+    }
+    _udp_out_socket = socket;
+    _udp_out->add( data, len, _dest_udp, segment );
+
+    if( !_udp_flush_scheduled )
+    {
+        _udp_flush_scheduled = true;
+        _loop.defer( [this]() { flushUdpForwarder(); } );
+    }
+}
+
+void TunnelClientDispatch::flushUdpForwarder( )
+{
+    _udp_flush_scheduled = false;
+    if( _udp_out->empty() ) return;
+
+    _udp_send_calls++;
+    _udp_send_packets += _udp_out_socket->sendBatch( *_udp_out );
+}
+
+void TunnelClientDispatch::sendToUdpChannel( uint32_t conn_id, TunnelMessageType type, const char* payload, size_t len )
+{
+    if( _channel_out->full() )
+    {
+        flushUdpChannel();
+    }
+
+    TunnelMessageHeader header;
+    TunnelProtocol::createHeader( header, conn_id, len, type );
+    _channel_out->add( &header, TunnelProtocol::HEADER_SIZE, payload, len, _dest_channel );
+
+    if( !_channel_flush_scheduled )
+    {
+        _channel_flush_scheduled = true;
+        _loop.defer( [this]() { flushUdpChannel(); } );
+    }
+}
+
+void TunnelClientDispatch::flushUdpChannel( )
+{
+    _channel_flush_scheduled = false;
+    if( _channel_out->empty() ) return;
+
+    _channel_send_packets += _udp_channel->sendBatch( *_channel_out );
+}
+
+void TunnelClientDispatch::onHeartbeatTimer( )
+{
+    _heartbeat_timer = 0;
+
+    const Clock::time_point now = Clock::now();
+
+    // The tunnel is not read while a connection is throttled, its silence means nothing
+    if( !_throttled.empty() ) _last_received = now;
+
+    const Clock::time_point deadline = _last_received + _heartbeat_misses * _heartbeat_interval;
+    if( now >= deadline )
+    {
+        LOG_INFO << "Nothing from TunnelServer on shard " << _shard << " for " << _heartbeat_misses
+                 << " heartbeats, reconnecting. TCP connections will be preserved." << std::endl;
+        _dead_tunnels++;
+        _cont_loop = false;
+        return;
+    }
+
+    if( now >= _next_ping )
+    {
+        TunnelPing ping;
+        TunnelProtocol::createPing( ping, std::chrono::duration_cast<std::chrono::microseconds>(
+                                              now.time_since_epoch() ).count() );
+        sendToTunnel( 0, TunnelMessageType::PING, (const char*)&ping, sizeof(ping) );
+        _pings_sent++;
+        _next_ping = now + _heartbeat_interval;
+    }
+
+    _heartbeat_timer = _loop.addTimer( std::min( _next_ping, deadline ), [this]() { onHeartbeatTimer(); } );
+}
+
+void TunnelClientDispatch::onChannelTimer( )
+{
+    const Clock::time_point now = Clock::now();
+
+    if( _channel_up && now - _channel_last_echo > channel_timeout )
+    {
+        std::cout << "= UDP side channel of shard " << _shard
+                  << " lost, UDP packets use the tunnel" << std::endl;
+        _channel_up = false;
+    }
+
+    if( now >= _channel_next_hello )
+    {
+        TunnelUdpChannel channel;
+        TunnelProtocol::createUdpChannel( channel, _channel_cookie );
+        sendToUdpChannel( 0, TunnelMessageType::UDP_CHANNEL, (const char*)&channel, sizeof(channel) );
+        _channel_next_hello = now + ( _channel_up ? channel_keepalive : channel_retry );
+    }
+
+    _channel_timer = _loop.addTimer( _channel_next_hello, [this]() { onChannelTimer(); } );
+}
+
+void TunnelClientDispatch::onHelloTimeout( )
+{
+    _hello_timer = 0;
+    if( !_hello_pending ) return;
+
+    LOG_INFO << "TunnelServer did not answer the HELLO of shard " << _shard << std::endl;
+    _hello_pending = false;
+    if( _resume_enabled ) startWithoutResume();
+}
+
+void TunnelClientDispatch::onUdpChannel( )
+{
+    int count = _udp_channel->recvBatch( *_udp_in );
+    if( count < 0 )
+    {
+        if( errno != EWOULDBLOCK && errno != EAGAIN )
+        {
+            LOG_WARN << "Read from the UDP side channel failed. " << strerror(errno) << std::endl;
+        }
+        return;
+    }
+
+    for( int i = 0; i < count; i++ )
+    {
+        uint32_t          conn_id;
+        uint16_t          length;
+        TunnelMessageType type;
+        if( _udp_in->addr(i) != _dest_channel ||
+            !TunnelProtocol::parseDatagram( _udp_in->data(i), _udp_in->size(i), conn_id, length, type ) )
+        {
+            LOG_DEBUG << "Ignoring datagram from " << _udp_in->addr(i) << " on the UDP side channel" << std::endl;
+            continue;
+        }
+        const char* payload = _udp_in->data(i) + TunnelProtocol::HEADER_SIZE;
+        _channel_recv_packets++;
+
+        if( type == TunnelMessageType::UDP_PACKET )
+        {
+            sendToUdpForwarder( conn_id, payload, length );
+        }
+        else if( type == TunnelMessageType::UDP_CHANNEL )
+        {
+            uint64_t cookie;
+            if( !TunnelProtocol::parseUdpChannel( payload, length, cookie ) || cookie != _channel_cookie )
+            {
+                continue;
+            }
+            _channel_last_echo = Clock::now();
+            if( !_channel_up )
+            {
+                _channel_up = true;
+                _channel_next_hello = _channel_last_echo + channel_keepalive;
+                std::cout << "= UDP side channel to " << _dest_channel << " established" << std::endl;
+            }
+        }
+    }
+}
+
+void TunnelClientDispatch::onDestEvent( uint32_t conn_id, uint32_t events )
+{
+    auto* conn = _tcp_connections.getConnection(conn_id);
+    if (conn && conn->connecting)
+    {
+        onDestConnected(conn_id);
+        return;
+    }
+
+    if (events & IoEvent::Writable)
+    {
+        onDestWritable(conn_id);
+    }
+    if (events & (IoEvent::Readable | IoEvent::Error | IoEvent::HangUp))
+    {
+        onDestReadable(conn_id);
+    }
+}
+
+void TunnelClientDispatch::onDestConnected( uint32_t conn_id )
+{
+    auto* conn = _tcp_connections.getConnection(conn_id);
+    if (!conn || !conn->socket)
+        return;
+
+    int err = conn->socket->finishConnect();
+    if (err != 0)
+    {
+        LOG_ERROR << "Failed to connect to " << _dest_tcp.getAddress()
+                  << ":" << _dest_tcp.getPort()
+                  << " for conn_id=" << conn_id << " - " << strerror(err) << std::endl;
+
+        // Send TCP_CLOSE back to server, unless it has closed the connection already
+        const bool notify = !conn->closing;
+        removeConnection(conn_id);
+        if (notify)
+        {
+            sendToTunnel(conn_id, TunnelMessageType::TCP_CLOSE, nullptr, 0);
+        }
+        return;
+    }
+
+    LOG_INFO << "Connected to " << _dest_tcp.getAddress()
+             << ":" << _dest_tcp.getPort()
+             << " for conn_id=" << conn_id
+             << " (" << conn->queued() << " bytes waiting)" << std::endl;
+
+    conn->connecting = false;
+    _connects_in_flight.erase(conn_id);
+
+    // Deliver the data that arrived during the connect
+    if (conn->queued() > 0)
+    {
+        onDestWritable(conn_id);
+    }
+    else
+    {
+        updateConnection(conn);
+    }
+
+    startConnects();
+}
+
+void TunnelClientDispatch::onDestReadable( uint32_t conn_id )
+{
+    auto* conn = _tcp_connections.getConnection(conn_id);
+    if (!conn || !conn->socket || !conn->valid)
+        return;
+
+    // The connection is read in its turn at the end of the loop iteration
+    _tcp_connections.markReady(conn);
+    if (!_serve_scheduled)
+    {
+        _serve_scheduled = true;
+        _loop.defer( [this]() { serveConnections(); } );
+    }
+}
+
+void TunnelClientDispatch::serveConnections( )
+{
+    _serve_scheduled = false;
+
+    /* Connections to the destination are preserved across tunnel
+     * reconnections. While no tunnel exists, their data stays in the
+     * kernel until the next run(), and so do their places in the list.
+     */
+    if( _tunnel == nullptr || !_cont_loop )
+        return;
+
+    /* One round of the deficit round-robin: each connection that was ready
+     * when it started gets one turn. A connection that still has data after
+     * its turn goes to the back of the list. When the tunnel is congested,
+     * the others keep their place for the next round.
+     */
+    for (size_t turns = _tcp_connections.readyCount();
+         turns > 0 && !_tunnel_congested && _cont_loop; turns--)
+    {
+        auto* conn = _tcp_connections.nextReady();
+        if (conn && onDestConnection(conn))
+        {
+            _tcp_connections.markReady(conn);
+        }
+    }
+}
+
+bool TunnelClientDispatch::onDestConnection( TCPConnectionManager::Connection* conn )
+{
+    const uint32_t conn_id = conn->conn_id;
+
+    // Still paying back the frames of earlier turns
+    if (conn->deficit <= 0)
+        return true;
+
+    for (;;)
+    {
+        // TunnelServer closed this connection already, only the queue is left.
+        // Socket errors show up in onDestWritable.
+        if (!conn->socket || !conn->valid || conn->closing || conn->resuming)
+            break;
+
+        /* Never send more than TunnelServer can take for this connection.
+         * Interactive data is read in small pieces within the deficit. Bulk
+         * data is read in whole frames, which may overdraw the deficit; the
+         * connection pays that back in its next turns.
+         */
+        const size_t limit  = (dataPriority(conn) == TunnelWriter::Priority::Bulk)
+                            ? frameLimit(conn) : std::min<size_t>(max_tcp_data_size, conn->deficit);
+        const size_t window = std::min<size_t>(conn->sendWindow(), limit);
+        if (window == 0)
+        {
+            // Waits for a WINDOW_UPDATE, the rest of the turn carries over
+            watchConnection(conn);
+            return false;
+        }
+
+        bool spliced = false;
+        int  bytes   = readConnection(conn, window, spliced);
+
+        if (bytes == 0)
+        {
+            // Connection closed by destination
+            LOG_INFO << "Destination TCP connection closed, conn_id=" << conn_id << std::endl;
+
+            // Try to send TCP_CLOSE through tunnel
+            // If tunnel is down, this will fail but connection will be cleaned up
+            sendToTunnel(conn_id, TunnelMessageType::TCP_CLOSE, nullptr, 0);
+            finishConnection(conn);
+            return false;
+        }
+        else if (bytes < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // Non-blocking socket, no data available
+                break;
+            }
+
+            LOG_WARN << "Error reading from destination TCP conn_id=" << conn_id
+                     << ": " << strerror(errno) << std::endl;
+
+            sendToTunnel(conn_id, TunnelMessageType::TCP_CLOSE, nullptr, 0);
+            finishConnection(conn);
+            return false;
+        }
+
+        // Data received from destination
+        LOG_DEBUG << "Received " << bytes << " bytes from destination TCP conn_id=" << conn_id << std::endl;
+
+        // A spliced payload is already queued in the tunnel's pipe
+        bool success = true;
+        if (spliced)
+        {
+            scheduleTunnelFlush();
+            conn->compression.sent(bytes);
+        }
+        else
+        {
+            success = sendToTunnel(conn_id,
+                                   TunnelMessageType::TCP_DATA,
+                                   tcp_data_buffer,
+                                   bytes,
+                                   dataPriority(conn),
+                                   &conn->compression);
+
+            // Kept until TunnelServer has consumed it
+            if (success && _resume) conn->retransmit.append(tcp_data_buffer, bytes);
+        }
+
+        if (!success)
+        {
+            LOG_ERROR << "Failed to send TCP_DATA for conn_id=" << conn_id << std::endl;
+            LOG_INFO << "Tunnel connection lost while sending TCP data. Will reconnect." << std::endl;
+            // Don't remove connection - it will be preserved for reconnection
+            _cont_loop = false;
+            break;
+        }
+
+        conn->data_sent  += bytes;
+        conn->data_total += bytes;
+        conn->deficit    -= bytes;
+        if (conn->sendWindow() == 0)
+        {
+            LOG_DEBUG << "Send window of conn_id=" << conn_id << " is exhausted" << std::endl;
+            watchConnection(conn);
+            return false;
+        }
+
+        // A short read emptied the socket
+        if ((size_t)bytes < window)
+            break;
+
+        // The rest of the turn waits for the next round
+        if (conn->deficit <= 0 || _tunnel_congested)
+            return true;
+    }
+
+    // The socket is empty or closed. An idle connection does not save up its deficit.
+    conn->deficit = 0;
+    return false;
+}
+
+void TunnelClientDispatch::onDestWritable( uint32_t conn_id )
+{
+    auto* conn = _tcp_connections.getConnection(conn_id);
+    if (!conn || !conn->socket || !conn->valid)
+        return;
+
+    if (!conn->flush())
+    {
+        LOG_WARN << "Failed to send queued TCP data to conn_id=" << conn_id
+                 << ": " << strerror(errno) << std::endl;
+        const bool notify = !conn->closing;
+        removeConnection(conn_id);
+        if (notify && _tunnel != nullptr)
+        {
+            sendToTunnel(conn_id, TunnelMessageType::TCP_CLOSE, nullptr, 0);
+        }
+        return;
+    }
+
+    if (conn->closing && conn->queued() == 0)
+    {
+        LOG_INFO << "Flushed destination TCP conn_id=" << conn_id << ", closing it" << std::endl;
+        acknowledgeClose(conn);
+        removeConnection(conn_id);
+        return;
+    }
+
+    updateWindow(conn);
+    updateConnection(conn);
+}
+
+void TunnelClientDispatch::flushTunnel( )
+{
+    if( !_tunnel_writer.flush( *tunnel() ) )
+    {
+        LOG_ERROR << "Error writing to TCP tunnel, socket " << tunnel()->socket() << ". "
+                  << strerror(errno) << std::endl;
+        LOG_INFO << "Tunnel connection lost. TCP connections will be preserved for reconnection." << std::endl;
+        _cont_loop = false;
+        return;
+    }
+    if( _zerocopy ) _tunnel_writer.reapCompletions( *tunnel() );
+
+    _tunnel_blocked = _tunnel_writer.queued() > 0;
+    updateTunnelInterest();
+}
+
+bool TunnelClientDispatch::sendToTunnel( uint32_t conn_id,
+                                         TunnelMessageType type,
+                                         const char* payload,
+                                         size_t payload_len )
+{
+    return sendToTunnel( conn_id, type, payload, payload_len, messagePriority( type ) );
+}
+
+bool TunnelClientDispatch::sendToTunnel( uint32_t conn_id,
+                                         TunnelMessageType type,
+                                         const char* payload,
+                                         size_t payload_len,
+                                         TunnelWriter::Priority priority,
+                                         CompressionEstimator* compression )
+{
+    if( _tunnel == nullptr ) return false;
+
+    bool compressed = false;
+    const Compression::Codec codec = _codec;
+    if( codec != Compression::Codec::None && compression != nullptr )
+    {
+        if( !compression->active() )
+        {
+            compression->sent( payload_len );
+        }
+        else if( size_t size = compression->compress( payload, payload_len,
+                                                      compress_buffer, sizeof(compress_buffer), codec ) )
+        {
+            _compressed_in  += payload_len;
+            _compressed_out += size;
+            payload     = compress_buffer;
+            payload_len = size;
+            compressed  = true;
+        }
+    }
+
+    if( !sendTunnelMessage( _tunnel_writer, conn_id, type, payload, payload_len, priority, compressed ) )
+    {
+        return false;
+    }
+
+    scheduleTunnelFlush();
+    return true;
+}
+
+void TunnelClientDispatch::scheduleTunnelFlush( )
+{
+    // While the socket is full, the next writable event flushes
+    if( !_tunnel_blocked && !_tunnel_flush_scheduled )
+    {
+        _tunnel_flush_scheduled = true;
+        _loop.defer( [this]()
+        {
+            _tunnel_flush_scheduled = false;
+            if( _tunnel != nullptr && _cont_loop ) flushTunnel();
+        } );
+    }
+
+    if( !_tunnel_congested && _tunnel_writer.queued() > TCPConnectionManager::max_queued_bytes )
+    {
+        setTunnelCongested( true );
+    }
+}
+
+int TunnelClientDispatch::readConnection( TCPConnectionManager::Connection* conn, size_t window, bool& spliced )
+{
+    /* Splice bulk data straight into the tunnel's queue if the pipe has
+     * room. Resumption needs a copy of the data, which splicing avoids.
+     */
+    spliced = ( !_resume && dataPriority( conn ) == TunnelWriter::Priority::Bulk &&
+                !( _codec != Compression::Codec::None && conn->compression.active() ) &&
+                _tunnel_writer.spliceRoom() >= window );
+    if( spliced )
+    {
+        return _tunnel_writer.spliceFrom( conn->socket->socket(), conn->conn_id,
+                                          TunnelMessageType::TCP_DATA, window );
+    }
+    return conn->socket->recv( tcp_data_buffer, window );
+}
+
+size_t TunnelClientDispatch::frameLimit( const TCPConnectionManager::Connection* conn ) const
+{
+    // Compression takes one version 1 payload at a time
+    if( _codec != Compression::Codec::None && conn->compression.active() )
+    {
+        return std::min<size_t>( _tunnel_writer.maxPayload(), TunnelProtocol::MAX_PAYLOAD_SIZE );
+    }
+    return _tunnel_writer.maxPayload();
+}
+
+void TunnelClientDispatch::openConnection( uint32_t conn_id, uint16_t weight )
+{
+    // Create outgoing TCP connection to destination
+    std::unique_ptr<TCPSocket> tcp_conn( new TCPSocket );
+    if (!tcp_conn->createNoBlock())
+    {
+        LOG_ERROR << "Failed to create a socket for conn_id=" << conn_id << std::endl;
+
+        // Send TCP_CLOSE back to server
+        sendToTunnel(conn_id, TunnelMessageType::TCP_CLOSE, nullptr, 0);
+        return;
+    }
+
+    _tcp_connections.addConnection(conn_id, tcp_conn);
+    _tcp_connections.getConnection(conn_id)->connecting = true;
+    _tcp_connections.setWeight(conn_id, weight);
+
+    _waiting_connects.push_back(conn_id);
+    startConnects();
+}
+
+void TunnelClientDispatch::startConnects( )
+{
+    while (_connects_in_flight.size() < _max_connects && !_waiting_connects.empty())
+    {
+        const uint32_t conn_id = _waiting_connects.front();
+        _waiting_connects.pop_front();
+
+        auto* conn = _tcp_connections.getConnection(conn_id);
+        if (!conn || !conn->socket)
+            continue;
+
+        if (!conn->socket->startConnect(_dest_tcp))
+        {
+            LOG_ERROR << "Failed to connect to " << _dest_tcp.getAddress()
+                      << ":" << _dest_tcp.getPort()
+                      << " for conn_id=" << conn_id << std::endl;
+
+            const bool notify = !conn->closing;
+            removeConnection(conn_id);
+            if (notify)
+            {
+                sendToTunnel(conn_id, TunnelMessageType::TCP_CLOSE, nullptr, 0);
+            }
+            continue;
+        }
+
+        // The socket becomes writable when the connect is over
+        _connects_in_flight.insert(conn_id);
+        _loop.add( conn->socket->socket(), IoEvent::Writable,
+                   [this,conn_id](uint32_t events) { onDestEvent(conn_id, events); } );
+    }
+
+    if (!_waiting_connects.empty())
+    {
+        LOG_DEBUG << _waiting_connects.size() << " connections wait for one of "
+                  << _max_connects << " connect slots" << std::endl;
+    }
+}
+
+void TunnelClientDispatch::writeToConnection( TCPConnectionManager::Connection* conn,
+                                              const char* data, size_t len )
+{
+    const uint32_t conn_id = conn->conn_id;
+
+    if (!conn->write(data, len))
+    {
+        LOG_WARN << "Failed to send TCP data to conn_id=" << conn_id
+                 << ": " << strerror(errno) << std::endl;
+        removeConnection(conn_id);
+        sendToTunnel(conn_id, TunnelMessageType::TCP_CLOSE, nullptr, 0);
+        return;
+    }
+
+    LOG_DEBUG << "Forwarded " << len << " bytes to destination TCP conn_id=" << conn_id
+              << " (" << conn->queued() << " bytes queued)" << std::endl;
+
+    updateWindow(conn);
+    updateConnection(conn);
+}
+
+void TunnelClientDispatch::updateWindow( TCPConnectionManager::Connection* conn )
+{
+    // TunnelServer does not need credit for a connection it has closed
+    if (conn->closing) return;
+
+    // Batch the credit, a WINDOW_UPDATE per TCP_DATA would double the messages
+    const uint64_t consumed = conn->consumed();
+    if (consumed - conn->consumed_advertised < TunnelProtocol::STREAM_WINDOW / 4) return;
+
+    TunnelWindowUpdate update;
+    TunnelProtocol::createWindowUpdate(update, consumed);
+    if (sendToTunnel(conn->conn_id, TunnelMessageType::WINDOW_UPDATE,
+                     (const char*)&update, sizeof(update)))
+    {
+        conn->consumed_advertised = consumed;
+    }
+}
+
+void TunnelClientDispatch::handleHello( TunnelMessage& msg )
+{
+    uint16_t shard, shards, version;
+    uint32_t capabilities;
+    if( !_hello_pending || _reconstructor.framing() != 1 ||
+        !TunnelProtocol::parseHello( msg.payload.data(), msg.payload.size(),
+                                     shard, shards, version, capabilities ) ||
+        version < 1 || version > TunnelProtocol::VERSION )
+    {
+        LOG_WARN << "Unexpected HELLO from server on shard " << _shard << std::endl;
+        return;
+    }
+    _hello_pending = false;
+    _resume = _resume_enabled && ( capabilities & TunnelProtocol::CAP_RESUME );
+
+    // Only a TunnelServer that answers PINGs is expected to send something regularly
+    _last_received = Clock::now();
+    _next_ping     = _last_received;
+    if( _heartbeat_interval.count() > 0 && ( capabilities & TunnelProtocol::CAP_HEARTBEAT ) )
+    {
+        _heartbeat_timer = _loop.addTimer( _next_ping, [this]() { onHeartbeatTimer(); } );
+    }
+
+    if( _compress )
+    {
+        _codec = Compression::codecFor( capabilities );
+        if( _codec == Compression::Codec::None )
+        {
+            LOG_WARN << "TunnelServer cannot decompress any codec of this build, "
+                     << "the tunnel of shard " << _shard << " is not compressed" << std::endl;
+        }
+    }
+
+    /* With a newer framing, everything behind the answer has it. Our
+     * second HELLO is the last message with the old one, after everything
+     * that is queued already.
+     */
+    if( version >= 2 )
+    {
+        _reconstructor.setFraming( version );
+
+        const uint32_t caps = Compression::capabilities() | TunnelProtocol::CAP_HEARTBEAT | TunnelProtocol::CAP_UDP_FLOWS |
+                              ( _resume_enabled ? TunnelProtocol::CAP_RESUME : 0 );
+        TunnelHello hello;
+        TunnelProtocol::createHello( hello, _shard, _shards, version, caps );
+        _tunnel_writer.barrier();
+        sendToTunnel( 0, TunnelMessageType::HELLO, (const char*)&hello, sizeof(hello) );
+        _tunnel_writer.setFraming( version );
+
+        LOG_INFO << "Tunnel of shard " << _shard << " uses framing version " << version << std::endl;
+    }
+
+    if( _resume )
+    {
+        if( _tcp_connections.connectionCount() > 0 )
+        {
+            LOG_INFO << "Resuming " << _tcp_connections.connectionCount() << " TCP connections on shard "
+                     << _shard << std::endl;
+        }
+        for( uint32_t conn_id : _tcp_connections.getAllConnIds() )
+        {
+            sendResume( _tcp_connections.getConnection(conn_id) );
+        }
+    }
+    else if( _resume_enabled )
+    {
+        startWithoutResume();
+    }
+}
+
+void TunnelClientDispatch::handleWindowUpdate( TunnelMessage& msg )
+{
+    uint64_t consumed = 0;
+    if (!TunnelProtocol::parseWindowUpdate(msg.payload.data(), msg.payload.size(), consumed))
+    {
+        LOG_WARN << "Malformed WINDOW_UPDATE for conn_id=" << msg.conn_id << std::endl;
+        return;
+    }
+
+    auto* conn = _tcp_connections.getConnection(msg.conn_id);
+    if (!conn)
+    {
+        // The connection was closed while the update was on its way
+        LOG_DEBUG << "WINDOW_UPDATE for unknown conn_id=" << msg.conn_id << std::endl;
+        return;
+    }
+
+    if (consumed <= conn->peer_consumed || consumed > conn->data_sent)
+    {
+        LOG_DEBUG << "Ignoring stale WINDOW_UPDATE for conn_id=" << msg.conn_id
+                  << " (consumed " << consumed << ", sent " << conn->data_sent << ")" << std::endl;
+        return;
+    }
+
+    const bool was_blocked = conn->sendWindow() == 0;
+    conn->peer_consumed = consumed;
+    conn->retransmit.acknowledge(consumed);
+
+    if (conn->finished && conn->peer_consumed >= conn->data_sent)
+    {
+        LOG_DEBUG << "TunnelServer consumed all data of the closed conn_id=" << msg.conn_id << std::endl;
+        removeConnection(msg.conn_id);
+    }
+    else if (was_blocked)
+    {
+        LOG_DEBUG << "Send window of conn_id=" << msg.conn_id << " reopened" << std::endl;
+        watchConnection(conn);
+    }
+}
+
+void TunnelClientDispatch::handlePong( TunnelMessage& msg )
+{
+    uint64_t sent_us = 0;
+    if (!TunnelProtocol::parsePing(msg.payload.data(), msg.payload.size(), sent_us))
+    {
+        LOG_WARN << "Malformed PONG on shard " << _shard << std::endl;
+        return;
+    }
+
+    const int64_t now_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                               Clock::now().time_since_epoch() ).count();
+    const int64_t rtt_us = now_us - (int64_t)sent_us;
+    if (rtt_us < 0) return;
+
+    _pongs_received++;
+    _rtt_latest_us   = rtt_us;
+    _rtt_smoothed_us = (_rtt_smoothed_us < 0) ? rtt_us : (7 * _rtt_smoothed_us + rtt_us) / 8;
+    LOG_DEBUG << "Heartbeat RTT of shard " << _shard << ": " << rtt_us << " us" << std::endl;
+}
+
+void TunnelClientDispatch::handleResume( TunnelMessage& msg )
+{
+    uint64_t received = 0;
+    uint64_t consumed = 0;
+    if (!TunnelProtocol::parseResume(msg.payload.data(), msg.payload.size(), received, consumed))
+    {
+        LOG_WARN << "Malformed RESUME for conn_id=" << msg.conn_id << std::endl;
+        return;
+    }
+
+    auto* conn = _tcp_connections.getConnection(msg.conn_id);
+    if (!conn)
+    {
+        // The connection was closed while there was no tunnel
+        LOG_INFO << "RESUME for unknown conn_id=" << msg.conn_id << ", closing it" << std::endl;
+        sendToTunnel(msg.conn_id, TunnelMessageType::TCP_CLOSE, nullptr, 0);
+        return;
+    }
+
+    if (!_resume || !conn->resuming)
+    {
+        LOG_WARN << "Unexpected RESUME for conn_id=" << msg.conn_id << std::endl;
+        return;
+    }
+
+    if (received > conn->data_sent || received < conn->retransmit.base() || consumed > received)
+    {
+        LOG_WARN << "Cannot resume conn_id=" << msg.conn_id << " at " << received
+                 << ", sent " << conn->data_sent << ", kept from " << conn->retransmit.base()
+                 << ". Closing it" << std::endl;
+        removeConnection(msg.conn_id);
+        sendToTunnel(msg.conn_id, TunnelMessageType::TCP_CLOSE, nullptr, 0);
+        return;
+    }
+
+    conn->peer_consumed = std::max(conn->peer_consumed, consumed);
+    conn->retransmit.acknowledge(conn->peer_consumed);
+
+    // What was lost with the old tunnel goes first
+    for (uint64_t offset = received; offset < conn->data_sent; )
+    {
+        const size_t len = std::min<uint64_t>(frameLimit(conn), conn->data_sent - offset);
+        sendToTunnel(conn->conn_id, TunnelMessageType::TCP_DATA, conn->retransmit.at(offset), len,
+                     dataPriority(conn), &conn->compression);
+        offset        += len;
+        _bytes_resent += len;
+    }
+    _connections_resumed++;
+
+    LOG_DEBUG << "Resumed conn_id=" << msg.conn_id << ", sent " << conn->data_sent - received
+              << " bytes again" << std::endl;
+
+    conn->resuming = false;
+    if (conn->finished)
+    {
+        // TunnelServer may have missed our TCP_CLOSE as well
+        sendToTunnel(msg.conn_id, TunnelMessageType::TCP_CLOSE, nullptr, 0);
+        if (conn->peer_consumed >= conn->data_sent) removeConnection(msg.conn_id);
+        return;
+    }
+    watchConnection(conn);
+}
+
+void TunnelClientDispatch::sendResume( TCPConnectionManager::Connection* conn )
+{
+    TunnelResume resume;
+    TunnelProtocol::createResume(resume, conn->received(), conn->consumed());
+    sendToTunnel(conn->conn_id, TunnelMessageType::RESUME, (const char*)&resume, sizeof(resume));
+}
+
+void TunnelClientDispatch::startWithoutResume( )
+{
+    LOG_INFO << "TunnelServer does not resume connections, " << _tcp_connections.connectionCount()
+             << " preserved TCP connections continue without their data in flight" << std::endl;
+
+    // TunnelServer starts counting from zero on the new tunnel as well
+    _tcp_connections.resetWindows();
+    for (uint32_t conn_id : _tcp_connections.getAllConnIds())
+    {
+        auto* conn = _tcp_connections.getConnection(conn_id);
+        conn->resuming = false;
+        if (conn->finished)
+        {
+            // Its data is lost, but TunnelServer can still close it
+            sendToTunnel(conn_id, TunnelMessageType::TCP_CLOSE, nullptr, 0);
+            removeConnection(conn_id);
+            continue;
+        }
+        watchConnection(conn);
+    }
+}
+
+void TunnelClientDispatch::acknowledgeClose( TCPConnectionManager::Connection* conn )
+{
+    if (!_resume) return;
+
+    TunnelWindowUpdate update;
+    TunnelProtocol::createWindowUpdate(update, conn->consumed());
+    sendToTunnel(conn->conn_id, TunnelMessageType::WINDOW_UPDATE, (const char*)&update, sizeof(update));
+}
+
+void TunnelClientDispatch::watchConnection( TCPConnectionManager::Connection* conn )
+{
+    // Only the end of the connect is interesting until then
+    if (conn->connecting || !conn->socket) return;
+
+    const bool readable = !conn->closing && !conn->resuming &&
+                          !_tunnel_congested && conn->sendWindow() > 0;
+    uint32_t events = readable ? IoEvent::Readable : 0;
+    if (conn->queued() > 0) events |= IoEvent::Writable;
+    _loop.modify( conn->socket->socket(), events );
+}
+
+void TunnelClientDispatch::updateConnection( TCPConnectionManager::Connection* conn )
+{
+    watchConnection(conn);
+
+    if (conn->queued() > TCPConnectionManager::max_queued_bytes)
+    {
+        if (_throttled.insert(conn->conn_id).second)
+        {
+            LOG_INFO << "Destination TCP conn_id=" << conn->conn_id << " is slow, "
+                     << conn->queued() << " bytes queued. Pausing the tunnel of shard "
+                     << _shard << std::endl;
+        }
+    }
+    else if (conn->queued() <= TCPConnectionManager::max_queued_bytes / 2)
+    {
+        _throttled.erase(conn->conn_id);
+    }
+
+    updateTunnelInterest();
+}
+
+void TunnelClientDispatch::updateTunnelInterest( )
+{
+    if (_tunnel == nullptr) return;
+
+    uint32_t events = _throttled.empty() ? IoEvent::Readable : 0;
+    if (_tunnel_blocked) events |= IoEvent::Writable;
+    _loop.modify( tunnel()->socket(), events );
+
+    // Stop reading from the destination while the tunnel cannot keep up
+    const size_t queued = _tunnel_writer.queued();
+    if (!_tunnel_congested && queued > TCPConnectionManager::max_queued_bytes)
+    {
+        setTunnelCongested( true );
+    }
+    else if (_tunnel_congested && queued <= TCPConnectionManager::max_queued_bytes / 2)
+    {
+        setTunnelCongested( false );
+    }
+}
+
+void TunnelClientDispatch::setTunnelCongested( bool congested )
+{
+    LOG_DEBUG << "Tunnel of shard " << _shard << ( congested ? " is congested, " : " has drained, " )
+              << _tunnel_writer.queued() << " bytes queued" << std::endl;
+
+    _tunnel_congested = congested;
+    for (uint32_t conn_id : _tcp_connections.getAllConnIds())
+    {
+        watchConnection( _tcp_connections.getConnection(conn_id) );
+    }
+}
+
+void TunnelClientDispatch::removeConnection( uint32_t conn_id )
+{
+    auto* conn = _tcp_connections.getConnection(conn_id);
+    if (conn && conn->socket)
+    {
+        _loop.remove( conn->socket->socket() );
+    }
+    _tcp_connections.removeConnection(conn_id);
+
+    if (_throttled.erase(conn_id) > 0) updateTunnelInterest();
+
+    if (_connects_in_flight.erase(conn_id) > 0)
+    {
+        startConnects();
+    }
+    else
+    {
+        auto it = std::find(_waiting_connects.begin(), _waiting_connects.end(), conn_id);
+        if (it != _waiting_connects.end()) _waiting_connects.erase(it);
+    }
+}
+
+void TunnelClientDispatch::finishConnection( TCPConnectionManager::Connection* conn )
+{
+    const uint32_t conn_id = conn->conn_id;
+
+    if (!( _resume && conn->peer_consumed < conn->data_sent ))
+    {
+        removeConnection(conn_id);
+        return;
+    }
+
+    LOG_DEBUG << "Keeping conn_id=" << conn_id << " until TunnelServer has consumed "
+              << conn->data_sent - conn->peer_consumed << " more bytes" << std::endl;
+
+    _loop.remove( conn->socket->socket() );
+    _tcp_connections.closeSocket(conn_id);
+    conn->finished = true;
+
+    if (_throttled.erase(conn_id) > 0) updateTunnelInterest();
+}
@@ -1,17 +1,368 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <deque>
 #include <memory>
+#include <set>
 
 #include "udp.h"
 #include "tcp.h"
+#include "tunnel_writer.h"
 #include "sockaddr.h"
+#include "event_loop.h"
+#include "tunnel_protocol.h"
+#include "tunnel_message_reconstructor.h"
+#include "tcp_connection_manager.h"
+#include "udp_flow_table.h"
 
-// Dispatch loop for TunnelClient
-// Returns true if user requested quit (Q pressed)
-// Returns false if connection was lost (should reconnect)
-bool dispatch_loop( const std::unique_ptr<TCPSocket>& tunnel,
-                    UDPSocket& udp_forwarder,
-                    std::shared_ptr<TCPSocket> webSock,
-                    const SockAddr& dest_udp,
-                    const SockAddr& dest_tcp );
+/* The event handling of one shard of TunnelClient. Every shard has its own
+ * tunnel connection to TunnelServer and runs in its own thread. Shard 0 also
+ * owns the UDP forwarding socket.
+ *
+ * The object lives across tunnel reconnections, so that the TCP connections
+ * to the destination and their registrations in the event loop are preserved.
+ */
+class TunnelClientDispatch
+{
+    const int       _shard;
+    const int       _shards;
+    UDPSocket*      _udp_forwarder;  // nullptr except in shard 0
+    const SockAddr& _dest_udp;
+    const SockAddr& _dest_tcp;
+    const size_t    _max_connects;
 
+    EventLoop _loop;
+
+    // The tunnel of the current run(), nullptr between runs
+    const std::unique_ptr<TCPSocket>* _tunnel { nullptr };
+
+    // Messages for the tunnel. They are flushed once per loop iteration,
+    // or when the socket becomes writable again after it was full.
+    TunnelWriter _tunnel_writer;
+    bool         _tunnel_flush_scheduled { false };
+    bool         _tunnel_blocked         { false };
+
+    // Send large batches to the tunnel with MSG_ZEROCOPY
+    const bool   _zerocopy;
+
+    // TCP_DATA of a connection is Interactive until it has sent this many bytes
+    const size_t _interactive_bytes;
+
+    // Compress TCP_DATA and UDP_PACKET payloads where it pays off, with
+    // the codec that we share with TunnelServer, None until it answered
+    const bool   _compress;
+    std::atomic<Compression::Codec> _codec { Compression::Codec::None };
+    CompressionEstimator  _udp_compression;
+    std::atomic<uint64_t> _compressed_in  { 0 };  // payload bytes before compression
+    std::atomic<uint64_t> _compressed_out { 0 };  // and after
+
+    /* Resume the destination connections without losing data when the
+     * tunnel is replaced, see TunnelResume. _resume is set while the
+     * current tunnel does, which TunnelServer's HELLO answer decides. The
+     * connections are not read until that has arrived.
+     */
+    const bool            _resume_enabled;
+    bool                  _resume        { false };
+    bool                  _hello_pending { false };
+    EventLoop::TimerId    _hello_timer   { 0 };
+    std::atomic<uint64_t> _connections_resumed { 0 };
+    std::atomic<uint64_t> _bytes_resent        { 0 };
+
+    // More than max_queued_bytes wait in _tunnel_writer. The destination
+    // connections are not read and UDP responses are dropped meanwhile.
+    bool _tunnel_congested { false };
+
+    // serveConnections() runs at the end of this loop iteration
+    bool _serve_scheduled { false };
+
+    // Batches for the UDP forwarder, only allocated in shard 0. UDP
+    // packets from the tunnel are collected in _udp_out and sent with one
+    // sendmmsg at the end of the loop iteration.
+    std::unique_ptr<UDPBatch> _udp_in;
+    std::unique_ptr<UDPBatch> _udp_out;
+    bool                      _udp_flush_scheduled { false };
+    std::atomic<uint64_t>     _udp_recv_packets { 0 };
+    std::atomic<uint64_t>     _udp_recv_calls   { 0 };
+    std::atomic<uint64_t>     _udp_send_packets { 0 };
+    std::atomic<uint64_t>     _udp_send_calls   { 0 };
+
+    /* UDP side channel to TunnelServer's tunnel port, only in shard 0
+     * with --datagrams (see TunnelUdpChannel). UDP responses use it instead
+     * of the tunnel while TunnelServer echoes the registrations.
+     */
+    using Clock = std::chrono::steady_clock;
+    UDPSocket*                _udp_channel;
+    const SockAddr&           _dest_channel;
+    uint64_t                  _channel_cookie { 0 };
+    std::atomic<bool>         _channel_up     { false };
+    Clock::time_point         _channel_next_hello;
+    Clock::time_point         _channel_last_echo;
+    EventLoop::TimerId        _channel_timer { 0 };
+    std::unique_ptr<UDPBatch> _channel_out;
+    bool                      _channel_flush_scheduled { false };
+    std::atomic<uint64_t>     _channel_recv_packets { 0 };
+    std::atomic<uint64_t>     _channel_send_packets { 0 };
+
+    /* UDP flows, one per outside sender of TunnelServer, only in shard 0.
+     * Every flow is forwarded from an ephemeral socket of its own, so that
+     * the destination tells the senders apart and its responses go back to
+     * the right one. Flow 0, from a TunnelServer without CAP_UDP_FLOWS,
+     * uses _udp_forwarder. A flow expires when nothing passed in either
+     * direction for _udp_timeout; the least recently active one is closed
+     * when there are max_udp_flows.
+     */
+    using UdpFlows = UdpFlowTable<std::unique_ptr<UDPSocket>>;
+    static const size_t max_udp_flows = 1024;
+    const std::chrono::seconds            _udp_timeout;
+    UdpFlows                              _udp_flows { max_udp_flows };  // the socket of each flow
+    UDPSocket*                            _udp_out_socket { nullptr };  // destination of _udp_out
+    EventLoop::TimerId                    _udp_sweep_timer { 0 };
+    std::atomic<size_t>                   _udp_flow_count    { 0 };
+    std::atomic<uint64_t>                 _udp_flows_expired { 0 };  // idle for _udp_timeout
+    std::atomic<uint64_t>                 _udp_flows_evicted { 0 };  // closed for a new flow
+
+    /* Heartbeats, see TunnelPing. While TunnelServer answers PINGs, one
+     * goes out every _heartbeat_interval, and the tunnel is given up when
+     * nothing arrived for _heartbeat_misses intervals. 0 disables them.
+     */
+    const std::chrono::milliseconds _heartbeat_interval;
+    const int                       _heartbeat_misses;
+    EventLoop::TimerId              _heartbeat_timer { 0 };  // 0 while TunnelServer does not answer
+    Clock::time_point               _last_received;
+    Clock::time_point               _next_ping;
+    std::atomic<int64_t>            _rtt_latest_us   { -1 };  // -1 until the first PONG
+    std::atomic<int64_t>            _rtt_smoothed_us { -1 };
+    std::atomic<uint64_t>           _pings_sent      { 0 };
+    std::atomic<uint64_t>           _pongs_received  { 0 };
+    std::atomic<uint64_t>           _dead_tunnels    { 0 };
+
+    TunnelMessageReconstructor _reconstructor;
+
+    // TCP connection manager - preserved across reconnections
+    TCPConnectionManager _tcp_connections;
+
+    // Connections with more than max_queued_bytes waiting. The tunnel is
+    // not read while this is not empty.
+    std::set<uint32_t> _throttled;
+
+    /* Connects to the destination are non-blocking. At most _max_connects
+     * are in flight, further connections wait in FIFO order. Both kinds
+     * queue TCP_DATA until they are connected.
+     */
+    std::set<uint32_t>   _connects_in_flight;
+    std::deque<uint32_t> _waiting_connects;
+
+    // Time without a tunnel connection after one was lost, see noteFailover()
+    std::atomic<uint64_t> _failovers         { 0 };
+    std::atomic<uint64_t> _failovers_standby { 0 };  // to a standby that was ready
+    std::atomic<uint64_t> _failover_last_us  { 0 };
+    std::atomic<uint64_t> _failover_max_us   { 0 };
+    std::atomic<uint64_t> _failover_total_us { 0 };
+
+    bool _cont_loop { false };
+    std::atomic<bool> _user_quit { false };
+
+public:
+    TunnelClientDispatch( int shard,
+                          int shards,
+                          UDPSocket* udp_forwarder,
+                          UDPSocket* udp_channel,
+                          const SockAddr& dest_udp,
+                          const SockAddr& dest_tcp,
+                          const SockAddr& dest_channel,
+                          size_t max_connects,
+                          bool zerocopy,
+                          size_t interactive_bytes,
+                          bool compress,
+                          bool resume,
+                          int heartbeat_ms,
+                          int heartbeat_misses,
+                          int udp_timeout_s,
+                          EventLoop::Backend backend );
+
+    // Dispatch loop for TunnelClient
+    // Returns true if user requested quit (Q pressed)
+    // Returns false if connection was lost (should reconnect)
+    bool run( const std::unique_ptr<TCPSocket>& tunnel );
+
+    // Thread-safe. Print the shard's counters.
+    void printStats( std::ostream& ostr ) const;
+
+    /* Thread-safe. Record how long the shard was without a tunnel
+     * connection after it lost one; standby if it could switch to one
+     * that was established already.
+     */
+    void noteFailover( std::chrono::microseconds time, bool standby );
+
+    /* Thread-safe. Make run() return true, now or as soon as it is
+     * called the next time.
+     */
+    void quit( );
+
+private:
+    void onTunnel( uint32_t events );
+    void flushTunnel( );
+
+    /* Queue a message for the tunnel. It is written at the end of the
+     * current loop iteration together with the other messages queued by
+     * then. Returns false if there is no tunnel.
+     */
+    bool sendToTunnel( uint32_t conn_id,
+                       TunnelMessageType type,
+                       const char* payload,
+                       size_t payload_len );
+
+    /* Same with a priority other than messagePriority( type ). With
+     * --compress, the payload is compressed if compression, the estimator
+     * of its stream, finds that worth it.
+     */
+    bool sendToTunnel( uint32_t conn_id,
+                       TunnelMessageType type,
+                       const char* payload,
+                       size_t payload_len,
+                       TunnelWriter::Priority priority,
+                       CompressionEstimator* compression = nullptr );
+
+    // Priority of the connection's next TCP_DATA, see _interactive_bytes
+    inline TunnelWriter::Priority dataPriority( const TCPConnectionManager::Connection* conn ) const
+    {
+        return ( conn->data_total < _interactive_bytes ) ? TunnelWriter::Priority::Interactive
+                                                         : TunnelWriter::Priority::Bulk;
+    }
+
+    // Make sure the queued tunnel messages are flushed in this loop iteration
+    void scheduleTunnelFlush( );
+
+    /* Read from the connection's socket, at most window bytes. If the
+     * connection is Bulk and the tunnel's splice pipe has room, the data
+     * goes straight into the tunnel's queue as TCP_DATA and spliced is set. Otherwise it is read
+     * into tcp_data_buffer. Returns like recv().
+     */
+    int readConnection( TCPConnectionManager::Connection* conn, size_t window, bool& spliced );
+
+    /* Largest TCP_DATA payload of the connection in one message: a frame
+     * of the tunnel's framing, or what compression takes at once.
+     */
+    size_t frameLimit( const TCPConnectionManager::Connection* conn ) const;
+
+    // Forward the responses that the socket of a UDP flow has received
+    void onUdpForwarder( uint32_t flow_id, UDPSocket* socket );
+    void flushUdpForwarder( );
+
+    /* The socket of a UDP flow, created if it is new. Returns nullptr if
+     * no socket can be created.
+     */
+    UDPSocket* udpFlowSocket( uint32_t flow_id );
+
+    // Close a UDP flow's socket
+    void closeUdpFlow( UdpFlows::iterator it );
+
+    // Timer task, closes the UDP flows that have been idle for too long
+    void onUdpSweepTimer( );
+
+    // Queue a UDP packet, or a run of packets of size segment, of a flow for the destination
+    void sendToUdpForwarder( uint32_t flow_id, const char* data, size_t len, uint16_t segment = 0 );
+
+    void onUdpChannel( );
+    void flushUdpChannel( );
+
+    // Queue one message as a datagram for TunnelServer's end of the side channel
+    void sendToUdpChannel( uint32_t conn_id, TunnelMessageType type, const char* payload, size_t len );
+
+    /* Timer task, sends the UDP_CHANNEL registration when it is due, and
+     * falls back to the tunnel if TunnelServer stopped echoing it.
+     */
+    void onChannelTimer( );
+
+    /* Timer task, sends a PING when it is due, and gives up a tunnel that
+     * has been silent for too long.
+     */
+    void onHeartbeatTimer( );
+
+    // Timer task, for a TunnelServer that does not answer our HELLO
+    void onHelloTimeout( );
+
+    // Take the round-trip time from a PONG
+    void handlePong( TunnelMessage& msg );
+    void onDestEvent( uint32_t conn_id, uint32_t events );
+    void onDestConnected( uint32_t conn_id );
+
+    // Put a readable connection into the round-robin for serveConnections()
+    void onDestReadable( uint32_t conn_id );
+
+    // Give the ready destination connections one turn each, see TCPConnectionManager::nextReady()
+    void serveConnections( );
+
+    /* Read and forward at most conn->deficit bytes. Returns true if the
+     * connection has more data and its turn was cut short; it may have
+     * been removed when false is returned.
+     */
+    bool onDestConnection( TCPConnectionManager::Connection* conn );
+    void onDestWritable( uint32_t conn_id );
+
+    void handleTunnelMessage( TunnelMessage& msg );
+    void handleWindowUpdate( TunnelMessage& msg );
+
+    // TunnelServer's answer to our HELLO, switch to the agreed framing
+    void handleHello( TunnelMessage& msg );
+
+    /* TunnelServer's position in a connection on a new tunnel. Send the
+     * data again that it has not received, then read the connection again.
+     */
+    void handleResume( TunnelMessage& msg );
+
+    // Tell TunnelServer how far we got with a preserved connection
+    void sendResume( TCPConnectionManager::Connection* conn );
+
+    // The tunnel does without resumption, restart the preserved connections
+    void startWithoutResume( );
+
+    /* Tell TunnelServer that all data of a connection that it closed has
+     * been consumed, so that it can drop its copy.
+     */
+    void acknowledgeClose( TCPConnectionManager::Connection* conn );
+
+    // Open a connection to the destination for a TCP_OPEN from TunnelServer,
+    // with its round-robin weight
+    void openConnection( uint32_t conn_id, uint16_t weight );
+
+    // Start waiting connects while fewer than _max_connects are in flight
+    void startConnects( );
+
+    /* Write data to a destination connection. Whatever the socket does not
+     * take now is queued and sent when it becomes writable. Closes the
+     * connection if the socket failed.
+     */
+    void writeToConnection( TCPConnectionManager::Connection* conn,
+                            const char* data, size_t len );
+
+    // Set the connection's interest: readable unless it is closing or
+    // resuming, the tunnel is congested or the send window is exhausted,
+    // writable while data is queued
+    void watchConnection( TCPConnectionManager::Connection* conn );
+
+    // Give TunnelServer credit for the data that left the connection's queue
+    void updateWindow( TCPConnectionManager::Connection* conn );
+
+    // Update the interest and throttle the tunnel if too much is queued
+    void updateConnection( TCPConnectionManager::Connection* conn );
+
+    // Read the tunnel unless a connection is throttled, and watch for
+    // writability while the socket is full
+    void updateTunnelInterest( );
+
+    // Stop or resume reading from all destination connections
+    void setTunnelCongested( bool congested );
+
+    // Remove a TCP connection from the loop and the connection manager
+    void removeConnection( uint32_t conn_id );
+
+    /* The connection ended after its TCP_CLOSE. Remove it, or only close
+     * its socket while TunnelServer may still need its data again, see
+     * TCPConnectionManager::Connection::finished.
+     */
+    void finishConnection( TCPConnectionManager::Connection* conn );
+
+    inline const std::unique_ptr<TCPSocket>& tunnel() const { return *_tunnel; }
+};
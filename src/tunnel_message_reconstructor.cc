@@ -1,122 +1,109 @@
 #include "tunnel_message_reconstructor.h"
+#include "compression.h"
 #include "verbose.h"
 
 #include <iostream>
 #include <string.h>
 
-void TunnelMessageReconstructor::collect_from_tunnel(const char* buffer, int buflen)
+TunnelMessageReconstructor::TunnelMessageReconstructor()
+    : _buffer(2 * _max_message_size)
+    , _inflated(TunnelProtocol::MAX_PAYLOAD_SIZE)
 {
-    LOG_DEBUG << "Appending " << buflen << " bytes to reconstruction buffer" << std::endl
-              << "        Bytes before: " << _bytes_from_tunnel.size() << std::endl;
-    
-    // Append new bytes to buffer
-    _bytes_from_tunnel.insert(_bytes_from_tunnel.end(), buffer, buffer + buflen);
-    
-    LOG_DEBUG << "Bytes after: " << _bytes_from_tunnel.size() << std::endl;
-    
-    // Process as many complete messages as possible
-    while (!_bytes_from_tunnel.empty())
+}
+
+void TunnelMessageReconstructor::setFraming(uint16_t version)
+{
+    _framing          = version;
+    _max_message_size = TunnelProtocol::MAX_HEADER_SIZE + TunnelProtocol::maxPayload(version);
+    if (_buffer.size() < 2 * _max_message_size)
     {
-        if (_wait_for_header)
-        {
-            // Need complete header (8 bytes)
-            if (_bytes_from_tunnel.size() >= TunnelProtocol::HEADER_SIZE)
-            {
-                LOG_DEBUG << "Reading message header" << std::endl;
-                
-                // Parse header
-                TunnelMessageHeader header;
-                memcpy(&header, _bytes_from_tunnel.data(), TunnelProtocol::HEADER_SIZE);
-                
-                uint32_t conn_id;
-                uint16_t length;
-                TunnelMessageType type;
-                TunnelProtocol::parseHeader(header, conn_id, length, type);
-                
-                LOG_DEBUG << "Header: conn_id=" << conn_id 
-                          << " length=" << length 
-                          << " type=" << TunnelProtocol::messageTypeToString(type) << std::endl;
-                
-                // Validate message type
-                if (!TunnelProtocol::isValidMessageType(static_cast<uint16_t>(type)))
-                {
-                    LOG_ERROR << "Invalid message type " << static_cast<uint16_t>(type) << std::endl;
-                    _bytes_from_tunnel.clear();
-                    break;
-                }
-                
-                // Validate payload length
-                if (length > TunnelProtocol::MAX_PAYLOAD_SIZE)
-                {
-                    LOG_ERROR << "Payload length " << length 
-                              << " exceeds maximum " << TunnelProtocol::MAX_PAYLOAD_SIZE << std::endl;
-                    _bytes_from_tunnel.clear();
-                    break;
-                }
-                
-                // Remove header from buffer
-                _bytes_from_tunnel.erase(_bytes_from_tunnel.begin(), 
-                                        _bytes_from_tunnel.begin() + TunnelProtocol::HEADER_SIZE);
-                
-                // Set up state for receiving payload
-                _current_conn_id = conn_id;
-                _current_type = type;
-                _wait_for_payload = length;
-                _wait_for_header = false;
-                
-                // If payload length is 0, message is complete immediately
-                if (length == 0)
-                {
-                    LOG_INFO << "Zero-length payload, message complete" << std::endl;
-                    _reconstructed_messages.emplace_back(conn_id, type, 0);
-                    _wait_for_header = true;
-                }
-            }
-            else
-            {
-                LOG_DEBUG << "Need more bytes for header (have " 
-                     << _bytes_from_tunnel.size() << ")" << std::endl;
-                break;
-            }
-        }
-        else // Waiting for payload
-        {
-            if (_bytes_from_tunnel.size() >= _wait_for_payload)
-            {
-                LOG_DEBUG << " Have complete payload (" << _wait_for_payload << " bytes)" << std::endl;
-                
-                // Create message with payload
-                TunnelMessage msg(_current_conn_id, _current_type, _wait_for_payload);
-                memcpy(msg.payload.data(), _bytes_from_tunnel.data(), _wait_for_payload);
-                
-                // Remove payload from buffer
-                _bytes_from_tunnel.erase(_bytes_from_tunnel.begin(),
-                                        _bytes_from_tunnel.begin() + _wait_for_payload);
-                
-                // Add to queue
-                _reconstructed_messages.push_back(std::move(msg));
-                
-                LOG_DEBUG << " Message complete and queued. Remaining bytes: " 
-                          << _bytes_from_tunnel.size() << std::endl;
-                
-                // Reset state for next message
-                _wait_for_header = true;
-                _wait_for_payload = 0;
-            }
-            else
-            {
-                LOG_DEBUG << " Need " << _wait_for_payload 
-                          << " bytes for payload, have " << _bytes_from_tunnel.size() << std::endl;
-                break;
-            }
-        }
+        _buffer.resize(2 * _max_message_size);
     }
-    
-    // Warn if queue is getting large
-    if (_reconstructed_messages.size() > 10)
+}
+
+int TunnelMessageReconstructor::readFrom(TCPSocket& socket)
+{
+    // Make room for at least one maximal message behind the incomplete tail
+    if (_begin == _end)
     {
-        LOG_WARN << "Warning: Message queue depth is " 
-                 << _reconstructed_messages.size() << std::endl;
+        _begin = _end = 0;
     }
+    else if (_buffer.size() - _end < _max_message_size)
+    {
+        LOG_DEBUG << "Moving " << _end - _begin << " incomplete bytes to the front of the buffer" << std::endl;
+        memmove(_buffer.data(), _buffer.data() + _begin, _end - _begin);
+        _end  -= _begin;
+        _begin = 0;
+    }
+
+    int retval = socket.recv(_buffer.data() + _end, _buffer.size() - _end);
+    if (retval > 0)
+    {
+        _end += retval;
+        LOG_DEBUG << "Read " << retval << " bytes, " << _end - _begin << " bytes buffered" << std::endl;
+    }
+    return retval;
 }
 
+bool TunnelMessageReconstructor::peekMessage(TunnelMessage& msg)
+{
+    if (_failed) return false;
+
+    const size_t available = _end - _begin;
+
+    // Parse header, it needs 8 bytes with version 1 and 2 to 10 with version 2
+    size_t length;
+    bool   compressed;
+    const int header_size = TunnelProtocol::decodeHeader(_buffer.data() + _begin, available, _framing,
+                                                         msg.conn_id, length, msg.type, compressed);
+    if (header_size == 0)
+    {
+        return false;
+    }
+
+    // Validate message type, only data messages may be compressed
+    if (header_size < 0 ||
+        (compressed && msg.type != TunnelMessageType::TCP_DATA && msg.type != TunnelMessageType::UDP_PACKET))
+    {
+        LOG_ERROR << "Invalid message header, type " << static_cast<uint16_t>(msg.type)
+                  << " with framing version " << _framing << std::endl;
+        _failed = true;
+        return false;
+    }
+
+    if (available < (size_t)header_size + length)
+    {
+        LOG_DEBUG << "Need " << header_size + length
+                  << " bytes for message, have " << available << std::endl;
+        return false;
+    }
+
+    msg.payload = TunnelPayload(_buffer.data() + _begin + header_size, length);
+    _peeked     = header_size + length;
+
+    if (compressed)
+    {
+        const int size = Compression::decompress(msg.payload.data(), msg.payload.size(),
+                                                 _inflated.data(), _inflated.size());
+        if (size < 0)
+        {
+            LOG_ERROR << "Cannot decompress the " << length << " byte payload of "
+                      << TunnelProtocol::messageTypeToString(msg.type)
+                      << " for conn_id=" << msg.conn_id << std::endl;
+            _failed = true;
+            return false;
+        }
+        msg.payload = TunnelPayload(_inflated.data(), size);
+    }
+
+    LOG_DEBUG << "Message complete: conn_id=" << msg.conn_id
+              << " length=" << length
+              << " type=" << TunnelProtocol::messageTypeToString(msg.type) << std::endl;
+    return true;
+}
+
+void TunnelMessageReconstructor::popMessage()
+{
+    _begin += _peeked;
+    _peeked = 0;
+}
@@ -1,61 +1,115 @@
 #pragma once
 
 #include <vector>
-#include <deque>
+#include "tcp.h"
 #include "tunnel_protocol.h"
 
-// Represents a complete message received through the tunnel
+// Non-owning view of a message payload inside the reconstructor's buffer
+class TunnelPayload
+{
+    const char* _data { nullptr };
+    size_t      _size { 0 };
+
+public:
+    TunnelPayload() = default;
+    TunnelPayload(const char* data, size_t size) : _data(data), _size(size) {}
+
+    inline const char* data() const  { return _data; }
+    inline size_t      size() const  { return _size; }
+    inline bool        empty() const { return _size == 0; }
+};
+
+/* Represents a complete message received through the tunnel.
+ * The payload points into the TunnelMessageReconstructor that produced the
+ * message and stays valid until its next readFrom() or clear().
+ */
 struct TunnelMessage
 {
-    uint32_t conn_id;
-    TunnelMessageType type;
-    std::vector<char> payload;
-    
-    TunnelMessage(uint32_t id, TunnelMessageType t, size_t payload_size)
-        : conn_id(id), type(t), payload(payload_size) {}
+    uint32_t          conn_id { 0 };
+    TunnelMessageType type    { TunnelMessageType::UDP_PACKET };
+    TunnelPayload     payload;
 };
 
-// Reconstructs tunnel messages from the TCP byte stream
+/* Reconstructs tunnel messages from the TCP byte stream.
+ * The tunnel socket is read directly into a buffer that holds two messages
+ * of maximal size. Complete messages are handed out as views into it, so
+ * decoding does not allocate or copy. Only the incomplete tail is moved to
+ * the front of the buffer, when the space behind it gets too small for
+ * another maximal message. Compressed payloads are the exception, they are
+ * decompressed into a second buffer.
+ *
+ * Headers are decoded with the framing version of the tunnel connection,
+ * version 1 until setFraming() changes it. The buffer grows with the
+ * larger messages of version 2.
+ */
 class TunnelMessageReconstructor
 {
 private:
+    // Framing version, and the size of the largest message it allows.
+    // Declared before _buffer, whose size depends on it.
+    uint16_t _framing          { 1 };
+    size_t   _max_message_size { TunnelProtocol::HEADER_SIZE + TunnelProtocol::MAX_PAYLOAD_SIZE };
+
+    std::vector<char> _buffer;
+
+    // Size of the message returned by peekMessage(), header included
+    size_t _peeked { 0 };
+
+    // Payload of the last compressed message, after decompressing it
+    std::vector<char> _inflated;
+
     // Bytes received from the tunnel that haven't been processed yet
-    std::vector<char> _bytes_from_tunnel;
-    
-    // State machine for reconstruction
+    size_t _begin { 0 };
+    size_t _end   { 0 };
 
-    /* The other side of the tunnel sends a 8-byte headers before sending data.
-     * _wait_for_header is true while we are waiting for a length field.
+    // An invalid message was found, the message boundaries are lost
+    bool _failed { false };
+
+public:
+    TunnelMessageReconstructor();
+
+    /* Read from the tunnel socket into the buffer. Views of messages that
+     * were handed out before become invalid.
+     * Returns the result of TCPSocket::recv().
+     */
+    int readFrom(TCPSocket& socket);
+
+    /* Get the next complete message without removing it. Returns false if
+     * the message is incomplete. A message with an invalid header or a
+     * compressed payload that cannot be decompressed makes the
+     * reconstructor fail: it returns false from then on, and the tunnel
+     * connection must be closed. Compressed payloads are handed out
+     * decompressed.
      */
-    bool _wait_for_header { true };
+    bool peekMessage(TunnelMessage& msg);
 
-    uint32_t _current_conn_id { 0 };
+    // Remove the message returned by peekMessage()
+    void popMessage();
 
-    TunnelMessageType _current_type { TunnelMessageType::UDP_PACKET };
+    // Get and remove the next complete message. Returns false if there is none.
+    inline bool nextMessage(TunnelMessage& msg)
+    {
+        if (!peekMessage(msg)) return false;
+        popMessage();
+        return true;
+    }
 
-    /* If we are not waiting for a length field, _wait_for_data contains the number
-     * of bytes that are still needed for the current payload.
+    /* Check if the stream contained an invalid message. Nothing after it
+     * can be decoded, because the message boundaries are lost.
      */
-    size_t _wait_for_payload { 0 };
+    inline bool failed() const { return _failed; }
 
+    // Number of bytes that have not been handed out as messages
+    inline size_t buffered() const { return _end - _begin; }
 
-    // Queue of reconstructed messages ready to be processed
-    std::deque<TunnelMessage> _reconstructed_messages;
-    
-public:
-    // Add bytes received from the tunnel to the reconstruction buffer
-    void collect_from_tunnel(const char* buffer, int buflen);
-    
-    // Check if there are any complete messages ready
-    inline bool hasMessages() const { return !_reconstructed_messages.empty(); }
-    
-    // Get the next complete message (check hasMessages() first!)
-    inline TunnelMessage& frontMessage() { return _reconstructed_messages.front(); }
-    
-    // Remove the front message after processing
-    inline void popMessage() { _reconstructed_messages.pop_front(); }
-    
-    // Get number of queued messages
-    inline size_t messageCount() const { return _reconstructed_messages.size(); }
-};
+    /* Decode the bytes after the last message handed out with this
+     * framing version.
+     */
+    void setFraming(uint16_t version);
 
+    inline uint16_t framing() const { return _framing; }
+
+    // Drop all buffered bytes and a failure, e.g. for a new tunnel
+    // connection. The framing stays, call setFraming(1) for a new connection.
+    inline void clear() { _begin = _end = _peeked = 0; _failed = false; }
+};
@@ -1,17 +1,21 @@
 #include "tunnel_protocol.h"
 #include <arpa/inet.h>
 #include <string.h>
+#include <stddef.h>
+
+#include <algorithm>
 
 // Helper functions for creating and parsing tunnel messages
 
 void TunnelProtocol::createHeader(TunnelMessageHeader& header, 
                                    uint32_t conn_id,
                                    uint16_t length, 
-                                   TunnelMessageType type)
+                                   TunnelMessageType type,
+                                   bool compressed)
 {
     header.conn_id = htonl(conn_id);
     header.length = htons(length);
-    header.type = htons(static_cast<uint16_t>(type));
+    header.type = htons(static_cast<uint16_t>(type) | (compressed ? COMPRESSED : 0));
 }
 
 void TunnelProtocol::parseHeader(const TunnelMessageHeader& header,
@@ -24,10 +28,310 @@ void TunnelProtocol::parseHeader(const TunnelMessageHeader& header,
     type = static_cast<TunnelMessageType>(ntohs(header.type));
 }
 
+void TunnelProtocol::parseHeader(const TunnelMessageHeader& header,
+                                  uint32_t& conn_id,
+                                  uint16_t& length,
+                                  TunnelMessageType& type,
+                                  bool& compressed)
+{
+    conn_id = ntohl(header.conn_id);
+    length = ntohs(header.length);
+    const uint16_t value = ntohs(header.type);
+    type = static_cast<TunnelMessageType>(value & ~COMPRESSED);
+    compressed = (value & COMPRESSED) != 0;
+}
+
+// Append value as a LEB128 varint, returns the number of bytes
+static size_t putVarint(char* out, uint32_t value)
+{
+    size_t size = 0;
+    while (value >= 0x80)
+    {
+        out[size++] = static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out[size++] = static_cast<char>(value);
+    return size;
+}
+
+// Read a LEB128 varint of at most max_bytes, returns its size, 0 if it is
+// incomplete, or -1 if it is longer
+static int getVarint(const char* data, size_t size, size_t max_bytes, uint32_t& value)
+{
+    value = 0;
+    for (size_t i = 0; i < max_bytes; i++)
+    {
+        if (i == size)
+        {
+            return 0;
+        }
+        const uint8_t byte = static_cast<uint8_t>(data[i]);
+        value |= static_cast<uint32_t>(byte & 0x7f) << (7 * i);
+        if ((byte & 0x80) == 0)
+        {
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+size_t TunnelProtocol::encodeHeader(char* out, uint16_t version,
+                                    uint32_t conn_id,
+                                    size_t length,
+                                    TunnelMessageType type,
+                                    bool compressed)
+{
+    if (version < 2)
+    {
+        TunnelMessageHeader header;
+        createHeader(header, conn_id, length, type, compressed);
+        memcpy(out, &header, HEADER_SIZE);
+        return HEADER_SIZE;
+    }
+
+    uint8_t flags = static_cast<uint8_t>(type) & V2_TYPE;
+    if (conn_id != 0) flags |= V2_CONN_ID;
+    if (compressed)   flags |= V2_COMPRESSED;
+
+    size_t size = 0;
+    out[size++] = static_cast<char>(flags);
+    if (conn_id != 0)
+    {
+        size += putVarint(out + size, conn_id);
+    }
+    size += putVarint(out + size, length);
+    return size;
+}
+
+int TunnelProtocol::decodeHeader(const char* data, size_t size, uint16_t version,
+                                 uint32_t& conn_id,
+                                 size_t& length,
+                                 TunnelMessageType& type,
+                                 bool& compressed)
+{
+    if (version < 2)
+    {
+        if (size < HEADER_SIZE)
+        {
+            return 0;
+        }
+        TunnelMessageHeader header;
+        uint16_t short_length;
+        memcpy(&header, data, HEADER_SIZE);
+        parseHeader(header, conn_id, short_length, type, compressed);
+        length = short_length;
+        return isValidMessageType(static_cast<uint16_t>(type)) ? HEADER_SIZE : -1;
+    }
+
+    if (size < 1)
+    {
+        return 0;
+    }
+    const uint8_t flags = static_cast<uint8_t>(data[0]);
+    type = static_cast<TunnelMessageType>(flags & V2_TYPE);
+    compressed = (flags & V2_COMPRESSED) != 0;
+    if (!isValidMessageType(static_cast<uint16_t>(type)))
+    {
+        return -1;
+    }
+
+    int used = 1;
+    conn_id = 0;
+    if (flags & V2_CONN_ID)
+    {
+        const int retval = getVarint(data + used, size - used, 5, conn_id);
+        if (retval <= 0) return retval;
+        used += retval;
+    }
+
+    uint32_t value;
+    const int retval = getVarint(data + used, size - used, 4, value);
+    if (retval <= 0) return retval;
+    if (value > MAX_FRAME_SIZE)
+    {
+        return -1;
+    }
+    length = value;
+    return used + retval;
+}
+
+void TunnelProtocol::createHello(TunnelHello& hello, uint16_t shard, uint16_t shards,
+                                 uint16_t version, uint32_t capabilities)
+{
+    hello.shard = htons(shard);
+    hello.shards = htons(shards);
+    hello.version = htons(version);
+    hello.reserved = 0;
+    hello.capabilities = htonl(capabilities);
+}
+
+bool TunnelProtocol::parseHello(const char* payload, size_t length,
+                                uint16_t& shard, uint16_t& shards,
+                                uint16_t& version, uint32_t& capabilities)
+{
+    // The first 4 bytes are what the oldest clients send
+    const size_t min_length = offsetof(TunnelHello, version);
+    if (length < min_length)
+    {
+        return false;
+    }
+
+    TunnelHello hello;
+    memset(&hello, 0, sizeof(TunnelHello));
+    memcpy(&hello, payload, std::min(length, sizeof(TunnelHello)));
+    shard = ntohs(hello.shard);
+    shards = ntohs(hello.shards);
+    version = (length >= offsetof(TunnelHello, reserved)) ? ntohs(hello.version) : 1;
+    capabilities = (length >= sizeof(TunnelHello)) ? ntohl(hello.capabilities) : 0;
+    if (version == 0)
+    {
+        version = 1;
+    }
+    return true;
+}
+
+void TunnelProtocol::createTcpOpen(TunnelTcpOpen& open, uint16_t weight)
+{
+    open.weight = htons(weight);
+}
+
+uint16_t TunnelProtocol::parseTcpOpen(const char* payload, size_t length)
+{
+    if (length < sizeof(TunnelTcpOpen))
+    {
+        return 1;
+    }
+
+    TunnelTcpOpen open;
+    memcpy(&open, payload, sizeof(TunnelTcpOpen));
+    const uint16_t weight = ntohs(open.weight);
+    return (weight > 0) ? weight : 1;
+}
+
+void TunnelProtocol::createWindowUpdate(TunnelWindowUpdate& update, uint64_t consumed)
+{
+    update.consumed_hi = htonl(static_cast<uint32_t>(consumed >> 32));
+    update.consumed_lo = htonl(static_cast<uint32_t>(consumed));
+}
+
+bool TunnelProtocol::parseWindowUpdate(const char* payload, size_t length, uint64_t& consumed)
+{
+    if (length < sizeof(TunnelWindowUpdate))
+    {
+        return false;
+    }
+
+    TunnelWindowUpdate update;
+    memcpy(&update, payload, sizeof(TunnelWindowUpdate));
+    consumed = (static_cast<uint64_t>(ntohl(update.consumed_hi)) << 32)
+             | ntohl(update.consumed_lo);
+    return true;
+}
+
+void TunnelProtocol::createResume(TunnelResume& resume, uint64_t received, uint64_t consumed)
+{
+    resume.received_hi = htonl(static_cast<uint32_t>(received >> 32));
+    resume.received_lo = htonl(static_cast<uint32_t>(received));
+    resume.consumed_hi = htonl(static_cast<uint32_t>(consumed >> 32));
+    resume.consumed_lo = htonl(static_cast<uint32_t>(consumed));
+}
+
+bool TunnelProtocol::parseResume(const char* payload, size_t length, uint64_t& received, uint64_t& consumed)
+{
+    if (length < sizeof(TunnelResume))
+    {
+        return false;
+    }
+
+    TunnelResume resume;
+    memcpy(&resume, payload, sizeof(TunnelResume));
+    received = (static_cast<uint64_t>(ntohl(resume.received_hi)) << 32)
+             | ntohl(resume.received_lo);
+    consumed = (static_cast<uint64_t>(ntohl(resume.consumed_hi)) << 32)
+             | ntohl(resume.consumed_lo);
+    return true;
+}
+
+void TunnelProtocol::createUdpSegments(TunnelUdpSegments& segments, uint16_t segment_size)
+{
+    segments.segment_size = htons(segment_size);
+}
+
+bool TunnelProtocol::parseUdpSegments(const char* payload, size_t length, uint16_t& segment_size)
+{
+    if (length < sizeof(TunnelUdpSegments))
+    {
+        return false;
+    }
+
+    TunnelUdpSegments segments;
+    memcpy(&segments, payload, sizeof(TunnelUdpSegments));
+    segment_size = ntohs(segments.segment_size);
+    return segment_size > 0;
+}
+
+void TunnelProtocol::createPing(TunnelPing& ping, uint64_t time_us)
+{
+    ping.time_hi = htonl(static_cast<uint32_t>(time_us >> 32));
+    ping.time_lo = htonl(static_cast<uint32_t>(time_us));
+}
+
+bool TunnelProtocol::parsePing(const char* payload, size_t length, uint64_t& time_us)
+{
+    if (length < sizeof(TunnelPing))
+    {
+        return false;
+    }
+
+    TunnelPing ping;
+    memcpy(&ping, payload, sizeof(TunnelPing));
+    time_us = (static_cast<uint64_t>(ntohl(ping.time_hi)) << 32)
+            | ntohl(ping.time_lo);
+    return true;
+}
+
+void TunnelProtocol::createUdpChannel(TunnelUdpChannel& channel, uint64_t cookie)
+{
+    channel.cookie_hi = htonl(static_cast<uint32_t>(cookie >> 32));
+    channel.cookie_lo = htonl(static_cast<uint32_t>(cookie));
+}
+
+bool TunnelProtocol::parseUdpChannel(const char* payload, size_t length, uint64_t& cookie)
+{
+    if (length < sizeof(TunnelUdpChannel))
+    {
+        return false;
+    }
+
+    TunnelUdpChannel channel;
+    memcpy(&channel, payload, sizeof(TunnelUdpChannel));
+    cookie = (static_cast<uint64_t>(ntohl(channel.cookie_hi)) << 32)
+           | ntohl(channel.cookie_lo);
+    return true;
+}
+
+bool TunnelProtocol::parseDatagram(const char* data, size_t size,
+                                   uint32_t& conn_id,
+                                   uint16_t& length,
+                                   TunnelMessageType& type)
+{
+    if (size < HEADER_SIZE)
+    {
+        return false;
+    }
+
+    TunnelMessageHeader header;
+    memcpy(&header, data, HEADER_SIZE);
+    parseHeader(header, conn_id, length, type);
+
+    return isValidMessageType(static_cast<uint16_t>(type)) &&
+           HEADER_SIZE + length == size;
+}
+
 bool TunnelProtocol::isValidMessageType(uint16_t type)
 {
     return (type >= static_cast<uint16_t>(TunnelMessageType::UDP_PACKET) &&
-            type <= static_cast<uint16_t>(TunnelMessageType::TCP_CLOSE));
+            type <= static_cast<uint16_t>(TunnelMessageType::PONG));
 }
 
 const char* TunnelProtocol::messageTypeToString(TunnelMessageType type)
@@ -38,6 +342,13 @@ const char* TunnelProtocol::messageTypeToString(TunnelMessageType type)
         case TunnelMessageType::TCP_OPEN:   return "TCP_OPEN";
         case TunnelMessageType::TCP_DATA:   return "TCP_DATA";
         case TunnelMessageType::TCP_CLOSE:  return "TCP_CLOSE";
+        case TunnelMessageType::HELLO:      return "HELLO";
+        case TunnelMessageType::WINDOW_UPDATE: return "WINDOW_UPDATE";
+        case TunnelMessageType::UDP_SEGMENTS:  return "UDP_SEGMENTS";
+        case TunnelMessageType::UDP_CHANNEL:   return "UDP_CHANNEL";
+        case TunnelMessageType::RESUME:        return "RESUME";
+        case TunnelMessageType::PING:          return "PING";
+        case TunnelMessageType::PONG:          return "PONG";
         default:                            return "UNKNOWN";
     }
 }
@@ -6,10 +6,17 @@
 // Tunnel protocol message types
 enum class TunnelMessageType : uint16_t
 {
-    UDP_PACKET = 1,      // UDP packet data (conn_id = 0 for now)
-    TCP_OPEN = 2,        // New TCP connection established
+    UDP_PACKET = 1,      // UDP packet data, conn_id is the UDP flow (see CAP_UDP_FLOWS)
+    TCP_OPEN = 2,        // New TCP connection established (see TunnelTcpOpen)
     TCP_DATA = 3,        // TCP stream data
-    TCP_CLOSE = 4        // TCP connection closed
+    TCP_CLOSE = 4,       // TCP connection closed
+    HELLO = 5,           // First message on a tunnel connection (see TunnelHello)
+    WINDOW_UPDATE = 6,   // Flow control credit for one TCP connection (see TunnelWindowUpdate)
+    UDP_SEGMENTS = 7,    // Run of equally sized UDP packets (see TunnelUdpSegments)
+    UDP_CHANNEL = 8,     // Registration of the UDP side channel (see TunnelUdpChannel)
+    RESUME = 9,          // Position of a TCP connection after a reconnect (see TunnelResume)
+    PING = 10,           // Heartbeat request (see TunnelPing)
+    PONG = 11            // Heartbeat answer, returns the PING's payload
 };
 
 /* Tunnel message header (8 bytes total)
@@ -20,16 +27,161 @@ enum class TunnelMessageType : uint16_t
  * | conn_id (4 bytes)| length (2 bytes) | type (2 bytes)  |
  * +------------------+------------------+------------------+
  * 
- * For UDP_PACKET messages: conn_id is currently unused (set to 0)
+ * For UDP_PACKET messages: conn_id identifies the UDP flow, i.e. the outside
+ * sender, if TunnelClient's HELLO has CAP_UDP_FLOWS. It is 0 otherwise.
  * For TCP messages: conn_id identifies which TCP connection
+ *
+ * The highest bit of type is the COMPRESSED flag. A UDP_PACKET or TCP_DATA
+ * message with it set carries a payload made by Compression::compress().
+ *
+ * This is framing version 1. Every tunnel connection starts with it, and
+ * the UDP side channel and the reliable-UDP transport always use it. Peers
+ * that both speak version 2 switch to it with the HELLO handshake, see
+ * TunnelHello. A version 2 header is 2 to 10 bytes long:
+ *
+ * +---------+--------------------------+----------------------+
+ * | flags 1 | conn_id varint 0-5 bytes | length varint 1-4    |
+ * +---------+--------------------------+----------------------+
+ *
+ * Bits 0-5 of flags are the type, bit 6 (CONN_ID) tells whether conn_id
+ * follows, it is 0 otherwise, and bit 7 is the COMPRESSED flag. The varints
+ * are LEB128: 7 bits per byte, least significant group first, the highest
+ * bit set on all bytes but the last. A version 2 payload may be up to
+ * MAX_FRAME_SIZE bytes long. A UDP packet of less than 128 bytes costs 2
+ * bytes of header instead of 8.
  */
 struct TunnelMessageHeader
 {
-    uint32_t  conn_id;    // Connection ID (for TCP multiplexing), 0 for UDP
+    uint32_t  conn_id;    // Connection ID (for TCP multiplexing), or UDP flow
     uint16_t  length;     // Payload length in bytes (max 65535)
     uint16_t  type;       // Message type (TunnelMessageType)
 };
 
+/* Payload of a HELLO message (12 bytes, network endian).
+ * TunnelClient may open several tunnel connections in parallel. It sends a
+ * HELLO as the first message on each of them so that TunnelServer can hand
+ * the connection to the right shard. The conn_id of a HELLO is unused (0).
+ * Receivers accept longer payloads, so fields can be appended later.
+ *
+ * Older clients send only the first 4 bytes, which means version 1 and no
+ * capabilities. If the client offers version 2 or later, TunnelServer
+ * answers with a HELLO of its own, the last version 1 message it sends,
+ * with the version both speak and the capabilities it has. TunnelClient
+ * then sends a second HELLO, its last version 1 message, and both use the
+ * agreed framing from there on. Everything queued before a switch is sent
+ * before it. Without the answer, the tunnel stays at version 1.
+ * A reply has shards 0.
+ */
+struct TunnelHello
+{
+    uint16_t  shard;         // Index of this tunnel connection, 0..shards-1
+    uint16_t  shards;        // Number of parallel tunnel connections
+    uint16_t  version;       // Highest framing version that the sender speaks
+    uint16_t  reserved;      // 0
+    uint32_t  capabilities;  // TunnelProtocol::CAP_* bits of the sender
+};
+
+/* Payload of a TCP_OPEN message (2 bytes, network endian).
+ * Both sides read the connection's socket in deficit round-robin order
+ * with the other connections of the tunnel, see TCPConnectionManager. The
+ * weight is the connection's share, which TunnelServer picks when it
+ * accepts the connection. An empty payload means weight 1. Receivers
+ * accept longer payloads, so fields can be appended later.
+ */
+struct TunnelTcpOpen
+{
+    uint16_t  weight;
+};
+
+/* Payload of a WINDOW_UPDATE message (8 bytes, network endian).
+ * Every TCP connection has a send window of STREAM_WINDOW bytes in each
+ * direction. A sender may have at most that many TCP_DATA payload bytes of
+ * a connection outstanding, and stops reading the connection's socket when
+ * the window is exhausted. The receiver reports how many payload bytes of
+ * the connection it has written to the connection's socket, counted from
+ * the start of the current tunnel connection, in consumed.
+ * Since the count is absolute, a lost or merged update does no harm.
+ */
+struct TunnelWindowUpdate
+{
+    uint32_t  consumed_hi;  // Upper 32 bits of the consumed byte count
+    uint32_t  consumed_lo;  // Lower 32 bits of the consumed byte count
+};
+
+/* Header of a UDP_SEGMENTS payload (2 bytes, network endian).
+ * It is followed by a run of UDP packets from the same sender that are all
+ * segment_size bytes long, except for the last one, which may be shorter.
+ * TunnelServer receives such runs as one buffer with UDP_GRO, and
+ * TunnelClient sends them with one UDP_SEGMENT (GSO) send. The conn_id is
+ * used like the one of UDP_PACKET.
+ */
+struct TunnelUdpSegments
+{
+    uint16_t  segment_size;
+};
+
+/* Payload of a UDP_CHANNEL message (8 bytes, network endian).
+ * UDP packets can bypass the TCP tunnel on a UDP side channel, so that a
+ * lost TCP segment does not hold back the packets behind it. TunnelClient
+ * picks a random cookie for every tunnel connection of shard 0 and sends
+ * it in a UDP_CHANNEL message through the tunnel and in UDP_CHANNEL
+ * datagrams to the tunnel port of TunnelServer, until TunnelServer echoes
+ * one back from there. The address that the matching datagram came from
+ * is the client's end of the channel. TunnelClient repeats the datagram as
+ * a keepalive for NATs and firewalls.
+ * Every datagram on the channel is one tunnel message, header included.
+ * Only UDP_PACKET and UDP_CHANNEL messages travel this way, all TCP
+ * messages stay in the tunnel. The conn_id of UDP_CHANNEL is unused (0), a
+ * UDP_PACKET carries its flow as in the tunnel.
+ */
+struct TunnelUdpChannel
+{
+    uint32_t  cookie_hi;
+    uint32_t  cookie_lo;
+};
+
+/* Payload of a RESUME message (16 bytes, network endian).
+ * TCP connections survive the loss of a tunnel connection. If both HELLOs
+ * have CAP_RESUME, no TCP_DATA is lost with it either: the byte counts of
+ * a connection, including the ones in WINDOW_UPDATE, run from the opening
+ * of the connection instead of the start of the tunnel connection, and the
+ * sender keeps the payload bytes until the peer reports them consumed.
+ * On a new tunnel connection, each side sends a RESUME for every TCP
+ * connection that it has, TunnelServer right after its HELLO answer and
+ * TunnelClient right after receiving it. received is the number of
+ * payload bytes of the connection that the sender has received, consumed
+ * the number that it has written to the connection's socket. The receiver
+ * of the RESUME sends the bytes from received on again, repeats the
+ * TCP_CLOSE if it had sent one, and only then continues with new data of
+ * the connection. A RESUME for an unknown conn_id is answered with
+ * TCP_CLOSE.
+ * A side that read the end of a connection's stream keeps the connection
+ * after its TCP_CLOSE until the peer has consumed all data. A side that
+ * closes a connection because of the peer's TCP_CLOSE sends a final
+ * WINDOW_UPDATE for it.
+ */
+struct TunnelResume
+{
+    uint32_t  received_hi;
+    uint32_t  received_lo;
+    uint32_t  consumed_hi;
+    uint32_t  consumed_lo;
+};
+
+/* Payload of a PING and a PONG message (8 bytes, network endian).
+ * If the other side's HELLO has CAP_HEARTBEAT, a side sends a PING with a
+ * timestamp of its own clock in microseconds every heartbeat interval.
+ * The other side answers right away with a PONG that carries the same
+ * payload, which gives the sender the round-trip time. A side that has
+ * not received anything on the tunnel connection for a number of
+ * intervals considers it dead and closes it. The conn_id is unused (0).
+ */
+struct TunnelPing
+{
+    uint32_t  time_hi;
+    uint32_t  time_lo;
+};
+
 // Helper functions for working with the tunnel protocol
 namespace TunnelProtocol
 {
@@ -37,14 +189,99 @@ namespace TunnelProtocol
     void createHeader(TunnelMessageHeader& header, 
                      uint32_t conn_id,
                      uint16_t length, 
-                     TunnelMessageType type);
+                     TunnelMessageType type,
+                     bool compressed = false);
     
-    // Parse a message header (converts from network byte order)
+    // Parse a message header (converts from network byte order). The
+    // COMPRESSED flag stays in type, which makes it invalid.
     void parseHeader(const TunnelMessageHeader& header,
                     uint32_t& conn_id,
                     uint16_t& length,
                     TunnelMessageType& type);
+
+    // Same, but the COMPRESSED flag is removed from type into compressed
+    void parseHeader(const TunnelMessageHeader& header,
+                    uint32_t& conn_id,
+                    uint16_t& length,
+                    TunnelMessageType& type,
+                    bool& compressed);
     
+    /* Encode a header with the given framing version into out, which must
+     * have room for MAX_HEADER_SIZE bytes. Returns the size of the header.
+     * The length must fit the version, see maxPayload().
+     */
+    size_t encodeHeader(char* out, uint16_t version,
+                        uint32_t conn_id,
+                        size_t length,
+                        TunnelMessageType type,
+                        bool compressed = false);
+
+    /* Decode a header with the given framing version from the first size
+     * bytes of data. Returns the size of the header, 0 if it is incomplete,
+     * or -1 if it is invalid. The COMPRESSED flag is removed from type.
+     */
+    int decodeHeader(const char* data, size_t size, uint16_t version,
+                     uint32_t& conn_id,
+                     size_t& length,
+                     TunnelMessageType& type,
+                     bool& compressed);
+
+    // Create a HELLO payload (converts to network byte order)
+    void createHello(TunnelHello& hello, uint16_t shard, uint16_t shards,
+                     uint16_t version, uint32_t capabilities);
+
+    // Parse a HELLO payload. Returns false if it is too short. The version
+    // of an old peer is 1, and its capabilities are 0.
+    bool parseHello(const char* payload, size_t length,
+                    uint16_t& shard, uint16_t& shards,
+                    uint16_t& version, uint32_t& capabilities);
+
+    // Create a TCP_OPEN payload (converts to network byte order)
+    void createTcpOpen(TunnelTcpOpen& open, uint16_t weight);
+
+    // Parse a TCP_OPEN payload. An empty or too short one means weight 1,
+    // and so does 0.
+    uint16_t parseTcpOpen(const char* payload, size_t length);
+
+    // Create a WINDOW_UPDATE payload (converts to network byte order)
+    void createWindowUpdate(TunnelWindowUpdate& update, uint64_t consumed);
+
+    // Parse a WINDOW_UPDATE payload. Returns false if it is too short.
+    bool parseWindowUpdate(const char* payload, size_t length, uint64_t& consumed);
+
+    // Create a RESUME payload (converts to network byte order)
+    void createResume(TunnelResume& resume, uint64_t received, uint64_t consumed);
+
+    // Parse a RESUME payload. Returns false if it is too short.
+    bool parseResume(const char* payload, size_t length, uint64_t& received, uint64_t& consumed);
+
+    // Create a UDP_SEGMENTS header (converts to network byte order)
+    void createUdpSegments(TunnelUdpSegments& segments, uint16_t segment_size);
+
+    // Parse a UDP_SEGMENTS header. Returns false if it is too short or the
+    // segment size is 0.
+    bool parseUdpSegments(const char* payload, size_t length, uint16_t& segment_size);
+
+    // Create a PING payload (converts to network byte order)
+    void createPing(TunnelPing& ping, uint64_t time_us);
+
+    // Parse a PING or PONG payload. Returns false if it is too short.
+    bool parsePing(const char* payload, size_t length, uint64_t& time_us);
+
+    // Create a UDP_CHANNEL payload (converts to network byte order)
+    void createUdpChannel(TunnelUdpChannel& channel, uint64_t cookie);
+
+    // Parse a UDP_CHANNEL payload. Returns false if it is too short.
+    bool parseUdpChannel(const char* payload, size_t length, uint64_t& cookie);
+
+    /* Parse a datagram of the UDP side channel. Returns false unless it
+     * holds exactly one message of a valid type.
+     */
+    bool parseDatagram(const char* data, size_t size,
+                       uint32_t& conn_id,
+                       uint16_t& length,
+                       TunnelMessageType& type);
+
     // Check if a message type value is valid
     bool isValidMessageType(uint16_t type);
     
@@ -54,4 +291,28 @@ namespace TunnelProtocol
     // Constants
     static constexpr size_t HEADER_SIZE = sizeof(TunnelMessageHeader);
     static constexpr uint16_t MAX_PAYLOAD_SIZE = 65535;  // Max UDP packet size
+    static constexpr uint32_t STREAM_WINDOW = 1024 * 1024;  // Per connection and direction
+    static constexpr size_t MAX_DATAGRAM_SIZE = 65507;      // Largest UDP payload over IPv4
+    static constexpr uint16_t COMPRESSED = 0x8000;          // Flag in the type field
+
+    // Framing version 2
+    static constexpr uint16_t VERSION = 2;                  // Highest version we speak
+    static constexpr size_t MAX_HEADER_SIZE = 10;
+    static constexpr size_t MAX_FRAME_SIZE = 256 * 1024;    // Max payload of a version 2 message
+    static constexpr uint8_t V2_TYPE = 0x3f;                // Bits of the flags byte
+    static constexpr uint8_t V2_CONN_ID = 0x40;
+    static constexpr uint8_t V2_COMPRESSED = 0x80;
+
+    // Capabilities in a HELLO
+    static constexpr uint32_t CAP_LZ4 = 1 << 0;             // Decompresses LZ4 payloads
+    static constexpr uint32_t CAP_DEFLATE = 1 << 1;         // Decompresses deflate payloads
+    static constexpr uint32_t CAP_RESUME = 1 << 2;          // Resumes TCP connections losslessly
+    static constexpr uint32_t CAP_HEARTBEAT = 1 << 3;       // Answers PING with PONG
+    static constexpr uint32_t CAP_UDP_FLOWS = 1 << 4;       // Forwards each UDP flow from its own socket
+
+    // Largest payload of one message with the given framing version
+    inline size_t maxPayload(uint16_t version)
+    {
+        return (version >= 2) ? MAX_FRAME_SIZE : MAX_PAYLOAD_SIZE;
+    }
 };
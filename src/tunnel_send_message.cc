@@ -1,41 +1,35 @@
 #include "tunnel_send_message.h"
 
-bool sendTunnelMessage( const std::unique_ptr<TCPSocket>& tunnel, 
+bool sendTunnelMessage( TunnelWriter& writer,
                         uint32_t conn_id,
                         TunnelMessageType type,
                         const char* payload,
-                        uint16_t payload_len )
+                        size_t payload_len,
+                        TunnelWriter::Priority priority,
+                        bool compressed )
 {
     // Validate payload length
-    if (payload_len > TunnelProtocol::MAX_PAYLOAD_SIZE)
+    if (payload_len > writer.maxPayload())
     {
         LOG_ERROR << "Payload too large: " << payload_len << std::endl;
         return false;
     }
     
-    // Create header
-    TunnelMessageHeader header;
-    TunnelProtocol::createHeader(header, conn_id, payload_len, type);
-    
-    // Send header
-    int sent = tunnel->send(&header, TunnelProtocol::HEADER_SIZE);
-    if (sent != TunnelProtocol::HEADER_SIZE)
-    {
-        LOG_ERROR << "Failed to send message header" << std::endl;
-        return false;
-    }
-    
-    // Send payload (if any)
-    if (payload_len > 0)
+    // Header and payload go out together with the other queued messages,
+    // the writer encodes the header in the tunnel's framing
+    writer.append(conn_id, type, payload, payload_len, priority, compressed);
+    return true;
+}
+
+TunnelWriter::Priority messagePriority( TunnelMessageType type )
+{
+    switch (type)
     {
-        sent = tunnel->send(payload, payload_len);
-        if (sent != payload_len)
-        {
-            LOG_ERROR << "Failed to send message payload" << std::endl;
-            return false;
-        }
+        case TunnelMessageType::TCP_DATA:
+        case TunnelMessageType::TCP_CLOSE:
+            return TunnelWriter::Priority::Bulk;
+        default:
+            return TunnelWriter::Priority::Control;
     }
-    
-    return true;
 }
 
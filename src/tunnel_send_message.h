@@ -5,12 +5,26 @@
 #include <unistd.h>
 
 #include "tunnel_protocol.h"
-#include "tcp.h"
+#include "tunnel_writer.h"
 #include "verbose.h"
 
-bool sendTunnelMessage( const std::unique_ptr<TCPSocket>& tunnel, 
+/* Queue one message in the tunnel's writer with the given priority. It is
+ * written to the socket by the writer's next flush(). Returns false if the
+ * payload is too large. Set compressed if the payload was made by
+ * Compression::compress().
+ */
+bool sendTunnelMessage( TunnelWriter& writer,
                         uint32_t conn_id,
                         TunnelMessageType type,
                         const char* payload,
-                        uint16_t payload_len );
+                        size_t payload_len,
+                        TunnelWriter::Priority priority,
+                        bool compressed = false );
+
+/* The priority of a message that does not depend on its connection.
+ * TCP_DATA and TCP_CLOSE are Bulk: a TCP_CLOSE must not overtake any data
+ * of its conn_id, so it goes last. The caller may raise TCP_DATA to
+ * Interactive, which only moves it ahead of the Bulk messages.
+ */
+TunnelWriter::Priority messagePriority( TunnelMessageType type );
 
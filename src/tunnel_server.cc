@@ -3,6 +3,7 @@
 #include <vector>
 #include <memory>
 #include <algorithm>
+#include <thread>
 
 #include <argp.h>
 
@@ -10,9 +11,13 @@
 
 #include "tunnel_server_argp.h"
 #include "tunnel_server_dispatch.h"
+#include "tunnel_server_acceptor.h"
 #include "sockaddr.h"
 #include "udp.h"
 #include "tcp.h"
+#include "tls.h"
+#include "rudp.h"
+#include "buffer_pool.h"
 #include "verbose.h"
 
 int main( int argc, char* argv[] )
@@ -20,12 +25,25 @@ int main( int argc, char* argv[] )
     arguments args;
 
     callArgParse( argc, argv, args );
+    SlabMemory::useHugePages( args.huge_pages );
 
     std::cout << "= =======================" << std::endl;
     std::cout << "= ==== TunnelServer =====" << std::endl;
     std::cout << "= =======================" << std::endl;
     std::cout << "= Start this program first" << std::endl;
-    std::cout << "= Press Q<ret> to quit" << std::endl;
+    std::cout << "= Press Q<ret> to quit, S<ret> for statistics" << std::endl;
+
+    std::unique_ptr<TLSContext> tls;
+    if( !args.tls_cert.empty() )
+    {
+        tls = TLSContext::createServer( args.tls_cert, args.tls_key );
+        if( !tls )
+        {
+            LOG_ERROR << "Cannot set up TLS for the tunnel (quitting)" << std::endl;
+            return -1;
+        }
+        std::cout << "= Tunnel connections are encrypted with TLS 1.3" << std::endl;
+    }
 
     TCPSocket tunnel_listener( args.tunnel_tcp );
     if( tunnel_listener.valid() == false )
@@ -66,9 +84,70 @@ int main( int argc, char* argv[] )
     // std::shared_ptr<TCPSocket> tunnel;
     // std::shared_ptr<TCPSocket> webSock;
 
-    // dispatch_loop( tunnel_listener, outside_udp, outside_tcp_listener, tunnel, webSock );
-    dispatch_loop( tunnel_listener, outside_udp, outside_tcp_listener );
-    
+    // Optional UDP side channel for UDP packets, on the tunnel's port number
+    UDPSocket udp_channel;
+    if( args.datagrams )
+    {
+        if( !udp_channel.createServer( args.tunnel_tcp ) )
+        {
+            LOG_ERROR << "Failed to bind the UDP side channel to port " << args.tunnel_tcp << " (quitting)" << std::endl;
+            return -1;
+        }
+        std::cout << "= Accepting a UDP side channel on port " << args.tunnel_tcp
+                  << ", socket " << udp_channel.socket() << std::endl;
+    }
+
+    /* One shard per tunnel connection, shard 0 handles the outside UDP socket.
+     * With --realtime, shard 0 is an extra one that handles nothing else.
+     */
+    const int shard_count = args.tunnels + ( args.realtime ? 1 : 0 );
+    std::vector<std::unique_ptr<TunnelServerDispatch>> shards;
+    for( int i=0; i<shard_count; i++ )
+    {
+        shards.emplace_back( new TunnelServerDispatch( i, ( i == 0 ) ? &outside_udp : nullptr,
+                                                       ( i == 0 && args.datagrams ) ? &udp_channel : nullptr,
+                                                       args.zerocopy, size_t( args.interactive_kb ) * 1024,
+                                                       args.compress, !args.no_resume,
+                                                       args.heartbeat_ms, args.heartbeat_misses, args.udp_timeout,
+                                                       args.weights, args.backend ) );
+    }
+    if( shard_count > 1 )
+    {
+        std::cout << "= Expecting " << shard_count << " parallel tunnel connections" << std::endl;
+    }
+    if( args.realtime )
+    {
+        std::cout << "= Tunnel connection 0 is reserved for UDP packets" << std::endl;
+    }
+
+    std::vector<std::thread> threads;
+    for( auto& shard : shards )
+    {
+        threads.emplace_back( [&shard]() { shard->run(); } );
+    }
+
+    TunnelServerAcceptor acceptor( tunnel_listener, outside_tcp_listener, shards, tls.get(),
+                                   args.realtime, args.backend );
+
+    // Optional reliable-UDP transport for tunnel connections, on the tunnel's port number
+    RudpEndpoint rudp( args.backend );
+    if( args.rudp )
+    {
+        if( !rudp.listen( args.tunnel_tcp, [&acceptor]( std::unique_ptr<TCPSocket> tunnel )
+                          { acceptor.adoptTunnelSocket( std::move( tunnel ) ); } ) )
+        {
+            LOG_ERROR << "Failed to bind the reliable-UDP transport to port " << args.tunnel_tcp << " (quitting)" << std::endl;
+            for( auto& shard : shards ) shard->stop();
+            for( auto& t : threads ) t.join();
+            return -1;
+        }
+        std::cout << "= Waiting for reliable-UDP tunnel connections on port " << args.tunnel_tcp << std::endl;
+    }
+
+    acceptor.run( );
+
+    for( auto& t : threads ) t.join();
+
     std::cout << "= TunnelServer shutting down" << std::endl;
     return 0;
 }
@@ -0,0 +1,231 @@
+#include <iostream>
+
+#include <string.h>
+#include <errno.h>
+
+#include <algorithm>
+
+#include "tunnel_server_acceptor.h"
+#include "tunnel_protocol.h"
+#include "verbose.h"
+
+TunnelServerAcceptor::TunnelServerAcceptor( TCPSocket& tunnel_listener,
+                                            TCPSocket& outside_tcp_listener,
+                                            std::vector<std::unique_ptr<TunnelServerDispatch>>& shards,
+                                            TLSContext* tls,
+                                            bool realtime,
+                                            EventLoop::Backend backend )
+    : _tunnel_listener( tunnel_listener )
+    , _outside_tcp_listener( outside_tcp_listener )
+    , _shards( shards )
+    , _tls( tls )
+    , _realtime( realtime && shards.size() > 1 )
+    , _loop( backend )
+{
+    if( !_loop.add( 0, IoEvent::Readable, [this](uint32_t) { onStdin(); } ) )
+    {
+        LOG_WARN << "Cannot watch stdin, Q<ret> will not work" << std::endl;
+    }
+    _loop.add( _tunnel_listener.socket(), IoEvent::Readable,
+               [this](uint32_t) { onTunnelListener(); } );
+    _loop.add( _outside_tcp_listener.socket(), IoEvent::Readable,
+               [this](uint32_t) { onOutsideTcpListener(); } );
+}
+
+void TunnelServerAcceptor::run( )
+{
+    _loop.run();
+
+    for( auto& shard : _shards ) shard->stop();
+}
+
+void TunnelServerAcceptor::onStdin( )
+{
+    int c = getchar( );
+    if( c == 'q' || c == 'Q' )
+    {
+        std::cout << "= Q pressed by user. Quitting." << std::endl
+                  << "= Note: TCP tunnel port will be unavailable for up to a minute" << std::endl
+                  << "=       if TunnelClient was currently connected." << std::endl;
+        _loop.stop();
+    }
+    else if( c == 's' || c == 'S' )
+    {
+        for( auto& shard : _shards ) shard->printStats( std::cout );
+    }
+    else if( c == EOF )
+    {
+        // stdin is closed or redirected, stop watching it instead of spinning
+        _loop.remove( 0 );
+    }
+}
+
+void TunnelServerAcceptor::onTunnelListener( )
+{
+    /* Create a new TCP socket from the connect request. */
+    std::unique_ptr<TCPSocket> tcp_conn( new TCPSocket( _tunnel_listener, true ) );
+    if( !tcp_conn->valid() )
+    {
+        LOG_WARN << "Activity on tunnel listener socket, but accept failed" << std::endl;
+        return;
+    }
+
+    const int fd = tcp_conn->socket();
+    LOG_INFO << "Tunnel connection on socket " << fd << ", waiting for its HELLO" << std::endl;
+
+    // The handshake must not block the acceptor, it runs in onPendingTunnel()
+    if( _tls )
+    {
+        tcp_conn->setNoBlock();
+        if( !tcp_conn->startTLS( *_tls, true ) ) return;
+    }
+
+    addPendingTunnel( std::move( tcp_conn ), true );
+}
+
+void TunnelServerAcceptor::adoptTunnelSocket( std::unique_ptr<TCPSocket> tunnel )
+{
+    TCPSocket* t = tunnel.release();
+    _loop.post( [this,t]()
+    {
+        LOG_INFO << "Reliable-UDP tunnel connection on socket " << t->socket() << ", waiting for its HELLO" << std::endl;
+        addPendingTunnel( std::unique_ptr<TCPSocket>( t ), false );
+    } );
+}
+
+void TunnelServerAcceptor::addPendingTunnel( std::unique_ptr<TCPSocket> tunnel, bool tcp )
+{
+    const int fd = tunnel->socket();
+
+    PendingTunnel& pending = _pending_tunnels[fd];
+    pending.socket = std::move( tunnel );
+    pending.reconstructor.reset( new TunnelMessageReconstructor );
+    pending.tcp = tcp;
+    _loop.add( fd, IoEvent::Readable, [this,fd](uint32_t) { onPendingTunnel(fd); } );
+}
+
+void TunnelServerAcceptor::onPendingTunnel( int fd )
+{
+    auto it = _pending_tunnels.find( fd );
+    if( it == _pending_tunnels.end() ) return;
+
+    PendingTunnel& pending = it->second;
+
+    int retval = pending.reconstructor->readFrom( *pending.socket );
+    if( retval < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+    {
+        // Part of the TLS handshake
+        return;
+    }
+    if( retval <= 0 )
+    {
+        LOG_WARN << "Tunnel connection on socket " << fd << " closed before its HELLO" << std::endl;
+        _loop.remove( fd );
+        _pending_tunnels.erase( it );
+        return;
+    }
+
+    TunnelMessage first;
+    if( !pending.reconstructor->peekMessage( first ) )
+    {
+        if( pending.reconstructor->failed() )
+        {
+            LOG_ERROR << "Invalid first message on tunnel socket " << fd << " (closing)" << std::endl;
+            _loop.remove( fd );
+            _pending_tunnels.erase( it );
+        }
+        return;
+    }
+
+    uint16_t shard   = 0;
+    uint16_t shards  = 1;
+    uint16_t version = 1;
+    uint32_t caps    = 0;
+
+    if( first.type == TunnelMessageType::HELLO )
+    {
+        if( !TunnelProtocol::parseHello( first.payload.data(), first.payload.size(),
+                                         shard, shards, version, caps ) )
+        {
+            LOG_ERROR << "Malformed HELLO on tunnel socket " << fd << " (closing)" << std::endl;
+            _loop.remove( fd );
+            _pending_tunnels.erase( it );
+            return;
+        }
+        pending.reconstructor->popMessage();
+    }
+    else
+    {
+        LOG_WARN << "Tunnel connection on socket " << fd
+                 << " did not start with HELLO, assigning it to shard 0" << std::endl;
+    }
+
+    if( shards != _shards.size() )
+    {
+        LOG_WARN << "TunnelClient opens " << shards << " tunnel connections, but TunnelServer runs "
+                 << _shards.size() << " shards (see --tunnels)" << std::endl;
+    }
+
+    if( shard >= _shards.size() )
+    {
+        LOG_ERROR << "HELLO for shard " << shard << " but only " << _shards.size()
+                  << " shards exist (closing)" << std::endl;
+        _loop.remove( fd );
+        _pending_tunnels.erase( it );
+        return;
+    }
+
+    /* The reliable-UDP transport cuts the stream into messages itself and
+     * only knows framing version 1.
+     */
+    version = std::min( version, TunnelProtocol::VERSION );
+    const uint16_t framing = pending.tcp ? version : 1;
+
+    LOG_INFO << "Tunnel socket " << fd << " belongs to shard " << shard
+             << ", framing version " << framing << std::endl;
+
+    if( _realtime && shard == 0 && pending.tcp )
+    {
+        // UDP packets must not wait behind a full send buffer
+        pending.socket->setRealTime();
+    }
+
+    _loop.remove( fd );
+    _shards[shard]->adoptTunnel( std::move(pending.socket), std::move(pending.reconstructor),
+                                 version, framing, caps );
+    _pending_tunnels.erase( it );
+}
+
+void TunnelServerAcceptor::onOutsideTcpListener( )
+{
+    // New TCP connection from outside
+    std::unique_ptr<TCPSocket> tcp_conn( new TCPSocket( _outside_tcp_listener, true ) );
+    if( !tcp_conn->valid() ) return;
+
+    // Set non-blocking to avoid delaying UDP
+    tcp_conn->setNoBlock();
+
+    /* The conn_id decides the shard, so all data of one connection stays in
+     * one tunnel and remains ordered. Shards without a tunnel are skipped,
+     * and so is the real-time shard.
+     */
+    const uint32_t conn_id = _next_conn_id++;
+    const size_t   skip    = _realtime ? 1 : 0;
+    const size_t   count   = _shards.size() - skip;
+    const size_t   first   = conn_id % count;
+
+    for( size_t i=0; i<count; i++ )
+    {
+        auto& shard = _shards[ skip + (first + i) % count ];
+        if( shard->hasTunnel() )
+        {
+            LOG_INFO << "Outside TCP connection accepted on socket "
+                     << tcp_conn->socket() << ", assigned conn_id=" << conn_id << std::endl;
+            shard->adoptConnection( conn_id, std::move(tcp_conn) );
+            return;
+        }
+    }
+
+    LOG_WARN << "Outside TCP connection received but tunnel not established. Rejecting." << std::endl;
+    // tcp_conn will be automatically closed when unique_ptr goes out of scope
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "tcp.h"
+#include "tls.h"
+#include "event_loop.h"
+#include "tunnel_message_reconstructor.h"
+#include "tunnel_server_dispatch.h"
+
+/* The main thread of TunnelServer. It accepts tunnel connections from
+ * TunnelClient and connections from the outside, and distributes them to
+ * the shards. The data path never passes through this thread.
+ */
+class TunnelServerAcceptor
+{
+    TCPSocket& _tunnel_listener;
+    TCPSocket& _outside_tcp_listener;
+
+    std::vector<std::unique_ptr<TunnelServerDispatch>>& _shards;
+
+    // Tunnel connections speak TLS if set
+    TLSContext* _tls;
+
+    /* Shard 0 is reserved for UDP on a tunnel connection with a short send
+     * queue, no TCP connections are assigned to it (see --realtime)
+     */
+    bool _realtime;
+
+    EventLoop _loop;
+
+    // conn_ids are unique across all shards
+    uint32_t _next_conn_id { 1 };
+
+    /* A tunnel connection is pending until its HELLO has arrived and
+     * tells which shard it belongs to. The TLS handshake happens before.
+     */
+    struct PendingTunnel
+    {
+        std::unique_ptr<TCPSocket>                  socket;
+        std::unique_ptr<TunnelMessageReconstructor> reconstructor;
+        bool                                        tcp { true };  // false for reliable UDP
+    };
+    std::map<int, PendingTunnel> _pending_tunnels;  // socket fd -> pending tunnel
+
+public:
+    TunnelServerAcceptor( TCPSocket& tunnel_listener,
+                          TCPSocket& outside_tcp_listener,
+                          std::vector<std::unique_ptr<TunnelServerDispatch>>& shards,
+                          TLSContext* tls,
+                          bool realtime,
+                          EventLoop::Backend backend );
+
+    // Run until the user presses Q. S prints the counters of all shards.
+    void run( );
+
+    /* Treat tunnel as a new tunnel connection that waits for its HELLO,
+     * e.g. one that RudpEndpoint accepted. May be called from any thread.
+     */
+    void adoptTunnelSocket( std::unique_ptr<TCPSocket> tunnel );
+
+private:
+    void onStdin( );
+    void onTunnelListener( );
+    void addPendingTunnel( std::unique_ptr<TCPSocket> tunnel, bool tcp );
+    void onPendingTunnel( int fd );
+    void onOutsideTcpListener( );
+};
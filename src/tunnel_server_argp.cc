@@ -5,6 +5,7 @@
 #include <sys/types.h>
 #include <stdint.h>
 #include "tunnel_server_argp.h"
+#include "compression.h"
 #include "verbose.h"
 
 const char *argp_program_version = "TunnelServer 0.1";
@@ -17,6 +18,22 @@ static struct argp_option options[] = {
     { "<tunnel-port>",  1, "int", OPTION_DOC, "TCP listening port of this tunnel."},
     { "udp",          'u', "int", 0, "(mandatory) The UDP port to which TunnelServer will listen for packets from the outside."},
     { "tcp",          't', "int", 0, "(mandatory) The TCP port to which TunnelServer will listen for connection from the outside."},
+    { "tunnels",      'n', "int",    0, "Number of parallel tunnel connections that TunnelClient opens. Each is served by its own thread (default 1)."},
+    { "backend",      'b', "string", 0, "Event loop backend: epoll (default on Linux) or poll."},
+    { "huge-pages",   'H', 0,     0, "Allocate the tunnel message buffers from huge pages."},
+    { "zerocopy",     'z', 0,     0, "Send large batches of tunnel messages with MSG_ZEROCOPY (Linux)."},
+    { "compress",     'Z', 0,     0, "Compress TCP data and UDP packets for the tunnel where that saves bandwidth."},
+    { "no-resume",    'N', 0,     0, "Do not keep a copy of the TCP data in flight to send it again after a tunnel reconnect. Data in flight is lost then, but bulk data may be spliced."},
+    { "datagrams",    'd', 0,     0, "Accept a UDP side channel from TunnelClient on the UDP port with the tunnel's number, and carry UDP packets on it instead of the tunnel."},
+    { "interactive",  'I', "KB",  0, "TCP data of a connection goes ahead of bulk transfers in the tunnel's send queue until the connection has sent this many KB (default 64, 0 for never)."},
+    { "weight",       'W', "addr=n", 0, "Give outside TCP connections from this IP address n times the share of the tunnel of the others (default 1). May be repeated."},
+    { "realtime",     'R', 0,     0, "Expect an extra tunnel connection from TunnelClient that only carries UDP packets, with a short send queue. TCP connections use the others."},
+    { "transport",    'x', "string", 0, "tcp (default) or rudp: also accept tunnel connections over reliable UDP on the UDP port with the tunnel's number."},
+    { "tls-cert",     'C', "file", 0, "Encrypt the tunnel with TLS 1.3, using this PEM certificate chain (needs --tls-key)."},
+    { "tls-key",      'K', "file", 0, "PEM private key of the --tls-cert certificate."},
+    { "heartbeat",    'p', "ms",  0, "Send a PING to TunnelClient this often and measure the round-trip time (default 200, 0 for never)."},
+    { "heartbeat-misses", 'm', "int", 0, "Close the tunnel when nothing arrived from TunnelClient for this many heartbeats (default 3)."},
+    { "udp-timeout",  'U', "s",   0, "Forget an outside UDP sender when no packet passed for this many seconds (default 60)."},
     { "verbose",      'v', 0,     0, "Enable verbose output (informational and debug messages)."},
     { 0 }
 };
@@ -29,6 +46,65 @@ static error_t parse_opt( int key, char *arg, struct argp_state *state )
     {
     case 'u': args->outside_udp = atoi( arg ); break;
     case 't': args->outside_tcp = atoi( arg ); break;
+    case 'n':
+        args->tunnels = atoi( arg );
+        if( args->tunnels < 1 )
+        {
+            argp_error( state, "Option --tunnels (-n) must be at least 1.");
+        }
+        break;
+    case 'b':
+        if( !EventLoop::backendFromString( arg, args->backend ) )
+        {
+            argp_error( state, "Unknown event loop backend %s.", arg );
+        }
+        break;
+    case 'H': args->huge_pages = true; break;
+    case 'z': args->zerocopy = true; break;
+    case 'Z':
+        if( Compression::codec() == Compression::Codec::None )
+        {
+            argp_error( state, "Compression is not available, TunnelServer was built without LZ4 and zlib." );
+        }
+        args->compress = true;
+        break;
+    case 'd': args->datagrams = true; break;
+    case 'N': args->no_resume = true; break;
+    case 'R': args->realtime = true; break;
+    case 'I': args->interactive_kb = atoi( arg ); break;
+    case 'p': args->heartbeat_ms = atoi( arg ); break;
+    case 'U':
+        args->udp_timeout = atoi( arg );
+        if( args->udp_timeout < 1 )
+        {
+            argp_error( state, "Option --udp-timeout (-U) must be at least 1.");
+        }
+        break;
+    case 'm':
+        args->heartbeat_misses = atoi( arg );
+        if( args->heartbeat_misses < 1 )
+        {
+            argp_error( state, "Option --heartbeat-misses (-m) must be at least 1.");
+        }
+        break;
+    case 'W':
+        {
+            const std::string rule( arg );
+            const size_t      eq     = rule.find( '=' );
+            const int         weight = ( eq != std::string::npos ) ? atoi( rule.c_str() + eq + 1 ) : 0;
+            if( eq == 0 || weight < 1 || weight > 65535 )
+            {
+                argp_error( state, "Option --weight (-W) expects address=n with n from 1 to 65535." );
+            }
+            args->weights[ rule.substr( 0, eq ) ] = weight;
+        }
+        break;
+    case 'x':
+        if( std::string( arg ) == "rudp" ) args->rudp = true;
+        else if( std::string( arg ) != "tcp" ) argp_error( state, "Unknown transport %s.", arg );
+        break;
+    case 'C': args->tls_cert = arg; break;
+    case 'K': args->tls_key = arg; break;
     case 'v': args->verbose = true; g_verbose = true; break;
     case ARGP_KEY_ARG:
         switch( state->arg_num )
@@ -51,6 +127,18 @@ static error_t parse_opt( int key, char *arg, struct argp_state *state )
         {
             argp_error( state, "Positional option <tunnel-port> is missing.");
         }
+        if (args->tls_cert.empty() != args->tls_key.empty())
+        {
+            argp_error( state, "Options --tls-cert (-C) and --tls-key (-K) must be given together.");
+        }
+        if (args->datagrams && !args->tls_cert.empty())
+        {
+            argp_error( state, "The UDP side channel (--datagrams) is not encrypted and cannot be combined with TLS.");
+        }
+        if (args->rudp && ( args->datagrams || !args->tls_cert.empty() ))
+        {
+            argp_error( state, "The rudp transport cannot be combined with --datagrams or TLS.");
+        }
         return 0;
     default:
         return 0;
@@ -1,12 +1,36 @@
 #pragma once
 
+#include <map>
+#include <string>
 #include <argp.h>
 
+#include "event_loop.h"
+
 struct arguments
 {
     uint16_t outside_udp {0};
     uint16_t outside_tcp {0};
     uint16_t tunnel_tcp  {0};
+    uint16_t tunnels     {1};
+    uint32_t interactive_kb {64};
+    uint32_t heartbeat_ms {200};
+    uint32_t heartbeat_misses {3};
+    uint32_t udp_timeout {60};
+    EventLoop::Backend backend { EventLoop::defaultBackend() };
+
+    // Round-robin weights of outside TCP connections by peer IP address
+    std::map<std::string, uint16_t> weights;
+
+    std::string tls_cert {""};
+    std::string tls_key  {""};
+
+    bool huge_pages {false};
+    bool zerocopy {false};
+    bool compress {false};
+    bool no_resume {false};
+    bool datagrams {false};
+    bool rudp {false};
+    bool realtime {false};
     bool verbose {false};
 };
 
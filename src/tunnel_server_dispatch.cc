@@ -3,9 +3,7 @@
 #include <vector>
 #include <memory>
 #include <algorithm>
-#include <sstream>
 
-#include <sys/select.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
@@ -13,423 +11,1444 @@
 #include "tunnel_server_dispatch.h"
 #include "tunnel_protocol.h"
 #include "tunnel_send_message.h"
-#include "tunnel_message_reconstructor.h"
-#include "tcp_connection_manager.h"
 #include "sockaddr.h"
 #include "verbose.h"
 
-static const size_t max_buffer_size = 100000;
-static const size_t max_udp_packet_size = 65536;
-static const size_t max_tcp_data_size = 16384;  // 16KB per TCP read
+static const size_t max_tcp_data_size = 16384;  // 16KB per read of interactive data
 
-// Buffers
-static char udp_packet_buffer[max_udp_packet_size];
-static char tcp_data_buffer[max_tcp_data_size];
-static char tcp_tunnel_buffer[max_buffer_size];
+// Buffers, one set per shard thread
+static thread_local char tcp_data_buffer[TunnelProtocol::MAX_FRAME_SIZE];
+static thread_local char compress_buffer[TunnelProtocol::MAX_PAYLOAD_SIZE];
+static thread_local char udp_segments_buffer[TunnelProtocol::MAX_PAYLOAD_SIZE];
 
-void dispatch_loop( TCPSocket& tunnel_listener,
-                    UDPSocket& outside_udp,
-                    TCPSocket& outside_tcp_listener )
+TunnelServerDispatch::TunnelServerDispatch( int shard,
+                                            UDPSocket* outside_udp,
+                                            UDPSocket* udp_channel,
+                                            bool zerocopy,
+                                            size_t interactive_bytes,
+                                            bool compress,
+                                            bool resume,
+                                            int heartbeat_ms,
+                                            int heartbeat_misses,
+                                            int udp_timeout_s,
+                                            const std::map<std::string, uint16_t>& weights,
+                                            EventLoop::Backend backend )
+    : _shard( shard )
+    , _outside_udp( outside_udp )
+    , _loop( backend )
+    , _zerocopy( zerocopy )
+    , _interactive_bytes( interactive_bytes )
+    , _compress( compress )
+    , _resume_enabled( resume )
+    , _heartbeat_interval( heartbeat_ms )
+    , _heartbeat_misses( std::max( heartbeat_misses, 1 ) )
+    , _weights( weights )
+    , _udp_timeout( std::max( udp_timeout_s, 1 ) )
+    , _udp_channel( udp_channel )
 {
-    fd_set fds;
-    int    fd_max = 0;
-    bool   cont_loop = true;
+    // Bulk TCP data bypasses user space where splice() exists
+    _tunnel_writer.enableSplice();
 
-    // There can only be one open tunnel at any time.
-    std::unique_ptr<TCPSocket> tunnel;
+    if( _outside_udp )
+    {
+        _udp_in.reset( new UDPBatch );
+        _udp_out.reset( new UDPBatch );
+        _outside_udp->enableGRO();
+        _loop.add( _outside_udp->socket(), IoEvent::Readable,
+                   [this](uint32_t) { onOutsideUdp(); } );
+    }
+
+    if( _udp_channel )
+    {
+        _channel_out.reset( new UDPBatch );
+        _udp_channel->setNoBlock();
+        _loop.add( _udp_channel->socket(), IoEvent::Readable,
+                   [this](uint32_t) { onUdpChannel(); } );
+    }
+}
+
+void TunnelServerDispatch::run( )
+{
+    LOG_INFO << "Shard " << _shard << " dispatching events with " << _loop.backendName() << std::endl;
+    _loop.run();
+}
+
+void TunnelServerDispatch::stop( )
+{
+    _loop.stop();
+}
+
+void TunnelServerDispatch::printStats( std::ostream& ostr ) const
+{
+    const uint64_t messages = _tunnel_writer.messages();
+    const uint64_t writes   = _tunnel_writer.writes();
+
+    ostr << "= Shard " << _shard << ": " << messages << " tunnel messages in "
+         << writes << " writes";
+    if( writes > 0 ) ostr << " (" << (double)messages / writes << " per write)";
+    ostr << std::endl;
+
+    ostr << "= Shard " << _shard << ": message buffers " << _tunnel_writer.pool().hits() << " hits, "
+         << _tunnel_writer.pool().misses() << " misses; connection records "
+         << _tcp_connections.pool().hits() << " hits, " << _tcp_connections.pool().misses()
+         << " misses" << std::endl;
+
+    ostr << "= Shard " << _shard << ": tunnel bytes " << _tunnel_writer.bytesZeroCopy() << " zero-copy, "
+         << _tunnel_writer.bytesCopied() << " copied, " << _tunnel_writer.bytesSpliced()
+         << " spliced" << std::endl;
+
+    if( _compress )
+    {
+        ostr << "= Shard " << _shard << ": " << Compression::codecName( _codec )
+             << " compressed " << _compressed_in << " payload bytes to " << _compressed_out << std::endl;
+    }
+
+    if( _heartbeat_interval.count() > 0 )
+    {
+        ostr << "= Shard " << _shard << ": heartbeat RTT ";
+        if( _rtt_latest_us < 0 ) ostr << "unknown";
+        else ostr << _rtt_latest_us / 1000.0 << " ms (smoothed " << _rtt_smoothed_us / 1000.0 << " ms)";
+        ostr << ", " << _pings_sent << " PINGs, " << _pongs_received << " PONGs, "
+             << _dead_tunnels << " dead tunnels closed" << std::endl;
+    }
+
+    if( _resume_enabled )
+    {
+        ostr << "= Shard " << _shard << ": " << _connections_resumed << " connections resumed, "
+             << _bytes_resent << " bytes sent again" << std::endl;
+    }
+
+    if( _outside_udp )
+    {
+        ostr << "= Shard " << _shard << ": " << _udp_recv_packets << " UDP packets in "
+             << _udp_recv_calls << " receive calls, " << _udp_send_packets << " UDP packets in "
+             << _udp_send_calls << " send calls; " << _udp_flow_count << " UDP flows, "
+             << _udp_flows_expired << " expired, " << _udp_flows_evicted << " evicted" << std::endl;
+    }
+
+    if( _udp_channel )
+    {
+        ostr << "= Shard " << _shard << ": UDP side channel " << ( _channel_up ? "up" : "down" ) << ", "
+             << _channel_recv_packets << " datagrams received, "
+             << _channel_send_packets << " sent" << std::endl;
+    }
+}
+
+void TunnelServerDispatch::adoptTunnel( std::unique_ptr<TCPSocket> tunnel,
+                                        std::unique_ptr<TunnelMessageReconstructor> reconstructor,
+                                        uint16_t version, uint16_t framing, uint32_t capabilities )
+{
+    TCPSocket*                  t = tunnel.release();
+    TunnelMessageReconstructor* r = reconstructor.release();
+    _loop.post( [this,t,r,version,framing,capabilities]()
+    {
+        onAdoptTunnel( t, r, version, framing, capabilities );
+    } );
+}
+
+void TunnelServerDispatch::adoptConnection( uint32_t conn_id, std::unique_ptr<TCPSocket> conn )
+{
+    TCPSocket* c = conn.release();
+    _loop.post( [this,conn_id,c]() { onAdoptConnection( conn_id, c ); } );
+}
+
+void TunnelServerDispatch::onAdoptTunnel( TCPSocket* tunnel, TunnelMessageReconstructor* reconstructor,
+                                          uint16_t version, uint16_t framing, uint32_t capabilities )
+{
+    // Close old tunnel if exists
+    if( _tunnel && _tunnel->valid() )
+    {
+        LOG_INFO << "Replacing existing tunnel connection of shard " << _shard << std::endl;
+        closeTunnel();
+    }
+
+    _tunnel.reset( tunnel );
+    _tunnel->setNoBlock();
+    _tunnel_writer.allowSplice( _tunnel->rawWrites() );
+    if( _zerocopy ) _tunnel_writer.enableZeroCopy( *_tunnel );
+    _reconstructor.reset( reconstructor );
+    _loop.add( _tunnel->socket(), IoEvent::Readable,
+               [this](uint32_t events) { onTunnel(events); } );
+    _has_tunnel = true;
+    updateTunnelInterest();
+
+    _codec = _compress ? Compression::codecFor( capabilities ) : Compression::Codec::None;
+    if( _compress && _codec == Compression::Codec::None )
+    {
+        LOG_WARN << "TunnelClient cannot decompress any codec of this build, "
+                 << "the tunnel of shard " << _shard << " is not compressed" << std::endl;
+    }
+
+    /* Answer a client that has a HELLO version 2. If framing is newer,
+     * our answer is the last message with version 1, TunnelClient switches
+     * after it, and we switch our reconstructor when its second HELLO
+     * arrives.
+     */
+    _resume = _resume_enabled && version >= 2 && ( capabilities & TunnelProtocol::CAP_RESUME );
+
+    _udp_flows_enabled = ( capabilities & TunnelProtocol::CAP_UDP_FLOWS ) != 0;
+
+    // Only a client that answers PINGs is expected to send something regularly
+    _last_received = Clock::now();
+    _next_ping     = _last_received;
+    if( _heartbeat_interval.count() > 0 && ( capabilities & TunnelProtocol::CAP_HEARTBEAT ) )
+    {
+        _heartbeat_timer = _loop.addTimer( _next_ping, [this]() { onHeartbeatTimer(); } );
+    }
+    if( version >= 2 )
+    {
+        const uint32_t caps = Compression::capabilities() | TunnelProtocol::CAP_HEARTBEAT |
+                              ( _resume_enabled ? TunnelProtocol::CAP_RESUME : 0 );
+        TunnelHello hello;
+        TunnelProtocol::createHello( hello, _shard, 0, framing, caps );
+        _tunnel_writer.barrier();
+        sendToTunnel( 0, TunnelMessageType::HELLO, reinterpret_cast<const char*>(&hello), sizeof(hello) );
+        if( framing >= 2 ) _tunnel_writer.setFraming( framing );
+    }
+
+    // Log preserved TCP connections after tunnel reconnect
+    if (_tcp_connections.connectionCount() > 0)
+    {
+        LOG_INFO << "Tunnel reconnected with " << _tcp_connections.connectionCount()
+                 << " preserved outside TCP connections"
+                 << ( _resume ? ", resuming them" : "" ) << std::endl;
+    }
+
+    if( _resume )
+    {
+        // The connections wait for TunnelClient's position in them
+        for (uint32_t conn_id : _tcp_connections.getAllConnIds())
+        {
+            auto* conn = _tcp_connections.getConnection(conn_id);
+            conn->resuming = true;
+            sendResume( conn );
+            watchConnection( conn );
+        }
+    }
+    else
+    {
+        startWithoutResume();
+    }
+
+    std::cout << "= Connection from TunnelClient established on port " << _tunnel->getPort()
+              << ", socket " << _tunnel->socket() << ", shard " << _shard << std::endl;
+
+    // Messages that arrived together with the HELLO
+    processMessages();
+}
+
+void TunnelServerDispatch::onAdoptConnection( uint32_t conn_id, TCPSocket* conn )
+{
+    std::unique_ptr<TCPSocket> tcp_conn( conn );
+
+    if (!_tunnel || !_tunnel->valid())
+    {
+        LOG_WARN << "Outside TCP connection conn_id=" << conn_id
+                 << " arrived after the tunnel of shard " << _shard << " was closed. Rejecting." << std::endl;
+        return;
+    }
+
+    int sock = tcp_conn->socket();
+
+    LOG_INFO << "Outside TCP connection on socket " << sock
+             << ", conn_id=" << conn_id << " added to shard " << _shard << std::endl;
+
+    // Connections from some peers get a larger share of the tunnel
+    auto     rule   = _weights.find(tcp_conn->getPeer().getAddress());
+    uint16_t weight = (rule != _weights.end()) ? rule->second : 1;
+
+    // Add to connection manager and the event loop
+    _tcp_connections.addConnection(conn_id, tcp_conn);
+    _tcp_connections.setWeight(conn_id, weight);
+    _loop.add( sock, IoEvent::Readable,
+               [this,conn_id](uint32_t events) { onOutsideEvent(conn_id, events); } );
+
+    // Send TCP_OPEN message through tunnel, TunnelClient uses the same weight
+    TunnelTcpOpen open;
+    TunnelProtocol::createTcpOpen(open, weight);
+    bool success = sendToTunnel(conn_id,
+                                TunnelMessageType::TCP_OPEN,
+                                (const char*)&open,
+                                sizeof(open));
+
+    if (success)
+    {
+        LOG_DEBUG << "Sent TCP_OPEN for conn_id=" << conn_id << std::endl;
+    }
+    else
+    {
+        LOG_ERROR << "Failed to send TCP_OPEN for conn_id=" << conn_id << std::endl;
+        removeConnection(conn_id);
+    }
+}
+
+void TunnelServerDispatch::onOutsideUdp( )
+{
+    // Receive all waiting UDP packets from outside - could be initial requests OR responses
+    int count = _outside_udp->recvBatch( *_udp_in );
+    if( count < 0 )
+    {
+        if( errno != EAGAIN && errno != EWOULDBLOCK )
+        {
+            LOG_WARN << "Read from outside UDP socket failed. " << strerror(errno) << std::endl;
+        }
+        return;
+    }
+
+    _udp_recv_calls++;
+    _udp_recv_packets += count;
+
+    for( int i=0; i<count; i++ )
+    {
+        const int retval = _udp_in->size(i);
+
+        LOG_DEBUG << "Received UDP packet (" << retval << " bytes) from "
+                  << _udp_in->addr(i).getAddress() << ":" << _udp_in->addr(i).getPort() << std::endl;
+
+        if( retval == 0 )
+        {
+            continue;
+        }
+
+        // The side channel is not held back by the tunnel's congestion
+        if( !_channel_up && _tunnel_congested )
+        {
+            LOG_DEBUG << "Tunnel of shard " << _shard << " is congested. Drop UDP packet." << std::endl;
+            continue;
+        }
+        if( !_channel_up && !( _tunnel && _tunnel->valid() ) )
+        {
+            LOG_INFO << "Tunnel to TunnelClient isn't established. Drop UDP packets." << std::endl;
+            break;
+        }
+
+        // Responses find this sender through its flow
+        _last_udp_flow = udpFlowFor( _udp_in->addr(i) );
+        const uint32_t flow_id = _udp_flows_enabled ? _last_udp_flow : 0;
+
+        if( _channel_up )
+        {
+            // Not queued behind the tunnel's data
+            forwardUdpToChannel(flow_id, _udp_in->data(i), retval, _udp_in->segment(i));
+        }
+        else
+        {
+            bool success = forwardUdpToTunnel(flow_id, _udp_in->data(i), retval, _udp_in->segment(i));
+
+            if (!success)
+            {
+                LOG_WARN << "Failed to send UDP packet through tunnel. Connection broken?" << std::endl;
+                closeTunnel();
+            }
+        }
+    }
+}
+
+uint32_t TunnelServerDispatch::udpFlowFor( const SockAddr& peer )
+{
+    const Clock::time_point now = Clock::now();
+
+    auto it = _udp_flow_ids.find( peer.key() );
+    if( it != _udp_flow_ids.end() )
+    {
+        _udp_flows.touch( _udp_flows.find( it->second ), now );
+        return it->second;
+    }
+
+    if( _udp_flows.full() )
+    {
+        auto oldest = _udp_flows.oldest();
+        LOG_INFO << "Too many UDP flows, dropping flow " << oldest->first << " of " << oldest->second.flow << std::endl;
+        eraseUdpFlow( oldest );
+        _udp_flows_evicted++;
+    }
+
+    // Flow ids are never 0, that stands for TunnelClients without flows
+    const uint32_t flow_id = _next_udp_flow;
+    _next_udp_flow = ( _next_udp_flow == UINT32_MAX ) ? 1 : _next_udp_flow + 1;
+
+    _udp_flow_ids[peer.key()] = flow_id;
+    _udp_flows.insert( flow_id, peer, now );
+    _udp_flow_count           = _udp_flows.size();
+    if( !_udp_sweep_timer ) _udp_sweep_timer = _loop.addTimer( _udp_timeout, [this]() { onUdpSweepTimer(); } );
+
+    LOG_INFO << "New UDP flow " << flow_id << " from " << peer << std::endl;
+    return flow_id;
+}
+
+void TunnelServerDispatch::onUdpSweepTimer( )
+{
+    _udp_sweep_timer = 0;
+
+    // The first flow that is still active ends the sweep, all later ones are younger
+    const Clock::time_point now = Clock::now();
+    while( !_udp_flows.empty() )
+    {
+        auto it = _udp_flows.oldest();
+        if( now - it->second.last_active < _udp_timeout ) break;
+
+        LOG_INFO << "UDP flow " << it->first << " of " << it->second.flow << " expired" << std::endl;
+        eraseUdpFlow( it );
+        _udp_flows_expired++;
+    }
+
+    // A flow is dropped at most a quarter of the timeout late
+    if( !_udp_flows.empty() )
+    {
+        _udp_sweep_timer = _loop.addTimer( std::chrono::duration_cast<Clock::duration>( _udp_timeout ) / 4,
+                                           [this]() { onUdpSweepTimer(); } );
+    }
+}
+
+void TunnelServerDispatch::eraseUdpFlow( UdpFlowTable<SockAddr>::iterator it )
+{
+    if( _last_udp_flow == it->first ) _last_udp_flow = 0;
+    _udp_flow_ids.erase( it->second.flow.key() );
+    _udp_flows.erase( it );
+    _udp_flow_count = _udp_flows.size();
+}
+
+bool TunnelServerDispatch::forwardUdpToTunnel( uint32_t flow_id, const char* data, size_t len, uint16_t segment )
+{
+    if( segment == 0 )
+    {
+        return sendToTunnel( flow_id, TunnelMessageType::UDP_PACKET, data, len,
+                             TunnelWriter::Priority::Control, &_udp_compression );
+    }
+
+    if( sizeof(TunnelUdpSegments) + len <= TunnelProtocol::MAX_PAYLOAD_SIZE )
+    {
+        // The whole run travels as one message and leaves TunnelClient with one GSO send
+        TunnelUdpSegments header;
+        TunnelProtocol::createUdpSegments( header, segment );
+        memcpy( udp_segments_buffer, &header, sizeof(header) );
+        memcpy( udp_segments_buffer + sizeof(header), data, len );
+        return sendToTunnel( flow_id, TunnelMessageType::UDP_SEGMENTS,
+                             udp_segments_buffer, sizeof(header) + len );
+    }
+
+    // Too large for one message, split the run into its packets
+    for( size_t offset = 0; offset < len; offset += segment )
+    {
+        const size_t seglen = std::min<size_t>( segment, len - offset );
+        if( !sendToTunnel( flow_id, TunnelMessageType::UDP_PACKET, data + offset, seglen ) )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void TunnelServerDispatch::forwardUdpToChannel( uint32_t flow_id, const char* data, size_t len, uint16_t segment )
+{
+    // Every packet of a run becomes its own datagram, a lost one takes no others along
+    const size_t step = ( segment == 0 ) ? len : segment;
+    size_t offset = 0;
+    do
+    {
+        const size_t pktlen = std::min( step, len - offset );
+        if( TunnelProtocol::HEADER_SIZE + pktlen <= TunnelProtocol::MAX_DATAGRAM_SIZE )
+        {
+            sendToUdpChannel( flow_id, TunnelMessageType::UDP_PACKET, data + offset, pktlen );
+        }
+        else if( !_tunnel_congested && _tunnel )
+        {
+            // No room for the header in a datagram
+            sendToTunnel( flow_id, TunnelMessageType::UDP_PACKET, data + offset, pktlen );
+        }
+        offset += pktlen;
+    }
+    while( offset < len );
+}
+
+void TunnelServerDispatch::sendToUdpChannel( uint32_t conn_id, TunnelMessageType type, const char* payload, size_t len )
+{
+    if( _channel_out->full() )
+    {
+        flushUdpChannel();
+    }
+
+    TunnelMessageHeader header;
+    TunnelProtocol::createHeader( header, conn_id, len, type );
+    _channel_out->add( &header, TunnelProtocol::HEADER_SIZE, payload, len, _channel_peer );
+
+    if( !_channel_flush_scheduled )
+    {
+        _channel_flush_scheduled = true;
+        _loop.defer( [this]() { flushUdpChannel(); } );
+    }
+}
+
+void TunnelServerDispatch::flushUdpChannel( )
+{
+    _channel_flush_scheduled = false;
+    if( _channel_out->empty() ) return;
+
+    _channel_send_packets += _udp_channel->sendBatch( *_channel_out );
+}
+
+void TunnelServerDispatch::onUdpChannel( )
+{
+    int count = _udp_channel->recvBatch( *_udp_in );
+    if( count < 0 )
+    {
+        if( errno != EAGAIN && errno != EWOULDBLOCK )
+        {
+            LOG_WARN << "Read from the UDP side channel failed. " << strerror(errno) << std::endl;
+        }
+        return;
+    }
+
+    for( int i=0; i<count; i++ )
+    {
+        uint32_t          conn_id;
+        uint16_t          length;
+        TunnelMessageType type;
+        if( !TunnelProtocol::parseDatagram( _udp_in->data(i), _udp_in->size(i), conn_id, length, type ) )
+        {
+            LOG_DEBUG << "Ignoring malformed datagram from " << _udp_in->addr(i) << std::endl;
+            continue;
+        }
+        const char* payload = _udp_in->data(i) + TunnelProtocol::HEADER_SIZE;
+
+        if( type == TunnelMessageType::UDP_CHANNEL )
+        {
+            uint64_t cookie;
+            if( !_channel_expected ||
+                !TunnelProtocol::parseUdpChannel( payload, length, cookie ) ||
+                cookie != _channel_cookie )
+            {
+                LOG_DEBUG << "Ignoring UDP_CHANNEL datagram with an unknown cookie from "
+                          << _udp_in->addr(i) << std::endl;
+                continue;
+            }
+
+            if( !_channel_up || _channel_peer != _udp_in->addr(i) )
+            {
+                _channel_peer = _udp_in->addr(i);
+                _channel_up   = true;
+                std::cout << "= UDP side channel to " << _channel_peer << " established" << std::endl;
+            }
+            _channel_recv_packets++;
+
+            // The echo confirms the channel and keeps NAT bindings on the way alive
+            sendToUdpChannel( 0, TunnelMessageType::UDP_CHANNEL, payload, length );
+        }
+        else if( type == TunnelMessageType::UDP_PACKET && _channel_up && _channel_peer == _udp_in->addr(i) )
+        {
+            _channel_recv_packets++;
+            deliverUdpResponse( conn_id, payload, length );
+        }
+        else
+        {
+            LOG_DEBUG << "Ignoring " << TunnelProtocol::messageTypeToString(type)
+                      << " datagram from " << _udp_in->addr(i) << std::endl;
+        }
+    }
+}
+
+void TunnelServerDispatch::deliverUdpResponse( uint32_t flow_id, const char* data, size_t len )
+{
+    if (flow_id == 0) flow_id = _last_udp_flow;
+
+    auto it = _udp_flows.find(flow_id);
+    if (it == _udp_flows.end())
+    {
+        LOG_DEBUG << "Dropping UDP response for unknown or expired flow " << flow_id << std::endl;
+        return;
+    }
+    if (len > 0)
+    {
+        _udp_flows.touch(it, Clock::now());
+        sendToOutsideUdp(data, len, it->second.flow);
+        LOG_DEBUG << "Queued UDP response (" << len << " bytes) for "
+                  << it->second.flow.getAddress() << ":"
+                  << it->second.flow.getPort() << std::endl;
+    }
+}
+
+void TunnelServerDispatch::sendToOutsideUdp( const char* data, size_t len, const SockAddr& peer )
+{
+    if( _udp_out->full() )
+    {
+        flushOutsideUdp();
+    }
+    _udp_out->add( data, len, peer );
+
+    if( !_udp_flush_scheduled )
+    {
+        _udp_flush_scheduled = true;
+        _loop.defer( [this]() { flushOutsideUdp(); } );
+    }
+}
+
+void TunnelServerDispatch::flushOutsideUdp( )
+{
+    _udp_flush_scheduled = false;
+    if( _udp_out->empty() ) return;
+
+    _udp_send_calls++;
+    _udp_send_packets += _outside_udp->sendBatch( *_udp_out );
+}
+
+void TunnelServerDispatch::onOutsideEvent( uint32_t conn_id, uint32_t events )
+{
+    if (events & IoEvent::Writable)
+    {
+        onOutsideWritable(conn_id);
+    }
+    if (events & (IoEvent::Readable | IoEvent::Error | IoEvent::HangUp))
+    {
+        if (_tunnel)
+        {
+            onOutsideReadable(conn_id);
+        }
+        else if (events & (IoEvent::Error | IoEvent::HangUp))
+        {
+            // Its data waits in the kernel while there is no tunnel, but a broken connection does not
+            auto* conn = _tcp_connections.getConnection(conn_id);
+            if (conn && conn->socket)
+            {
+                LOG_INFO << "Outside TCP connection failed without a tunnel, conn_id=" << conn_id << std::endl;
+                finishConnection(conn);
+            }
+        }
+    }
+}
+
+void TunnelServerDispatch::onOutsideReadable( uint32_t conn_id )
+{
+    auto* conn = _tcp_connections.getConnection(conn_id);
+    if (!conn || !conn->socket || !conn->valid)
+        return;
+
+    // The connection is read in its turn at the end of the loop iteration
+    _tcp_connections.markReady(conn);
+    if (!_serve_scheduled)
+    {
+        _serve_scheduled = true;
+        _loop.defer( [this]() { serveConnections(); } );
+    }
+}
+
+void TunnelServerDispatch::serveConnections( )
+{
+    _serve_scheduled = false;
+
+    /* One round of the deficit round-robin: each connection that was ready
+     * when it started gets one turn. A connection that still has data after
+     * its turn goes to the back of the list. When the tunnel is congested,
+     * the others keep their place for the next round.
+     */
+    for (size_t turns = _tcp_connections.readyCount(); turns > 0 && !_tunnel_congested; turns--)
+    {
+        auto* conn = _tcp_connections.nextReady();
+        if (conn && onOutsideConnection(conn))
+        {
+            _tcp_connections.markReady(conn);
+        }
+    }
+}
+
+bool TunnelServerDispatch::onOutsideConnection( TCPConnectionManager::Connection* conn )
+{
+    const uint32_t conn_id = conn->conn_id;
+
+    // Still paying back the frames of earlier turns
+    if (conn->deficit <= 0)
+        return true;
+
+    for (;;)
+    {
+        // TunnelClient closed this connection already, only the queue is left.
+        // Socket errors show up in onOutsideWritable. Without a tunnel, the
+        // data waits in the kernel.
+        if (!conn->socket || !conn->valid || conn->closing || conn->resuming || !_tunnel)
+            break;
+
+        /* Never send more than TunnelClient can take for this connection.
+         * Interactive data is read in small pieces within the deficit. Bulk
+         * data is read in whole frames, which may overdraw the deficit; the
+         * connection pays that back in its next turns.
+         */
+        const size_t limit  = (dataPriority(conn) == TunnelWriter::Priority::Bulk)
+                            ? frameLimit(conn) : std::min<size_t>(max_tcp_data_size, conn->deficit);
+        const size_t window = std::min<size_t>(conn->sendWindow(), limit);
+        if (window == 0)
+        {
+            // Waits for a WINDOW_UPDATE, the rest of the turn carries over
+            watchConnection(conn);
+            return false;
+        }
+
+        bool spliced = false;
+        int  bytes   = readConnection(conn, window, spliced);
+
+        if (bytes == 0)
+        {
+            // Connection closed by peer
+            LOG_INFO << "Outside TCP connection closed by peer, conn_id=" << conn_id << std::endl;
+
+            sendToTunnel(conn_id, TunnelMessageType::TCP_CLOSE, nullptr, 0);
+            finishConnection(conn);
+            return false;
+        }
+        else if (bytes < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // Non-blocking socket, no data available
+                break;
+            }
+
+            LOG_WARN << "Error reading from outside TCP conn_id=" << conn_id
+                     << ": " << strerror(errno) << std::endl;
+
+            sendToTunnel(conn_id, TunnelMessageType::TCP_CLOSE, nullptr, 0);
+            finishConnection(conn);
+            return false;
+        }
+
+        // Data received
+        LOG_DEBUG << "Received " << bytes << " bytes from outside TCP conn_id=" << conn_id << std::endl;
+
+        if (spliced)
+        {
+            // The payload is already queued in the tunnel's pipe
+            scheduleTunnelFlush();
+            conn->compression.sent(bytes);
+        }
+        else
+        {
+            bool success = sendToTunnel(conn_id,
+                                        TunnelMessageType::TCP_DATA,
+                                        tcp_data_buffer,
+                                        bytes,
+                                        dataPriority(conn),
+                                        &conn->compression);
+
+            if (!success)
+            {
+                LOG_ERROR << "Failed to send TCP_DATA for conn_id=" << conn_id << std::endl;
+                removeConnection(conn_id);
+                return false;
+            }
+
+            // Kept until TunnelClient has consumed it
+            if (_resume) conn->retransmit.append(tcp_data_buffer, bytes);
+        }
+
+        conn->data_sent  += bytes;
+        conn->data_total += bytes;
+        conn->deficit    -= bytes;
+        if (conn->sendWindow() == 0)
+        {
+            LOG_DEBUG << "Send window of conn_id=" << conn_id << " is exhausted" << std::endl;
+            watchConnection(conn);
+            return false;
+        }
+
+        // A short read emptied the socket
+        if ((size_t)bytes < window)
+            break;
+
+        // The rest of the turn waits for the next round
+        if (conn->deficit <= 0 || _tunnel_congested)
+            return true;
+    }
+
+    // The socket is empty or closed. An idle connection does not save up its deficit.
+    conn->deficit = 0;
+    return false;
+}
+
+void TunnelServerDispatch::onOutsideWritable( uint32_t conn_id )
+{
+    auto* conn = _tcp_connections.getConnection(conn_id);
+    if (!conn || !conn->socket || !conn->valid)
+        return;
+
+    if (!conn->flush())
+    {
+        LOG_WARN << "Failed to send queued TCP data to conn_id=" << conn_id
+                 << ": " << strerror(errno) << std::endl;
+        const bool notify = !conn->closing;
+        removeConnection(conn_id);
+        if (notify && _tunnel && _tunnel->valid())
+        {
+            sendToTunnel(conn_id, TunnelMessageType::TCP_CLOSE, nullptr, 0);
+        }
+        return;
+    }
+
+    if (conn->closing && conn->queued() == 0)
+    {
+        LOG_INFO << "Flushed outside TCP conn_id=" << conn_id << ", closing it" << std::endl;
+        acknowledgeClose(conn);
+        removeConnection(conn_id);
+        return;
+    }
 
-    // std::shared_ptr<TCPSocket> webSock )
+    updateWindow(conn);
+    updateConnection(conn);
+}
+
+void TunnelServerDispatch::onTunnel( uint32_t events )
+{
+    // Zero-copy completions arrive on the error queue
+    if( ( events & IoEvent::Error ) && _zerocopy )
+    {
+        _tunnel_writer.reapCompletions( *_tunnel );
+    }
+    if( events & IoEvent::Writable )
+    {
+        flushTunnel();
+        if( !_tunnel ) return;
+    }
+    if( !( events & ( IoEvent::Readable | IoEvent::Error | IoEvent::HangUp ) ) ) return;
+
+    // Read straight into the reconstructor's buffer
+    int retval = _reconstructor->readFrom( *_tunnel );
+    if( retval == 0 )
+    {
+        LOG_INFO << "TCP tunnel closed by peer." << std::endl;
+        closeTunnel();
+        std::cout << "= Tunnel connection closed. Waiting for new connection..." << std::endl;
+        return;
+    }
+    else if (retval < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+
+        LOG_WARN << "Error reading from tunnel: " << strerror(errno) << std::endl;
+        closeTunnel();
+        return;
+    }
 
-    std::vector<int> sockets;
-    sockets.push_back( 0 ); // stdin
-    sockets.push_back( tunnel_listener.socket() );
-    sockets.push_back( outside_udp.socket() );
-    sockets.push_back( outside_tcp_listener.socket() );
+    // Data received on tunnel from TunnelClient
+    LOG_DEBUG << "Received " << retval << " bytes on tunnel" << std::endl;
+    _last_received = Clock::now();
 
-    // Track the last sender address for UDP responses
-    SockAddr last_udp_sender;
-    bool has_udp_sender = false;
-    
-    // Message reconstructor for parsing messages from TunnelClient
-    TunnelMessageReconstructor reconstructor;
-    
-    // TCP connection manager for multiplexing TCP connections
-    // STATIC - preserved across tunnel reconnections
-    static TCPConnectionManager tcp_connections;
+    processMessages();
+}
 
-    while( cont_loop )
+void TunnelServerDispatch::processMessages( )
+{
+    // Process all complete messages. A message may close the tunnel.
+    TunnelMessage msg;
+    while (_tunnel && _reconstructor->nextMessage( msg ))
     {
-        FD_ZERO( &fds );
-        fd_max = 0;
-        
-        std::ostringstream ostr;
-        ostr << "call select with sockets ";
-        for( auto it : sockets )
-        {
-            ostr << it << " ";
-            FD_SET( it, &fds );
-            fd_max = std::max( fd_max, it );
-        }
-        
-        // Add all TCP connection sockets
-        auto tcp_sockets = tcp_connections.getAllSockets();
-        for (int sock : tcp_sockets)
-        {
-            ostr << sock << " ";
-            FD_SET( sock, &fds );
-            fd_max = std::max( fd_max, sock );
-        }
-        
-        LOG_DEBUG << ostr.str() << std::endl;
+        handleTunnelMessage( msg );
+    }
+
+    // Nothing after a corrupt message can be trusted, TunnelClient reconnects
+    if (_tunnel && _reconstructor->failed())
+    {
+        LOG_ERROR << "Corrupt message from TunnelClient on shard " << _shard
+                  << ", closing the tunnel connection" << std::endl;
+        closeTunnel();
+        return;
+    }
+
+    // TLS may hold decrypted bytes back that did not fit into the buffer
+    if (_tunnel && _tunnel->pending() > 0)
+    {
+        _loop.defer( [this]() { if( _tunnel ) onTunnel( IoEvent::Readable ); } );
+    }
+}
 
-        int retval = ::select( fd_max + 1, &fds, nullptr, nullptr, nullptr );
+void TunnelServerDispatch::handleTunnelMessage( TunnelMessage& msg )
+{
+    LOG_DEBUG << "Processing message from TunnelClient: type="
+              << TunnelProtocol::messageTypeToString(msg.type)
+              << " conn_id=" << msg.conn_id
+              << " payload_size=" << msg.payload.size() << std::endl;
 
-        if( retval < 0 )
+    switch (msg.type)
+    {
+        case TunnelMessageType::UDP_PACKET:
         {
-            if (errno == EINTR)
+            // This is a response UDP packet from inside the firewall
+            // Forward it back to the last sender
+            if (!_outside_udp)
             {
-                // Interrupted by signal, retry
-                continue;
+                LOG_WARN << "Received UDP response on shard " << _shard
+                         << ", but only shard 0 handles UDP" << std::endl;
+            }
+            else
+            {
+                deliverUdpResponse(msg.conn_id, msg.payload.data(), msg.payload.size());
             }
-            LOG_ERROR << "Select failed: " << strerror(errno) << std::endl;
             break;
         }
 
-        if( FD_ISSET( 0, &fds ) )
+        case TunnelMessageType::UDP_CHANNEL:
         {
-            int c = getchar( );
-            if( c == 'q' || c == 'Q' )
+            // TunnelClient is about to register its end of the UDP side channel
+            uint64_t cookie;
+            if (!_udp_channel)
             {
-                std::cout << "= Q pressed by user. Quitting." << std::endl
-                          << "= Note: TCP tunnel port will be unavailable for up to a minute" << std::endl
-                          << "=       if TunnelClient was currently connected." << std::endl;
-                cont_loop = false;
+                LOG_WARN << "TunnelClient asks for a UDP side channel, but shard " << _shard
+                         << " has none (see --datagrams)" << std::endl;
             }
-        }
-
-        if( FD_ISSET( tunnel_listener.socket(), &fds ) )
-        {
-            /* Create a new TCP socket from the connect request. */
-            std::unique_ptr<TCPSocket> tcp_conn( new TCPSocket( tunnel_listener, true ) );
-            if( tcp_conn->valid() )
+            else if (!TunnelProtocol::parseUdpChannel(msg.payload.data(), msg.payload.size(), cookie))
             {
-                // Close old tunnel if exists
-                if( tunnel && tunnel->valid() )
-                {
-                    LOG_INFO << "Replacing existing tunnel connection" << std::endl;
-                    // Remove old socket from list
-                    auto it = std::find(sockets.begin(), sockets.end(), tunnel->socket());
-                    if (it != sockets.end())
-                    {
-                        sockets.erase(it);
-                    }
-                }
-                
-                tunnel = std::move( tcp_conn );
-                sockets.push_back( tunnel->socket() );
-                
-                // Log preserved TCP connections after tunnel reconnect
-                if (tcp_connections.connectionCount() > 0)
-                {
-                    LOG_INFO << "Tunnel reconnected with " << tcp_connections.connectionCount() 
-                             << " preserved outside TCP connections" << std::endl;
-                }
-                
-                std::cout << "= Connection from TunnelClient established on port " << tunnel->getPort()
-                          << ", socket " << tunnel->socket() << std::endl;
+                LOG_WARN << "Ignoring malformed UDP_CHANNEL message" << std::endl;
             }
             else
             {
-                LOG_WARN << "Activity on tunnel listener socket, but accept failed" << std::endl;
+                _channel_cookie   = cookie;
+                _channel_expected = true;
+                _channel_up       = false;
             }
+            break;
         }
 
-        if( FD_ISSET( outside_tcp_listener.socket(), &fds ) )
+        case TunnelMessageType::TCP_DATA:
         {
-            // New TCP connection from outside
-            std::unique_ptr<TCPSocket> tcp_conn( new TCPSocket( outside_tcp_listener, true ) );
-            if( tcp_conn->valid() )
+            auto* conn = _tcp_connections.getConnection(msg.conn_id);
+            if (conn && conn->socket && conn->valid)
+            {
+                writeToConnection(conn, msg.payload.data(), msg.payload.size());
+            }
+            else if (!conn || !conn->finished)
             {
-                // Set non-blocking to avoid delaying UDP
-                tcp_conn->setNoBlock();
-                
-                if (tunnel && tunnel->valid())
-                {
-                    // Allocate connection ID
-                    uint32_t conn_id = tcp_connections.allocateConnId();
-                    
-                    LOG_INFO << "Outside TCP connection accepted on socket " 
-                              << tcp_conn->socket() << ", assigned conn_id=" << conn_id << std::endl;
-                    
-                    // Add to connection manager
-                    tcp_connections.addConnection(conn_id, tcp_conn);
-                    
-                    // Send TCP_OPEN message through tunnel
-                    bool success = sendTunnelMessage(tunnel, 
-                                                     conn_id,
-                                                     TunnelMessageType::TCP_OPEN,
-                                                     nullptr,
-                                                     0);
-                    
-                    if (success)
-                    {
-                        LOG_DEBUG << "Sent TCP_OPEN for conn_id=" << conn_id << std::endl;
-                    }
-                    else
-                    {
-                        LOG_ERROR << "Failed to send TCP_OPEN for conn_id=" << conn_id << std::endl;
-                        tcp_connections.removeConnection(conn_id);
-                    }
-                }
-                else
-                {
-                    LOG_WARN << "Outside TCP connection received but tunnel not established. Rejecting." << std::endl;
-                    // tcp_conn will be automatically closed when shared_ptr goes out of scope
-                }
+                LOG_WARN << "Received TCP_DATA for unknown conn_id=" << msg.conn_id << std::endl;
             }
+            break;
         }
 
-        if( FD_ISSET( outside_udp.socket(), &fds ) )
+        case TunnelMessageType::TCP_CLOSE:
         {
-            // Receive UDP packet from outside - could be initial request OR response
-            retval = outside_udp.recv( udp_packet_buffer, max_udp_packet_size, last_udp_sender );
-            if( retval < 0 )
+            LOG_INFO << "Received TCP_CLOSE for conn_id=" << msg.conn_id << std::endl;
+            auto* conn = _tcp_connections.getConnection(msg.conn_id);
+            if (conn && conn->socket && conn->queued() > 0)
             {
-                LOG_WARN << "Read from outside UDP socket failed. " << strerror(errno) << std::endl;
-            }
-            else if( retval == 0 )
-            {
-                LOG_DEBUG << "recv on outside UDP socket returned 0" << std::endl;
+                // Deliver what TunnelClient sent before closing
+                LOG_DEBUG << "Closing conn_id=" << msg.conn_id << " after flushing "
+                          << conn->queued() << " queued bytes" << std::endl;
+                conn->closing = true;
+                updateConnection(conn);
             }
             else
             {
-                LOG_DEBUG << "Received UDP packet (" << retval << " bytes) from " 
-                          << last_udp_sender.getAddress() << ":" << last_udp_sender.getPort() << std::endl;
-                
-                // Remember this sender for future responses
-                has_udp_sender = true;
-                
-                if( tunnel && tunnel->valid() )
-                {
-                    // Send UDP packet through tunnel using new protocol
-                    // conn_id = 0 for UDP (not using connection multiplexing yet)
-                    bool success = sendTunnelMessage(tunnel, 
-                                                     0,  // conn_id = 0 for UDP
-                                                     TunnelMessageType::UDP_PACKET,
-                                                     udp_packet_buffer,
-                                                     retval);
-                    
-                    if (!success)
-                    {
-                        LOG_WARN << "Failed to send UDP packet through tunnel. Connection broken?" << std::endl;
-                        auto it = std::find(sockets.begin(), sockets.end(), tunnel->socket());
-                        if (it != sockets.end())
-                        {
-                            sockets.erase(it);
-                        }
-                        tunnel.reset();
-                    }
-                }
-                else
-                {
-                    LOG_INFO << "Tunnel to TunnelClient isn't established. Drop UDP packets." << std::endl;
-                }
+                if (conn && conn->socket) acknowledgeClose(conn);
+                removeConnection(msg.conn_id);
             }
+            break;
         }
 
-        // Check all TCP connections from outside for data
-        for (uint32_t conn_id : tcp_connections.getAllConnIds())
+        case TunnelMessageType::TCP_OPEN:
         {
-            auto* conn = tcp_connections.getConnection(conn_id);
-            if (!conn || !conn->socket || !conn->valid)
-                continue;
-                
-            if (FD_ISSET(conn->socket->socket(), &fds))
-            {
-                int bytes = conn->socket->recv(tcp_data_buffer, max_tcp_data_size);
-                
-                if (bytes == 0)
-                {
-                    // Connection closed by peer
-                    LOG_INFO << "Outside TCP connection closed by peer, conn_id=" << conn_id << std::endl;
-                    
-                    if (tunnel && tunnel->valid())
-                    {
-                        sendTunnelMessage(tunnel, conn_id, TunnelMessageType::TCP_CLOSE, nullptr, 0);
-                    }
-                    
-                    tcp_connections.removeConnection(conn_id);
-                }
-                else if (bytes < 0)
-                {
-                    if (errno == EAGAIN || errno == EWOULDBLOCK)
-                    {
-                        // Non-blocking socket, no data available
-                        continue;
-                    }
-                    
-                    LOG_WARN << "Error reading from outside TCP conn_id=" << conn_id 
-                             << ": " << strerror(errno) << std::endl;
-                    
-                    if (tunnel && tunnel->valid())
-                    {
-                        sendTunnelMessage(tunnel, conn_id, TunnelMessageType::TCP_CLOSE, nullptr, 0);
-                    }
-                    
-                    tcp_connections.removeConnection(conn_id);
-                }
-                else
-                {
-                    // Data received
-                    LOG_DEBUG << "Received " << bytes << " bytes from outside TCP conn_id=" << conn_id << std::endl;
-                    
-                    if (tunnel && tunnel->valid())
-                    {
-                        bool success = sendTunnelMessage(tunnel, 
-                                                         conn_id,
-                                                         TunnelMessageType::TCP_DATA,
-                                                         tcp_data_buffer,
-                                                         bytes);
-                        
-                        if (!success)
-                        {
-                            LOG_ERROR << "Failed to send TCP_DATA for conn_id=" << conn_id << std::endl;
-                            tcp_connections.removeConnection(conn_id);
-                        }
-                    }
-                }
-            }
+            LOG_WARN << "Unexpected TCP_OPEN from client for conn_id=" << msg.conn_id << std::endl;
+            break;
         }
 
-        if( tunnel && FD_ISSET( tunnel->socket(), &fds ) )
+        case TunnelMessageType::WINDOW_UPDATE:
         {
-            int retval = tunnel->recv( tcp_tunnel_buffer, max_buffer_size );
-            if( retval == 0 )
-            {
-                LOG_INFO << "TCP tunnel closed by peer." << std::endl;
-                // Remove from socket list
-                auto it = std::find(sockets.begin(), sockets.end(), tunnel->socket());
-                if (it != sockets.end())
-                {
-                    sockets.erase(it);
-                }
-                tunnel.reset();
-                std::cout << "= Tunnel connection closed. Waiting for new connection..." << std::endl;
-            }
-            else if (retval < 0)
-            {
-                LOG_WARN << "Error reading from tunnel: " << strerror(errno) << std::endl;
-                // Remove from socket list
-                auto it = std::find(sockets.begin(), sockets.end(), tunnel->socket());
-                if (it != sockets.end())
-                {
-                    sockets.erase(it);
-                }
-                tunnel.reset();
-            }
-            else
+            handleWindowUpdate(msg);
+            break;
+        }
+
+        case TunnelMessageType::RESUME:
+        {
+            handleResume(msg);
+            break;
+        }
+
+        case TunnelMessageType::PING:
+        {
+            sendToTunnel(0, TunnelMessageType::PONG, msg.payload.data(), msg.payload.size());
+            break;
+        }
+
+        case TunnelMessageType::PONG:
+        {
+            handlePong(msg);
+            break;
+        }
+
+        case TunnelMessageType::HELLO:
+        {
+            // TunnelClient's answer to ours, it switches the framing
+            uint16_t shard, shards, version;
+            uint32_t capabilities;
+            if( _tunnel_writer.framing() >= 2 && _reconstructor->framing() == 1 &&
+                TunnelProtocol::parseHello( msg.payload.data(), msg.payload.size(),
+                                            shard, shards, version, capabilities ) &&
+                version == _tunnel_writer.framing() )
             {
-                // Data received on tunnel from TunnelClient
-                LOG_DEBUG << "Received " << retval << " bytes on tunnel" << std::endl;
-                
-                // Feed received bytes to reconstructor
-                reconstructor.collect_from_tunnel( tcp_tunnel_buffer, retval );
-                
-                // Process all complete messages
-                while (reconstructor.hasMessages())
-                {
-                    TunnelMessage& msg = reconstructor.frontMessage();
-                    
-                    LOG_DEBUG << "Processing message from TunnelClient: type=" 
-                              << TunnelProtocol::messageTypeToString(msg.type)
-                              << " conn_id=" << msg.conn_id
-                              << " payload_size=" << msg.payload.size() << std::endl;
-                    
-                    switch (msg.type)
-                    {
-                        case TunnelMessageType::UDP_PACKET:
-                        {
-                            // This is a response UDP packet from inside the firewall
-                            // Forward it back to the last sender
-                            if (has_udp_sender)
-                            {
-                                if (msg.payload.size() > 0)
-                                {
-                                    int sent = outside_udp.send(msg.payload.data(), 
-                                                               msg.payload.size(), 
-                                                               last_udp_sender);
-                                    if (sent >= 0)
-                                    {
-                                        LOG_DEBUG << "Forwarded UDP response (" << msg.payload.size() 
-                                                  << " bytes) back to " 
-                                                  << last_udp_sender.getAddress() << ":" 
-                                                  << last_udp_sender.getPort() << std::endl;
-                                    }
-                                    else
-                                    {
-                                        LOG_ERROR << "Error forwarding UDP response: " 
-                                                  << strerror(errno) << std::endl;
-                                    }
-                                }
-                            }
-                            else
-                            {
-                                LOG_WARN << "Received UDP response but no sender address known (no request received yet)" 
-                                         << std::endl;
-                            }
-                            break;
-                        }
-                        
-                        case TunnelMessageType::TCP_DATA:
-                        {
-                            auto* conn = tcp_connections.getConnection(msg.conn_id);
-                            if (conn && conn->socket && conn->valid)
-                            {
-                                int sent = conn->socket->send(msg.payload.data(), msg.payload.size());
-                                if (sent < 0)
-                                {
-                                    LOG_WARN << "Failed to send TCP data to conn_id=" 
-                                             << msg.conn_id << std::endl;
-                                    tcp_connections.removeConnection(msg.conn_id);
-                                    sendTunnelMessage(tunnel, msg.conn_id, 
-                                                     TunnelMessageType::TCP_CLOSE, nullptr, 0);
-                                }
-                                else
-                                {
-                                    LOG_DEBUG << "Forwarded " << sent 
-                                              << " bytes to outside TCP conn_id=" << msg.conn_id << std::endl;
-                                }
-                            }
-                            else
-                            {
-                                LOG_WARN << "Received TCP_DATA for unknown conn_id=" << msg.conn_id << std::endl;
-                            }
-                            break;
-                        }
-                        
-                        case TunnelMessageType::TCP_CLOSE:
-                        {
-                            LOG_INFO << "Received TCP_CLOSE for conn_id=" << msg.conn_id << std::endl;
-                            tcp_connections.removeConnection(msg.conn_id);
-                            break;
-                        }
-                        
-                        case TunnelMessageType::TCP_OPEN:
-                        {
-                            LOG_WARN << "Unexpected TCP_OPEN from client for conn_id=" << msg.conn_id << std::endl;
-                            break;
-                        }
-                        
-                        default:
-                            LOG_ERROR << "Unknown message type: " << static_cast<int>(msg.type) << std::endl;
-                            break;
-                    }
-                    
-                    // Remove processed message
-                    reconstructor.popMessage();
-                }
+                LOG_INFO << "Tunnel of shard " << _shard << " uses framing version " << version << std::endl;
+                _reconstructor->setFraming( version );
+                break;
             }
+            LOG_WARN << "Unexpected HELLO in the middle of the tunnel of shard " << _shard << std::endl;
+            break;
+        }
+
+        default:
+            LOG_ERROR << "Unknown message type: " << static_cast<int>(msg.type) << std::endl;
+            break;
+    }
+}
+
+void TunnelServerDispatch::flushTunnel( )
+{
+    if( !_tunnel_writer.flush( *_tunnel ) )
+    {
+        LOG_WARN << "Error writing to tunnel: " << strerror(errno) << std::endl;
+        closeTunnel();
+        return;
+    }
+    if( _zerocopy ) _tunnel_writer.reapCompletions( *_tunnel );
+
+    _tunnel_blocked = _tunnel_writer.queued() > 0;
+    updateTunnelInterest();
+}
+
+bool TunnelServerDispatch::sendToTunnel( uint32_t conn_id,
+                                         TunnelMessageType type,
+                                         const char* payload,
+                                         size_t payload_len )
+{
+    return sendToTunnel( conn_id, type, payload, payload_len, messagePriority( type ) );
+}
+
+bool TunnelServerDispatch::sendToTunnel( uint32_t conn_id,
+                                         TunnelMessageType type,
+                                         const char* payload,
+                                         size_t payload_len,
+                                         TunnelWriter::Priority priority,
+                                         CompressionEstimator* compression )
+{
+    if( !_tunnel ) return false;
+
+    bool compressed = false;
+    const Compression::Codec codec = _codec;
+    if( codec != Compression::Codec::None && compression != nullptr )
+    {
+        if( !compression->active() )
+        {
+            compression->sent( payload_len );
+        }
+        else if( size_t size = compression->compress( payload, payload_len,
+                                                      compress_buffer, sizeof(compress_buffer), codec ) )
+        {
+            _compressed_in  += payload_len;
+            _compressed_out += size;
+            payload     = compress_buffer;
+            payload_len = size;
+            compressed  = true;
+        }
+    }
+
+    if( !sendTunnelMessage( _tunnel_writer, conn_id, type, payload, payload_len, priority, compressed ) )
+    {
+        return false;
+    }
+
+    scheduleTunnelFlush();
+    return true;
+}
+
+void TunnelServerDispatch::scheduleTunnelFlush( )
+{
+    // While the socket is full, the next writable event flushes
+    if( !_tunnel_blocked && !_tunnel_flush_scheduled )
+    {
+        _tunnel_flush_scheduled = true;
+        _loop.defer( [this]()
+        {
+            _tunnel_flush_scheduled = false;
+            if( _tunnel ) flushTunnel();
+        } );
+    }
+
+    if( !_tunnel_congested && _tunnel_writer.queued() > TCPConnectionManager::max_queued_bytes )
+    {
+        setTunnelCongested( true );
+    }
+}
+
+int TunnelServerDispatch::readConnection( TCPConnectionManager::Connection* conn, size_t window, bool& spliced )
+{
+    /* Splice bulk data straight into the tunnel's queue if the pipe has
+     * room. Resumption needs a copy of the data, which splicing avoids.
+     */
+    spliced = ( !_resume && dataPriority( conn ) == TunnelWriter::Priority::Bulk &&
+                !( _codec != Compression::Codec::None && conn->compression.active() ) &&
+                _tunnel_writer.spliceRoom() >= window );
+    if( spliced )
+    {
+        return _tunnel_writer.spliceFrom( conn->socket->socket(), conn->conn_id,
+                                          TunnelMessageType::TCP_DATA, window );
+    }
+    return conn->socket->recv( tcp_data_buffer, window );
+}
+
+size_t TunnelServerDispatch::frameLimit( const TCPConnectionManager::Connection* conn ) const
+{
+    // Compression takes one version 1 payload at a time
+    if( _codec != Compression::Codec::None && conn->compression.active() )
+    {
+        return std::min<size_t>( _tunnel_writer.maxPayload(), TunnelProtocol::MAX_PAYLOAD_SIZE );
+    }
+    return _tunnel_writer.maxPayload();
+}
+
+void TunnelServerDispatch::writeToConnection( TCPConnectionManager::Connection* conn,
+                                              const char* data, size_t len )
+{
+    const uint32_t conn_id = conn->conn_id;
+
+    if (!conn->write(data, len))
+    {
+        LOG_WARN << "Failed to send TCP data to conn_id=" << conn_id
+                 << ": " << strerror(errno) << std::endl;
+        removeConnection(conn_id);
+        sendToTunnel(conn_id, TunnelMessageType::TCP_CLOSE, nullptr, 0);
+        return;
+    }
+
+    LOG_DEBUG << "Forwarded " << len << " bytes to outside TCP conn_id=" << conn_id
+              << " (" << conn->queued() << " bytes queued)" << std::endl;
+
+    updateWindow(conn);
+    updateConnection(conn);
+}
+
+void TunnelServerDispatch::updateWindow( TCPConnectionManager::Connection* conn )
+{
+    // TunnelClient does not need credit for a connection it has closed
+    if (conn->closing) return;
+
+    // Batch the credit, a WINDOW_UPDATE per TCP_DATA would double the messages
+    const uint64_t consumed = conn->consumed();
+    if (consumed - conn->consumed_advertised < TunnelProtocol::STREAM_WINDOW / 4) return;
+
+    TunnelWindowUpdate update;
+    TunnelProtocol::createWindowUpdate(update, consumed);
+    if (sendToTunnel(conn->conn_id, TunnelMessageType::WINDOW_UPDATE,
+                     (const char*)&update, sizeof(update)))
+    {
+        conn->consumed_advertised = consumed;
+    }
+}
+
+void TunnelServerDispatch::handleWindowUpdate( TunnelMessage& msg )
+{
+    uint64_t consumed = 0;
+    if (!TunnelProtocol::parseWindowUpdate(msg.payload.data(), msg.payload.size(), consumed))
+    {
+        LOG_WARN << "Malformed WINDOW_UPDATE for conn_id=" << msg.conn_id << std::endl;
+        return;
+    }
+
+    auto* conn = _tcp_connections.getConnection(msg.conn_id);
+    if (!conn)
+    {
+        // The connection was closed while the update was on its way
+        LOG_DEBUG << "WINDOW_UPDATE for unknown conn_id=" << msg.conn_id << std::endl;
+        return;
+    }
+
+    if (consumed <= conn->peer_consumed || consumed > conn->data_sent)
+    {
+        LOG_DEBUG << "Ignoring stale WINDOW_UPDATE for conn_id=" << msg.conn_id
+                  << " (consumed " << consumed << ", sent " << conn->data_sent << ")" << std::endl;
+        return;
+    }
+
+    const bool was_blocked = conn->sendWindow() == 0;
+    conn->peer_consumed = consumed;
+    conn->retransmit.acknowledge(consumed);
+
+    if (conn->finished && conn->peer_consumed >= conn->data_sent)
+    {
+        LOG_DEBUG << "TunnelClient consumed all data of the closed conn_id=" << msg.conn_id << std::endl;
+        removeConnection(msg.conn_id);
+    }
+    else if (was_blocked)
+    {
+        LOG_DEBUG << "Send window of conn_id=" << msg.conn_id << " reopened" << std::endl;
+        watchConnection(conn);
+    }
+}
+
+void TunnelServerDispatch::handlePong( TunnelMessage& msg )
+{
+    uint64_t sent_us = 0;
+    if (!TunnelProtocol::parsePing(msg.payload.data(), msg.payload.size(), sent_us))
+    {
+        LOG_WARN << "Malformed PONG on shard " << _shard << std::endl;
+        return;
+    }
+
+    const int64_t now_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                               Clock::now().time_since_epoch() ).count();
+    const int64_t rtt_us = now_us - (int64_t)sent_us;
+    if (rtt_us < 0) return;
+
+    _pongs_received++;
+    _rtt_latest_us   = rtt_us;
+    _rtt_smoothed_us = (_rtt_smoothed_us < 0) ? rtt_us : (7 * _rtt_smoothed_us + rtt_us) / 8;
+    LOG_DEBUG << "Heartbeat RTT of shard " << _shard << ": " << rtt_us << " us" << std::endl;
+}
+
+void TunnelServerDispatch::onHeartbeatTimer( )
+{
+    _heartbeat_timer = 0;
+
+    const Clock::time_point now = Clock::now();
+
+    // The tunnel is not read while a connection is throttled, its silence means nothing
+    if (!_throttled.empty()) _last_received = now;
+
+    const Clock::time_point deadline = _last_received + _heartbeat_misses * _heartbeat_interval;
+    if (now >= deadline)
+    {
+        std::cout << "= Nothing from TunnelClient on shard " << _shard << " for "
+                  << _heartbeat_misses << " heartbeats, closing the tunnel" << std::endl;
+        _dead_tunnels++;
+        closeTunnel();
+        return;
+    }
+
+    if (now >= _next_ping)
+    {
+        TunnelPing ping;
+        TunnelProtocol::createPing(ping, std::chrono::duration_cast<std::chrono::microseconds>(
+                                             now.time_since_epoch() ).count());
+        sendToTunnel(0, TunnelMessageType::PING, (const char*)&ping, sizeof(ping));
+        _pings_sent++;
+        _next_ping = now + _heartbeat_interval;
+    }
+
+    _heartbeat_timer = _loop.addTimer( std::min( _next_ping, deadline ), [this]() { onHeartbeatTimer(); } );
+}
+
+void TunnelServerDispatch::handleResume( TunnelMessage& msg )
+{
+    uint64_t received = 0;
+    uint64_t consumed = 0;
+    if (!TunnelProtocol::parseResume(msg.payload.data(), msg.payload.size(), received, consumed))
+    {
+        LOG_WARN << "Malformed RESUME for conn_id=" << msg.conn_id << std::endl;
+        return;
+    }
+
+    auto* conn = _tcp_connections.getConnection(msg.conn_id);
+    if (!conn)
+    {
+        // The connection was closed while there was no tunnel
+        LOG_INFO << "RESUME for unknown conn_id=" << msg.conn_id << ", closing it" << std::endl;
+        sendToTunnel(msg.conn_id, TunnelMessageType::TCP_CLOSE, nullptr, 0);
+        return;
+    }
+
+    if (!_resume || !conn->resuming)
+    {
+        LOG_WARN << "Unexpected RESUME for conn_id=" << msg.conn_id << std::endl;
+        return;
+    }
+
+    if (received > conn->data_sent || received < conn->retransmit.base() || consumed > received)
+    {
+        LOG_WARN << "Cannot resume conn_id=" << msg.conn_id << " at " << received
+                 << ", sent " << conn->data_sent << ", kept from " << conn->retransmit.base()
+                 << ". Closing it" << std::endl;
+        removeConnection(msg.conn_id);
+        sendToTunnel(msg.conn_id, TunnelMessageType::TCP_CLOSE, nullptr, 0);
+        return;
+    }
+
+    conn->peer_consumed = std::max(conn->peer_consumed, consumed);
+    conn->retransmit.acknowledge(conn->peer_consumed);
+
+    // What was lost with the old tunnel goes first
+    for (uint64_t offset = received; offset < conn->data_sent; )
+    {
+        const size_t len = std::min<uint64_t>(frameLimit(conn), conn->data_sent - offset);
+        sendToTunnel(conn->conn_id, TunnelMessageType::TCP_DATA, conn->retransmit.at(offset), len,
+                     dataPriority(conn), &conn->compression);
+        offset        += len;
+        _bytes_resent += len;
+    }
+    _connections_resumed++;
+
+    LOG_DEBUG << "Resumed conn_id=" << msg.conn_id << ", sent " << conn->data_sent - received
+              << " bytes again" << std::endl;
+
+    conn->resuming = false;
+    if (conn->finished)
+    {
+        // TunnelClient may have missed our TCP_CLOSE as well
+        sendToTunnel(msg.conn_id, TunnelMessageType::TCP_CLOSE, nullptr, 0);
+        if (conn->peer_consumed >= conn->data_sent) removeConnection(msg.conn_id);
+        return;
+    }
+    watchConnection(conn);
+}
+
+void TunnelServerDispatch::sendResume( TCPConnectionManager::Connection* conn )
+{
+    TunnelResume resume;
+    TunnelProtocol::createResume(resume, conn->received(), conn->consumed());
+    sendToTunnel(conn->conn_id, TunnelMessageType::RESUME, (const char*)&resume, sizeof(resume));
+}
+
+void TunnelServerDispatch::startWithoutResume( )
+{
+    // TunnelClient starts counting from zero on the new tunnel as well
+    _tcp_connections.resetWindows();
+    for (uint32_t conn_id : _tcp_connections.getAllConnIds())
+    {
+        auto* conn = _tcp_connections.getConnection(conn_id);
+        conn->resuming = false;
+        if (conn->finished)
+        {
+            // Its data is lost, but TunnelClient can still close it
+            sendToTunnel(conn_id, TunnelMessageType::TCP_CLOSE, nullptr, 0);
+            removeConnection(conn_id);
+            continue;
+        }
+        watchConnection(conn);
+    }
+}
+
+void TunnelServerDispatch::acknowledgeClose( TCPConnectionManager::Connection* conn )
+{
+    if (!_resume) return;
+
+    TunnelWindowUpdate update;
+    TunnelProtocol::createWindowUpdate(update, conn->consumed());
+    sendToTunnel(conn->conn_id, TunnelMessageType::WINDOW_UPDATE, (const char*)&update, sizeof(update));
+}
+
+void TunnelServerDispatch::watchConnection( TCPConnectionManager::Connection* conn )
+{
+    if (!conn->socket) return;
+
+    const bool readable = _tunnel && !conn->closing && !conn->resuming &&
+                          !_tunnel_congested && conn->sendWindow() > 0;
+    uint32_t events = readable ? IoEvent::Readable : 0;
+    if (conn->queued() > 0) events |= IoEvent::Writable;
+    _loop.modify( conn->socket->socket(), events );
+}
+
+void TunnelServerDispatch::updateConnection( TCPConnectionManager::Connection* conn )
+{
+    watchConnection(conn);
+
+    if (conn->queued() > TCPConnectionManager::max_queued_bytes)
+    {
+        if (_throttled.insert(conn->conn_id).second)
+        {
+            LOG_INFO << "Outside TCP conn_id=" << conn->conn_id << " is slow, "
+                     << conn->queued() << " bytes queued. Pausing the tunnel of shard "
+                     << _shard << std::endl;
         }
     }
+    else if (conn->queued() <= TCPConnectionManager::max_queued_bytes / 2)
+    {
+        _throttled.erase(conn->conn_id);
+    }
+
+    updateTunnelInterest();
+}
+
+void TunnelServerDispatch::updateTunnelInterest( )
+{
+    if (!_tunnel) return;
+
+    uint32_t events = _throttled.empty() ? IoEvent::Readable : 0;
+    if (_tunnel_blocked) events |= IoEvent::Writable;
+    _loop.modify( _tunnel->socket(), events );
+
+    // Stop reading from the outside while the tunnel cannot keep up
+    const size_t queued = _tunnel_writer.queued();
+    if (!_tunnel_congested && queued > TCPConnectionManager::max_queued_bytes)
+    {
+        setTunnelCongested( true );
+    }
+    else if (_tunnel_congested && queued <= TCPConnectionManager::max_queued_bytes / 2)
+    {
+        setTunnelCongested( false );
+    }
 }
 
+void TunnelServerDispatch::setTunnelCongested( bool congested )
+{
+    LOG_DEBUG << "Tunnel of shard " << _shard << ( congested ? " is congested, " : " has drained, " )
+              << _tunnel_writer.queued() << " bytes queued" << std::endl;
+
+    _tunnel_congested = congested;
+    for (uint32_t conn_id : _tcp_connections.getAllConnIds())
+    {
+        watchConnection( _tcp_connections.getConnection(conn_id) );
+    }
+}
+
+void TunnelServerDispatch::removeConnection( uint32_t conn_id )
+{
+    auto* conn = _tcp_connections.getConnection(conn_id);
+    if (conn && conn->socket)
+    {
+        _loop.remove( conn->socket->socket() );
+    }
+    _tcp_connections.removeConnection(conn_id);
+
+    if (_throttled.erase(conn_id) > 0) updateTunnelInterest();
+}
+
+void TunnelServerDispatch::finishConnection( TCPConnectionManager::Connection* conn )
+{
+    const uint32_t conn_id = conn->conn_id;
+
+    // Without a tunnel, the TCP_CLOSE is due on the next one
+    if (_tunnel && !( _resume && conn->peer_consumed < conn->data_sent ))
+    {
+        removeConnection(conn_id);
+        return;
+    }
+
+    LOG_DEBUG << "Keeping conn_id=" << conn_id << " until TunnelClient has consumed "
+              << conn->data_sent - conn->peer_consumed << " more bytes" << std::endl;
+
+    _loop.remove( conn->socket->socket() );
+    _tcp_connections.closeSocket(conn_id);
+    conn->finished = true;
+
+    if (_throttled.erase(conn_id) > 0) updateTunnelInterest();
+}
+
+void TunnelServerDispatch::closeTunnel( )
+{
+    if( !_tunnel ) return;
+
+    _has_tunnel = false;
+    _loop.remove( _tunnel->socket() );
+    _tunnel.reset();
+
+    _loop.cancelTimer( _heartbeat_timer );
+    _heartbeat_timer = 0;
+
+    // The next tunnel brings a new cookie
+    if( _channel_up )
+    {
+        std::cout << "= UDP side channel to " << _channel_peer << " closed with the tunnel" << std::endl;
+    }
+    _channel_expected = false;
+    _channel_up       = false;
+
+    // Whatever was not sent is lost with the tunnel, or sent again on the next one
+    _tunnel_writer.clear();
+    _tunnel_blocked   = false;
+    _tunnel_congested = false;
+
+    // The outside connections are not read until the next tunnel
+    for (uint32_t conn_id : _tcp_connections.getAllConnIds())
+    {
+        watchConnection( _tcp_connections.getConnection(conn_id) );
+    }
+}
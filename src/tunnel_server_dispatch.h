@@ -1,10 +1,357 @@
 #pragma once
+#include <atomic>
+#include <chrono>
+#include <map>
 #include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
 
 #include "udp.h"
 #include "tcp.h"
+#include "tunnel_writer.h"
+#include "sockaddr.h"
+#include "event_loop.h"
+#include "tunnel_protocol.h"
+#include "tunnel_message_reconstructor.h"
+#include "tcp_connection_manager.h"
+#include "udp_flow_table.h"
 
-void dispatch_loop( TCPSocket& tunnel_listener,
-                    UDPSocket& outside_udp,
-                    TCPSocket& outside_tcp_listener );
+/* One shard of TunnelServer. A shard owns one tunnel connection from
+ * TunnelClient and all outside TCP connections whose data travels through
+ * that tunnel. Every shard runs its own EventLoop in its own thread. Other
+ * threads must only use the functions that are marked thread-safe; they
+ * post work into the shard's loop.
+ *
+ * Shard 0 also owns the outside UDP socket, so UDP packets are never
+ * reordered between tunnels.
+ */
+class TunnelServerDispatch
+{
+    const int  _shard;
+    UDPSocket* _outside_udp;  // nullptr except in shard 0
 
+    EventLoop _loop;
+
+    // There can only be one open tunnel per shard at any time.
+    std::unique_ptr<TCPSocket> _tunnel;
+    std::atomic<bool>          _has_tunnel { false };
+
+    // Messages for the tunnel. They are flushed once per loop iteration,
+    // or when the socket becomes writable again after it was full.
+    TunnelWriter _tunnel_writer;
+    bool         _tunnel_flush_scheduled { false };
+    bool         _tunnel_blocked         { false };
+
+    // Send large batches to the tunnel with MSG_ZEROCOPY
+    const bool   _zerocopy;
+
+    // TCP_DATA of a connection is Interactive until it has sent this many bytes
+    const size_t _interactive_bytes;
+
+    // Compress TCP_DATA and UDP_PACKET payloads where it pays off, with
+    // the codec that we share with TunnelClient, None if there is none
+    const bool   _compress;
+    std::atomic<Compression::Codec> _codec { Compression::Codec::None };
+    CompressionEstimator  _udp_compression;
+    std::atomic<uint64_t> _compressed_in  { 0 };  // payload bytes before compression
+    std::atomic<uint64_t> _compressed_out { 0 };  // and after
+
+    /* Resume the outside connections without losing data when the tunnel
+     * is replaced, see TunnelResume. _resume is set while the current
+     * tunnel does, which needs TunnelClient's consent in its HELLO.
+     */
+    const bool            _resume_enabled;
+    bool                  _resume { false };
+    std::atomic<uint64_t> _connections_resumed { 0 };
+    std::atomic<uint64_t> _bytes_resent        { 0 };
+
+    /* Heartbeats, see TunnelPing. While TunnelClient answers PINGs, one
+     * goes out every _heartbeat_interval, and the tunnel is closed when
+     * nothing arrived for _heartbeat_misses intervals. 0 disables them.
+     */
+    using Clock = std::chrono::steady_clock;
+    const std::chrono::milliseconds _heartbeat_interval;
+    const int                       _heartbeat_misses;
+    EventLoop::TimerId              _heartbeat_timer { 0 };  // 0 while TunnelClient does not answer
+    Clock::time_point               _last_received;
+    Clock::time_point               _next_ping;
+    std::atomic<int64_t>            _rtt_latest_us   { -1 };  // -1 until the first PONG
+    std::atomic<int64_t>            _rtt_smoothed_us { -1 };
+    std::atomic<uint64_t>           _pings_sent      { 0 };
+    std::atomic<uint64_t>           _pongs_received  { 0 };
+    std::atomic<uint64_t>           _dead_tunnels    { 0 };
+
+    // Weights of outside connections by the peer's IP address, 1 if not listed
+    const std::map<std::string, uint16_t> _weights;
+
+    // More than max_queued_bytes wait in _tunnel_writer. The outside
+    // connections are not read and UDP packets are dropped meanwhile.
+    bool _tunnel_congested { false };
+
+    // serveConnections() runs at the end of this loop iteration
+    bool _serve_scheduled { false };
+
+    /* UDP flows, one per outside sender, only in shard 0. The flow id is
+     * the conn_id of its UDP_PACKETs, and TunnelClient forwards every
+     * flow from a socket of its own. A flow expires when nothing passed
+     * in either direction for _udp_timeout. A TunnelClient without
+     * CAP_UDP_FLOWS gets conn_id 0, and its responses go to the flow that
+     * sent last.
+     */
+    static const size_t max_udp_flows = 65536;
+    const std::chrono::seconds              _udp_timeout;
+    std::unordered_map<uint64_t, uint32_t>  _udp_flow_ids;  // SockAddr::key() of the peer -> flow id
+    UdpFlowTable<SockAddr>                  _udp_flows { max_udp_flows };  // the peer of each flow
+    uint32_t                                _next_udp_flow  { 1 };
+    uint32_t                                _last_udp_flow  { 0 };  // 0 before the first packet
+    bool                                    _udp_flows_enabled { false };  // TunnelClient has CAP_UDP_FLOWS
+    EventLoop::TimerId                      _udp_sweep_timer { 0 };
+    std::atomic<size_t>                     _udp_flow_count    { 0 };
+    std::atomic<uint64_t>                   _udp_flows_expired { 0 };  // idle for _udp_timeout
+    std::atomic<uint64_t>                   _udp_flows_evicted { 0 };  // dropped for a new flow
+
+    // Batches for the outside UDP socket, only allocated in shard 0.
+    // UDP responses from the tunnel are collected in _udp_out and sent
+    // with one sendmmsg at the end of the loop iteration.
+    std::unique_ptr<UDPBatch> _udp_in;
+    std::unique_ptr<UDPBatch> _udp_out;
+    bool                      _udp_flush_scheduled { false };
+    std::atomic<uint64_t>     _udp_recv_packets { 0 };
+    std::atomic<uint64_t>     _udp_recv_calls   { 0 };
+    std::atomic<uint64_t>     _udp_send_packets { 0 };
+    std::atomic<uint64_t>     _udp_send_calls   { 0 };
+
+    /* UDP side channel, only in shard 0 with --datagrams. UDP packets
+     * travel on it instead of the tunnel while TunnelClient has registered
+     * with the cookie of the current tunnel (see TunnelUdpChannel).
+     */
+    UDPSocket*                _udp_channel;
+    uint64_t                  _channel_cookie   { 0 };
+    bool                      _channel_expected { false };  // cookie received through the tunnel
+    std::atomic<bool>         _channel_up       { false };
+    SockAddr                  _channel_peer;
+    std::unique_ptr<UDPBatch> _channel_out;
+    bool                      _channel_flush_scheduled { false };
+    std::atomic<uint64_t>     _channel_recv_packets { 0 };
+    std::atomic<uint64_t>     _channel_send_packets { 0 };
+
+    // Message reconstructor for parsing messages from TunnelClient
+    std::unique_ptr<TunnelMessageReconstructor> _reconstructor;
+
+    // TCP connection manager for multiplexing TCP connections.
+    // Preserved across tunnel reconnections.
+    TCPConnectionManager _tcp_connections;
+
+    // Connections with more than max_queued_bytes waiting. The tunnel is
+    // not read while this is not empty.
+    std::set<uint32_t> _throttled;
+
+public:
+    TunnelServerDispatch( int shard,
+                          UDPSocket* outside_udp,
+                          UDPSocket* udp_channel,
+                          bool zerocopy,
+                          size_t interactive_bytes,
+                          bool compress,
+                          bool resume,
+                          int heartbeat_ms,
+                          int heartbeat_misses,
+                          int udp_timeout_s,
+                          const std::map<std::string, uint16_t>& weights,
+                          EventLoop::Backend backend );
+
+    // Run the shard's event loop until stop() is called
+    void run( );
+
+    // Thread-safe. Make run() return.
+    void stop( );
+
+    // Thread-safe. Print the shard's counters.
+    void printStats( std::ostream& ostr ) const;
+
+    // Thread-safe. True while the shard has a tunnel to TunnelClient.
+    inline bool hasTunnel() const { return _has_tunnel; }
+
+    /* Thread-safe. Hand a new tunnel connection to this shard. The HELLO
+     * message has been consumed already; messages that arrived behind it
+     * are still in the reconstructor and are processed first.
+     * An existing tunnel of the shard is replaced. version and capabilities
+     * are the ones of TunnelClient's HELLO, the shard answers it if version
+     * is 2 or more. framing is the version that the shard offers in that
+     * answer, 1 to stay with the first one.
+     */
+    void adoptTunnel( std::unique_ptr<TCPSocket> tunnel,
+                      std::unique_ptr<TunnelMessageReconstructor> reconstructor,
+                      uint16_t version, uint16_t framing, uint32_t capabilities );
+
+    /* Thread-safe. Hand an accepted outside TCP connection to this shard.
+     * The shard announces it to TunnelClient with TCP_OPEN, or closes it if
+     * the tunnel disappeared in the meantime.
+     */
+    void adoptConnection( uint32_t conn_id, std::unique_ptr<TCPSocket> conn );
+
+private:
+    void onAdoptTunnel( TCPSocket* tunnel, TunnelMessageReconstructor* reconstructor,
+                        uint16_t version, uint16_t framing, uint32_t capabilities );
+    void onAdoptConnection( uint32_t conn_id, TCPSocket* conn );
+    void onOutsideUdp( );
+    void flushOutsideUdp( );
+
+    /* Send a UDP packet from outside through the tunnel. If segment is not
+     * 0, data is a run of packets of that size, which is sent as one
+     * UDP_SEGMENTS message if it fits.
+     */
+    bool forwardUdpToTunnel( uint32_t flow_id, const char* data, size_t len, uint16_t segment );
+
+    // Send a UDP packet, or a run of them, from outside on the side channel
+    void forwardUdpToChannel( uint32_t flow_id, const char* data, size_t len, uint16_t segment );
+
+    /* The flow of an outside sender, created if it is new. The least
+     * recently active flow is dropped when there are max_udp_flows.
+     */
+    uint32_t udpFlowFor( const SockAddr& peer );
+
+    // Forget an expired or evicted flow
+    void eraseUdpFlow( UdpFlowTable<SockAddr>::iterator it );
+
+    // Queue a UDP response for an outside sender
+    void sendToOutsideUdp( const char* data, size_t len, const SockAddr& peer );
+
+    /* Forward a UDP response from TunnelClient to the outside sender of
+     * its flow, if that still exists. flow_id 0 is the one that sent last.
+     */
+    void deliverUdpResponse( uint32_t flow_id, const char* data, size_t len );
+
+    // Timer task, drops the UDP flows that have been idle for too long
+    void onUdpSweepTimer( );
+
+    void onUdpChannel( );
+    void flushUdpChannel( );
+
+    // Queue one message as a datagram for TunnelClient's end of the side channel
+    void sendToUdpChannel( uint32_t conn_id, TunnelMessageType type, const char* payload, size_t len );
+    void onOutsideEvent( uint32_t conn_id, uint32_t events );
+
+    // Put a readable connection into the round-robin for serveConnections()
+    void onOutsideReadable( uint32_t conn_id );
+
+    // Give the ready outside connections one turn each, see TCPConnectionManager::nextReady()
+    void serveConnections( );
+
+    /* Read and forward at most conn->deficit bytes. Returns true if the
+     * connection has more data and its turn was cut short; it may have
+     * been removed when false is returned.
+     */
+    bool onOutsideConnection( TCPConnectionManager::Connection* conn );
+    void onOutsideWritable( uint32_t conn_id );
+    void onTunnel( uint32_t events );
+    void flushTunnel( );
+
+    /* Queue a message for the tunnel. It is written at the end of the
+     * current loop iteration together with the other messages queued by
+     * then. Returns false if there is no tunnel.
+     */
+    bool sendToTunnel( uint32_t conn_id,
+                       TunnelMessageType type,
+                       const char* payload,
+                       size_t payload_len );
+
+    /* Same with a priority other than messagePriority( type ). With
+     * --compress, the payload is compressed if compression, the estimator
+     * of its stream, finds that worth it.
+     */
+    bool sendToTunnel( uint32_t conn_id,
+                       TunnelMessageType type,
+                       const char* payload,
+                       size_t payload_len,
+                       TunnelWriter::Priority priority,
+                       CompressionEstimator* compression = nullptr );
+
+    // Priority of the connection's next TCP_DATA, see _interactive_bytes
+    inline TunnelWriter::Priority dataPriority( const TCPConnectionManager::Connection* conn ) const
+    {
+        return ( conn->data_total < _interactive_bytes ) ? TunnelWriter::Priority::Interactive
+                                                         : TunnelWriter::Priority::Bulk;
+    }
+
+    // Make sure the queued tunnel messages are flushed in this loop iteration
+    void scheduleTunnelFlush( );
+
+    /* Read from the connection's socket, at most window bytes. If the
+     * connection is Bulk and the tunnel's splice pipe has room, the data
+     * goes straight into the tunnel's queue as TCP_DATA and spliced is set. Otherwise it is read
+     * into tcp_data_buffer. Returns like recv().
+     */
+    int readConnection( TCPConnectionManager::Connection* conn, size_t window, bool& spliced );
+
+    /* Largest TCP_DATA payload of the connection in one message: a frame
+     * of the tunnel's framing, or what compression takes at once.
+     */
+    size_t frameLimit( const TCPConnectionManager::Connection* conn ) const;
+
+    void processMessages( );
+    void handleTunnelMessage( TunnelMessage& msg );
+    void handleWindowUpdate( TunnelMessage& msg );
+
+    // Take the round-trip time from a PONG
+    void handlePong( TunnelMessage& msg );
+
+    /* Timer task, sends a PING when it is due, and closes a tunnel that
+     * has been silent for too long.
+     */
+    void onHeartbeatTimer( );
+
+    /* TunnelClient's position in a connection on a new tunnel. Send the
+     * data again that it has not received, then read the connection again.
+     */
+    void handleResume( TunnelMessage& msg );
+
+    // Tell TunnelClient how far we got with a preserved connection
+    void sendResume( TCPConnectionManager::Connection* conn );
+
+    // The tunnel does without resumption, restart the preserved connections
+    void startWithoutResume( );
+
+    /* Tell TunnelClient that all data of a connection that it closed has
+     * been consumed, so that it can drop its copy.
+     */
+    void acknowledgeClose( TCPConnectionManager::Connection* conn );
+
+    /* Write data to an outside connection. Whatever the socket does not
+     * take now is queued and sent when it becomes writable. Closes the
+     * connection if the socket failed.
+     */
+    void writeToConnection( TCPConnectionManager::Connection* conn,
+                            const char* data, size_t len );
+
+    // Set the connection's interest: readable unless there is no tunnel, it
+    // is closing or resuming, the tunnel is congested or the send window is
+    // exhausted, writable while data is queued
+    void watchConnection( TCPConnectionManager::Connection* conn );
+
+    // Give TunnelClient credit for the data that left the connection's queue
+    void updateWindow( TCPConnectionManager::Connection* conn );
+
+    // Update the interest and throttle the tunnel if too much is queued
+    void updateConnection( TCPConnectionManager::Connection* conn );
+
+    // Read the tunnel unless a connection is throttled, and watch for
+    // writability while the socket is full
+    void updateTunnelInterest( );
+
+    // Stop or resume reading from all outside connections
+    void setTunnelCongested( bool congested );
+
+    // Remove a TCP connection from the loop and the connection manager
+    void removeConnection( uint32_t conn_id );
+
+    /* The connection ended after its TCP_CLOSE, if there is a tunnel.
+     * Remove it, or only close its socket while TunnelClient may still
+     * need its data again, see TCPConnectionManager::Connection::finished.
+     */
+    void finishConnection( TCPConnectionManager::Connection* conn );
+
+    // Drop the current tunnel connection
+    void closeTunnel( );
+};
@@ -0,0 +1,438 @@
+#include <algorithm>
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "tunnel_writer.h"
+#include "verbose.h"
+
+// Upper bound for the iovec array of one sendmsg, it lives on the stack
+static const size_t max_iov = 256;
+
+// Requested size of the splice pipe. Linux allows up to 1 MB without privileges.
+static const int splice_pipe_size = 1024 * 1024;
+
+TunnelWriter::~TunnelWriter( )
+{
+    clear();
+    closePipe();
+}
+
+void TunnelWriter::append( uint32_t conn_id, TunnelMessageType type, const char* payload, size_t len,
+                           Priority priority, bool compressed )
+{
+    char header[TunnelProtocol::MAX_HEADER_SIZE];
+    const size_t header_size = TunnelProtocol::encodeHeader( header, _framing, conn_id, len, type, compressed );
+    appendSegment( header, header_size, payload, len, priority );
+}
+
+TunnelWriter::Segment& TunnelWriter::appendSegment( const char* header, size_t header_size,
+                                                    const char* payload, size_t len, Priority priority )
+{
+    std::deque<Segment>& queue = _segments[ static_cast<size_t>( priority ) ];
+    queue.emplace_back();
+    Segment& seg = queue.back();
+
+    seg.size  = header_size + len;
+    seg.bytes = _pool.get( seg.size, seg.capacity );
+    memcpy( seg.bytes, header, header_size );
+    if( len > 0 )
+    {
+        memcpy( seg.bytes + header_size, payload, len );
+    }
+    seg.offset = 0;
+    seg.last   = true;
+    seg.zc     = false;
+    seg.zc_id  = 0;
+
+    _queued += seg.size;
+    return seg;
+}
+
+void TunnelWriter::barrier( )
+{
+    std::deque<Segment>& control = _segments[ static_cast<size_t>( Priority::Control ) ];
+
+    /* flush() would write what TLS holds, or else the rest of a torn
+     * message first, then the queues by priority. Put everything into the
+     * Control queue in that order.
+     */
+    std::deque<Segment> merged;
+    for( uint8_t& q : _held )
+    {
+        merged.push_back( _segments[q].front() );
+        _segments[q].pop_front();
+        q = static_cast<uint8_t>( Priority::Control );
+    }
+    if( _torn >= 0 && !_held.empty() )
+    {
+        // The held segments start with the torn message
+        _torn = static_cast<int>( Priority::Control );
+    }
+    else if( _torn >= 0 )
+    {
+        std::deque<Segment>& torn = _segments[_torn];
+        bool last = false;
+        while( !last && !torn.empty() )
+        {
+            last = torn.front().last;
+            merged.push_back( torn.front() );
+            torn.pop_front();
+        }
+        _torn = static_cast<int>( Priority::Control );
+    }
+    for( auto& queue : _segments )
+    {
+        merged.insert( merged.end(), queue.begin(), queue.end() );
+        queue.clear();
+    }
+    control.swap( merged );
+}
+
+bool TunnelWriter::enableSplice( )
+{
+#ifdef __linux__
+    if( _pipe[0] >= 0 ) return true;
+
+    if( pipe2( _pipe, O_NONBLOCK | O_CLOEXEC ) < 0 )
+    {
+        LOG_WARN << "Cannot create a pipe for splice: " << strerror(errno) << std::endl;
+        _pipe[0] = _pipe[1] = -1;
+        return false;
+    }
+
+    fcntl( _pipe[1], F_SETPIPE_SZ, splice_pipe_size );
+    int size = fcntl( _pipe[1], F_GETPIPE_SZ );
+    _pipe_capacity = ( size > 0 ) ? size : 0;
+    _piped         = 0;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void TunnelWriter::closePipe( )
+{
+    if( _pipe[0] >= 0 )
+    {
+        ::close( _pipe[0] );
+        ::close( _pipe[1] );
+    }
+    _pipe[0] = _pipe[1] = -1;
+    _pipe_capacity = 0;
+    _piped         = 0;
+}
+
+int TunnelWriter::spliceFrom( int fd, uint32_t conn_id, TunnelMessageType type, size_t len )
+{
+#ifdef __linux__
+    len = std::min( { len, spliceRoom(), maxPayload() } );
+
+    /* The pipe has room for len bytes, so EAGAIN can only come from the
+     * socket.
+     */
+    ssize_t moved = splice( fd, nullptr, _pipe[1], nullptr, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+    if( moved <= 0 ) return moved;
+
+    char header[TunnelProtocol::MAX_HEADER_SIZE];
+    const size_t header_size = TunnelProtocol::encodeHeader( header, _framing, conn_id, moved, type );
+
+    std::deque<Segment>& queue = _segments[ static_cast<size_t>( Priority::Bulk ) ];
+    appendSegment( header, header_size, nullptr, 0, Priority::Bulk ).last = false;
+
+    queue.emplace_back();
+    Segment& seg = queue.back();
+    seg.bytes    = nullptr;
+    seg.size     = moved;
+    seg.capacity = 0;
+    seg.offset   = 0;
+    seg.last     = true;
+    seg.zc       = false;
+    seg.zc_id    = 0;
+
+    _piped  += moved;
+    _queued += moved;
+    return moved;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+size_t TunnelWriter::segmentCount( ) const
+{
+    size_t count = 0;
+    for( const auto& queue : _segments ) count += queue.size();
+    return count;
+}
+
+int TunnelWriter::nextQueue( ) const
+{
+    if( !_held.empty() ) return _held.front();
+    if( _torn >= 0 ) return _torn;
+
+    for( size_t q=0; q<priorities; q++ )
+    {
+        if( !_segments[q].empty() ) return q;
+    }
+    return -1;
+}
+
+bool TunnelWriter::flushPiped( TCPSocket& socket, int q, bool& blocked )
+{
+#ifdef __linux__
+    Segment& seg = _segments[q].front();
+    const size_t rest = seg.size - seg.offset;
+
+    unsigned int flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+    if( segmentCount() > 1 ) flags |= SPLICE_F_MORE;
+
+    ssize_t retval = splice( _pipe[0], nullptr, socket.socket(), nullptr, rest, flags );
+    if( retval < 0 )
+    {
+        blocked = ( errno == EAGAIN || errno == EWOULDBLOCK );
+        return blocked;
+    }
+
+    _writes++;
+    _queued -= retval;
+    _piped  -= retval;
+    _bytes_spliced += retval;
+
+    if( (size_t)retval < rest )
+    {
+        seg.offset += retval;
+        _torn   = q;
+        blocked = true;
+        return true;
+    }
+
+    _segments[q].pop_front();
+    _messages++;
+    _torn   = -1;
+    blocked = false;
+    return true;
+#else
+    blocked = false;
+    return false;
+#endif
+}
+
+bool TunnelWriter::flush( TCPSocket& socket )
+{
+    int first;
+    while( ( first = nextQueue() ) >= 0 )
+    {
+        if( _segments[first].front().bytes == nullptr )
+        {
+            bool blocked;
+            if( !flushPiped( socket, first, blocked ) ) return false;
+            if( blocked ) return true;
+            continue;
+        }
+
+        iovec   iov[max_iov];
+        uint8_t from[max_iov];  // queue of each iovec entry
+        size_t  count = 0;
+        size_t  bytes = 0;
+        size_t  taken[priorities] = { 0 };
+        bool    piped = false;
+
+        /* Gather messages from the front of queue q. A payload in the pipe
+         * ends the batch, since nothing may come between it and its header.
+         */
+        auto gather = [&]( int q, bool one_message )
+        {
+            std::deque<Segment>& queue = _segments[q];
+            while( !piped && count < max_iov && taken[q] < queue.size() )
+            {
+                Segment& seg = queue[ taken[q] ];
+                if( seg.bytes == nullptr )
+                {
+                    piped = true;
+                    break;
+                }
+                iov[count].iov_base = seg.bytes + seg.offset;
+                iov[count].iov_len  = seg.size - seg.offset;
+                from[count]         = q;
+                bytes += iov[count].iov_len;
+                count++;
+                taken[q]++;
+                if( one_message && seg.last ) break;
+            }
+        };
+
+        /* What TLS holds in a record, which starts with the rest of a
+         * partially written message, or else that rest. Then the queues by
+         * priority.
+         */
+        for( uint8_t q : _held )
+        {
+            Segment& seg = _segments[q][ taken[q]++ ];
+            iov[count].iov_base = seg.bytes + seg.offset;
+            iov[count].iov_len  = seg.size - seg.offset;
+            from[count]         = q;
+            bytes += iov[count].iov_len;
+            count++;
+        }
+        if( _held.empty() && _torn >= 0 ) gather( _torn, true );
+        for( size_t q=0; q<priorities; q++ ) gather( q, false );
+
+        // Tell TCP that more follows if the batch did not fit into one call
+        const bool more = ( count < segmentCount() );
+
+        // Pinning pages only pays off for large batches
+        const bool zc = _zerocopy && bytes >= zerocopy_min;
+
+        int retval = socket.sendv( iov, count, more, zc );
+        if( retval < 0 && errno != EAGAIN && errno != EWOULDBLOCK ) return false;
+
+        // Note the segments behind the written bytes that TLS has taken already
+        _held.clear();
+        size_t skip = std::max( retval, 0 );
+        size_t hold = socket.pendingWrite();
+        for( size_t i=0; i<count && hold > 0; i++ )
+        {
+            size_t len = iov[i].iov_len;
+            if( skip >= len )
+            {
+                skip -= len;
+                continue;
+            }
+            len -= skip;
+            skip = 0;
+            _held.push_back( from[i] );
+            hold -= std::min( hold, len );
+        }
+
+        if( retval < 0 ) return true;
+
+        _writes++;
+        _queued -= retval;
+
+        const uint32_t zc_id = _zc_next_id;
+        if( zc )
+        {
+            _zc_sends.push_back( ZeroCopySend{ zc_id, (size_t)retval } );
+            _zc_next_id++;
+        }
+        else
+        {
+            _bytes_copied += retval;
+        }
+
+        // The entries were taken from the fronts of their queues, in order
+        size_t done = retval;
+        for( size_t i=0; i<count && done > 0; i++ )
+        {
+            Segment& seg = _segments[ from[i] ].front();
+            if( zc )
+            {
+                seg.zc    = true;
+                seg.zc_id = zc_id;
+            }
+
+            const size_t rest = seg.size - seg.offset;
+            if( done < rest )
+            {
+                seg.offset += done;
+                _torn = from[i];
+                break;
+            }
+            done -= rest;
+            if( seg.last ) _messages++;
+            _torn = seg.last ? -1 : from[i];
+            release( seg );
+            _segments[ from[i] ].pop_front();
+        }
+
+        LOG_DEBUG << "Wrote " << retval << " of " << bytes << " bytes in one call, "
+                  << segmentCount() << " segments still queued" << std::endl;
+
+        // The socket buffer is full, wait until it is writable again
+        if( (size_t)retval < bytes ) return true;
+    }
+    return true;
+}
+
+void TunnelWriter::release( Segment& seg )
+{
+    if( seg.zc ) _pinned.push_back( Pinned{ seg.zc_id, seg.bytes, seg.capacity } );
+    else         _pool.put( seg.bytes, seg.capacity );
+}
+
+bool TunnelWriter::enableZeroCopy( TCPSocket& socket )
+{
+    _zc_next_id = 0;
+    _zerocopy   = false;
+
+    // TLS sends encrypted copies, and kTLS does not take MSG_ZEROCOPY
+    if( socket.isTLS() )
+    {
+        LOG_WARN << "Zero-copy sends are not used on a TLS tunnel" << std::endl;
+        return false;
+    }
+    _zerocopy   = socket.setZeroCopy();
+    return _zerocopy;
+}
+
+void TunnelWriter::reapCompletions( TCPSocket& socket )
+{
+    uint32_t lo, hi;
+    bool     copied;
+
+    while( socket.recvZeroCopyCompletion( lo, hi, copied ) )
+    {
+        LOG_DEBUG << "Zero-copy sends " << lo << " to " << hi << " completed"
+                  << ( copied ? " (copied)" : "" ) << std::endl;
+
+        /* TCP completes its sends in order, so everything up to hi is
+         * done. The comparison survives the wrap of the 32 bit numbers.
+         */
+        while( !_zc_sends.empty() && (int32_t)( _zc_sends.front().zc_id - hi ) <= 0 )
+        {
+            if( copied ) _bytes_copied   += _zc_sends.front().bytes;
+            else         _bytes_zerocopy += _zc_sends.front().bytes;
+            _zc_sends.pop_front();
+        }
+        while( !_pinned.empty() && (int32_t)( _pinned.front().zc_id - hi ) <= 0 )
+        {
+            _pool.put( _pinned.front().bytes, _pinned.front().capacity );
+            _pinned.pop_front();
+        }
+    }
+}
+
+void TunnelWriter::clear( )
+{
+    for( auto& queue : _segments )
+    {
+        for( Segment& seg : queue )
+        {
+            if( seg.bytes ) _pool.put( seg.bytes, seg.capacity );
+        }
+        queue.clear();
+    }
+    _queued  = 0;
+    _torn    = -1;
+    _held.clear();
+    _framing = 1;
+
+    for( Pinned& p : _pinned )
+    {
+        _pool.put( p.bytes, p.capacity );
+    }
+    _pinned.clear();
+    _zc_sends.clear();
+    _zerocopy = false;
+
+    // Payloads left in the pipe belong to the lost tunnel connection
+    if( _piped > 0 )
+    {
+        closePipe();
+        enableSplice();
+    }
+}
@@ -0,0 +1,229 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tcp.h"
+#include "buffer_pool.h"
+#include "tunnel_protocol.h"
+
+/* Outbound side of a tunnel connection. Messages are appended while the
+ * event loop dispatches a wakeup, and flush() writes all of them with a
+ * single sendmsg() at the end of it, instead of two write() calls per
+ * message. Whatever the non-blocking socket does not accept stays queued
+ * until it becomes writable. Messages are never torn apart.
+ *
+ * On Linux, the payload of a message can also be moved from another socket
+ * into a pipe with splice() and from there to the tunnel, so that it never
+ * passes through user space. Such payloads wait in the pipe, in order with
+ * the other queued messages.
+ *
+ * In zero-copy mode, large batches are sent with MSG_ZEROCOPY. Their
+ * buffers stay pinned after they have been sent, until the kernel reports
+ * the completion on the socket's error queue, see reapCompletions().
+ *
+ * Messages are queued by priority. Every write takes the queued messages
+ * of higher priority first, so a UDP packet never waits behind TCP data
+ * that was queued before it, only behind the rest of a message that was
+ * partially written. Within one priority, messages keep their order.
+ * With TLS in user space, the bytes of a record that could not be sent
+ * yet go first as well, since OpenSSL wants them repeated unchanged.
+ *
+ * The writer encodes the message headers with the framing version of the
+ * tunnel connection, see TunnelProtocol. It starts with version 1. When
+ * the peers agree on another one, barrier() makes everything that is queued
+ * go out before the marker message of the switch, see TunnelHello.
+ */
+class TunnelWriter
+{
+public:
+    enum class Priority : uint8_t
+    {
+        Control     = 0,  // UDP packets and messages without payload data
+        Interactive = 1,  // TCP_DATA of connections that have sent little so far
+        Bulk        = 2   // everything else, including all spliced payloads
+    };
+    static const size_t priorities = 3;
+
+private:
+    /* Part of a message. Bytes before offset have been sent. The bytes are
+     * a buffer from _pool of the given capacity, or nullptr if they wait
+     * in the pipe. last is false for the header of a piped payload.
+     * zc is set if a zero-copy send used the buffer, zc_id is the number
+     * of the latest one.
+     */
+    struct Segment
+    {
+        char*    bytes;
+        size_t   size;
+        size_t   capacity;
+        size_t   offset;
+        bool     last;
+        bool     zc;
+        uint32_t zc_id;
+    };
+
+    // A buffer that was sent but may still be read by the kernel
+    struct Pinned
+    {
+        uint32_t zc_id;
+        char*    bytes;
+        size_t   capacity;
+    };
+
+    // A zero-copy send that has not completed yet
+    struct ZeroCopySend
+    {
+        uint32_t zc_id;
+        size_t   bytes;
+    };
+
+    BufferPool          _pool;
+    std::deque<Segment> _segments[priorities];
+    size_t              _queued { 0 };
+
+    // Priority whose front message was partially written, or -1
+    int                 _torn { -1 };
+
+    /* Queues of the segments, in the order of the last write, that TLS
+     * has taken but not reported as written, see TCPSocket::pendingWrite().
+     * The next write repeats them in that order before anything else.
+     */
+    std::vector<uint8_t> _held;
+
+    // Framing version of the headers that append() creates
+    uint16_t            _framing { 1 };
+
+    // Pipe for spliced payloads, -1 if splicing is not enabled
+    int    _pipe[2]        { -1, -1 };
+    size_t _pipe_capacity  { 0 };
+    size_t _piped          { 0 };  // bytes in the pipe
+    bool   _splice_allowed { true };
+
+    // Zero-copy mode, numbers count the zero-copy sends on the socket
+    bool                     _zerocopy     { false };
+    uint32_t                 _zc_next_id   { 0 };
+    std::deque<Pinned>       _pinned;
+    std::deque<ZeroCopySend> _zc_sends;
+
+    // Statistics, may be read by other threads
+    std::atomic<uint64_t> _messages { 0 };  // messages written completely
+    std::atomic<uint64_t> _writes   { 0 };  // sendmsg calls that wrote bytes
+    std::atomic<uint64_t> _bytes_zerocopy { 0 };  // sent without copying
+    std::atomic<uint64_t> _bytes_copied   { 0 };  // copied into the kernel
+    std::atomic<uint64_t> _bytes_spliced  { 0 };  // moved from the pipe
+
+public:
+    TunnelWriter( ) = default;
+    ~TunnelWriter( );
+
+    /* Queue a message with a header in the current framing. len must not
+     * exceed maxPayload(). Set compressed if the payload was made by
+     * Compression::compress().
+     */
+    void append( uint32_t conn_id, TunnelMessageType type, const char* payload, size_t len,
+                 Priority priority = Priority::Bulk, bool compressed = false );
+
+    // Framing version of the messages that are appended from now on
+    inline uint16_t framing() const { return _framing; }
+    inline void setFraming( uint16_t version ) { _framing = version; }
+
+    // Largest payload of one message in the current framing
+    inline size_t maxPayload() const { return TunnelProtocol::maxPayload( _framing ); }
+
+    /* Everything that is queued now is written before anything that is
+     * appended later, whatever the priorities. The queued messages keep
+     * the order in which they would have been written.
+     */
+    void barrier( );
+
+    /* Create the pipe for spliceFrom(). Returns false if splice() is not
+     * available.
+     */
+    bool enableSplice( );
+
+    // Largest payload that spliceFrom() can take now, 0 if splicing is disabled
+    inline size_t spliceRoom() const { return _splice_allowed ? _pipe_capacity - _piped : 0; }
+
+    /* Splicing writes plain bytes to the tunnel socket, which is wrong for
+     * TLS unless the kernel encrypts them. Set it from
+     * TCPSocket::rawWrites() for every new tunnel connection.
+     */
+    inline void allowSplice( bool on ) { _splice_allowed = on; }
+
+    /* Move up to len bytes (at most spliceRoom() and maxPayload()) from
+     * the socket fd into the pipe and queue them as the payload of a
+     * message. The pipe keeps its bytes in order, so these messages are
+     * always Bulk. Returns the number of bytes, 0 at the end of the stream,
+     * or -1 with errno set like recv().
+     */
+    int spliceFrom( int fd, uint32_t conn_id, TunnelMessageType type, size_t len );
+
+    /* Send batches of at least zerocopy_min bytes on socket with
+     * MSG_ZEROCOPY. Call it for every new tunnel connection, after clear().
+     * Returns false if the socket does not support it, or speaks TLS.
+     */
+    bool enableZeroCopy( TCPSocket& socket );
+
+    static const size_t zerocopy_min = 16384;
+
+    /* Release the buffers of completed zero-copy sends. Call it when the
+     * socket reports an error event, which is how the kernel signals
+     * completions.
+     */
+    void reapCompletions( TCPSocket& socket );
+
+    /* Write as much of the queue as the socket takes, with one sendmsg
+     * per batch of messages. Returns false if the socket failed.
+     */
+    bool flush( TCPSocket& socket );
+
+    // Number of bytes waiting to be written
+    inline size_t queued() const { return _queued; }
+
+    /* Drop all queued messages, e.g. when the tunnel connection is lost.
+     * This also ends zero-copy mode and goes back to framing version 1.
+     * Pinned buffers are released, since only the lost connection can
+     * still read them.
+     */
+    void clear( );
+
+    // Thread-safe. Messages written so far.
+    inline uint64_t messages() const { return _messages; }
+
+    // Thread-safe. Number of sendmsg calls so far.
+    inline uint64_t writes() const { return _writes; }
+
+    // Thread-safe statistics of the message buffers
+    inline const BufferPool& pool() const { return _pool; }
+
+    // Thread-safe. Bytes sent with zero-copy, with a copy, and by splice.
+    // Zero-copy sends are counted when they complete.
+    inline uint64_t bytesZeroCopy() const { return _bytes_zerocopy; }
+    inline uint64_t bytesCopied() const   { return _bytes_copied; }
+    inline uint64_t bytesSpliced() const  { return _bytes_spliced; }
+
+private:
+    // Queue a header and a payload as one segment
+    Segment& appendSegment( const char* header, size_t header_size,
+                            const char* payload, size_t len, Priority priority );
+
+    void closePipe( );
+
+    // Total number of queued segments
+    size_t segmentCount() const;
+
+    // The queue that the next write starts with, or -1 if all are empty
+    int nextQueue() const;
+
+    // Write the piped front segment of queue q. Returns false if the socket failed.
+    bool flushPiped( TCPSocket& socket, int q, bool& blocked );
+
+    // Return a sent segment's buffer to the pool, or pin it
+    void release( Segment& seg );
+};
+
@@ -1,11 +1,68 @@
+#include <algorithm>
+
 #include <unistd.h> // for close
 #include <string.h> // for strerror
 #include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
 
 #include "verbose.h"
 #include "sockaddr.h"
 #include "udp.h"
 
+#ifdef __linux__
+// Older C libraries do not define the GSO and GRO socket options
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#endif
+
+UDPBatch::UDPBatch( )
+    : _buffers( max_packets * max_packet_size )
+{
+}
+
+bool UDPBatch::add( const char* buffer, size_t buflen, const SockAddr& dest, uint16_t segment )
+{
+    if( full() || buflen > max_packet_size ) return false;
+
+    if( buflen > 0 )
+    {
+        memcpy( _buffers.data() + _count * max_packet_size, buffer, buflen );
+    }
+    _sizes[_count]    = buflen;
+    _segments[_count] = ( segment < buflen ) ? segment : 0;
+    _addrs[_count]    = dest;
+    _count++;
+    return true;
+}
+
+bool UDPBatch::add( const void* head, size_t headlen, const char* body, size_t bodylen, const SockAddr& dest )
+{
+    if( full() || headlen + bodylen > max_packet_size ) return false;
+
+    char* buffer = _buffers.data() + _count * max_packet_size;
+    memcpy( buffer, head, headlen );
+    if( bodylen > 0 )
+    {
+        memcpy( buffer + headlen, body, bodylen );
+    }
+    _sizes[_count]    = headlen + bodylen;
+    _segments[_count] = 0;
+    _addrs[_count]    = dest;
+    _count++;
+    return true;
+}
+
 UDPSocket::UDPSocket( uint16_t port )
 {
     createServer( port );
@@ -89,6 +146,20 @@ void UDPSocket::setNoBlock( )
     fcntl( _sock, F_SETFL, flags );
 }
 
+bool UDPSocket::enableGRO( )
+{
+#ifdef __linux__
+    int on = 1;
+    if( setsockopt( _sock, SOL_UDP, UDP_GRO, &on, sizeof(on) ) == 0 )
+    {
+        _gro = true;
+        return true;
+    }
+    LOG_DEBUG << "UDP_GRO is not supported on port " << _port << ": " << strerror(errno) << std::endl;
+#endif
+    return false;
+}
+
 int UDPSocket::recv( char* buffer, size_t buflen, SockAddr& clientAddr )
 {
     socklen_t clientAddrLen = clientAddr.size();
@@ -133,3 +204,177 @@ int UDPSocket::send( const char* buffer, size_t buflen, const SockAddr& dest )
     return bytesSent;
 }
 
+int UDPSocket::recvBatch( UDPBatch& batch )
+{
+    batch.clear();
+
+#ifdef __linux__
+    mmsghdr msgs[UDPBatch::max_packets];
+    iovec   iovs[UDPBatch::max_packets];
+    char    control[UDPBatch::max_packets][CMSG_SPACE(sizeof(int))];
+
+    memset( msgs, 0, sizeof(msgs) );
+    for( size_t i=0; i<UDPBatch::max_packets; i++ )
+    {
+        iovs[i].iov_base = batch._buffers.data() + i * UDPBatch::max_packet_size;
+        iovs[i].iov_len  = UDPBatch::max_packet_size;
+        msgs[i].msg_hdr.msg_name    = batch._addrs[i].get();
+        msgs[i].msg_hdr.msg_namelen = batch._addrs[i].size();
+        msgs[i].msg_hdr.msg_iov     = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen  = 1;
+        if( _gro )
+        {
+            msgs[i].msg_hdr.msg_control    = control[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+        }
+    }
+
+    int n = recvmmsg( _sock, msgs, UDPBatch::max_packets, MSG_DONTWAIT, nullptr );
+    if( n < 0 )
+    {
+        if( errno != EAGAIN && errno != EWOULDBLOCK )
+        {
+            LOG_WARN << "recvmmsg failed: " << strerror(errno) << std::endl;
+        }
+        return n;
+    }
+
+    for( int i=0; i<n; i++ )
+    {
+        batch._sizes[i]    = msgs[i].msg_len;
+        batch._segments[i] = 0;
+
+        // The kernel reports the segment size of coalesced datagrams
+        for( cmsghdr* cm = CMSG_FIRSTHDR( &msgs[i].msg_hdr ); cm != nullptr;
+             cm = CMSG_NXTHDR( &msgs[i].msg_hdr, cm ) )
+        {
+            if( cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO )
+            {
+                int segment;
+                memcpy( &segment, CMSG_DATA(cm), sizeof(segment) );
+                if( segment > 0 && (size_t)segment < batch._sizes[i] )
+                {
+                    batch._segments[i] = segment;
+                }
+            }
+        }
+    }
+    batch._count = n;
+#else
+    // One recvfrom per datagram where recvmmsg does not exist
+    while( !batch.full() )
+    {
+        const size_t i = batch._count;
+        socklen_t addrlen = batch._addrs[i].size();
+        int retval = recvfrom( _sock, batch._buffers.data() + i * UDPBatch::max_packet_size,
+                               UDPBatch::max_packet_size, MSG_DONTWAIT,
+                               batch._addrs[i].get(), &addrlen );
+        if( retval < 0 )
+        {
+            if( batch._count > 0 ) break;
+            return retval;
+        }
+        batch._sizes[i]    = retval;
+        batch._segments[i] = 0;
+        batch._count++;
+    }
+#endif
+
+    LOG_DEBUG << "Received " << batch._count << " UDP packets on port " << _port << " in one batch" << std::endl;
+    return batch._count;
+}
+
+int UDPSocket::sendBatch( UDPBatch& batch )
+{
+    int sent = 0;
+
+#ifdef __linux__
+    mmsghdr msgs[UDPBatch::max_packets];
+    iovec   iovs[UDPBatch::max_packets];
+    char    control[UDPBatch::max_packets][CMSG_SPACE(sizeof(uint16_t))];
+
+    memset( msgs, 0, sizeof(msgs) );
+    memset( control, 0, sizeof(control) );
+    for( size_t i=0; i<batch._count; i++ )
+    {
+        iovs[i].iov_base = batch._buffers.data() + i * UDPBatch::max_packet_size;
+        iovs[i].iov_len  = batch._sizes[i];
+        msgs[i].msg_hdr.msg_name    = batch._addrs[i].get();
+        msgs[i].msg_hdr.msg_namelen = batch._addrs[i].size();
+        msgs[i].msg_hdr.msg_iov     = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen  = 1;
+        if( batch._segments[i] > 0 )
+        {
+            // Let the kernel cut the run into datagrams (GSO)
+            msgs[i].msg_hdr.msg_control    = control[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+            cmsghdr* cm = CMSG_FIRSTHDR( &msgs[i].msg_hdr );
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type  = UDP_SEGMENT;
+            cm->cmsg_len   = CMSG_LEN(sizeof(uint16_t));
+            memcpy( CMSG_DATA(cm), &batch._segments[i], sizeof(uint16_t) );
+        }
+    }
+
+    size_t next = 0;
+    while( next < batch._count )
+    {
+        int n = sendmmsg( _sock, msgs + next, batch._count - next, MSG_DONTWAIT );
+        if( n < 0 )
+        {
+            if( errno == EINTR ) continue;
+
+            // sendmmsg reports the error of the first datagram, skip it
+            if( batch._segments[next] > 0 && errno != EAGAIN && errno != EWOULDBLOCK )
+            {
+                // No GSO for this route, e.g. no checksum offload
+                if( sendSegments( batch, next ) ) sent++;
+            }
+            else
+            {
+                LOG_DEBUG << "sendmmsg to " << batch._addrs[next] << " failed: " << strerror(errno)
+                          << ", dropping the packet" << std::endl;
+            }
+            next++;
+            continue;
+        }
+        sent += n;
+        next += n;
+    }
+#else
+    for( size_t i=0; i<batch._count; i++ )
+    {
+        if( sendSegments( batch, i ) ) sent++;
+    }
+#endif
+
+    LOG_DEBUG << "Sent " << sent << " of " << batch._count << " UDP packets from port " << _port
+              << " in one batch" << std::endl;
+    batch.clear();
+    return sent;
+}
+
+bool UDPSocket::sendSegments( const UDPBatch& batch, size_t i )
+{
+    const char*  data    = batch.data(i);
+    const size_t size    = batch._sizes[i];
+    const size_t segment = batch._segments[i] > 0 ? batch._segments[i] : size;
+    bool         ok      = true;
+
+    size_t offset = 0;
+    do
+    {
+        const size_t len = std::min( segment, size - offset );
+        if( sendto( _sock, data + offset, len, MSG_DONTWAIT,
+                    batch._addrs[i].get(), batch._addrs[i].size() ) < 0 )
+        {
+            LOG_DEBUG << "sendto " << batch._addrs[i] << " failed: " << strerror(errno)
+                      << ", dropping the packet" << std::endl;
+            ok = false;
+        }
+        offset += len;
+    }
+    while( offset < size );
+
+    return ok;
+}
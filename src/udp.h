@@ -1,14 +1,70 @@
 #pragma once
 
+#include <vector>
+
 #include <sys/types.h>
 
 #include "sockaddr.h"
 
+/* A set of datagrams for UDPSocket::recvBatch() and sendBatch(), each with
+ * its own address. The buffers are allocated once and reused for every
+ * call, so a batch should live as long as the socket.
+ */
+class UDPBatch
+{
+    friend class UDPSocket;
+
+public:
+    static const size_t max_packets     = 32;
+    static const size_t max_packet_size = 65536;
+
+private:
+    std::vector<char> _buffers;
+    size_t            _sizes[max_packets];
+    uint16_t          _segments[max_packets];
+    SockAddr          _addrs[max_packets];
+    size_t            _count { 0 };
+
+public:
+    UDPBatch( );
+
+    // Number of datagrams in the batch
+    inline size_t count() const { return _count; }
+    inline bool   full()  const { return _count == max_packets; }
+    inline bool   empty() const { return _count == 0; }
+
+    // Payload, size and peer address of datagram i < count()
+    inline const char*     data( size_t i ) const { return _buffers.data() + i * max_packet_size; }
+    inline size_t          size( size_t i ) const { return _sizes[i]; }
+    inline const SockAddr& addr( size_t i ) const { return _addrs[i]; }
+
+    /* Segment size of entry i if it is a run of datagrams of that size
+     * (the last one may be shorter) that the kernel coalesced with UDP_GRO,
+     * or 0 for a single datagram.
+     */
+    inline uint16_t segment( size_t i ) const { return _segments[i]; }
+
+    /* Copy a datagram for sendBatch() into the batch. If segment is not 0,
+     * buffer holds a run of datagrams of that size, which is sent with one
+     * UDP_SEGMENT (GSO) send where the kernel supports it.
+     * Returns false if the batch is full or the datagram too large.
+     */
+    bool add( const char* buffer, size_t buflen, const SockAddr& dest, uint16_t segment = 0 );
+
+    /* Copy a datagram that consists of a header and a body into the batch.
+     * Returns false if the batch is full or the datagram too large.
+     */
+    bool add( const void* head, size_t headlen, const char* body, size_t bodylen, const SockAddr& dest );
+
+    void clear( ) { _count = 0; }
+};
+
 class UDPSocket
 {
     bool     _valid {false};
     uint16_t _port  {0};
     int      _sock  {-1};
+    bool     _gro   {false};
 
 public:
     // Default object, not initialized
@@ -38,6 +94,12 @@ public:
     // Set the socket to non-blocking mode.
     void setNoBlock( );
 
+    /* Let the kernel coalesce runs of equally sized datagrams from the same
+     * sender into one buffer for recvBatch() (UDP_GRO, Linux 5.0 and later).
+     * Returns false if that is not supported.
+     */
+    bool enableGRO( );
+
     /* Returns the member variable _port.
      * It is not guaranteed that this is the variable that getsockname
      * would return.
@@ -57,5 +119,24 @@ public:
 
     // Send the buffer to the given address and port using this socket
     int send( const char* buffer, size_t buflen, const SockAddr& dest );
+
+    /* Receive as many datagrams as are waiting, up to max_packets, into
+     * batch, with one recvmmsg call on Linux. Never blocks.
+     * Returns the number of datagrams, or -1 with errno set (EAGAIN if
+     * nothing was waiting).
+     */
+    int recvBatch( UDPBatch& batch );
+
+    /* Send all datagrams of batch to their addresses, with one sendmmsg
+     * call on Linux if nothing fails. Runs of datagrams are split again if
+     * the kernel refuses to segment them. Datagrams that the socket refuses
+     * are dropped, like UDP would. Returns the number of entries sent. The
+     * batch is cleared.
+     */
+    int sendBatch( UDPBatch& batch );
+
+private:
+    // Send entry i of batch with one sendto per datagram
+    bool sendSegments( const UDPBatch& batch, size_t i );
 };
 
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <chrono>
+#include <list>
+#include <unordered_map>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The UDP flows of a shard by flow id, see TunnelServerDispatch and
+ * TunnelClientDispatch. Flow is what a side keeps of a flow, the sender's
+ * address or the socket that forwards it. A flow is active whenever a
+ * packet passes in either direction. When the table is full, the least
+ * recently active flow makes room for a new one. The flows are kept in the
+ * order of their activity, so finding that one, or the ones that have
+ * been idle for too long, only looks at the front.
+ */
+template <typename Flow>
+class UdpFlowTable
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Entry
+    {
+        Flow                          flow;
+        Clock::time_point             last_active;
+        std::list<uint32_t>::iterator lru;  // position in _lru
+    };
+
+    using Map      = std::unordered_map<uint32_t, Entry>;
+    using iterator = typename Map::iterator;
+
+private:
+    Map                 _flows;
+    std::list<uint32_t> _lru;  // flow ids, least recently active first
+    const size_t        _max_flows;
+
+public:
+    explicit UdpFlowTable( size_t max_flows ) : _max_flows( max_flows ) {}
+
+    inline size_t size() const { return _flows.size(); }
+    inline bool empty() const { return _flows.empty(); }
+
+    // No flow can be inserted before one is erased
+    inline bool full() const { return _flows.size() >= _max_flows; }
+
+    inline iterator begin() { return _flows.begin(); }
+    inline iterator end() { return _flows.end(); }
+    inline iterator find( uint32_t flow_id ) { return _flows.find( flow_id ); }
+
+    // A packet of the flow has passed at now, which is not before any other
+    inline void touch( iterator it, Clock::time_point now )
+    {
+        it->second.last_active = now;
+        _lru.splice( _lru.end(), _lru, it->second.lru );
+    }
+
+    // Add a flow that is not in the table and not full()
+    inline iterator insert( uint32_t flow_id, Flow flow, Clock::time_point now )
+    {
+        return _flows.emplace( flow_id, Entry{ std::move( flow ), now, _lru.insert( _lru.end(), flow_id ) } ).first;
+    }
+
+    // The least recently active flow, end() if there is none
+    inline iterator oldest( ) { return _lru.empty() ? _flows.end() : _flows.find( _lru.front() ); }
+
+    inline iterator erase( iterator it )
+    {
+        _lru.erase( it->second.lru );
+        return _flows.erase( it );
+    }
+};